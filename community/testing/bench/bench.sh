@@ -0,0 +1,202 @@
+#!/bin/bash
+#Copyright (C) The openNDS Contributors 2004-2024
+#This software is released under the GNU GPL license.
+#
+# openNDS web server load benchmark, run by "make bench".
+#
+# Starts the freshly built opennds in a private network namespace with the helper
+# scripts, nft and ip replaced by stub.sh, then drives it with loadgen from a second
+# namespace holding many client addresses.
+#
+# Must be run as root on a generic Linux host (network and mount namespaces are used,
+# nothing on the host is modified apart from creating /usr/lib/opennds if missing).
+#
+# Tunables (environment):
+#	BENCH_CLIENTS		simulated client addresses (default 200)
+#	BENCH_CONCURRENCY	concurrent connections (default 16)
+#	BENCH_DURATION		seconds of load (default 10)
+#	BENCH_WEIGHTS		loadgen flow weights probe,splash,auth,rfc8908 (default 70,12,6,12)
+#	OPENNDS			daemon binary (default ./opennds)
+#	LOADGEN			load generator binary (default community/testing/bench/loadgen)
+#
+
+clients=${BENCH_CLIENTS:-200}
+concurrency=${BENCH_CONCURRENCY:-16}
+duration=${BENCH_DURATION:-10}
+weights=${BENCH_WEIGHTS:-70,12,6,12}
+here=$(cd "$(dirname "$0")" && pwd)
+opennds=$(realpath "${OPENNDS:-./opennds}")
+loadgen=$(realpath "${LOADGEN:-$here/loadgen}")
+
+gwns="ndsbench"
+clns="ndsbench-c"
+gwif="nds0"
+clif="ndsc0"
+net="192.168.231"
+gwip="$net.1"
+first=10
+
+if [ "$(id -u)" != "0" ]; then
+	echo "bench: must be run as root (network namespaces are required)"
+	exit 1
+fi
+
+if [ ! -x "$opennds" ] || [ ! -x "$loadgen" ]; then
+	echo "bench: build opennds and the loadgen first (make bench)"
+	exit 1
+fi
+
+if [ "$clients" -gt 240 ]; then
+	echo "bench: BENCH_CLIENTS is limited to 240"
+	exit 1
+fi
+
+NDSBENCH_DIR=$(mktemp -d /tmp/ndsbench.XXXXXX)
+NDSBENCH_IP=$(command -v ip)
+export NDSBENCH_DIR NDSBENCH_IP
+
+daemonpid=""
+madelibdir=""
+
+cleanup() {
+	if [ -n "$daemonpid" ]; then
+		kill "$daemonpid" 2>/dev/null
+		wait "$daemonpid" 2>/dev/null
+	fi
+
+	ip netns del "$gwns" 2>/dev/null
+	ip netns del "$clns" 2>/dev/null
+
+	if [ -n "$madelibdir" ]; then
+		rmdir /usr/lib/opennds 2>/dev/null
+	fi
+
+	if [ -z "$BENCH_KEEP" ]; then
+		rm -rf "$NDSBENCH_DIR"
+	else
+		echo "bench: results kept in $NDSBENCH_DIR"
+	fi
+}
+
+trap cleanup EXIT
+trap "exit 1" INT TERM
+
+# Stub layout: every helper the daemon executes is stub.sh under another name
+mkdir -p "$NDSBENCH_DIR/lib" "$NDSBENCH_DIR/bin" "$NDSBENCH_DIR/tmp" "$NDSBENCH_DIR/htdocs/images"
+: > "$NDSBENCH_DIR/exec.log"
+cp "$here/stub.sh" "$NDSBENCH_DIR/stub.sh"
+chmod 755 "$NDSBENCH_DIR/stub.sh"
+
+for script in libopennds.sh dnsconfig.sh get_client_interface.sh authmon.sh client_params.sh \
+	binauth_log.sh custombinauth.sh download_resources.sh \
+	theme_click-to-continue.sh theme_user-email-login-basic.sh; do
+	ln -s "$NDSBENCH_DIR/stub.sh" "$NDSBENCH_DIR/lib/$script"
+done
+
+ln -s "$NDSBENCH_DIR/stub.sh" "$NDSBENCH_DIR/bin/nft"
+ln -s "$NDSBENCH_DIR/stub.sh" "$NDSBENCH_DIR/bin/ip"
+
+cp "$here/../../../resources/splash.css" "$NDSBENCH_DIR/htdocs/"
+cp "$here/../../../resources/splash.jpg" "$NDSBENCH_DIR/htdocs/images/"
+
+# A simulated client sends far more requests than a real device, so the per source rate limit is off
+cat > "$NDSBENCH_DIR/bench.conf" <<-EOF
+	gatewayname=openNDS Bench
+	gatewayinterface=$gwif
+	gatewayip=$gwip
+	faskey=bench
+	fas_secure_enabled=1
+	maxclients=$((clients + 10))
+	webroot=$NDSBENCH_DIR/htdocs
+	debuglevel=0
+	http_source_rate=0
+EOF
+
+# Neighbour table as "ip neigh show" would print it for the simulated clients
+for i in $(seq 0 $((clients - 1))); do
+	host=$((first + i))
+	printf "%s.%d dev %s lladdr 02:00:c0:a8:e7:%02x REACHABLE\n" "$net" "$host" "$gwif" "$host"
+done > "$NDSBENCH_DIR/neigh"
+
+# Gateway and client namespaces joined by a veth pair
+ip netns del "$gwns" 2>/dev/null
+ip netns del "$clns" 2>/dev/null
+ip netns add "$gwns" || exit 1
+ip netns add "$clns" || exit 1
+ip link add "$gwif" netns "$gwns" type veth peer name "$clif" netns "$clns" || exit 1
+ip -n "$gwns" addr add "$gwip/24" dev "$gwif"
+ip -n "$gwns" link set lo up
+ip -n "$gwns" link set "$gwif" up
+ip -n "$clns" link set lo up
+ip -n "$clns" link set "$clif" up
+
+for i in $(seq 0 $((clients - 1))); do
+	ip -n "$clns" addr add "$net.$((first + i))/24" dev "$clif"
+done
+
+if [ ! -d /usr/lib/opennds ]; then
+	mkdir -p /usr/lib/opennds || exit 1
+	madelibdir="yes"
+fi
+
+# The daemon hardcodes /usr/lib/opennds, so bind the stubs over it in a private mount namespace
+ip netns exec "$gwns" unshare -m sh -c "
+	mount --bind '$NDSBENCH_DIR/lib' /usr/lib/opennds || exit 1
+	PATH='$NDSBENCH_DIR/bin':\$PATH exec '$opennds' -f
+" > "$NDSBENCH_DIR/opennds.log" 2>&1 &
+daemonpid=$!
+
+echo "bench: waiting for opennds on $gwip:2050"
+
+for i in $(seq 1 60); do
+	if ip netns exec "$clns" bash -c "exec 3<>/dev/tcp/$gwip/2050" 2>/dev/null; then
+		break
+	fi
+
+	if ! kill -0 "$daemonpid" 2>/dev/null; then
+		echo "bench: opennds exited during startup, log follows"
+		cat "$NDSBENCH_DIR/opennds.log"
+		exit 1
+	fi
+
+	sleep 0.5
+done
+
+# Let the startup helpers finish before taking the baseline
+sleep 1
+
+execs_before=$(wc -l < "$NDSBENCH_DIR/exec.log")
+cp "$NDSBENCH_DIR/exec.log" "$NDSBENCH_DIR/exec.startup"
+forks_before=$(awk '$1 == "processes" {print $2}' /proc/stat)
+
+echo "bench: $clients clients, $concurrency connections, ${duration}s"
+echo
+
+ip netns exec "$clns" "$loadgen" -s "$gwip" -b "$net.$first" -n "$clients" \
+	-c "$concurrency" -d "$duration" -k bench -w "$weights" | tee "$NDSBENCH_DIR/loadgen.out"
+
+forks_after=$(awk '$1 == "processes" {print $2}' /proc/stat)
+execs_after=$(wc -l < "$NDSBENCH_DIR/exec.log")
+
+summary=$(grep "^loadgen " "$NDSBENCH_DIR/loadgen.out")
+requests=$(echo "$summary" | awk '{for (i = 2; i <= NF; i++) {split($i, kv, "="); if (kv[1] == "requests") print kv[2]}}')
+
+if [ -z "$requests" ] || [ "$requests" -eq 0 ]; then
+	echo "bench: no requests completed, opennds log follows"
+	tail -n 50 "$NDSBENCH_DIR/opennds.log"
+	exit 1
+fi
+
+echo
+echo "Helper executions during the run:"
+tail -n +"$((execs_before + 1))" "$NDSBENCH_DIR/exec.log" | sort | uniq -c | sort -rn | head -n 15
+
+# /proc/stat counts every fork and thread created on the host (including MHD connection
+# threads and the loadgen itself), so run on an otherwise idle machine
+echo
+echo "$summary" | awk -v forks="$((forks_after - forks_before))" -v execs="$((execs_after - execs_before))" -v requests="$requests" '
+	{
+		sub(/^loadgen /, "")
+		printf "bench %s forks=%d execs=%d forks_per_request=%.2f execs_per_request=%.2f\n",
+			$0, forks, execs, forks / requests, execs / requests
+	}'
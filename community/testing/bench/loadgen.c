@@ -0,0 +1,675 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file loadgen.c
+    @brief Captive portal load generator for the openNDS benchmark harness
+
+    Drives the openNDS web server with the traffic a busy hotspot sees:
+    operating system captive portal probes from many client addresses,
+    splash page fetches, client authentications and RFC8908 API requests.
+    Every request uses its own connection bound to one of the simulated
+    client source addresses. Latency of every request is recorded and
+    summarised when the run completes.
+
+    @author Copyright (C) 2024 The openNDS Contributors
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define RESPONSE_BUF 65536
+#define REQUEST_BUF 4096
+
+enum {
+	FLOW_PROBE,
+	FLOW_SPLASH,
+	FLOW_AUTH,
+	FLOW_RFC8908,
+	FLOWS
+};
+
+static const char *flow_names[FLOWS] = {"probe", "splash", "auth", "rfc8908"};
+
+// Captive portal detection requests as sent by the common client operating systems
+static const struct {
+	const char *host;
+	const char *path;
+	const char *agent;
+} probes[] = {
+	{"captive.apple.com", "/hotspot-detect.html", "CaptiveNetworkSupport-443.1 wispr"},
+	{"connectivitycheck.gstatic.com", "/generate_204", "Dalvik/2.1.0 (Linux; U; Android 13; Pixel 7 Build/TQ3A.230805.001)"},
+	{"www.msftconnecttest.com", "/connecttest.txt", "Microsoft NCSI"},
+	{"detectportal.firefox.com", "/success.txt", "Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0"},
+	{"nmcheck.gnome.org", "/check_network_status.txt", "NetworkManager/1.42.4"},
+};
+
+#define PROBES (sizeof(probes) / sizeof(probes[0]))
+
+struct sample {
+	double seconds;
+	unsigned char flow;
+	short status;
+};
+
+struct worker {
+	pthread_t thread;
+	unsigned int index;
+	unsigned int seed;
+	struct sample *samples;
+	size_t count;
+	size_t size;
+	unsigned long errors;
+	unsigned long authenticated;
+};
+
+static struct in_addr server_addr;
+static unsigned short server_port = 2050;
+static struct in_addr source_base;
+static unsigned int sources = 200;
+static unsigned int concurrency = 16;
+static unsigned int duration = 10;
+static const char *faskey = "bench";
+static unsigned int weights[FLOWS] = {70, 12, 6, 12};
+static volatile int running = 1;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Minimal SHA-256, enough to compute the hid based token a FAS would return */
+
+static const uint32_t sha_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+sha256_block(uint32_t h[8], const unsigned char *p)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, k, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 | (uint32_t)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+	}
+
+	for (i = 16; i < 64; i++) {
+		w[i] = w[i - 16] + (ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3))
+			+ w[i - 7] + (ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+	}
+
+	a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4]; f = h[5]; g = h[6]; k = h[7];
+
+	for (i = 0; i < 64; i++) {
+		t1 = k + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + sha_k[i] + w[i];
+		t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		k = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+static void
+sha256_hex(char out[65], const char *src)
+{
+	uint32_t h[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	unsigned char block[64];
+	size_t len = strlen(src);
+	size_t done = 0;
+	uint64_t bits = (uint64_t)len * 8;
+	int i;
+
+	while (len - done >= 64) {
+		sha256_block(h, (const unsigned char *)src + done);
+		done += 64;
+	}
+
+	memset(block, 0, sizeof(block));
+	memcpy(block, src + done, len - done);
+	block[len - done] = 0x80;
+
+	if (len - done >= 56) {
+		sha256_block(h, block);
+		memset(block, 0, sizeof(block));
+	}
+
+	for (i = 0; i < 8; i++) {
+		block[63 - i] = bits >> (i * 8);
+	}
+
+	sha256_block(h, block);
+
+	for (i = 0; i < 8; i++) {
+		sprintf(out + i * 8, "%08x", h[i]);
+	}
+}
+
+static int
+b64_value(char c)
+{
+	if (c >= 'A' && c <= 'Z') return c - 'A';
+	if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+	if (c >= '0' && c <= '9') return c - '0' + 52;
+	if (c == '+' || c == '-') return 62;
+	if (c == '/' || c == '_') return 63;
+	return -1;
+}
+
+static void
+b64_decode(char *dst, size_t dst_len, const char *src)
+{
+	unsigned int acc = 0;
+	int bits = 0;
+	int v;
+	size_t n = 0;
+
+	for (; *src && n + 1 < dst_len; src++) {
+		if (src[0] == '%' && src[1] && src[2]) {
+			// tolerate url encoded padding
+			src += 2;
+			continue;
+		}
+
+		if ((v = b64_value(*src)) < 0) {
+			if (*src == '=') {
+				continue;
+			}
+			break;
+		}
+
+		acc = (acc << 6) | v;
+		bits += 6;
+
+		if (bits >= 8) {
+			bits -= 8;
+			dst[n++] = (acc >> bits) & 0xff;
+		}
+	}
+
+	dst[n] = '\0';
+}
+
+static void
+record(struct worker *w, int flow, int status, double seconds)
+{
+	if (w->count == w->size) {
+		w->size = w->size ? w->size * 2 : 4096;
+		w->samples = realloc(w->samples, w->size * sizeof(struct sample));
+
+		if (!w->samples) {
+			fprintf(stderr, "loadgen: out of memory\n");
+			exit(1);
+		}
+	}
+
+	w->samples[w->count].seconds = seconds;
+	w->samples[w->count].flow = flow;
+	w->samples[w->count].status = status;
+	w->count++;
+}
+
+/** Send one request on a new connection bound to the given client source address.
+ *  Returns the HTTP status, or -1 on a transport error. The response is left in buf.
+ */
+static int
+http_get(struct in_addr src, const char *host, const char *path, const char *agent, const char *accept, char *buf, size_t buf_len)
+{
+	struct sockaddr_in sa;
+	char req[REQUEST_BUF];
+	int fd, len, one = 1, status = -1;
+	size_t got = 0;
+	ssize_t n;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (fd < 0) {
+		return -1;
+	}
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr = src;
+
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	sa.sin_addr = server_addr;
+	sa.sin_port = htons(server_port);
+
+	if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	len = snprintf(req, sizeof(req),
+		"GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: %s\r\nAccept: %s\r\nConnection: close\r\n\r\n",
+		path, host, agent, accept ? accept : "*/*");
+
+	if (len >= sizeof(req) || write(fd, req, len) != len) {
+		close(fd);
+		return -1;
+	}
+
+	while (got < buf_len - 1 && (n = read(fd, buf + got, buf_len - 1 - got)) > 0) {
+		got += n;
+	}
+
+	// Drain anything that did not fit so the server sees a clean close
+	while (got == buf_len - 1 && read(fd, req, sizeof(req)) > 0);
+
+	close(fd);
+	buf[got] = '\0';
+
+	if (sscanf(buf, "HTTP/1.%*d %d", &status) != 1) {
+		return -1;
+	}
+
+	return status;
+}
+
+/** Copy the Location header of a response into dst. Returns 0 if found. */
+static int
+get_location(const char *response, char *dst, size_t dst_len)
+{
+	const char *p, *e;
+
+	p = strcasestr(response, "\r\nLocation: ");
+
+	if (!p) {
+		return -1;
+	}
+
+	p += 12;
+	e = strstr(p, "\r\n");
+
+	if (!e || (size_t)(e - p) >= dst_len) {
+		return -1;
+	}
+
+	memcpy(dst, p, e - p);
+	dst[e - p] = '\0';
+	return 0;
+}
+
+/** Split an absolute http url into host and path. */
+static void
+split_url(const char *url, char *host, size_t host_len, const char **path)
+{
+	const char *p = url;
+	size_t n;
+
+	if (strncmp(p, "http://", 7) == 0) {
+		p += 7;
+	}
+
+	*path = strchr(p, '/');
+
+	if (!*path) {
+		*path = "/";
+		n = strlen(p);
+	} else {
+		n = *path - p;
+	}
+
+	if (n >= host_len) {
+		n = host_len - 1;
+	}
+
+	memcpy(host, p, n);
+	host[n] = '\0';
+}
+
+/** Run one flow from the given client address, recording each request it makes. */
+static void
+run_flow(struct worker *w, int flow, struct in_addr src, char *buf)
+{
+	char location[REQUEST_BUF];
+	char host[256];
+	char hid[512];
+	char tok[65];
+	char rhidraw[640];
+	char path[REQUEST_BUF];
+	const char *p, *fas;
+	double start;
+	int status;
+	int probe = rand_r(&w->seed) % PROBES;
+
+	start = now();
+
+	if (flow == FLOW_RFC8908) {
+		status = http_get(src, probes[probe].host, "/", probes[probe].agent, "application/captive+json", buf, RESPONSE_BUF);
+		record(w, flow, status, now() - start);
+		w->errors += (status != 200);
+		return;
+	}
+
+	status = http_get(src, probes[probe].host, probes[probe].path, probes[probe].agent, NULL, buf, RESPONSE_BUF);
+	record(w, FLOW_PROBE, status, now() - start);
+
+	if (flow == FLOW_PROBE) {
+		w->errors += (status < 0 || status >= 500);
+		return;
+	}
+
+	// Follow the redirect to the splash page as the captive portal browser would
+	if (status != 302 || get_location(buf, location, sizeof(location)) != 0) {
+		// Already authenticated or the server refused us
+		return;
+	}
+
+	split_url(location, host, sizeof(host), &p);
+	start = now();
+	status = http_get(src, host, p, probes[probe].agent, "text/html", buf, RESPONSE_BUF);
+	record(w, FLOW_SPLASH, status, now() - start);
+	w->errors += (status != 200);
+
+	if (flow != FLOW_AUTH || status != 200) {
+		return;
+	}
+
+	// Recover the hid from the fas query string and answer with the token the login page would build
+	fas = strstr(location, "fas=");
+
+	if (!fas) {
+		return;
+	}
+
+	b64_decode(hid, sizeof(hid), fas + 4);
+
+	if (strncmp(hid, "hid=", 4) != 0) {
+		return;
+	}
+
+	hid[strcspn(hid, ", ")] = '\0';
+	snprintf(rhidraw, sizeof(rhidraw), "%s%s", hid + 4, faskey);
+	sha256_hex(tok, rhidraw);
+
+	snprintf(path, sizeof(path), "/opennds_auth/?tok=%s&redir=http%%3a%%2f%%2f%s%s", tok, probes[probe].host, probes[probe].path);
+	start = now();
+	status = http_get(src, host, path, probes[probe].agent, "text/html", buf, RESPONSE_BUF);
+	record(w, FLOW_AUTH, status, now() - start);
+
+	if (status >= 200 && status < 400) {
+		w->authenticated++;
+	} else {
+		w->errors++;
+	}
+}
+
+static void *
+worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	struct in_addr src;
+	unsigned int next = w->index;
+	unsigned int total = 0, pick, flow;
+	char *buf;
+
+	buf = malloc(RESPONSE_BUF);
+
+	if (!buf) {
+		return NULL;
+	}
+
+	for (flow = 0; flow < FLOWS; flow++) {
+		total += weights[flow];
+	}
+
+	while (running) {
+		// Each worker owns every concurrency'th client address
+		src.s_addr = htonl(ntohl(source_base.s_addr) + next);
+		next += concurrency;
+
+		if (next >= sources) {
+			next = w->index;
+		}
+
+		pick = rand_r(&w->seed) % total;
+
+		for (flow = 0; flow < FLOWS - 1 && pick >= weights[flow]; flow++) {
+			pick -= weights[flow];
+		}
+
+		run_flow(w, flow, src, buf);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double
+percentile(double *sorted, size_t n, double p)
+{
+	size_t i;
+
+	if (n == 0) {
+		return 0;
+	}
+
+	i = (size_t)(p * (n - 1) + 0.5);
+	return sorted[i];
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: loadgen -s <server ip> [options]\n"
+		"\n"
+		"  -s <ip>      address of the openNDS gateway\n"
+		"  -p <port>    gateway port (default 2050)\n"
+		"  -b <ip>      first simulated client source address (default 192.168.231.10)\n"
+		"  -n <count>   number of simulated client addresses (default 200)\n"
+		"  -c <count>   concurrent connections (default 16)\n"
+		"  -d <secs>    run time in seconds (default 10)\n"
+		"  -k <faskey>  faskey configured on the gateway (default bench)\n"
+		"  -w p,s,a,r   flow weights for probe, splash, auth, rfc8908 (default 70,12,6,12)\n"
+	);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct worker *workers;
+	double started, elapsed, *lat, *flow_lat;
+	size_t total = 0, n, i, k;
+	unsigned long errors = 0, authenticated = 0, classes[6] = {0};
+	unsigned int t;
+	int opt;
+
+	inet_pton(AF_INET, "192.168.231.10", &source_base);
+	server_addr.s_addr = 0;
+
+	while ((opt = getopt(argc, argv, "s:p:b:n:c:d:k:w:h")) != -1) {
+		switch (opt) {
+		case 's':
+			if (inet_pton(AF_INET, optarg, &server_addr) != 1) usage();
+			break;
+		case 'p':
+			server_port = atoi(optarg);
+			break;
+		case 'b':
+			if (inet_pton(AF_INET, optarg, &source_base) != 1) usage();
+			break;
+		case 'n':
+			sources = atoi(optarg);
+			break;
+		case 'c':
+			concurrency = atoi(optarg);
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 'k':
+			faskey = optarg;
+			break;
+		case 'w':
+			if (sscanf(optarg, "%u,%u,%u,%u", &weights[0], &weights[1], &weights[2], &weights[3]) != 4) usage();
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (server_addr.s_addr == 0 || sources == 0 || concurrency == 0 || duration == 0) {
+		usage();
+	}
+
+	if (concurrency > sources) {
+		concurrency = sources;
+	}
+
+	workers = calloc(concurrency, sizeof(struct worker));
+
+	if (!workers) {
+		return 1;
+	}
+
+	started = now();
+
+	for (t = 0; t < concurrency; t++) {
+		workers[t].index = t;
+		workers[t].seed = 0x6e6473 + t;
+
+		if (pthread_create(&workers[t].thread, NULL, worker_thread, &workers[t]) != 0) {
+			fprintf(stderr, "loadgen: failed to create worker: %s\n", strerror(errno));
+			return 1;
+		}
+	}
+
+	sleep(duration);
+	running = 0;
+
+	for (t = 0; t < concurrency; t++) {
+		pthread_join(workers[t].thread, NULL);
+		total += workers[t].count;
+		errors += workers[t].errors;
+		authenticated += workers[t].authenticated;
+	}
+
+	elapsed = now() - started;
+
+	lat = malloc((total + 1) * sizeof(double));
+	flow_lat = malloc((total + 1) * sizeof(double));
+
+	if (!lat || !flow_lat) {
+		return 1;
+	}
+
+	for (t = 0, n = 0; t < concurrency; t++) {
+		for (i = 0; i < workers[t].count; i++) {
+			lat[n++] = workers[t].samples[i].seconds;
+
+			if (workers[t].samples[i].status < 0) {
+				classes[0]++;
+			} else if (workers[t].samples[i].status / 100 <= 5) {
+				classes[workers[t].samples[i].status / 100]++;
+			}
+		}
+	}
+
+	qsort(lat, total, sizeof(double), cmp_double);
+
+	printf("%-10s %10s %10s %10s %10s %10s\n", "flow", "requests", "p50 ms", "p90 ms", "p99 ms", "max ms");
+
+	for (k = 0; k < FLOWS; k++) {
+		for (t = 0, n = 0; t < concurrency; t++) {
+			for (i = 0; i < workers[t].count; i++) {
+				if (workers[t].samples[i].flow == k) {
+					flow_lat[n++] = workers[t].samples[i].seconds;
+				}
+			}
+		}
+
+		qsort(flow_lat, n, sizeof(double), cmp_double);
+		printf("%-10s %10zu %10.2f %10.2f %10.2f %10.2f\n", flow_names[k], n,
+			percentile(flow_lat, n, 0.5) * 1000,
+			percentile(flow_lat, n, 0.9) * 1000,
+			percentile(flow_lat, n, 0.99) * 1000,
+			n ? flow_lat[n - 1] * 1000 : 0);
+	}
+
+	printf("%-10s %10zu %10.2f %10.2f %10.2f %10.2f\n", "all", total,
+		percentile(lat, total, 0.5) * 1000,
+		percentile(lat, total, 0.9) * 1000,
+		percentile(lat, total, 0.99) * 1000,
+		total ? lat[total - 1] * 1000 : 0);
+
+	printf("\nstatus 2xx %lu, 3xx %lu, 4xx %lu, 5xx %lu, transport errors %lu, authentications %lu\n",
+		classes[2], classes[3], classes[4], classes[5], classes[0], authenticated);
+
+	// Machine readable summary, consumed by bench.sh
+	printf("loadgen requests=%zu seconds=%.3f rps=%.1f p50_ms=%.3f p99_ms=%.3f errors=%lu auths=%lu\n",
+		total, elapsed, total / elapsed,
+		percentile(lat, total, 0.5) * 1000,
+		percentile(lat, total, 0.99) * 1000,
+		errors + classes[0], authenticated);
+
+	for (t = 0; t < concurrency; t++) {
+		free(workers[t].samples);
+	}
+
+	free(workers);
+	free(lat);
+	free(flow_lat);
+	return 0;
+}
@@ -0,0 +1,629 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file microbench.c
+    @brief Microbenchmarks for the pure C hot paths of openNDS
+
+    Times the client list lookups at several list sizes, the url, html entity
+    and base64 encoders, query string collection and mimetype lookup.
+
+    The daemon objects, apart from main.o, are linked as built, and the
+    functions under test are reached through their headers.
+
+    Every result is printed as one line of key=value pairs:
+
+	microbench name=client_list_find size=1000 iterations=... ns_per_op=...
+
+    @author Copyright (C) 2024 The openNDS Contributors
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <microhttpd.h>
+
+#include "../../../src/common.h"
+#include "../../../src/safe.h"
+#include "../../../src/debug.h"
+#include "../../../src/conf.h"
+#include "../../../src/client_list.h"
+#include "../../../src/http_microhttpd.h"
+#include "../../../src/http_microhttpd_utils.h"
+#include "../../../src/request_arena.h"
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+extern pthread_mutex_t client_list_mutex;
+
+// Normally defined in main.c, which is not linked here
+time_t started_time = 0;
+
+int
+authmon_start(void)
+{
+	return 0;
+}
+
+// Minimum time each case is run for, seconds
+static double min_time = 0.2;
+
+typedef void (*bench_fn)(void *arg, unsigned long iterations);
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Run fn with a doubling iteration count until it takes at least min_time.
+ *  Returns nanoseconds per iteration.
+ */
+static double
+bench_run(bench_fn fn, void *arg, unsigned long *iterations)
+{
+	unsigned long n = 1;
+	double start, elapsed;
+
+	while (1) {
+		start = bench_now();
+		fn(arg, n);
+		elapsed = bench_now() - start;
+
+		if (elapsed >= min_time || n >= (1UL << 40)) {
+			break;
+		}
+
+		// Jump close to the target once the timing is meaningful
+		if (elapsed > 0.001) {
+			n = (unsigned long)(n * (min_time * 1.1 / elapsed)) + 1;
+		} else {
+			n *= 2;
+		}
+	}
+
+	*iterations = n;
+	return elapsed * 1e9 / n;
+}
+
+static void
+report(const char *name, unsigned long size, unsigned long iterations, double ns_per_op, size_t bytes_per_op)
+{
+	printf("microbench name=%s size=%lu iterations=%lu ns_per_op=%.1f", name, size, iterations, ns_per_op);
+
+	if (bytes_per_op) {
+		printf(" mb_per_s=%.1f", bytes_per_op / ns_per_op * 1e9 / 1048576.0);
+	}
+
+	printf("\n");
+	fflush(stdout);
+}
+
+/* Client list */
+
+struct list_bench {
+	unsigned int clients;
+	char (*mac)[18];
+	char (*ip)[16];
+	char (*token)[9];
+	unsigned int *id;
+	volatile t_client *found;
+};
+
+/** Build a list of n clients through client_list_restore_client(), which skips the hash_str() fork. */
+static void
+list_populate(struct list_bench *b)
+{
+	t_client *client;
+	unsigned int i;
+
+	client_list_init();
+
+	b->mac = safe_calloc(b->clients * sizeof(*b->mac));
+	b->ip = safe_calloc(b->clients * sizeof(*b->ip));
+	b->token = safe_calloc(b->clients * sizeof(*b->token));
+	b->id = safe_calloc(b->clients * sizeof(*b->id));
+
+	LOCK_CLIENT_LIST();
+
+	for (i = 0; i < b->clients; i++) {
+		snprintf(b->mac[i], sizeof(b->mac[i]), "02:00:00:%02x:%02x:%02x", (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+		snprintf(b->ip[i], sizeof(b->ip[i]), "10.%u.%u.%u", (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+		snprintf(b->token[i], sizeof(b->token[i]), "%08x", 0x6e640000 + i);
+
+		client = client_list_restore_client(b->mac[i], b->ip[i], b->token[i], "0000000000000000000000000000000000000000000000000000000000000000");
+
+		if (!client) {
+			fprintf(stderr, "microbench: could not add client %s %s\n", b->mac[i], b->ip[i]);
+			exit(1);
+		}
+
+		b->id[i] = client->id;
+	}
+
+	UNLOCK_CLIENT_LIST();
+}
+
+static void
+list_free(struct list_bench *b)
+{
+	t_client *client;
+
+	LOCK_CLIENT_LIST();
+
+	while ((client = client_get_first_client())) {
+		client_list_delete(client);
+	}
+
+	UNLOCK_CLIENT_LIST();
+
+	free(b->mac);
+	free(b->ip);
+	free(b->token);
+	free(b->id);
+}
+
+static void
+bench_find(void *arg, unsigned long n)
+{
+	struct list_bench *b = arg;
+	unsigned long i;
+
+	for (i = 0; i < n; i++) {
+		b->found = client_list_find(b->mac[i % b->clients], b->ip[i % b->clients]);
+	}
+}
+
+static void
+bench_find_miss(void *arg, unsigned long n)
+{
+	struct list_bench *b = arg;
+	unsigned long i;
+
+	for (i = 0; i < n; i++) {
+		b->found = client_list_find("02:ff:ff:ff:ff:ff", "10.255.255.255");
+	}
+}
+
+static void
+bench_find_by_ip(void *arg, unsigned long n)
+{
+	struct list_bench *b = arg;
+	unsigned long i;
+
+	for (i = 0; i < n; i++) {
+		b->found = client_list_find_by_ip(b->ip[i % b->clients]);
+	}
+}
+
+static void
+bench_find_by_mac(void *arg, unsigned long n)
+{
+	struct list_bench *b = arg;
+	unsigned long i;
+
+	for (i = 0; i < n; i++) {
+		b->found = client_list_find_by_mac(b->mac[i % b->clients]);
+	}
+}
+
+static void
+bench_find_by_id(void *arg, unsigned long n)
+{
+	struct list_bench *b = arg;
+	unsigned long i;
+
+	for (i = 0; i < n; i++) {
+		b->found = client_list_find_by_id(b->id[i % b->clients]);
+	}
+}
+
+static void
+bench_find_by_token(void *arg, unsigned long n)
+{
+	struct list_bench *b = arg;
+	unsigned long i;
+
+	for (i = 0; i < n; i++) {
+		b->found = client_list_find_by_token(b->token[i % b->clients]);
+	}
+}
+
+static void
+bench_find_by_any(void *arg, unsigned long n)
+{
+	struct list_bench *b = arg;
+	unsigned long i;
+
+	for (i = 0; i < n; i++) {
+		b->found = client_list_find_by_any(b->mac[i % b->clients], b->ip[i % b->clients], NULL);
+	}
+}
+
+static void
+run_client_list(void)
+{
+	static const unsigned int sizes[] = {10, 100, 1000, 10000};
+	static const struct {
+		const char *name;
+		bench_fn fn;
+	} cases[] = {
+		{"client_list_find", bench_find},
+		{"client_list_find_miss", bench_find_miss},
+		{"client_list_find_by_ip", bench_find_by_ip},
+		{"client_list_find_by_mac", bench_find_by_mac},
+		{"client_list_find_by_id", bench_find_by_id},
+		{"client_list_find_by_token", bench_find_by_token},
+		{"client_list_find_by_any", bench_find_by_any},
+	};
+	struct list_bench b;
+	unsigned long iterations;
+	unsigned int s, c;
+	double ns;
+
+	for (s = 0; s < ARRAY_SIZE(sizes); s++) {
+		memset(&b, 0, sizeof(b));
+		b.clients = sizes[s];
+		list_populate(&b);
+
+		for (c = 0; c < ARRAY_SIZE(cases); c++) {
+			ns = bench_run(cases[c].fn, &b, &iterations);
+			report(cases[c].name, b.clients, iterations, ns, 0);
+		}
+
+		list_free(&b);
+	}
+}
+
+/* Encoders */
+
+struct encoder_bench {
+	char *src;
+	int slen;
+	char *dst;
+	int dlen;
+};
+
+static void
+bench_urlencode(void *arg, unsigned long n)
+{
+	struct encoder_bench *b = arg;
+
+	while (n--) {
+		uh_urlencode(b->dst, b->dlen, b->src, b->slen);
+	}
+}
+
+static void
+bench_urldecode(void *arg, unsigned long n)
+{
+	struct encoder_bench *b = arg;
+
+	while (n--) {
+		uh_urldecode(b->dst, b->dlen, b->src, b->slen);
+	}
+}
+
+static void
+bench_htmlentityencode(void *arg, unsigned long n)
+{
+	struct encoder_bench *b = arg;
+
+	while (n--) {
+		htmlentityencode(b->dst, b->dlen, b->src, b->slen);
+	}
+}
+
+static void
+bench_b64_encode(void *arg, unsigned long n)
+{
+	struct encoder_bench *b = arg;
+
+	while (n--) {
+		b64_encode(b->dst, b->dlen, b->src, b->slen);
+	}
+}
+
+static void
+run_encoders(void)
+{
+	// Typical content of a FAS query, user agent or originurl
+	static const char sample[] =
+		"hid=3b6e1c0e5a7f9d2c, clientip=192.168.8.113, clientmac=a4:83:e7:10:2f:5c, "
+		"gatewayname=Caf\xc3\xa9 <Guest> & \"Friends\", originurl=http://captive.apple.com/hotspot-detect.html?a=1&b=2, "
+		"Mozilla/5.0 (iPhone; CPU iPhone OS 17_0 like Mac OS X) AppleWebKit/605.1.15 (KHTML, like Gecko) Mobile/15E148 ";
+	static const int sizes[] = {1024, 2048, 4096, 8192};
+	struct encoder_bench b, d;
+	unsigned long iterations;
+	unsigned int s;
+	int i;
+	double ns;
+
+	for (s = 0; s < ARRAY_SIZE(sizes); s++) {
+		b.slen = sizes[s];
+		b.src = safe_calloc(b.slen + 1);
+
+		for (i = 0; i < b.slen; i++) {
+			b.src[i] = sample[i % (sizeof(sample) - 1)];
+		}
+
+		// Worst case expansion is &quot; at six bytes per input byte
+		b.dlen = b.slen * 6 + 1;
+		b.dst = safe_calloc(b.dlen);
+
+		ns = bench_run(bench_urlencode, &b, &iterations);
+		report("uh_urlencode", b.slen, iterations, ns, b.slen);
+
+		// Decode what was just encoded
+		d.src = safe_strdup(b.dst);
+		d.slen = strlen(d.src);
+		d.dlen = b.slen + 1;
+		d.dst = safe_calloc(d.dlen);
+
+		ns = bench_run(bench_urldecode, &d, &iterations);
+		report("uh_urldecode", b.slen, iterations, ns, d.slen);
+
+		ns = bench_run(bench_htmlentityencode, &b, &iterations);
+		report("htmlentityencode", b.slen, iterations, ns, b.slen);
+
+		ns = bench_run(bench_b64_encode, &b, &iterations);
+		report("b64_encode", b.slen, iterations, ns, b.slen);
+
+		free(d.src);
+		free(d.dst);
+		free(b.src);
+		free(b.dst);
+	}
+}
+
+/* Query collection, timed inside a real MHD connection */
+
+struct query_bench {
+	struct MHD_Connection *connection;
+	char *query;
+	unsigned int arguments;
+	unsigned long iterations;
+	double ns;
+};
+
+static struct query_bench query_result;
+
+static void
+bench_get_query(void *arg, unsigned long n)
+{
+	struct query_bench *b = arg;
+	t_request_arena *arena;
+
+	// Each call is timed with the arena a request would have, from creation to release
+	while (n--) {
+		arena = request_arena_new();
+		request_arena_enter(arena);
+		get_query(b->connection, &b->query, QUERYSEPARATOR);
+		request_arena_leave();
+		request_arena_free(arena);
+	}
+}
+
+static enum MHD_Result
+query_handler(void *cls, struct MHD_Connection *connection, const char *url, const char *method,
+	const char *version, const char *upload_data, size_t *upload_data_size, void **ptr)
+{
+	struct MHD_Response *response;
+	enum MHD_Result ret;
+
+	query_result.connection = connection;
+	query_result.query = safe_calloc(QUERYMAXLEN);
+	query_result.ns = bench_run(bench_get_query, &query_result, &query_result.iterations);
+	free(query_result.query);
+
+	response = MHD_create_response_from_buffer(0, "", MHD_RESPMEM_PERSISTENT);
+	ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+	MHD_destroy_response(response);
+	return ret;
+}
+
+static int
+query_request(unsigned short port, unsigned int arguments)
+{
+	struct sockaddr_in sa;
+	char *request, buf[512];
+	int fd, len;
+	unsigned int i;
+
+	request = safe_calloc(MAX_BUF);
+	len = snprintf(request, MAX_BUF, "GET /opennds_preauth/");
+
+	for (i = 0; i < arguments; i++) {
+		len += snprintf(request + len, MAX_BUF - len, "%carg%u=value%%20number%%20%u", i ? '&' : '?', i, i);
+	}
+
+	len += snprintf(request + len, MAX_BUF - len, " HTTP/1.1\r\nHost: 127.0.0.1\r\nConnection: close\r\n\r\n");
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sa.sin_port = htons(port);
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (fd < 0 || connect(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0 || write(fd, request, len) != len) {
+		fprintf(stderr, "microbench: query request failed: %s\n", strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+		}
+		free(request);
+		return -1;
+	}
+
+	while (read(fd, buf, sizeof(buf)) > 0);
+
+	close(fd);
+	free(request);
+	return 0;
+}
+
+static void
+run_get_query(void)
+{
+	static const unsigned int arguments[] = {4, 16, 32, 64};
+	struct MHD_Daemon *daemon;
+	const union MHD_DaemonInfo *info;
+	struct sockaddr_in sa;
+	unsigned int a;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	daemon = MHD_start_daemon(MHD_USE_INTERNAL_POLLING_THREAD, 0, NULL, NULL, query_handler, NULL,
+		MHD_OPTION_SOCK_ADDR, (struct sockaddr *)&sa,
+		MHD_OPTION_CONNECTION_MEMORY_LIMIT, (size_t)(64 * 1024),
+		MHD_OPTION_END);
+
+	if (!daemon) {
+		fprintf(stderr, "microbench: could not start MHD, skipping get_query\n");
+		return;
+	}
+
+	info = MHD_get_daemon_info(daemon, MHD_DAEMON_INFO_BIND_PORT);
+
+	for (a = 0; info && a < ARRAY_SIZE(arguments); a++) {
+		query_result.iterations = 0;
+
+		if (query_request(info->port, arguments[a]) == 0 && query_result.iterations) {
+			report("get_query", arguments[a], query_result.iterations, query_result.ns, 0);
+		}
+	}
+
+	MHD_stop_daemon(daemon);
+}
+
+/* Mimetype lookup */
+
+static void
+bench_lookup_mimetype(void *arg, unsigned long n)
+{
+	static const char *files[] = {
+		"/index.html", "/splash.css", "/images/splash.jpg", "/js/app.js",
+		"/images/logo.png", "/fonts/font.woff2", "/data/status.json", "/images/banner.svg"
+	};
+	volatile const char *mime;
+	unsigned long i;
+
+	for (i = 0; i < n; i++) {
+		mime = lookup_mimetype(files[i % ARRAY_SIZE(files)]);
+	}
+
+	(void)mime;
+}
+
+static void
+bench_lookup_mimetype_unknown(void *arg, unsigned long n)
+{
+	volatile const char *mime;
+
+	while (n--) {
+		mime = lookup_mimetype("/download/archive.unknownext");
+	}
+
+	(void)mime;
+}
+
+static void
+run_lookup_mimetype(void)
+{
+	unsigned long iterations;
+	double ns;
+
+	ns = bench_run(bench_lookup_mimetype, NULL, &iterations);
+	report("lookup_mimetype", 8, iterations, ns, 0);
+
+	// Unknown extensions log an error each time, which is part of what is measured
+	ns = bench_run(bench_lookup_mimetype_unknown, NULL, &iterations);
+	report("lookup_mimetype_unknown", 1, iterations, ns, 0);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: microbench [-t seconds] [group ...]\n"
+		"\n"
+		"  -t <seconds>  minimum run time per case (default 0.2)\n"
+		"  groups        client_list encoders get_query lookup_mimetype (default all)\n"
+	);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const struct {
+		const char *name;
+		void (*run)(void);
+	} groups[] = {
+		{"client_list", run_client_list},
+		{"encoders", run_encoders},
+		{"get_query", run_get_query},
+		{"lookup_mimetype", run_lookup_mimetype},
+	};
+	s_config *config = config_get_config();
+	unsigned int g;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "t:h")) != -1) {
+		switch (opt) {
+		case 't':
+			min_time = atof(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	// Measure with the daemon default log level
+	config->debuglevel = 1;
+	config->fas_key = "microbench";
+	config->maxclients = 10000;
+
+	for (g = 0; g < ARRAY_SIZE(groups); g++) {
+		if (optind == argc) {
+			groups[g].run();
+			continue;
+		}
+
+		for (i = optind; i < argc; i++) {
+			if (strcmp(argv[i], groups[g].name) == 0) {
+				groups[g].run();
+			}
+		}
+	}
+
+	return 0;
+}
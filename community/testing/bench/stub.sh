@@ -0,0 +1,134 @@
+#!/bin/bash
+#Copyright (C) The openNDS Contributors 2004-2024
+#This software is released under the GNU GPL license.
+#
+# Stand-in for the openNDS helper scripts, nft and ip, used by bench.sh.
+#
+# bench.sh links this file into place under every name the daemon executes
+# (/usr/lib/opennds/*.sh, nft and ip). It answers with the minimum each caller
+# parses, so the benchmark measures openNDS itself rather than uci, dnsmasq or the
+# kernel firewall, while still paying for every fork/exec the daemon makes.
+#
+# Every invocation is appended to $NDSBENCH_DIR/exec.log so bench.sh can report
+# executions per request.
+#
+
+name=$(basename "$0")
+echo "$name $1" >> "$NDSBENCH_DIR/exec.log"
+
+option() {
+	awk -F= -v key="$1" '$1 == key {sub(/^[^=]*=/, ""); printf "%s", $0}' "$NDSBENCH_DIR/bench.conf"
+}
+
+case "$name" in
+	nft)
+		# Counters are read with "nft list chain ..."; an empty ruleset reads as no traffic
+		exit 0
+	;;
+
+	ip)
+		if [ "$1" = "neigh" ]; then
+			cat "$NDSBENCH_DIR/neigh"
+			exit 0
+		fi
+
+		exec "$NDSBENCH_IP" "$@"
+	;;
+
+	get_client_interface.sh)
+		printf "%s" "$(option gatewayinterface)"
+		exit 0
+	;;
+
+	libopennds.sh)
+	;;
+
+	*)
+		# dnsconfig.sh, authmon.sh, binauth_log.sh etc.
+		exit 0
+	;;
+esac
+
+case "$1" in
+	is_nodog|check_heartbeat|preemptivemac|get_next_preemptive_auth)
+		exit 1
+	;;
+
+	get_option_from_config)
+		option "$2"
+	;;
+
+	tmpfs|clean)
+		printf "%s" "$NDSBENCH_DIR/tmp"
+	;;
+
+	gatewayip)
+		option gatewayip
+	;;
+
+	gatewaymac)
+		printf "%s" "$(cat "/sys/class/net/$2/address")"
+	;;
+
+	gatewayid)
+		tr -d ':\n' < "/sys/class/net/$2/address"
+	;;
+
+	gatewayroute)
+		printf "%s" "$(option gatewayip) $2 online"
+	;;
+
+	get_interface_by_ip)
+		printf "%s" "$(option gatewayinterface)"
+	;;
+
+	pad_string)
+		# $2 left, $3 pad characters, $4 string
+		printf "%s%s" "${3:0:$((${#3} - ${#4}))}" "$4"
+	;;
+
+	get_quotas_by_mac)
+		printf "0 0 0 0 0"
+	;;
+
+	dhcpcheck)
+		printf "%s" "$2"
+	;;
+
+	write|rmcid)
+		printf "done"
+	;;
+
+	get_list_from_config|debuglevel|pre_setup|delete_chains|nftset|auth_restore|write_log|download| \
+	create_client_ruleset|replace_client_rule|delete_client_rule|startdaemon|stopdaemon|set_key)
+		exit 0
+	;;
+
+	*)
+		# Preauth mode: $1 is the encoded query, $2 the user agent, $3 login option, $4 themespec
+		cat <<-EOF
+			<!DOCTYPE html>
+			<html>
+			<head>
+			<meta charset="utf-8">
+			<meta name="viewport" content="width=device-width, initial-scale=1.0">
+			<link rel="stylesheet" type="text/css" href="/splash.css">
+			<title>openNDS Benchmark</title>
+			</head>
+			<body>
+			<div class="offset">
+			<med-blue>openNDS Benchmark</med-blue>
+			<div class="insert">
+			<form action="/opennds_preauth/" method="get">
+			<input type="hidden" name="fas" value="$1">
+			<input type="submit" value="Continue">
+			</form>
+			</div>
+			</div>
+			</body>
+			</html>
+		EOF
+	;;
+esac
+
+exit 0
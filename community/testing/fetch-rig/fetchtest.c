@@ -0,0 +1,402 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file fetchtest.c
+    @brief Checks the remote fetcher against a stand-in http server on loopback
+
+    The server runs in this process, on an ephemeral port of 127.0.0.1, and
+    serves a few resources with ETag and Last-Modified validators, a redirect,
+    a 404, a response cut short and one with its body sent after the headers. Each check runs fetcher_run() on the same
+    jobs as download_remotes() would and looks at the results, the files in the
+    destination directory and the responses the server sent.
+
+    Every check prints a PASS or FAIL line, and the last line is machine readable:
+
+	fetchtest passed=... failed=... requests=... not_modified=... max_parallel=...
+
+    @author Copyright (C) 2024 The openNDS Contributors
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../../../src/conf.h"
+#include "../../../src/fetcher.h"
+
+// Normally defined in main.c, which is not linked here
+time_t started_time = 0;
+
+int
+authmon_start(void)
+{
+	return 0;
+}
+
+typedef struct {
+	const char *path;
+	char body[64];
+	char etag[32];
+	const char *last_modified;
+	int cut;			/**< @brief Announce more than is sent, then close */
+	int split;			/**< @brief Send the body in a write of its own, after the headers */
+} t_resource;
+
+static t_resource resources[] = {
+	{"/a.png", "PNG image a", "\"a1\"", "Mon, 01 Jan 2024 00:00:00 GMT", 0, 0},
+	{"/b.css", "body { color: red; }", "\"b1\"", NULL, 0, 0},
+	{"/c.txt", "plain text c", "\"c1\"", "Mon, 01 Jan 2024 00:00:00 GMT", 0, 0},
+	{"/cut.txt", "only part of the body", "\"d1\"", NULL, 1, 0},
+	{"/split.txt", "body after the headers", "\"e1\"", NULL, 0, 1},
+};
+
+static pthread_mutex_t server_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int requests = 0;
+static int not_modified = 0;
+static int in_flight = 0;
+static int max_parallel = 0;
+static int passed = 0;
+static int failed = 0;
+static char dir[64];
+static int port;
+
+static void
+check(int ok, const char *what)
+{
+	printf("%s %s\n", ok ? "PASS" : "FAIL", what);
+	ok ? passed++ : failed++;
+}
+
+static void
+header_value(const char *request, const char *name, char *value, size_t size)
+{
+	const char *line = strcasestr(request, name);
+	size_t len;
+
+	value[0] = '\0';
+
+	if (!line) {
+		return;
+	}
+
+	line += strlen(name);
+	len = strcspn(line, "\r\n");
+
+	if (len < size) {
+		memcpy(value, line, len);
+		value[len] = '\0';
+	}
+}
+
+static void *
+serve(void *arg)
+{
+	int sock = (int)(long)arg;
+	char request[2048] = {0};
+	char reply[1024];
+	char path[256] = {0};
+	const char *body = NULL;
+	char etag[64];
+	char since[64];
+	t_resource *r = NULL;
+	size_t len = 0;
+	ssize_t n;
+	int i;
+
+	while (!strstr(request, "\r\n\r\n") && len < sizeof(request) - 1) {
+		n = recv(sock, request + len, sizeof(request) - 1 - len, 0);
+
+		if (n <= 0) {
+			break;
+		}
+
+		len += n;
+	}
+
+	pthread_mutex_lock(&server_mutex);
+	requests++;
+	in_flight++;
+
+	if (in_flight > max_parallel) {
+		max_parallel = in_flight;
+	}
+
+	pthread_mutex_unlock(&server_mutex);
+
+	// Long enough for the fetcher's connections to overlap
+	usleep(50000);
+
+	sscanf(request, "GET %255s", path);
+	header_value(request, "If-None-Match: ", etag, sizeof(etag));
+	header_value(request, "If-Modified-Since: ", since, sizeof(since));
+
+	for (i = 0; i < sizeof(resources) / sizeof(resources[0]); i++) {
+		if (strcmp(path, resources[i].path) == 0) {
+			r = &resources[i];
+		}
+	}
+
+	pthread_mutex_lock(&server_mutex);
+
+	if (strcmp(path, "/moved") == 0) {
+		len = snprintf(reply, sizeof(reply), "HTTP/1.1 302 Found\r\nLocation: /a.png\r\nContent-Length: 0\r\n\r\n");
+	} else if (!r) {
+		len = snprintf(reply, sizeof(reply), "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+	} else if ((etag[0] && strcmp(etag, r->etag) == 0) || (!etag[0] && since[0] && r->last_modified && strcmp(since, r->last_modified) == 0)) {
+		len = snprintf(reply, sizeof(reply), "HTTP/1.1 304 Not Modified\r\nETag: %s\r\n\r\n", r->etag);
+		not_modified++;
+	} else {
+		len = snprintf(reply, sizeof(reply), "HTTP/1.1 200 OK\r\nETag: %s\r\n%s%s%sContent-Length: %zu\r\n\r\n%s",
+			r->etag,
+			r->last_modified ? "Last-Modified: " : "",
+			r->last_modified ? r->last_modified : "",
+			r->last_modified ? "\r\n" : "",
+			strlen(r->body) + (r->cut ? 100 : 0),
+			r->split ? "" : r->body);
+		body = r->split ? r->body : NULL;
+	}
+
+	in_flight--;
+	pthread_mutex_unlock(&server_mutex);
+
+	send(sock, reply, len, MSG_NOSIGNAL);
+
+	// The fetcher has read the headers alone before the body arrives
+	if (body) {
+		usleep(100000);
+		send(sock, body, strlen(body), MSG_NOSIGNAL);
+	}
+
+	close(sock);
+	return NULL;
+}
+
+static void *
+server(void *arg)
+{
+	int listener = (int)(long)arg;
+	pthread_t tid;
+	int sock;
+
+	while ((sock = accept(listener, NULL, NULL)) >= 0) {
+		pthread_create(&tid, NULL, serve, (void *)(long)sock);
+		pthread_detach(tid);
+	}
+
+	return NULL;
+}
+
+static int
+start_server(void)
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	pthread_t tid;
+	int listener;
+
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, 16) != 0) {
+		return -1;
+	}
+
+	getsockname(listener, (struct sockaddr *)&addr, &addrlen);
+	port = ntohs(addr.sin_port);
+	return pthread_create(&tid, NULL, server, (void *)(long)listener);
+}
+
+static int
+file_is(const char *name, const char *content)
+{
+	char path[128];
+	char buf[128] = {0};
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	fp = fopen(path, "r");
+
+	if (!fp) {
+		return content == NULL;
+	}
+
+	fread(buf, 1, sizeof(buf) - 1, fp);
+	fclose(fp);
+	return content && strcmp(buf, content) == 0;
+}
+
+static ino_t
+inode(const char *name)
+{
+	char path[128];
+	struct stat st;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	return stat(path, &st) == 0 ? st.st_ino : 0;
+}
+
+// Temporary files are named after the destination with a random suffix
+static int
+leftovers(void)
+{
+	struct dirent *entry;
+	DIR *d = opendir(dir);
+	int count = 0;
+
+	while ((entry = readdir(d))) {
+		if (strchr(entry->d_name, '.') && strlen(strrchr(entry->d_name, '.')) == 7) {
+			count++;
+		}
+	}
+
+	closedir(d);
+	return count;
+}
+
+#define JOBS 6
+
+static int
+run(t_fetch_job *jobs, int refresh)
+{
+	const char *names[JOBS] = {"a.png", "b.css", "c.txt", "moved.png", "missing.png", "cut.txt"};
+	const char *paths[JOBS] = {"/a.png", "/b.css", "/c.txt", "/moved", "/missing.png", "/cut.txt"};
+	int i;
+
+	for (i = 0; i < JOBS; i++) {
+		free(jobs[i].url);
+		free(jobs[i].path);
+		asprintf(&jobs[i].url, "http://127.0.0.1:%d%s", port, paths[i]);
+		asprintf(&jobs[i].path, "%s/%s", dir, names[i]);
+		jobs[i].result = FETCH_SKIPPED;
+	}
+
+	return fetcher_run(jobs, JOBS, refresh);
+}
+
+int
+main(int argc, char **argv)
+{
+	t_fetch_job jobs[JOBS] = {{0}};
+	ino_t a, b, c;
+	char *list;
+	char *url;
+	char *path;
+	int before;
+	FILE *fp;
+
+	snprintf(dir, sizeof(dir), "/tmp/ndsfetch.XXXXXX");
+
+	if (!mkdtemp(dir) || start_server() != 0) {
+		printf("fetchtest: cannot set up the stand-in server\n");
+		return 1;
+	}
+
+	// First download, only missing files
+	check(run(jobs, 0) == 2, "initial fetch fails only for the 404 and the cut response");
+	check(file_is("a.png", "PNG image a") && file_is("b.css", "body { color: red; }") && file_is("c.txt", "plain text c"), "initial fetch content");
+	check(jobs[3].result == FETCH_UPDATED && file_is("moved.png", "PNG image a"), "redirect followed");
+	check(file_is("missing.png", NULL) && file_is("cut.txt", NULL), "failed fetches leave no file");
+	check(leftovers() == 0, "no temporary files left");
+	check(max_parallel > 1 && max_parallel <= FETCHER_PARALLEL, "parallel fetches bounded by FETCHER_PARALLEL");
+
+	// Present files are not fetched again
+	before = requests;
+	run(jobs, 0);
+	check(requests - before == 2, "missing only fetch asks for the absent files alone");
+
+	// A refresh revalidates
+	a = inode("a.png");
+	b = inode("b.css");
+	c = inode("c.txt");
+	before = not_modified;
+	run(jobs, 1);
+	check(jobs[0].result == FETCH_UNCHANGED && jobs[1].result == FETCH_UNCHANGED && jobs[2].result == FETCH_UNCHANGED, "refresh answered 304");
+	check(not_modified - before == 4, "304 for every file with validators, redirect included");
+	check(inode("a.png") == a && inode("b.css") == b && inode("c.txt") == c, "unchanged files not replaced");
+
+	// New content is renamed into place
+	snprintf(resources[1].body, sizeof(resources[1].body), "body { color: blue; }");
+	snprintf(resources[1].etag, sizeof(resources[1].etag), "\"b2\"");
+	run(jobs, 1);
+	check(jobs[1].result == FETCH_UPDATED && file_is("b.css", "body { color: blue; }"), "changed file updated");
+	check(inode("b.css") != b, "changed file replaced by rename");
+
+	// A new validator on the same content is only a deduplicated download
+	snprintf(resources[2].etag, sizeof(resources[2].etag), "\"c2\"");
+	resources[2].last_modified = NULL;
+	run(jobs, 1);
+	check(jobs[2].result == FETCH_DEDUPED && inode("c.txt") == c, "same content deduplicated");
+
+	// A cut response keeps the file in place
+	fp = fopen(jobs[5].path, "w");
+	fputs("old content", fp);
+	fclose(fp);
+	run(jobs, 1);
+	check(jobs[5].result == FETCH_FAILED && file_is("cut.txt", "old content"), "cut response keeps the old file");
+	check(leftovers() == 0, "no temporary files left after failures");
+
+	// A body sent apart from the headers is read to the end
+	asprintf(&url, "http://127.0.0.1:%d/split.txt", port);
+	asprintf(&path, "%s/split.txt", dir);
+	check(fetcher_fetch(url, path, 0) == FETCH_UPDATED && file_is("split.txt", "body after the headers"), "body sent after the headers");
+	free(url);
+	free(path);
+
+	// A host longer than the fetcher holds is refused, not copied
+	asprintf(&url, "http://%0260d/long.txt", 0);
+	asprintf(&path, "%s/long.txt", dir);
+	check(fetcher_fetch(url, path, 0) == FETCH_FAILED && file_is("long.txt", NULL), "overlong host refused");
+	free(url);
+	free(path);
+
+	// Only entries that are not http are left to the download library call
+	list = fetcher_script_list("logo_png=http://example.com/logo.png, banner_jpg=https://example.com/b.jpg, terms_htm=file:///etc/terms.htm, ");
+	check(list && strcmp(list, "banner_jpg=https://example.com/b.jpg, terms_htm=file:///etc/terms.htm, ") == 0, "script list without http entries");
+	free(list);
+	check(fetcher_script_list("logo_png=http://example.com/logo.png, ") == NULL, "script list empty when all are http");
+
+	printf("fetchtest passed=%d failed=%d requests=%d not_modified=%d max_parallel=%d\n",
+		passed, failed, requests, not_modified, max_parallel);
+
+	if (!getenv("FETCHTEST_KEEP")) {
+		char *cmd;
+
+		asprintf(&cmd, "rm -rf %s", dir);
+		system(cmd);
+		free(cmd);
+	} else {
+		printf("fetchtest: files kept in %s\n", dir);
+	}
+
+	return failed ? 1 : 0;
+}
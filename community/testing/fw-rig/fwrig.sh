@@ -0,0 +1,718 @@
+#!/bin/bash
+#Copyright (C) The openNDS Contributors 2004-2024
+#This software is released under the GNU GPL license.
+#
+# openNDS firewall integration and scale rig, run by "make fwtest".
+#
+# Builds a small network out of namespaces on a plain Linux box:
+#
+#	client namespaces ndsrig-c<n> --veth--> br-lan [ndsrig-gw: opennds + nft] wan0 --veth--> [ndsrig-wan]
+#
+# then starts the freshly built opennds on br-lan with the libopennds.sh from this
+# tree and the real nft, and walks N dual stack clients through authentication, traffic,
+# rate limiting and deauthentication, checking the nft ruleset and counters at each step
+# and timing every operation.
+#
+# Must be run as root. Needs nft, ping (iputils), nsenter and unshare.
+# Nothing on the host is modified apart from creating /usr/lib/opennds and
+# /etc/config if missing. dnsmasq is not touched (dnsconfig.sh is a no-op here),
+# so walled garden and blocklist sets are not covered.
+#
+# Tunables (environment):
+#	RIG_CLIENTS		number of simulated clients (default 50, max 200)
+#	RIG_CHECKINTERVAL	opennds checkinterval in seconds (default 5)
+#	RIG_RATE		download rate limit in kb/s applied to the last client (default 256)
+#	OPENNDS			daemon binary (default ./opennds)
+#	NDSCTL			ndsctl binary (default ./ndsctl)
+#
+
+clients=${RIG_CLIENTS:-50}
+checkinterval=${RIG_CHECKINTERVAL:-5}
+ratecheckwindow=2
+rate=${RIG_RATE:-256}
+here=$(cd "$(dirname "$0")" && pwd)
+tree=$(cd "$here/../../.." && pwd)
+opennds=$(realpath "${OPENNDS:-./opennds}")
+ndsctl=$(realpath "${NDSCTL:-./ndsctl}")
+
+gwns="ndsrig-gw"
+wanns="ndsrig-wan"
+clns="ndsrig-c"
+lan="192.168.232"
+gwip="$lan.1"
+wan="10.231.0"
+lan6="fd00:232:"
+gwip6="$lan6:1"
+wan6="fd00:231:"
+first=10
+
+passed=0
+failed=0
+
+for cmd in nft ping nsenter unshare ip; do
+	if ! type "$cmd" &> /dev/null; then
+		echo "fwrig: $cmd is required"
+		exit 1
+	fi
+done
+
+if [ "$(id -u)" != "0" ]; then
+	echo "fwrig: must be run as root (network namespaces are required)"
+	exit 1
+fi
+
+if type uci &> /dev/null; then
+	echo "fwrig: uci is present, run the rig on a generic Linux host rather than a router"
+	exit 1
+fi
+
+if [ ! -x "$opennds" ] || [ ! -x "$ndsctl" ]; then
+	echo "fwrig: build opennds and ndsctl first (make fwtest)"
+	exit 1
+fi
+
+if [ "$clients" -lt 1 ] || [ "$clients" -gt 200 ]; then
+	echo "fwrig: RIG_CLIENTS must be between 1 and 200"
+	exit 1
+fi
+
+# Not under /tmp, which the daemon's mount namespace replaces with "$RIG_DIR/tmp"
+RIG_DIR=$(mktemp -d /var/tmp/ndsrig.XXXXXX)
+
+daemonpid=""
+floodpid=""
+madedirs=""
+
+cleanup() {
+	local i
+
+	[ -n "$floodpid" ] && kill "$floodpid" 2>/dev/null
+
+	if [ -n "$daemonpid" ]; then
+		kill "$daemonpid" 2>/dev/null
+		wait "$daemonpid" 2>/dev/null
+	fi
+
+	for i in $(seq 0 $((clients - 1))); do
+		ip netns del "$clns$i" 2>/dev/null
+	done
+
+	ip netns del "$gwns" 2>/dev/null
+	ip netns del "$wanns" 2>/dev/null
+
+	for dir in $madedirs; do
+		rmdir "$dir" 2>/dev/null
+	done
+
+	if [ -z "$RIG_KEEP" ]; then
+		rm -rf "$RIG_DIR"
+	else
+		echo "fwrig: logs kept in $RIG_DIR"
+	fi
+}
+
+trap cleanup EXIT
+trap "exit 1" INT TERM
+
+now_ms() {
+	echo $(($(date +%s%N) / 1000000))
+}
+
+# Record a check result: $1 is 0 for pass, $2 the description
+check() {
+	if [ "$1" -eq 0 ]; then
+		echo "PASS $2"
+		passed=$((passed + 1))
+	else
+		echo "FAIL $2"
+		failed=$((failed + 1))
+	fi
+}
+
+# Print "count p50 p99 max total" of the millisecond values in file $1
+stats() {
+	sort -n "$1" | awk '
+		{v[NR] = $1; total += $1}
+		END {
+			if (NR == 0) {print "0 0 0 0 0"; exit}
+			printf "%d %d %d %d %d\n", NR, v[int(0.5 * (NR - 1)) + 1], v[int(0.99 * (NR - 1)) + 1], v[NR], total
+		}'
+}
+
+client_ip() {
+	echo "$lan.$((first + $1))"
+}
+
+client_ip6() {
+	echo "$lan6:$((first + $1))"
+}
+
+# Run ndsctl inside the daemon's network and mount namespaces
+nds_ctl() {
+	nsenter -t "$daemonpid" -m -n "$ndsctl" "$@"
+}
+
+# Count the rules in chain $2 of table $1 that mention address $3
+rule_count() {
+	grep -c -w -- "$3" "$RIG_DIR/ruleset.$1.$2"
+}
+
+snapshot_chain() {
+	ip netns exec "$gwns" nft list chain inet "$1" "$2" > "$RIG_DIR/ruleset.$1.$2" 2>/dev/null
+}
+
+snapshot_ruleset() {
+	snapshot_chain nds_mangle ndsOUT
+	snapshot_chain nds_mangle ndsINC
+	snapshot_chain nds_mangle ndsDLR
+	snapshot_chain nds_filter ndsULR
+}
+
+#### Network ####
+
+echo "fwrig: building network with $clients clients"
+started=$(now_ms)
+
+ip netns add "$gwns" || exit 1
+ip netns add "$wanns" || exit 1
+ip netns exec "$gwns" sysctl -q -w net.ipv4.ip_forward=1
+ip netns exec "$gwns" sysctl -q -w net.ipv6.conf.all.forwarding=1
+ip -n "$gwns" link set lo up
+ip -n "$gwns" link add br-lan type bridge
+ip -n "$gwns" addr add "$gwip/24" dev br-lan
+ip -n "$gwns" addr add "$gwip6/64" dev br-lan nodad
+ip -n "$gwns" link set br-lan up
+
+ip link add wan0 netns "$gwns" type veth peer name up0 netns "$wanns" || exit 1
+ip -n "$gwns" addr add "$wan.2/24" dev wan0
+ip -n "$gwns" link set wan0 up
+ip -n "$gwns" addr add "$wan6:2/64" dev wan0 nodad
+ip -n "$gwns" route add default via "$wan.1"
+ip -n "$wanns" link set lo up
+ip -n "$wanns" addr add "$wan.1/24" dev up0
+ip -n "$wanns" link set up0 up
+ip -n "$wanns" addr add "$wan6:1/64" dev up0 nodad
+ip -n "$wanns" route add "$lan.0/24" via "$wan.2"
+ip -n "$wanns" -6 route add "$lan6:/64" via "$wan6:2"
+
+: > "$RIG_DIR/dhcp.leases"
+
+for i in $(seq 0 $((clients - 1))); do
+	ns="$clns$i"
+	ip netns add "$ns" || exit 1
+	ip link add eth0 netns "$ns" type veth peer name "lan$i" netns "$gwns" || exit 1
+	ip -n "$gwns" link set "lan$i" master br-lan
+	ip -n "$gwns" link set "lan$i" up
+	ip -n "$ns" link set lo up
+	ip -n "$ns" addr add "$(client_ip "$i")/24" dev eth0
+	ip -n "$ns" link set eth0 up
+	ip -n "$ns" route add default via "$gwip"
+	ip -n "$ns" addr add "$(client_ip6 "$i")/64" dev eth0 nodad
+	ip -n "$ns" -6 route add default via "$gwip6"
+	mac=$(ip netns exec "$ns" cat /sys/class/net/eth0/address)
+	echo "$(($(date +%s) + 86400)) $mac $(client_ip "$i") client$i *" >> "$RIG_DIR/dhcp.leases"
+done
+
+# Upstream gateway must be in the neighbour table for gatewayroute to report online
+ip netns exec "$gwns" ping -c 1 -W 1 "$wan.1" > /dev/null
+
+echo "fwrig: network ready in $(($(now_ms) - started)) ms"
+
+#### opennds ####
+
+mkdir -p "$RIG_DIR/lib" "$RIG_DIR/config" "$RIG_DIR/tmp"
+
+for script in "$tree"/forward_authentication_service/libs/*.sh \
+	"$tree"/forward_authentication_service/PreAuth/*.sh \
+	"$tree"/forward_authentication_service/binauth/*.sh; do
+	sed '0,/#!\/bin\/sh/{s/#!\/bin\/sh/#!\/bin\/bash/}' "$script" > "$RIG_DIR/lib/$(basename "$script")"
+done
+
+cp "$RIG_DIR/lib/theme_click-to-continue-basic.sh" "$RIG_DIR/lib/theme_click-to-continue.sh"
+
+# Keep dnsmasq and its configuration out of it
+cat > "$RIG_DIR/lib/dnsconfig.sh" <<-EOF
+	#!/bin/bash
+	exit 0
+EOF
+
+chmod 755 "$RIG_DIR"/lib/*.sh
+
+cat > "$RIG_DIR/config/opennds" <<-EOF
+	config opennds 'setup'
+		option enabled '1'
+		option gatewayinterface 'br-lan'
+		option gatewayname 'openNDS firewall rig'
+		option faskey 'fwrig'
+		option maxclients '$((clients + 10))'
+		option checkinterval '$checkinterval'
+		option ratecheckwindow '$ratecheckwindow'
+		option allow_preemptive_authentication '1'
+		option dhcp_leases_file '$RIG_DIR/dhcp.leases'
+		option debuglevel '1'
+EOF
+
+for dir in /usr/lib/opennds /etc/config; do
+	if [ ! -d "$dir" ]; then
+		mkdir -p "$dir" || exit 1
+		madedirs="$dir $madedirs"
+	fi
+done
+
+# Start opennds in the gateway namespace, logging to $1, and wait until it answers ndsctl.
+# /tmp is a rig directory rather than a private tmpfs, so the snapshot outlives a restart
+# as it would on a router. Sets daemonpid and ready (0 once it answers).
+start_opennds() {
+	local i
+
+	ip netns exec "$gwns" unshare -m sh -c "
+		mount --bind '$RIG_DIR/lib' /usr/lib/opennds || exit 1
+		mount --bind '$RIG_DIR/config' /etc/config || exit 1
+		mount --bind '$RIG_DIR/tmp' /tmp || exit 1
+		exec '$opennds' -f
+	" > "$1" 2>&1 &
+	daemonpid=$!
+
+	ready=1
+
+	for i in $(seq 1 120); do
+		if ! kill -0 "$daemonpid" 2>/dev/null; then
+			break
+		fi
+
+		if nds_ctl status > /dev/null 2>&1; then
+			ready=0
+			break
+		fi
+
+		sleep 0.5
+	done
+}
+
+started=$(now_ms)
+start_opennds "$RIG_DIR/opennds.log"
+startup_ms=$(($(now_ms) - started))
+check "$ready" "opennds started and answers ndsctl ($startup_ms ms)"
+
+if [ "$ready" -ne 0 ]; then
+	tail -n 50 "$RIG_DIR/opennds.log"
+	exit 1
+fi
+
+tables=$(ip netns exec "$gwns" nft list tables)
+
+for table in nds_filter nds_mangle nds_nat; do
+	echo "$tables" | grep -q -w "inet $table"
+	check $? "table inet $table exists"
+done
+
+snapshot_ruleset
+
+for chain in nds_mangle.ndsOUT nds_mangle.ndsINC nds_mangle.ndsDLR nds_filter.ndsULR; do
+	[ -s "$RIG_DIR/ruleset.$chain" ]
+	check $? "chain ${chain#*.} exists"
+done
+
+#### Preauthenticated ####
+
+# Every client talks to the gateway so it is in the neighbour table
+for i in $(seq 0 $((clients - 1))); do
+	ip netns exec "$clns$i" ping -c 1 -W 2 "$gwip" > /dev/null &
+done
+
+wait
+
+ip netns exec "${clns}0" ping -c 2 -W 1 "$wan.1" > /dev/null 2>&1
+[ $? -ne 0 ]
+check $? "preauthenticated client cannot reach the internet"
+
+#### Authentication ####
+
+: > "$RIG_DIR/auth.ms"
+authfails=0
+last=$((clients - 1))
+
+for i in $(seq 0 $last); do
+	if [ "$i" -eq "$last" ]; then
+		# sessiontimeout uploadrate downloadrate uploadquota downloadquota
+		args="0 0 $rate 0 0"
+	else
+		args=""
+	fi
+
+	t0=$(now_ms)
+	out=$(nds_ctl auth "$(client_ip "$i")" $args 2>&1)
+	echo $(($(now_ms) - t0)) >> "$RIG_DIR/auth.ms"
+
+	if ! echo "$out" | grep -q "authenticated"; then
+		authfails=$((authfails + 1))
+	fi
+done
+
+check "$authfails" "ndsctl auth succeeded for all $clients clients"
+
+t0=$(now_ms)
+snapshot_ruleset
+list_ms=$(($(now_ms) - t0))
+
+missing=0
+
+for i in $(seq 0 $last); do
+	addr=$(client_ip "$i")
+	[ "$(rule_count nds_mangle ndsOUT "$addr")" -eq 1 ] || missing=$((missing + 1))
+	[ "$(rule_count nds_mangle ndsINC "$addr")" -eq 1 ] || missing=$((missing + 1))
+	[ "$(rule_count nds_mangle ndsDLR "$addr")" -eq 2 ] || missing=$((missing + 1))
+	[ "$(rule_count nds_filter ndsULR "$addr")" -eq 2 ] || missing=$((missing + 1))
+done
+
+check "$missing" "each client has 1 ndsOUT, 1 ndsINC, 2 ndsDLR and 2 ndsULR rules ($list_ms ms to list)"
+
+#### Traffic and counters ####
+
+: > "$RIG_DIR/ping.fail"
+
+for i in $(seq 0 $last); do
+	(ip netns exec "$clns$i" ping -c 5 -i 0.2 -s 1400 -W 2 "$wan.1" > /dev/null 2>&1 || echo "$i" >> "$RIG_DIR/ping.fail") &
+done
+
+wait
+
+check "$(wc -l < "$RIG_DIR/ping.fail")" "authenticated clients reach the internet"
+
+snapshot_ruleset
+uncounted=0
+
+for i in $(seq 0 $last); do
+	packets=$(grep -w -- "$(client_ip "$i")" "$RIG_DIR/ruleset.nds_mangle.ndsOUT" | awk '{for (f = 1; f < NF; f++) if ($f == "packets") print $(f + 1)}')
+
+	if [ -z "$packets" ] || [ "$packets" -eq 0 ]; then
+		uncounted=$((uncounted + 1))
+	fi
+done
+
+check "$uncounted" "ndsOUT counters count every client's upload"
+
+# Let the client check thread pick the counters up
+sleep $((checkinterval * 2 + 1))
+uploaded=$(nds_ctl json "$(client_ip 0)" | awk -F'"' '$2 == "upload_this_session" {print $4}')
+[ -n "$uploaded" ] && [ "$uploaded" -gt 0 ]
+check $? "ndsctl json reports upload_this_session for a client ($uploaded kB)"
+
+#### Rate limiting ####
+
+addr=$(client_ip "$last")
+ip netns exec "$wanns" ping -f -s 1400 -w $((checkinterval * (ratecheckwindow + 4))) "$addr" > /dev/null 2>&1 &
+floodpid=$!
+limited=1
+t0=$(now_ms)
+
+while kill -0 "$floodpid" 2>/dev/null; do
+	snapshot_chain nds_mangle ndsDLR
+
+	if grep -w -- "$addr" "$RIG_DIR/ruleset.nds_mangle.ndsDLR" | grep -q "limit rate"; then
+		limited=0
+		break
+	fi
+
+	sleep 1
+done
+
+limit_ms=$(($(now_ms) - t0))
+kill "$floodpid" 2>/dev/null
+wait "$floodpid" 2>/dev/null
+floodpid=""
+check "$limited" "download rate limit of $rate kb/s applied to $addr under load ($limit_ms ms)"
+
+#### Deauthentication ####
+
+: > "$RIG_DIR/deauth.ms"
+deauthfails=0
+
+for i in $(seq 0 $last); do
+	t0=$(now_ms)
+	out=$(nds_ctl deauth "$(client_ip "$i")" 2>&1)
+	echo $(($(now_ms) - t0)) >> "$RIG_DIR/deauth.ms"
+
+	if ! echo "$out" | grep -q "deauthenticated"; then
+		deauthfails=$((deauthfails + 1))
+	fi
+done
+
+check "$deauthfails" "ndsctl deauth succeeded for all $clients clients"
+
+snapshot_ruleset
+leftover=0
+
+for i in $(seq 0 $last); do
+	addr=$(client_ip "$i")
+
+	for chain in nds_mangle.ndsOUT nds_mangle.ndsINC nds_mangle.ndsDLR nds_filter.ndsULR; do
+		[ "$(rule_count "${chain%.*}" "${chain#*.}" "$addr")" -eq 0 ] || leftover=$((leftover + 1))
+	done
+done
+
+check "$leftover" "no client rules remain after deauthentication"
+
+ip netns exec "${clns}0" ping -c 2 -W 1 "$wan.1" > /dev/null 2>&1
+[ $? -ne 0 ]
+check $? "deauthenticated client cannot reach the internet"
+
+#### Batches ####
+
+# Every client, then one that is not on the list and one already handled earlier in the batch
+unknown="$lan.250"
+
+batch_file() {
+	local i
+
+	echo "# $1 from the fw rig"
+
+	for i in $(seq 0 $last); do
+		client_ip "$i"
+	done
+
+	echo
+	echo "$unknown"
+	client_ip 0
+}
+
+# Check the reply in $RIG_DIR/$1.out of a batch written by batch_file, with $2 the wrong state result
+check_batch() {
+	local out="$RIG_DIR/$1.out"
+	local bad=0
+	local i
+
+	for i in $(seq 0 $last); do
+		grep -q -x -- "$((i + 2)) $(client_ip "$i") ok" "$out" || bad=$((bad + 1))
+	done
+
+	check "$bad" "$1 reports ok on the line of each of the $clients clients"
+
+	grep -q -x -- "$((clients + 3)) $unknown not_found" "$out"
+	check $? "$1 reports not_found for a client not on the list"
+
+	grep -q -x -- "$((clients + 4)) $(client_ip 0) $2" "$out"
+	check $? "$1 reports $2 for a client already done in the batch"
+
+	grep -q -x -- "summary lines=$((clients + 2)) ok=$clients failed=2 firewall=ok" "$out"
+	check $? "$1 summary counts $clients ok and 2 failed lines"
+
+	[ "$(wc -l < "$out")" -eq $((clients + 3)) ]
+	check $? "$1 prints one result per client line and the summary"
+}
+
+batch_file authbatch > "$RIG_DIR/authbatch.in"
+t0=$(now_ms)
+nds_ctl authbatch - < "$RIG_DIR/authbatch.in" > "$RIG_DIR/authbatch.out" 2>&1
+batch_rc=$?
+authbatch_ms=$(($(now_ms) - t0))
+
+[ "$batch_rc" -ne 0 ]
+check $? "ndsctl authbatch exits non zero when a line fails ($authbatch_ms ms)"
+check_batch authbatch not_preauthenticated
+
+snapshot_ruleset
+missing=0
+
+for i in $(seq 0 $last); do
+	addr=$(client_ip "$i")
+	[ "$(rule_count nds_mangle ndsOUT "$addr")" -eq 1 ] || missing=$((missing + 1))
+	[ "$(rule_count nds_mangle ndsINC "$addr")" -eq 1 ] || missing=$((missing + 1))
+	[ "$(rule_count nds_mangle ndsDLR "$addr")" -eq 2 ] || missing=$((missing + 1))
+	[ "$(rule_count nds_filter ndsULR "$addr")" -eq 2 ] || missing=$((missing + 1))
+done
+
+check "$missing" "after authbatch each client has 1 ndsOUT, 1 ndsINC, 2 ndsDLR and 2 ndsULR rules"
+
+for chain in nds_mangle.ndsOUT nds_mangle.ndsINC nds_mangle.ndsDLR nds_filter.ndsULR; do
+	[ "$(rule_count "${chain%.*}" "${chain#*.}" "$unknown")" -eq 0 ]
+	check $? "authbatch adds no ${chain#*.} rule for a client not on the list"
+done
+
+batch_file deauthbatch > "$RIG_DIR/deauthbatch.in"
+t0=$(now_ms)
+nds_ctl deauthbatch - < "$RIG_DIR/deauthbatch.in" > "$RIG_DIR/deauthbatch.out" 2>&1
+batch_rc=$?
+deauthbatch_ms=$(($(now_ms) - t0))
+
+[ "$batch_rc" -ne 0 ]
+check $? "ndsctl deauthbatch exits non zero when a line fails ($deauthbatch_ms ms)"
+check_batch deauthbatch not_authenticated
+
+snapshot_ruleset
+leftover=0
+
+for i in $(seq 0 $last); do
+	addr=$(client_ip "$i")
+
+	for chain in nds_mangle.ndsOUT nds_mangle.ndsINC nds_mangle.ndsDLR nds_filter.ndsULR; do
+		[ "$(rule_count "${chain%.*}" "${chain#*.}" "$addr")" -eq 0 ] || leftover=$((leftover + 1))
+	done
+done
+
+check "$leftover" "no client rules remain after deauthbatch"
+
+#### Restart ####
+
+# Quotas in kB, large enough not to end a session during the rig
+quota=1048576
+
+# Print "state session_start upload_this_session download_quota" of client $1 from ndsctl json
+client_state() {
+	nds_ctl json "$(client_ip "$1")" | awk -F'"' '
+		$2 == "state" {state = $4}
+		$2 == "session_start" {start = $4}
+		$2 == "upload_this_session" {upload = $4}
+		$2 == "download_quota" {quota = $4}
+		END {print state, start, upload, quota}'
+}
+
+authfails=0
+
+for i in $(seq 0 $last); do
+	# sessiontimeout uploadrate downloadrate uploadquota downloadquota
+	nds_ctl auth "$(client_ip "$i")" 0 0 0 $quota $quota 2>&1 | grep -q "authenticated" || authfails=$((authfails + 1))
+done
+
+check "$authfails" "ndsctl auth with quotas succeeded for all $clients clients"
+
+for i in $(seq 0 $last); do
+	ip netns exec "$clns$i" ping -c 5 -i 0.2 -s 1400 -W 2 "$wan.1" > /dev/null 2>&1 &
+done
+
+wait
+
+# Let the client check thread pick the counters up and write the snapshot
+sleep $((checkinterval * 2 + 1))
+
+for i in $(seq 0 $last); do
+	echo "$i $(client_state "$i")"
+done > "$RIG_DIR/restart.before"
+
+kill -TERM "$daemonpid"
+wait "$daemonpid" 2>/dev/null
+daemonpid=""
+
+[ -s "$RIG_DIR/tmp/ndsclients.snap" ]
+check $? "opennds leaves a snapshot of the authenticated clients on shutdown"
+
+start_opennds "$RIG_DIR/opennds.restart.log"
+check "$ready" "opennds restarted and answers ndsctl"
+
+if [ "$ready" -ne 0 ]; then
+	tail -n 50 "$RIG_DIR/opennds.restart.log"
+	exit 1
+fi
+
+# Snapshot: restored <n> of <count> clients saved <s> seconds ago, in <ms> ms
+restoreline=$(grep -o "Snapshot: restored .*" "$RIG_DIR/opennds.restart.log")
+restored=$(echo "$restoreline" | awk '{print $3}')
+restore_ms=$(echo "$restoreline" | awk '{print $(NF - 1)}')
+
+[ "$restored" = "$clients" ]
+check $? "snapshot restored ${restored:-0} of $clients clients in ${restore_ms:-?} ms"
+
+lost=0
+
+while read -r i state start upload dlquota; do
+	read -r state2 start2 upload2 dlquota2 <<< "$(client_state "$i")"
+
+	if [ "$state2" != "Authenticated" ] || [ "$start2" != "$start" ] \
+		|| [ "${upload2:-0}" -lt "${upload:-0}" ] || [ "$dlquota2" != "$dlquota" ]; then
+		lost=$((lost + 1))
+	fi
+done < "$RIG_DIR/restart.before"
+
+check "$lost" "every client is still authenticated with its session, upload counter and quota"
+
+snapshot_ruleset
+missing=0
+
+for i in $(seq 0 $last); do
+	addr=$(client_ip "$i")
+	[ "$(rule_count nds_mangle ndsOUT "$addr")" -eq 1 ] || missing=$((missing + 1))
+	[ "$(rule_count nds_mangle ndsINC "$addr")" -eq 1 ] || missing=$((missing + 1))
+	[ "$(rule_count nds_mangle ndsDLR "$addr")" -eq 2 ] || missing=$((missing + 1))
+	[ "$(rule_count nds_filter ndsULR "$addr")" -eq 2 ] || missing=$((missing + 1))
+done
+
+check "$missing" "after the restart each client has 1 ndsOUT, 1 ndsINC, 2 ndsDLR and 2 ndsULR rules"
+
+: > "$RIG_DIR/ping.fail"
+
+for i in $(seq 0 $last); do
+	(ip netns exec "$clns$i" ping -c 5 -i 0.2 -s 1400 -W 2 "$wan.1" > /dev/null 2>&1 || echo "$i" >> "$RIG_DIR/ping.fail") &
+done
+
+wait
+
+check "$(wc -l < "$RIG_DIR/ping.fail")" "restored clients reach the internet without authenticating again"
+
+sleep $((checkinterval * 2 + 1))
+read -r i state start upload dlquota < "$RIG_DIR/restart.before"
+read -r state2 start2 upload2 dlquota2 <<< "$(client_state 0)"
+[ -n "$upload2" ] && [ "$upload2" -gt "${upload:-0}" ]
+check $? "upload_this_session carries on counting after the restart ($upload kB then $upload2 kB)"
+
+#### Dual stack ####
+
+# Client 0 was authenticated by its IPv4 address, its IPv6 one reaches the gateway's neighbour table
+addr6=$(client_ip6 0)
+ip netns exec "${clns}0" ping -6 -c 1 -W 2 "$gwip6" > /dev/null 2>&1
+
+scanned=1
+t0=$(now_ms)
+
+for i in $(seq 1 $((checkinterval * 3))); do
+	snapshot_chain nds_mangle ndsOUT
+
+	if grep -w -- "$addr6" "$RIG_DIR/ruleset.nds_mangle.ndsOUT" | grep -q "ip6 saddr"; then
+		scanned=0
+		break
+	fi
+
+	sleep 1
+done
+
+scan_ms=$(($(now_ms) - t0))
+check "$scanned" "neighbour scan adds an ip6 ndsOUT rule for $addr6 ($scan_ms ms)"
+
+snapshot_ruleset
+missing=0
+[ "$(rule_count nds_mangle ndsOUT "$addr6")" -eq 1 ] || missing=$((missing + 1))
+[ "$(rule_count nds_mangle ndsINC "$addr6")" -eq 1 ] || missing=$((missing + 1))
+[ "$(rule_count nds_mangle ndsDLR "$addr6")" -eq 2 ] || missing=$((missing + 1))
+[ "$(rule_count nds_filter ndsULR "$addr6")" -eq 2 ] || missing=$((missing + 1))
+check "$missing" "$addr6 has 1 ndsOUT, 1 ndsINC, 2 ndsDLR and 2 ndsULR rules"
+
+read -r state start upload dlquota <<< "$(client_state 0)"
+ip netns exec "${clns}0" ping -6 -c 20 -i 0.2 -s 1400 -W 2 "$wan6:1" > /dev/null 2>&1
+
+snapshot_chain nds_mangle ndsOUT
+packets=$(grep -w -- "$addr6" "$RIG_DIR/ruleset.nds_mangle.ndsOUT" | awk '{for (f = 1; f < NF; f++) if ($f == "packets") print $(f + 1)}')
+[ -n "$packets" ] && [ "$packets" -gt 0 ]
+check $? "the ip6 ndsOUT rule of $addr6 counts its upload (${packets:-0} packets)"
+
+sleep $((checkinterval * 2 + 1))
+read -r state2 start2 upload2 dlquota2 <<< "$(client_state 0)"
+[ -n "$upload2" ] && [ "$upload2" -gt "${upload:-0}" ]
+check $? "upload_this_session of the client includes its IPv6 upload ($upload kB then $upload2 kB)"
+
+#### Report ####
+
+echo
+echo "nft and helper timings reported by the daemon:"
+nds_ctl metrics | grep -E "^opennds_(nft|exec|client_sweep)_duration_seconds_(sum|count)"
+
+read -r auth_n auth_p50 auth_p99 auth_max auth_total < <(stats "$RIG_DIR/auth.ms")
+read -r deauth_n deauth_p50 deauth_p99 deauth_max deauth_total < <(stats "$RIG_DIR/deauth.ms")
+
+echo
+echo "fwrig clients=$clients startup_ms=$startup_ms" \
+	"auth_p50_ms=$auth_p50 auth_p99_ms=$auth_p99 auth_total_ms=$auth_total" \
+	"deauth_p50_ms=$deauth_p50 deauth_p99_ms=$deauth_p99 deauth_total_ms=$deauth_total" \
+	"ruleset_list_ms=$list_ms ratelimit_ms=$limit_ms authbatch_ms=$authbatch_ms deauthbatch_ms=$deauthbatch_ms" \
+	"restore_ms=${restore_ms:-0} ip6_scan_ms=${scan_ms:-0}" \
+	"passed=$passed failed=$failed"
+
+[ "$failed" -eq 0 ]
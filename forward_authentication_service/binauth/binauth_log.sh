@@ -198,7 +198,7 @@ if [ "$action" = "auth_client" ]; then
 	# $7 custom data string
 
 	# customdata is by default b64encoded.
-	# You can use ndsctl to decode it (all functions of ndsctl are locked from use within binauth except b64encode and b64decode)
+	# You can use ndsctl to decode it (ndsctl commands that change state are refused within binauth, b64encode and b64decode are available)
 	# Note the format of the decoded customdata is set in the FAS or Themespec scripts so unencoded special characters may cause issues.
 	# For example, to decode customdata use:
 	# customdata=$(ndsctl b64decode "$customdata")
@@ -15,31 +15,6 @@ hosts="/etc/hosts"
 setconf="$1"
 uciconfig=$(uci show dhcp 2>/dev/null)
 
-ipset_to_nftset () {
-
-	local timeout=$loopcount
-
-	for tic in $(seq $timeout); do
-		ipset list "$ipsetname" &>/dev/null
-		ipsetstat=$?
-		elements=$(ipset list "$ipsetname" 2>/dev/null | awk -F"." 'NF==4 {printf ", %s", $0}')
-
-		if [ $ipsetstat -gt 0 ]; then
-			break
-		fi
-
-		elements=$(ipset list "$ipsetname" 2>/dev/null | awk -F"." 'NF==4 {printf ", %s", $0}')
-		elements=${elements:2}
-
-		if [ ! -z "$elements" ] && [ "$elements" != "$last_elements" ]; then
-			nft add element ip nds_filter "$ipsetname" {"$elements"}
-		fi
-
-		last_elements="$elements"
-		sleep 1
-	done
-}
-
 delete_114s() {
 	cpidconfig=$(echo "get dhcp.$network_zone.dhcp_option_force" | uci batch 2>/dev/null)
 	dellist="del_list dhcp.$network_zone.dhcp_option_force="
@@ -179,21 +154,6 @@ elif [ "$setconf" = "cpidconf" ]; then
 	printf "%s" "done"
 	exit 0
 
-elif [ "$1" = "ipset_to_nftset" ]; then
-	ipsetname=$2
-
-	if [ -z "$2" ]; then
-		exit 4
-	fi
-
-	if [ -z "$3" ]; then
-		loopcount=1
-	else
-		loopcount=$3
-	fi
-
-	ipset_to_nftset
-	exit 0
 else
 	exit 1 
 fi
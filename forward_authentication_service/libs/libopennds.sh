@@ -127,7 +127,8 @@ get_image_file() {
 	evalimg=$(echo "$customimageroot/""$filename")
 	eval $forename=$evalimg
 
-	if [ "$refresh" -ne 3 ]; then
+	# An empty url is an http image, fetched by openNDS itself
+	if [ "$refresh" -ne 3 ] && [ ! -z "$imageurl" ]; then
 		if [ ! -f "$mountpoint/ndsremote/$filename" ] || [ "$refresh" -eq 1 ]; then
 			# get protocol
 			protocol=$(echo "$imageurl" | awk -F'://' '{printf("%s", $1)}')
@@ -231,7 +232,8 @@ get_data_file() {
 	evaldata=$(echo "$mountpoint/ndsdata/""$filename")
 	eval $forename=$evaldata
 
-	if [ "$refresh" -ne 3 ]; then
+	# An empty url is an http file, fetched by openNDS itself
+	if [ "$refresh" -ne 3 ] && [ ! -z "$dataurl" ]; then
 		if [ ! -f "$mountpoint/ndsdata/$filename" ] || [ "$refresh" -eq 1 ]; then
 			# get protocol
 			protocol=$(echo "$dataurl" | awk -F'://' '{printf("%s", $1)}')
@@ -1368,12 +1370,17 @@ ipt_to_nft () {
 	echo "$nds_date: $cmdstr | $nftstr [ $ret ]" >> "$mountpoint/translate"
 }
 
+match_client_ip () {
+	# Pass the rules holding client_ip as a whole word, so fd00::5 does not also pick fd00::5:1 as "grep -w" would
+	awk -v ip="$client_ip" '{for (i = 1; i <= NF; i++) if ($i == ip) {print; next}}'
+}
+
 delete_client_rule () {
 
 	if [ "$nds_verdict" = "all" ]; then
-		local handles=$(nft -a list chain inet "$nds_table" "$nds_chain" | grep -w "$client_ip" | awk -F"handle " '{printf "%s ", $2}')
+		local handles=$(nft -a list chain inet "$nds_table" "$nds_chain" | match_client_ip | awk -F"handle " '{printf "%s ", $2}')
 	else
-		local handles=$(nft -a list chain inet "$nds_table" "$nds_chain" | grep -w "$client_ip" | grep -w "$nds_verdict" | awk -F"handle " '{printf "%s ", $2}')
+		local handles=$(nft -a list chain inet "$nds_table" "$nds_chain" | match_client_ip | grep -w "$nds_verdict" | awk -F"handle " '{printf "%s ", $2}')
 	fi
 
 	for rulehandle in $handles; do
@@ -1384,9 +1391,9 @@ delete_client_rule () {
 replace_client_rule () {
 
 	if [ "$nds_verdict" = "all" ]; then
-		local handles=$(nft -a list chain inet "$nds_table" "$nds_chain" | grep -w "$client_ip" | awk -F"handle " '{printf "%s ", $2}')
+		local handles=$(nft -a list chain inet "$nds_table" "$nds_chain" | match_client_ip | awk -F"handle " '{printf "%s ", $2}')
 	else
-		local handles=$(nft -a list chain inet "$nds_table" "$nds_chain" | grep -w "$client_ip" | grep -w "$nds_verdict" | awk -F"handle " '{printf "%s ", $2}')
+		local handles=$(nft -a list chain inet "$nds_table" "$nds_chain" | match_client_ip | grep -w "$nds_verdict" | awk -F"handle " '{printf "%s ", $2}')
 	fi
 
 	for rulehandle in $handles; do
@@ -1456,7 +1463,7 @@ nft_set () {
 
 		if [ "$nftsetmode" = "add" ] || [ "$nftsetmode" = "insert" ]; then
 			# Add the set, add/insert the rule and the Dnsmasq config
-			nft add set ip nds_filter "$nftsetname" { type ipv4_addr\; size 128\; }
+			nft add set ip nds_filter "$nftsetname" { type ipv4_addr\; flags interval\; }
 			ret=$?
 
 			if [ "$ret" -ne 0 ]; then
@@ -2510,9 +2517,10 @@ elif [ "$1" = "gatewayroute" ]; then
 
 					for arg in $arptest; do
 
-						if [ "$arg" = "PROBE" ] || [ "$arg" = "INCOMPLETE" ] || [ "$arg" = "FAILED"  ]; then
+						# PROBE is the routine revalidation of a known gateway, not a sign it is gone
+						if [ "$arg" = "INCOMPLETE" ] || [ "$arg" = "FAILED"  ]; then
 							gatewayinterfaces="$gatewayinterfaces$offline:$ipaddr,$iface "
-						elif [ "$arg" = "REACHABLE" ] || [ "$arg" = "STALE" ] || [ "$arg" = "DELAY"  ]; then
+						elif [ "$arg" = "REACHABLE" ] || [ "$arg" = "STALE" ] || [ "$arg" = "DELAY"  ] || [ "$arg" = "PROBE"  ]; then
 							gatewayinterfaces="$gatewayinterfaces$online:$ipaddr,$iface "
 						fi
 					done
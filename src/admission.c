@@ -0,0 +1,211 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @internal
+  @file admission.c
+  @brief Admission control for the web server, per source rate limits and the script budget
+  @author Copyright (C) 2015-2025 Modifications and additions by BlueWave Projects and Services <opennds@blue-wave.net>
+
+  Most requests that reach libmicrohttpd_cb() run helper scripts, so a single device
+  or app hammering the gateway port can keep every connection thread forking and
+  starve the other clients. Two budgets are checked before any script runs:
+
+  Each source address has a token bucket, refilled at http_source_rate requests per
+  second up to http_source_burst. Buckets live in a fixed table keyed by address, a
+  source not seen for a while is simply taken over by another.
+
+  http_script_concurrency caps the number of requests running scripts at once.
+
+  Requests over either budget are answered at once by the caller, and counted here.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "conf.h"
+#include "admission.h"
+#include "metrics.h"
+
+typedef struct {
+	char ip[INET6_ADDRSTRLEN];
+	double tokens;
+	double stamp;				/**< @brief Time of the last refill */
+} t_admission_bucket;
+
+static t_admission_bucket buckets[ADMISSION_SOURCES];
+static pthread_mutex_t admission_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int script_running = 0;
+static int script_peak = 0;
+static unsigned long long int shed_rate = 0;
+static unsigned long long int shed_busy = 0;
+
+static unsigned int
+_admission_hash(const char ip[])
+{
+	unsigned int hash = 2166136261u;
+
+	while (*ip) {
+		hash = (hash ^ (unsigned char)*ip++) * 16777619u;
+	}
+
+	return hash;
+}
+
+// Called with admission_mutex held
+static t_admission_bucket *
+_admission_bucket(const char ip[], unsigned int burst, double now)
+{
+	t_admission_bucket *bucket;
+	t_admission_bucket *stalest = NULL;
+	unsigned int hash;
+	int i;
+
+	hash = _admission_hash(ip);
+
+	for (i = 0; i < ADMISSION_PROBE; i++) {
+		bucket = &buckets[(hash + i) & (ADMISSION_SOURCES - 1)];
+
+		if (strcmp(bucket->ip, ip) == 0) {
+			return bucket;
+		}
+
+		if (!stalest || bucket->stamp < stalest->stamp) {
+			stalest = bucket;
+		}
+	}
+
+	// A new source, or one pushed out, starts with a full bucket
+	snprintf(stalest->ip, sizeof(stalest->ip), "%s", ip);
+	stalest->tokens = burst;
+	stalest->stamp = now;
+	return stalest;
+}
+
+/** Takes a token from the bucket of ip.
+ *  @return 0 if the request may go on, -1 if the source is over its rate
+ */
+int
+admission_source(const char ip[])
+{
+	s_config *config = config_get_config();
+	t_admission_bucket *bucket;
+	unsigned int rate = config->http_source_rate;
+	unsigned int burst = config->http_source_burst;
+	double now;
+	int rc = 0;
+
+	if (rate == 0) {
+		return 0;
+	}
+
+	if (burst < 1) {
+		burst = 1;
+	}
+
+	now = metrics_now();
+
+	pthread_mutex_lock(&admission_mutex);
+
+	bucket = _admission_bucket(ip, burst, now);
+	bucket->tokens += (now - bucket->stamp) * rate;
+	bucket->stamp = now;
+
+	if (bucket->tokens > burst) {
+		bucket->tokens = burst;
+	}
+
+	if (bucket->tokens >= 1) {
+		bucket->tokens -= 1;
+	} else {
+		shed_rate++;
+		rc = -1;
+	}
+
+	pthread_mutex_unlock(&admission_mutex);
+
+	if (rc != 0) {
+		metrics_inc(METRIC_HTTP_SHED, "rate");
+	}
+
+	return rc;
+}
+
+/** Takes a place in the budget of requests running scripts.
+ *  @return 0 if the request may go on and must call admission_script_leave(), -1 if the budget is spent
+ */
+int
+admission_script_enter(void)
+{
+	s_config *config = config_get_config();
+	int running;
+
+	running = __atomic_add_fetch(&script_running, 1, __ATOMIC_ACQ_REL);
+
+	if (config->http_script_concurrency > 0 && running > config->http_script_concurrency) {
+		__atomic_sub_fetch(&script_running, 1, __ATOMIC_ACQ_REL);
+		__atomic_add_fetch(&shed_busy, 1, __ATOMIC_RELAXED);
+		metrics_inc(METRIC_HTTP_SHED, "busy");
+		return -1;
+	}
+
+	if (running > __atomic_load_n(&script_peak, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&script_peak, running, __ATOMIC_RELAXED);
+	}
+
+	return 0;
+}
+
+void
+admission_script_leave(void)
+{
+	__atomic_sub_fetch(&script_running, 1, __ATOMIC_ACQ_REL);
+}
+
+void
+admission_status(FILE *fp)
+{
+	s_config *config = config_get_config();
+	unsigned long long int rate_count;
+
+	if (config->http_source_rate > 0) {
+		fprintf(fp, "HTTP requests per source: %u/s, burst %u\n", config->http_source_rate, config->http_source_burst);
+	} else {
+		fprintf(fp, "HTTP requests per source: no limit\n");
+	}
+
+	if (config->http_script_concurrency > 0) {
+		fprintf(fp, "HTTP script budget: %d requests at once\n", config->http_script_concurrency);
+	} else {
+		fprintf(fp, "HTTP script budget: no limit\n");
+	}
+
+	pthread_mutex_lock(&admission_mutex);
+	rate_count = shed_rate;
+	pthread_mutex_unlock(&admission_mutex);
+
+	fprintf(fp, "HTTP requests running scripts: %d now, %d peak\n",
+		__atomic_load_n(&script_running, __ATOMIC_RELAXED),
+		__atomic_load_n(&script_peak, __ATOMIC_RELAXED));
+	fprintf(fp, "HTTP requests shed: %llu over source rate (511), %llu over script budget (503)\n",
+		rate_count, __atomic_load_n(&shed_busy, __ATOMIC_RELAXED));
+}
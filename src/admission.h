@@ -0,0 +1,48 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file admission.h
+    @brief Admission control for the web server, per source rate limits and the script budget
+    @author Copyright (C) 2015-2025 Modifications and additions by BlueWave Projects and Services <opennds@blue-wave.net>
+*/
+
+#ifndef _ADMISSION_H_
+#define _ADMISSION_H_
+
+#include <stdio.h>
+
+/** Number of source addresses tracked, a power of two */
+#define ADMISSION_SOURCES 1024
+/** Slots probed for a source before the stalest is taken over */
+#define ADMISSION_PROBE 4
+
+/** @brief Take a token from the bucket of a source address. Returns 0 if the request may go on */
+int admission_source(const char ip[]);
+
+/** @brief Take a place in the budget of requests running scripts. Returns 0 if the request may go on */
+int admission_script_enter(void);
+
+/** @brief Give back a place taken by admission_script_enter() */
+void admission_script_leave(void);
+
+/** @brief Write the budgets and their counters, for ndsctl status */
+void admission_status(FILE *fp);
+
+#endif /* _ADMISSION_H_ */
@@ -47,6 +47,11 @@
 #include "util.h"
 #include "http_microhttpd_utils.h"
 #include "http_microhttpd.h"
+#include "metrics.h"
+#include "ndsctl_thread.h"
+#include "snapshot.h"
+#include "watchdog.h"
+#include "netmon.h"
 
 #define ENABLE 1
 #define DISABLE 0
@@ -194,7 +199,7 @@ client_auth(char *arg)
 						if (client) {
 							id = client ? client->id : 0;
 							debug(LOG_DEBUG, "client id: [%d]", id);
-							client->client_type = safe_strdup("preemptive");
+							client->client_type = client_list_strdup(client, "preemptive");
 
 							// log the preemptive authentication
 							safe_asprintf(&libcmd,
@@ -278,8 +283,9 @@ static int binauth_action(t_client *client, const char *reason, const char *cust
 	char *ndsctl_auth = "ndsctl_auth";
 	char *customdata_enc;
 	char *binauthcmd;
-	int ret = 1;
 	int rc = 0;
+	int hold;
+	double started;
 
 	if (config->binauth) {
 		debug(LOG_DEBUG, "client->custom=%s", client->custom);
@@ -314,11 +320,8 @@ static int binauth_action(t_client *client, const char *reason, const char *cust
 			sessionstart = now;
 		}
 
-		// ndsctl will deadlock if run within the BinAuth script so lock it.
-		// But if a call to ndsctl auth or deauth brought us here then it is locked already.
-		if (strstr(reason, deauth) == NULL && strstr(reason, ndsctl_auth) == NULL) {
-			ret=ndsctl_lock();
-		}
+		// ndsctl commands changing state wait until BinAuth is done, or are refused if BinAuth calls them
+		hold = ndsctl_hold();
 
 		debug(LOG_DEBUG, "BinAuth %s - client session end time: [ %lu ]", reason, sessionend);
 
@@ -335,7 +338,9 @@ static int binauth_action(t_client *client, const char *reason, const char *cust
 			customdata_enc
 		);
 
+		started = metrics_now();
 		rc = system(binauthcmd);
+		metrics_observe(METRIC_EXEC, "binauth", metrics_now() - started);
 		free(binauthcmd);
 		free(customdata_enc);
 
@@ -345,12 +350,7 @@ static int binauth_action(t_client *client, const char *reason, const char *cust
 
 		debug(LOG_DEBUG, "binauth return code %d", rc);
 
-		if (strstr(reason, deauth) == NULL && strstr(reason, ndsctl_auth) == NULL) {
-			// unlock ndsctl
-			if (ret == 0) {
-				ndsctl_unlock();
-			}
-		}
+		ndsctl_release(hold);
 		return rc;
 	}
 	// No binauth configured, so good to go
@@ -456,9 +456,9 @@ static int auth_change_state(t_client *client, const unsigned int new_state, con
 
 
 			if (customdata && strlen(customdata) > 0) {
-				client->custom = safe_strdup(customdata);
+				client->custom = client_list_strdup(client, customdata);
 			} else {
-				client->custom = safe_strdup("bmE=");
+				client->custom = client_list_strdup(client, "bmE=");
 			}
 
 			debug(LOG_DEBUG, "auth_change_state: client->custom=%s ", client->custom);
@@ -572,7 +572,6 @@ fw_refresh_client_list(void)
 	unsigned long long int uprate;
 	unsigned long long int downrate;
 	int action;
-	char *dnscmd;
 	char *pmaccmd;
 	char msg[MID_BUF];
 	char *gnpa;
@@ -582,22 +581,6 @@ fw_refresh_client_list(void)
 	int routercheck;
 	routercheck = check_routing(watchdog);
 
-	// If Walled Garden ipset exists, copy it to the nftset.
-	dnscmd = safe_calloc(STATUS_BUF);
-	safe_snprintf(dnscmd, STATUS_BUF, "/usr/lib/opennds/dnsconfig.sh \"ipset_to_nftset\" \"walledgarden\" %d &", config->checkinterval);
-	if (system(dnscmd) != 0) {
-		debug(LOG_DEBUG, "legacy ipset not defined: %s", dnscmd);
-	}
-	free(dnscmd);
-
-	// If Block List ipset exists, copy it to the nftset.
-	dnscmd = safe_calloc(STATUS_BUF);
-	safe_snprintf(dnscmd, STATUS_BUF, "/usr/lib/opennds/dnsconfig.sh \"ipset_to_nftset\" \"blocklist\" %d &", config->checkinterval);
-	if (system(dnscmd) != 0) {
-		debug(LOG_DEBUG, "legacy ipset not defined: %s", dnscmd);
-	}
-	free(dnscmd);
-
 	if (routercheck > 0) {
 		/* If the refresh interval has expired, refresh the downloaded remote files.
 			This can be used to update data files or images used by openNDS from storage on a remote server.
@@ -621,6 +604,9 @@ fw_refresh_client_list(void)
 
 	debug(LOG_DEBUG, "Rate Check Window is set to %u period(s) of checkinterval", config->rate_check_window);
 
+	// Count the addresses clients went on to use, IPv6 ones in particular, along with the ones they were found by
+	client_list_scan_neighbours();
+
 	// Update all the counters
 	if (-1 == iptables_fw_counters_update()) {
 		debug(LOG_ERR, "Could not get counters from firewall!");
@@ -974,6 +960,9 @@ fw_refresh_client_list(void)
 		}
 	}
 
+	// Free clients deleted earlier, once web server threads are no longer using them
+	client_list_reclaim();
+
 	UNLOCK_CLIENT_LIST();
 
 
@@ -1023,52 +1012,77 @@ thread_client_timeout_check(void *arg)
 	pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
 	pthread_mutex_t cond_mutex = PTHREAD_MUTEX_INITIALIZER;
 	struct timespec timeout;
-	char msg[8] = {0};
-	const char mhd_fail[] = "2";
-	char *testcmd;
-	s_config *config = config_get_config();
+	double started;
+	char *gw_mac;
+	s_config *config;
 
-	// Build command to check MHD
-	testcmd = safe_calloc(STATUS_BUF);
-	safe_snprintf(testcmd, STATUS_BUF,
-		"/usr/lib/opennds/libopennds.sh mhdcheck \"%s\"",
-		config->gw_address
-	);
+	while (1) {
+		// A reload may have replaced the config since the last pass, the one read stays valid until the sleep
+		config_read_begin();
+		config = config_get_config();
 
+		// check gateway mac, kept current by netlink events unless they are unavailable
+		if (!netmon_active()) {
+			gw_mac = get_iface_mac(config->gw_interface);
 
-	while (1) {
-		// check gateway mac
-		config->gw_mac = get_iface_mac(config->gw_interface);
-		debug(LOG_DEBUG, "Watchdog: Gateway Interface [%s], mac [%s]", config->gw_interface, config->gw_mac);
+			// Set holding the lock, so a reload copying the config cannot lose it
+			LOCK_CONFIG();
+			config = config_get_config();
 
-		// check MHD
-		if (execute_ret_url_encoded(msg, sizeof(msg) - 1, testcmd) == 0) {
-			debug(LOG_DEBUG, "MHD Test Result: %s", msg);
-		} else {
-			debug(LOG_DEBUG, "MHD Test failed: Continuing...");
+			if (strcmp(gw_mac, config->gw_mac) != 0) {
+				__atomic_store_n(&config->gw_mac, gw_mac, __ATOMIC_RELEASE);
+			} else {
+				free(gw_mac);
+			}
+
+			UNLOCK_CONFIG();
 		}
 
-		if (strcmp(msg, mhd_fail) == 0) {
-			debug(LOG_INFO, "MHD Watchdog - Restart requested");
+		debug(LOG_DEBUG, "Watchdog: Gateway Interface [%s], mac [%s]", config->gw_interface, config->gw_mac);
+
+		// check MHD, restarting it only if it has stalled
+		if (watchdog_check_mhd() == 0) {
+			debug(LOG_DEBUG, "MHD Watchdog - MHD is alive");
+			watchdog_write_heartbeat();
+		} else {
+			debug(LOG_WARNING, "MHD Watchdog - MHD has stalled, restart requested");
 			debug(LOG_DEBUG, "MHD Watchdog - Attempting to stop failing MHD instance");
 			stop_mhd();
 			debug(LOG_DEBUG, "MHD Watchdog - Restarting MHD");
 			start_mhd();
+			watchdog_restarted();
 			debug(LOG_INFO, "MHD Restarted");
 		}
 
-		memset(msg, 0, sizeof(msg));
+		// check the ruleset has not been removed by another process
+		if (watchdog_check_ruleset() != 0) {
+			debug(LOG_EMERG, "The openNDS nftables ruleset is missing or has been removed by another process.");
+			debug(LOG_WARNING, "Restarting....");
+			execute("if type uci >/dev/null 2>&1; then /etc/init.d/opennds restart; else systemctl restart opennds; fi");
+		}
 
 		debug(LOG_DEBUG, "Starting Refresh Client List");
 
+		started = metrics_now();
 		fw_refresh_client_list();
+		metrics_observe(METRIC_SWEEP, NULL, metrics_now() - started);
 
 		debug(LOG_DEBUG, "Client List Refresh is Done");
 
+		// Keep the snapshot current, for a fast restart
+		snapshot_write();
+
 		// Sleep for config.checkinterval seconds...
 		timeout.tv_sec = time(NULL) + config_get_config()->checkinterval;
 		timeout.tv_nsec = 0;
 
+		config_read_end();
+
+		// Free what ndsctl trust, untrust and reloads retired, once its readers have left
+		LOCK_CONFIG();
+		config_reclaim();
+		UNLOCK_CONFIG();
+
 		// Mutex must be locked for pthread_cond_timedwait...
 		pthread_mutex_lock(&cond_mutex);
 
@@ -1079,33 +1093,43 @@ thread_client_timeout_check(void *arg)
 		pthread_mutex_unlock(&cond_mutex);
 	}
 
-	free(testcmd);
 	return NULL;
 }
 
-/** Take action on a client.
- * Alter the firewall rules and client list accordingly.
-*/
+/**
+ * @brief auth_client_deauth_nolock deauthenticate a client without holding the CLIENT_LIST lock
+ * @param id the client id
+ * @param reason can be NULL
+ * @return 0 on success
+ */
 int
-auth_client_deauth(const unsigned id, const char *reason)
+auth_client_deauth_nolock(const unsigned id, const char *reason)
 {
 	t_client *client;
-	int rc = -1;
-
-	LOCK_CLIENT_LIST();
 
 	client = client_list_find_by_id(id);
 
 	// Client should already have hit the server and be on the client list
 	if (client == NULL) {
 		debug(LOG_ERR, "Client %u to deauthenticate is not on client list", id);
-		goto end;
+		return -1;
 	}
 
-	rc = auth_change_state(client, FW_MARK_PREAUTHENTICATED, reason, NULL);
+	return auth_change_state(client, FW_MARK_PREAUTHENTICATED, reason, NULL);
+}
+
+/** Take action on a client.
+ * Alter the firewall rules and client list accordingly.
+*/
+int
+auth_client_deauth(const unsigned id, const char *reason)
+{
+	int rc;
 
-end:
+	LOCK_CLIENT_LIST();
+	rc = auth_client_deauth_nolock(id, reason);
 	UNLOCK_CLIENT_LIST();
+
 	return rc;
 }
 
@@ -28,6 +28,7 @@
 #define _AUTH_H_
 
 int auth_client_deauth(unsigned id, const char *reason);
+int auth_client_deauth_nolock(const unsigned id, const char *reason);
 int auth_client_auth(unsigned id, const char *reason, const char *customdata);
 int auth_client_auth_nolock(const unsigned id, const char *reason, const char *customdata);
 int auth_client_trust(const char *mac);
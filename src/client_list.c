@@ -34,6 +34,8 @@
 #include <pthread.h>
 #include <sys/wait.h>
 #include <sys/types.h>
+#include <arpa/inet.h>
+#include <netinet/ether.h>
 
 #include <string.h>
 
@@ -47,6 +49,31 @@
 #include "util.h"
 
 
+// Client counter
+
+/* Readers (lookups from the web server and ndsctl reports) do not take
+ * client_list_mutex. They bracket their use of the list with
+ * client_list_read_begin() and client_list_read_end(), and only writers,
+ * holding the mutex, change it.
+ *
+ * Writers link a fully built node in with a release store, so a reader sees
+ * either the old or the new list. A deleted node is unlinked but keeps its
+ * next pointer, so a reader standing on it can carry on, and is only freed
+ * once no reader can still hold it:
+ *
+ * Readers register in one of two epochs. Deleted nodes wait in limbo. When
+ * limbo is moved to pending the epoch is flipped, so new readers can no
+ * longer reach them, and pending is freed once the readers of the previous
+ * epoch have all left. Writers never wait for readers; reclamation is retried
+ * on the next change to the list or client list refresh.
+ *
+ * An address replaced in a client that has no free slot is retired the same
+ * way: it is unhashed, and its slot is reused once two grace periods, each a
+ * flip of the epoch and the exit of its readers, have passed.
+ */
+#define LIST_LOAD(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define LIST_STORE(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
 // Client counter
 static int client_count = 0;
 static int client_id = 1;
@@ -59,6 +86,62 @@ pthread_mutex_t client_list_mutex = PTHREAD_MUTEX_INITIALIZER;
  */
 static t_client *firstclient = NULL;
 
+// Read side epoch and the readers registered in each
+static int read_epoch = 0;
+static int readers[2] = {0, 0};
+
+// Read sections can nest within a thread, only the outermost one registers
+static __thread int read_depth = 0;
+static __thread int thread_epoch = 0;
+
+// Deleted clients, not yet freed
+static t_client *limbo = NULL;
+static t_client *pending = NULL;
+
+// Grace periods completed, and the number retired addresses wait for
+static int draining = 0;
+static unsigned int grace_periods = 0;
+static unsigned int grace_wanted = 0;
+
+/* Client nodes are carved from slabs of CLIENT_SLAB_SIZE and freed nodes are
+ * kept on a free list for reuse, so a long running gateway does not fragment
+ * the heap with client sized holes. Slabs are kept once allocated.
+ *
+ * The strings of a client that vary in length go into its arena, a chain of
+ * blocks freed together with the client. A string replaced while the client
+ * is on the list keeps its memory, so readers still holding it are safe.
+ */
+#define CLIENT_SLAB_SIZE 32
+#define CLIENT_ARENA_BLOCK 256
+
+typedef struct _t_client_slab {
+	struct _t_client_slab *next;
+	t_client clients[CLIENT_SLAB_SIZE];
+} t_client_slab;
+
+typedef struct _t_client_arena {
+	struct _t_client_arena *next;
+	size_t used;
+	size_t size;
+	char data[];
+} t_client_arena;
+
+// Nodes are allocated without client_list_mutex held, see client_list_admit_client()
+static pthread_mutex_t client_slab_mutex = PTHREAD_MUTEX_INITIALIZER;
+static t_client_slab *client_slabs = NULL;
+static t_client *client_free = NULL;
+
+/* Clients are also found through two hash tables, of their MACs and of all their
+ * addresses. The chains are changed by writers like the list itself and read
+ * without the mutex. An address entry stays in its chain until its client is
+ * deleted or it is replaced, and its slot is only reused after a grace period.
+ */
+#define CLIENT_HASH_BITS 10
+#define CLIENT_HASH_SIZE (1 << CLIENT_HASH_BITS)
+
+static t_client *mac_buckets[CLIENT_HASH_SIZE];
+static t_client_addr *ip_buckets[CLIENT_HASH_SIZE];
+
 // Return current length of the client list
 int
 get_client_list_length()
@@ -70,7 +153,14 @@ get_client_list_length()
 t_client *
 client_get_first_client(void)
 {
-	return firstclient;
+	return LIST_LOAD(firstclient);
+}
+
+// Get the next element of the client list, safe inside a read section
+t_client *
+client_get_next_client(t_client *client)
+{
+	return LIST_LOAD(client->next);
 }
 
 // Initialize the list of connected clients
@@ -79,91 +169,353 @@ client_list_init(void)
 {
 	firstclient = NULL;
 	client_count = 0;
+	memset(mac_buckets, 0, sizeof(mac_buckets));
+	memset(ip_buckets, 0, sizeof(ip_buckets));
+}
+
+/**
+ * @brief Enters a read section of the client list
+ *
+ * Clients found inside the section remain valid, though possibly deleted
+ * from the list, until client_list_read_end().
+ * Does not block, and may be called with client_list_mutex held.
+ */
+void
+client_list_read_begin(void)
+{
+	int epoch;
+
+	if (read_depth++ > 0) {
+		return;
+	}
+
+	for (;;) {
+		epoch = __atomic_load_n(&read_epoch, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&readers[epoch], 1, __ATOMIC_SEQ_CST);
+
+		// A writer flipping the epoch in between may already have counted this epoch's readers
+		if (__atomic_load_n(&read_epoch, __ATOMIC_SEQ_CST) == epoch) {
+			break;
+		}
+
+		__atomic_sub_fetch(&readers[epoch], 1, __ATOMIC_SEQ_CST);
+	}
+
+	thread_epoch = epoch;
+}
+
+/** @brief Leaves a read section of the client list */
+void
+client_list_read_end(void)
+{
+	if (--read_depth > 0) {
+		return;
+	}
+
+	__atomic_sub_fetch(&readers[thread_epoch], 1, __ATOMIC_SEQ_CST);
 }
 
 /** @internal
- * Given IP, MAC, and client token, appends a new entry
- * to the end of the client list and returns a pointer to the new entry.
- * All the memory allocation for a list entry is done here.
- * Checks for number of current clients.
- * Does not check for duplicate entries; so check before calling.
- * @param ip IP address
- * @param mac MAC address
- * @param token Token
- * @return Pointer to the client we just created
+ * @brief Takes a zeroed node from the free list, adding a slab when it is empty
  */
 static t_client *
-_client_list_append(const char mac[], const char ip[])
+_client_list_alloc_node(void)
 {
-	char *hash;
-	t_client *client, *prevclient;
-	s_config *config;
+	t_client_slab *slab;
+	t_client *client;
+	int i;
 
-	config = config_get_config();
-	if (client_count >= config->maxclients) {
-		debug(LOG_NOTICE, "Already list %d clients, cannot add %s %s", client_count, ip, mac);
-		return NULL;
+	pthread_mutex_lock(&client_slab_mutex);
+
+	if (!client_free) {
+		slab = safe_calloc(sizeof(t_client_slab));
+		slab->next = client_slabs;
+		client_slabs = slab;
+
+		for (i = CLIENT_SLAB_SIZE - 1; i >= 0; i--) {
+			slab->clients[i].reclaim_next = client_free;
+			client_free = &slab->clients[i];
+		}
+
+		debug(LOG_DEBUG, "Added a slab of %d client nodes", CLIENT_SLAB_SIZE);
 	}
 
-	prevclient = NULL;
-	client = firstclient;
+	client = client_free;
+	client_free = client->reclaim_next;
 
-	while (client != NULL) {
-		prevclient = client;
-		client = client->next;
+	pthread_mutex_unlock(&client_slab_mutex);
+
+	memset(client, 0, sizeof(t_client));
+	return client;
+}
+
+/** @internal
+ * @brief Frees the memory used by a t_client structure
+ * @param client Points to the client to be freed
+ */
+static void
+_client_list_free_node(t_client *client)
+{
+	t_client_arena *block;
+
+	debug(LOG_DEBUG, "Freeing client node [ %lu ] [ %s ]", client, client->mac);
+
+	while ((block = client->arena)) {
+		client->arena = block->next;
+		free(block);
 	}
 
-	client = safe_calloc(sizeof(t_client));
+	free(client->probe_redirect);
 
-	client->mac = safe_strdup(mac);
-	client->ip = safe_strdup(ip);
-	client->counters.last_updated = time(NULL);
+	pthread_mutex_lock(&client_slab_mutex);
+	client->reclaim_next = client_free;
+	client_free = client;
+	pthread_mutex_unlock(&client_slab_mutex);
 
-	// Create new token and hid
-	hash = safe_calloc(STATUS_BUF);
-	client->token = safe_calloc(STATUS_BUF);
-	safe_snprintf(client->token, STATUS_BUF, "%04hx%04hx", rand16(), rand16());
-	hash_str(hash, STATUS_BUF, client->token);
-	client->hid = safe_strdup(hash);
-	free(hash);
+	debug(LOG_DEBUG, "Client node [ %lu ] freed", client);
+}
 
-	// Trusted client does not trigger the splash page.
-	if (is_trusted_mac(mac)) {
-		client->fw_connection_state = FW_MARK_TRUSTED;
-	} else {
-		client->fw_connection_state = FW_MARK_PREAUTHENTICATED;
+/**
+ * @brief Copies a string into the client's arena
+ *
+ * The copy lasts as long as the client, so a string field may be replaced
+ * without freeing the old value, which readers may still hold.
+ * @return The copy
+ */
+char *
+client_list_strdup(t_client *client, const char s[])
+{
+	t_client_arena *block;
+	size_t len = strlen(s) + 1;
+	char *copy;
+
+	pthread_mutex_lock(&client_slab_mutex);
+
+	block = client->arena;
+
+	if (!block || block->size - block->used < len) {
+		block = safe_calloc(sizeof(t_client_arena) + (len > CLIENT_ARENA_BLOCK ? len : CLIENT_ARENA_BLOCK));
+		block->size = len > CLIENT_ARENA_BLOCK ? len : CLIENT_ARENA_BLOCK;
+		block->next = client->arena;
+		client->arena = block;
 	}
 
-	client->id = client_id;
-	client->out_packet_limit = 0;
-	client->inc_packet_limit = 0;
+	copy = block->data + block->used;
+	block->used += len;
 
-	debug(LOG_NOTICE, "Adding %s %s token %s to client list",
-		client->ip, client->mac, client->token ? client->token : "none");
+	pthread_mutex_unlock(&client_slab_mutex);
 
-	if (prevclient == NULL) {
-		firstclient = client;
+	memcpy(copy, s, len);
+	return copy;
+}
+
+/** @internal
+ * Parses an IP address into the form held in t_client_addr, IPv4 mapped into IPv6.
+ * @return 0 if it is a valid address
+ */
+static int
+_client_list_parse_ip(const char ip[], unsigned char bin[16])
+{
+	memset(bin, 0, 16);
+
+	if (inet_pton(AF_INET, ip, bin + 12) == 1) {
+		bin[10] = 0xff;
+		bin[11] = 0xff;
+		return 0;
+	}
+
+	return inet_pton(AF_INET6, ip, bin) == 1 ? 0 : -1;
+}
+
+// Writes an address as nft prints it, dotted quad for IPv4
+static void
+_client_list_format_ip(const unsigned char bin[16], char text[CLIENT_IP_LEN])
+{
+	static const unsigned char v4mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+	if (memcmp(bin, v4mapped, sizeof(v4mapped)) == 0) {
+		inet_ntop(AF_INET, bin + 12, text, CLIENT_IP_LEN);
 	} else {
-		prevclient->next = client;
+		inet_ntop(AF_INET6, bin, text, CLIENT_IP_LEN);
 	}
+}
 
-	client_id++;
-	client_count++;
+/** @internal
+ * Parses a MAC address into the 48 bit integer held in mac_bin.
+ * @return 0 if it is a valid address
+ */
+static int
+_client_list_parse_mac(const char mac[], unsigned long long int *bin)
+{
+	struct ether_addr addr;
+	int i;
 
-	return client;
+	if (!ether_aton_r(mac, &addr)) {
+		return -1;
+	}
+
+	*bin = 0;
+
+	for (i = 0; i < 6; i++) {
+		*bin = (*bin << 8) | addr.ether_addr_octet[i];
+	}
+
+	return 0;
+}
+
+static unsigned int
+_client_list_hash_mac(unsigned long long int mac)
+{
+	return (unsigned int)((mac * 0x9e3779b97f4a7c15ULL) >> (64 - CLIENT_HASH_BITS));
+}
+
+static unsigned int
+_client_list_hash_ip(const unsigned char bin[16])
+{
+	unsigned long long int a;
+	unsigned long long int b;
+
+	memcpy(&a, bin, 8);
+	memcpy(&b, bin + 8, 8);
+
+	return (unsigned int)(((a ^ b) * 0x9e3779b97f4a7c15ULL) >> (64 - CLIENT_HASH_BITS));
+}
+
+// Links an address of a client into its hash chain, once it is fully set
+static void
+_client_list_hash_address(t_client_addr *addr)
+{
+	unsigned int bucket = _client_list_hash_ip(addr->bin);
+
+	addr->hash_next = ip_buckets[bucket];
+	LIST_STORE(ip_buckets[bucket], addr);
+}
+
+// Links a client and its addresses into the hash chains. Must be called with client_list_mutex held
+static void
+_client_list_hash_client(t_client *client)
+{
+	unsigned int bucket = _client_list_hash_mac(client->mac_bin);
+	int i;
+
+	for (i = 0; i < client->addr_count; i++) {
+		_client_list_hash_address(&client->addrs[i]);
+	}
+
+	client->mac_next = mac_buckets[bucket];
+	LIST_STORE(mac_buckets[bucket], client);
+}
+
+// Unlinks an address, leaving its own chain pointer for readers standing on it
+static void
+_client_list_unhash_address(t_client_addr *addr)
+{
+	t_client_addr **paddr;
+
+	for (paddr = &ip_buckets[_client_list_hash_ip(addr->bin)]; *paddr; paddr = &(*paddr)->hash_next) {
+		if (*paddr == addr) {
+			LIST_STORE(*paddr, addr->hash_next);
+			break;
+		}
+	}
+}
+
+// Unlinks a deleted client, leaving its own chain pointers for readers standing on it
+static void
+_client_list_unhash_client(t_client *client)
+{
+	t_client **pclient;
+	int i;
+
+	for (pclient = &mac_buckets[_client_list_hash_mac(client->mac_bin)]; *pclient; pclient = &(*pclient)->mac_next) {
+		if (*pclient == client) {
+			LIST_STORE(*pclient, client->mac_next);
+			break;
+		}
+	}
+
+	for (i = 0; i < client->addr_count; i++) {
+		if (!client->addrs[i].retired) {
+			_client_list_unhash_address(&client->addrs[i]);
+		}
+	}
+}
+
+/** @internal
+ * Sets the identity of a new client, checking the strings fit.
+ * @return 0 on success
+ */
+static int
+_client_list_set_identity(t_client *client, const char mac[], const char ip[], const char token[], const char hid[])
+{
+	if (strlen(mac) >= CLIENT_MAC_LEN || strlen(token) >= CLIENT_TOKEN_LEN || strlen(hid) >= CLIENT_HID_LEN) {
+		return -1;
+	}
+
+	if (_client_list_parse_mac(mac, &client->mac_bin) != 0 || _client_list_parse_ip(ip, client->addrs[0].bin) != 0) {
+		return -1;
+	}
+
+	_client_list_format_ip(client->addrs[0].bin, client->addrs[0].text);
+	client->addrs[0].client = client;
+	client->addrs[0].seen = time(NULL);
+	client->addr_count = 1;
+
+	strcpy(client->mac, mac);
+	strcpy(client->ip, client->addrs[0].text);
+	strcpy(client->token, token);
+	strcpy(client->hid, hid);
+
+	return 0;
 }
 
 /**
- *  Given an IP address, add a client corresponding to that IP to client list.
- *  Return a pointer to the new client list entry, or to an existing entry
- *  if one with the given IP already exists.
- *  Return NULL if no new client entry can be created.
+ * @brief Frees deleted clients that no reader can still hold
+ *
+ * Must be called with client_list_mutex held. Never waits for readers.
  */
-t_client *
-client_list_add_client(const char mac[], const char ip[])
+void
+client_list_reclaim(void)
 {
 	t_client *client;
+	int previous;
+
+	for (;;) {
+		if (draining) {
+			previous = !read_epoch;
+
+			if (__atomic_load_n(&readers[previous], __ATOMIC_SEQ_CST) != 0) {
+				// Readers that may hold pending clients are still active, try again later
+				return;
+			}
+
+			while ((client = pending)) {
+				pending = client->reclaim_next;
+				_client_list_free_node(client);
+			}
 
+			draining = 0;
+			grace_periods++;
+		}
+
+		if (!limbo && (int)(grace_wanted - grace_periods) <= 0) {
+			return;
+		}
+
+		pending = limbo;
+		limbo = NULL;
+		draining = 1;
+		__atomic_store_n(&read_epoch, !read_epoch, __ATOMIC_SEQ_CST);
+	}
+}
+/** @internal
+ * Checks the MAC and IP formats and that the IP was allocated by dhcp.
+ * Runs dhcpcheck, so call it without client_list_mutex held where possible.
+ * @return 0 if the client may be added
+ */
+static int
+_client_list_check(const char mac[], const char ip[])
+{
 	int rc = -1;
 	char *libcmd;
 	char *msg;
@@ -171,13 +523,13 @@ client_list_add_client(const char mac[], const char ip[])
 	if (!check_mac_format(mac)) {
 		// Inappropriate format in MAC address
 		debug(LOG_NOTICE, "Illegal MAC format [%s]", mac);
-		return NULL;
+		return -1;
 	}
 
 	if (!check_ip_format(ip)) {
 		// Inappropriate format in IP address
 		debug(LOG_NOTICE, "Illegal IP format [%s]", ip);
-		return NULL;
+		return -1;
 	}
 
 	// check if client ip was allocated by dhcp
@@ -191,14 +543,136 @@ client_list_add_client(const char mac[], const char ip[])
 	if (rc > 0) {
 		// IP address is not in the dhcp database
 		debug(LOG_NOTICE, "IP not allocated by dhcp [%s]", ip);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** @internal
+ * Allocates a new client entry with a new token and hid.
+ * Hashing the hid runs a command, so call it without client_list_mutex held where possible.
+ * @param ip IP address
+ * @param mac MAC address
+ * @return Pointer to the new, unlinked, client, or NULL if the identity is invalid
+ */
+static t_client *
+_client_list_new_node(const char mac[], const char ip[])
+{
+	char token[CLIENT_TOKEN_LEN];
+	char hash[CLIENT_HID_LEN] = "";
+	t_client *client;
+
+	// Create new token and hid
+	safe_snprintf(token, sizeof(token), "%04hx%04hx", rand16(), rand16());
+	hash_str(hash, sizeof(hash), token);
+
+	client = _client_list_alloc_node();
+
+	if (_client_list_set_identity(client, mac, ip, token, hash) != 0) {
+		debug(LOG_ERR, "Invalid identity for client %s %s", ip, mac);
+		_client_list_free_node(client);
+		return NULL;
+	}
+
+	client->counters.last_updated = time(NULL);
+
+	// Trusted client does not trigger the splash page.
+	if (is_trusted_mac(mac)) {
+		client->fw_connection_state = FW_MARK_TRUSTED;
+	} else {
+		client->fw_connection_state = FW_MARK_PREAUTHENTICATED;
+	}
+
+	client->out_packet_limit = 0;
+	client->inc_packet_limit = 0;
+
+	return client;
+}
+
+/** @internal
+ * Appends a new entry, made by _client_list_new_node(), to the end of the
+ * client list. Checks for number of current clients.
+ * Does not check for duplicate entries; so check before calling.
+ * Must be called with client_list_mutex held.
+ * @param client The new client, freed if it cannot be added, or NULL
+ * @return Pointer to the client we just added, or NULL
+ */
+static t_client *
+_client_list_append(t_client *client)
+{
+	t_client *ptr, *prevclient;
+	s_config *config;
+
+	if (!client) {
+		return NULL;
+	}
+
+	config = config_get_config();
+	if (client_count >= config->maxclients) {
+		debug(LOG_NOTICE, "Already list %d clients, cannot add %s %s", client_count, client->ip, client->mac);
+		_client_list_free_node(client);
+		return NULL;
+	}
+
+	prevclient = NULL;
+	ptr = firstclient;
+
+	while (ptr != NULL) {
+		prevclient = ptr;
+		ptr = ptr->next;
+	}
+
+	client->id = client_id;
+
+	debug(LOG_NOTICE, "Adding %s %s token %s to client list",
+		client->ip, client->mac, client->token);
+
+	// Publish the fully built client to readers
+	if (prevclient == NULL) {
+		LIST_STORE(firstclient, client);
+	} else {
+		LIST_STORE(prevclient->next, client);
+	}
+
+	_client_list_hash_client(client);
+
+	client_id++;
+	client_count++;
+
+	client_list_reclaim();
+
+	return client;
+}
+
+/**
+ *  Given an IP address, add a client corresponding to that IP to client list.
+ *  Return a pointer to the new client list entry, or to an existing entry
+ *  if one with the given IP already exists. An IP new to a client already on
+ *  the list with the same MAC is added to its addresses, and that client is
+ *  returned even if it has no room left for the address.
+ *  Return NULL if no new client entry can be created.
+ *  Must be called with client_list_mutex held.
+ */
+t_client *
+client_list_add_client(const char mac[], const char ip[])
+{
+	t_client *client;
+
+	if (_client_list_check(mac, ip) != 0) {
 		return NULL;
 	}
 
 	client = client_list_find(mac, ip);
 
+	// A client already known by its MAC is using another address, it keeps its one entry
+	if (!client && (client = client_list_find_by_mac(mac))) {
+		client_list_add_address(client, ip);
+	}
+
 	if (!client) {
 		// add the client
-		client = _client_list_append(mac, ip);
+		client = _client_list_append(_client_list_new_node(mac, ip));
 	} else {
 		debug(LOG_INFO, "Client %s %s token %s already on client list", ip, mac, client->token);
 	}
@@ -206,6 +680,87 @@ client_list_add_client(const char mac[], const char ip[])
 	return client;
 }
 
+/**
+ *  Adds a client saved by snapshot_write() in a previous run, keeping its
+ *  token and hid so sessions with a FAS carry on. The dhcp check was passed
+ *  when the client was first added, so is not repeated.
+ *  Return NULL if the client is already on the list or cannot be added.
+ *  Must be called with client_list_mutex held.
+ */
+t_client *
+client_list_restore_client(const char mac[], const char ip[], const char token[], const char hid[])
+{
+	t_client *client;
+
+	if (!check_mac_format(mac) || !check_ip_format(ip)) {
+		debug(LOG_NOTICE, "Illegal MAC or IP format [%s %s] in snapshot", mac, ip);
+		return NULL;
+	}
+
+	if (client_list_find(mac, ip) || client_list_find_by_token(token)) {
+		debug(LOG_INFO, "Client %s %s token %s already on client list", ip, mac, token);
+		return NULL;
+	}
+
+	client = _client_list_alloc_node();
+
+	if (_client_list_set_identity(client, mac, ip, token, hid) != 0) {
+		debug(LOG_NOTICE, "Invalid token or hid for %s %s in snapshot", ip, mac);
+		_client_list_free_node(client);
+		return NULL;
+	}
+
+	client->counters.last_updated = time(NULL);
+	client->fw_connection_state = FW_MARK_PREAUTHENTICATED;
+
+	return _client_list_append(client);
+}
+
+/**
+ *  As client_list_add_client(), but takes client_list_mutex itself, and only
+ *  to link the new entry in. The dhcp check and token hashing run unlocked,
+ *  so other threads are not held up by them.
+ *  Must be called without client_list_mutex held, in a read section to use the result.
+ */
+t_client *
+client_list_admit_client(const char mac[], const char ip[])
+{
+	t_client *client;
+	t_client *existing;
+
+	if (_client_list_check(mac, ip) != 0) {
+		return NULL;
+	}
+
+	if (!(client = _client_list_new_node(mac, ip))) {
+		return NULL;
+	}
+
+	LOCK_CLIENT_LIST();
+
+	// Another request from the same client may have added it meanwhile
+	existing = client_list_find(mac, ip);
+
+	// A client already known by its MAC is using another address, it keeps its one entry
+	if (!existing && (existing = client_list_find_by_mac(mac))) {
+		client_list_add_address(existing, ip);
+	}
+
+	if (!existing) {
+		client = _client_list_append(client);
+	}
+
+	UNLOCK_CLIENT_LIST();
+
+	if (existing) {
+		debug(LOG_INFO, "Client %s %s token %s already on client list", ip, mac, existing->token);
+		_client_list_free_node(client);
+		client = existing;
+	}
+
+	return client;
+}
+
 /** Finds a client by its token, IP or MAC.
  * A found client is guaranteed to be unique.
  * @param ip IP we are looking for in the linked list
@@ -235,14 +790,20 @@ client_list_find_by_any(const char mac[], const char ip[], const char token[])
 t_client *
 client_list_find(const char mac[], const char ip[])
 {
-	t_client *ptr;
+	t_client_addr *addr;
+	unsigned long long int mac_bin;
+	unsigned char ip_bin[16];
 
-	ptr = firstclient;
-	while (ptr) {
-		if (!strcmp(ptr->mac, mac) && !strcmp(ptr->ip, ip)) {
-			return ptr;
+	if (_client_list_parse_mac(mac, &mac_bin) != 0 || _client_list_parse_ip(ip, ip_bin) != 0) {
+		return NULL;
+	}
+
+	addr = LIST_LOAD(ip_buckets[_client_list_hash_ip(ip_bin)]);
+	while (addr) {
+		if (!memcmp(addr->bin, ip_bin, 16) && addr->client->mac_bin == mac_bin) {
+			return addr->client;
 		}
-		ptr = ptr->next;
+		addr = LIST_LOAD(addr->hash_next);
 	}
 
 	return NULL;
@@ -258,36 +819,56 @@ client_list_find_by_id(const unsigned id)
 {
 	t_client *ptr;
 
-	ptr = firstclient;
+	ptr = LIST_LOAD(firstclient);
 	while (ptr) {
 		if (ptr->id == id) {
 			return ptr;
 		}
-		ptr = ptr->next;
+		ptr = LIST_LOAD(ptr->next);
 	}
 
 	return NULL;
 }
 
 /**
- * Finds a client by its IP address. Returns NULL if
+ * Finds the entry of an address, held by any client. Returns NULL if
+ * no client holds the address.
+ * @return Pointer to the address, or NULL if not found
+ */
+t_client_addr *
+client_list_find_address(const char ip[])
+{
+	t_client_addr *addr;
+	unsigned char ip_bin[16];
+
+	if (_client_list_parse_ip(ip, ip_bin) != 0) {
+		return NULL;
+	}
+
+	addr = LIST_LOAD(ip_buckets[_client_list_hash_ip(ip_bin)]);
+	while (addr) {
+		if (!memcmp(addr->bin, ip_bin, 16)) {
+			return addr;
+		}
+		addr = LIST_LOAD(addr->hash_next);
+	}
+
+	return NULL;
+}
+
+/**
+ * Finds a client by any of its IP addresses. Returns NULL if
  * the client could not be found.
  * @return Pointer to the client, or NULL if not found
  */
 t_client *
 client_list_find_by_ip(const char ip[])
 {
-	t_client *ptr;
+	t_client_addr *addr;
 
-	ptr = firstclient;
-	while (ptr) {
-		if (!strcmp(ptr->ip, ip)) {
-			return ptr;
-		}
-		ptr = ptr->next;
-	}
+	addr = client_list_find_address(ip);
 
-	return NULL;
+	return addr ? addr->client : NULL;
 }
 
 /**
@@ -299,18 +880,286 @@ t_client *
 client_list_find_by_mac(const char mac[])
 {
 	t_client *ptr;
+	unsigned long long int mac_bin;
 
-	ptr = firstclient;
+	if (_client_list_parse_mac(mac, &mac_bin) != 0) {
+		return NULL;
+	}
+
+	ptr = LIST_LOAD(mac_buckets[_client_list_hash_mac(mac_bin)]);
 	while (ptr) {
-		if (!strcmp(ptr->mac, mac)) {
+		if (ptr->mac_bin == mac_bin) {
 			return ptr;
 		}
-		ptr = ptr->next;
+		ptr = LIST_LOAD(ptr->mac_next);
 	}
 
 	return NULL;
 }
 
+/**
+ * Returns the number of addresses of a client, for readers of client->addrs.
+ */
+int
+client_list_address_count(t_client *client)
+{
+	return LIST_LOAD(client->addr_count);
+}
+
+/** @internal
+ * Retires an address of a client, to make room for another. Its rules are deleted,
+ * in the current firewall batch if there is one, and it is unhashed, but it keeps
+ * its counters, which go on in the rules of the address that reuses the slot.
+ * Must be called with client_list_mutex held.
+ */
+static void
+_client_list_retire_address(t_client_addr *addr)
+{
+	t_client *client = addr->client;
+
+	debug(LOG_NOTICE, "Replacing address %s of %s %s, last seen %lld seconds ago",
+		addr->text, client->ip, client->mac, (long long)(time(NULL) - addr->seen));
+
+	if (client->fw_connection_state == FW_MARK_AUTHENTICATED) {
+		iptables_fw_deauthenticate_address(addr);
+	}
+
+	_client_list_unhash_address(addr);
+
+	addr->retired = 1;
+	addr->retired_grace = grace_periods + 2;
+
+	if ((int)(addr->retired_grace - grace_wanted) > 0) {
+		grace_wanted = addr->retired_grace;
+	}
+}
+
+// Returns a retired slot of a client no reader can still reach, or NULL
+static t_client_addr *
+_client_list_reusable_address(t_client *client)
+{
+	int i;
+
+	for (i = 1; i < client->addr_count; i++) {
+		if (client->addrs[i].retired && (int)(grace_periods - client->addrs[i].retired_grace) >= 0) {
+			return &client->addrs[i];
+		}
+	}
+
+	return NULL;
+}
+
+/** @internal
+ * Finds a slot for a new address of a client. Once all are used, the address
+ * least recently seen in the neighbour table is replaced, never the first one.
+ * Must be called with client_list_mutex held.
+ * @return The slot, or NULL if the one being replaced may still be held by readers
+ */
+static t_client_addr *
+_client_list_address_slot(t_client *client)
+{
+	t_client_addr *addr;
+	t_client_addr *oldest = NULL;
+	int i;
+
+	if (client->addr_count < CLIENT_MAX_ADDRS) {
+		addr = &client->addrs[client->addr_count];
+		memset(addr, 0, sizeof(*addr));
+		return addr;
+	}
+
+	if ((addr = _client_list_reusable_address(client))) {
+		return addr;
+	}
+
+	for (i = 1; i < client->addr_count; i++) {
+		if (client->addrs[i].retired) {
+			// Already waiting for its readers to leave
+			oldest = NULL;
+			break;
+		}
+
+		if (!oldest || client->addrs[i].seen < oldest->seen) {
+			oldest = &client->addrs[i];
+		}
+	}
+
+	if (oldest) {
+		_client_list_retire_address(oldest);
+	}
+
+	// Readers are brief, the slot can usually be reused straight away
+	client_list_reclaim();
+
+	return _client_list_reusable_address(client);
+}
+
+/**
+ * @brief Adds another address to a client
+ *
+ * A client is one MAC, which may use several IPv4 and IPv6 addresses at once.
+ * Each is counted by its own firewall rules, added here if the client is
+ * already authenticated. An address the client already holds is returned as it is.
+ * When the client has no free slot, the address it was least recently seen
+ * using is replaced, see _client_list_address_slot().
+ * Must be called with client_list_mutex held.
+ * @return Pointer to the address, or NULL if it is invalid or no slot is free yet
+ */
+t_client_addr *
+client_list_add_address(t_client *client, const char ip[])
+{
+	t_client_addr *addr;
+	unsigned char ip_bin[16];
+	int batch;
+	int i;
+
+	if (_client_list_parse_ip(ip, ip_bin) != 0) {
+		return NULL;
+	}
+
+	for (i = 0; i < client->addr_count; i++) {
+		if (!client->addrs[i].retired && !memcmp(client->addrs[i].bin, ip_bin, 16)) {
+			client->addrs[i].seen = time(NULL);
+			return &client->addrs[i];
+		}
+	}
+
+	// Rules of a replaced address go in the same transaction as those of the new one
+	batch = iptables_fw_batch_begin();
+
+	if (!(addr = _client_list_address_slot(client))) {
+		debug(LOG_INFO, "Client %s %s has no free address slot yet, not adding %s", client->ip, client->mac, ip);
+
+		if (batch) {
+			iptables_fw_batch_commit();
+		}
+
+		return NULL;
+	}
+
+	// A reused slot keeps the counters of the address it held
+	memcpy(addr->bin, ip_bin, 16);
+	_client_list_format_ip(addr->bin, addr->text);
+	addr->client = client;
+	addr->seen = time(NULL);
+	addr->retired = 0;
+
+	// Publish the address to readers of addrs, then to lookups
+	if (addr == &client->addrs[client->addr_count]) {
+		LIST_STORE(client->addr_count, client->addr_count + 1);
+	}
+
+	_client_list_hash_address(addr);
+
+	debug(LOG_NOTICE, "Adding address %s to %s %s token %s", addr->text, client->ip, client->mac, client->token);
+
+	if (client->fw_connection_state == FW_MARK_AUTHENTICATED) {
+		iptables_fw_authenticate_address(addr);
+	}
+
+	if (batch) {
+		iptables_fw_batch_commit();
+	}
+
+	return addr;
+}
+
+/**
+ * @brief Adds the addresses the neighbour table holds for the MACs of clients
+ *
+ * A client found by its first address may go on to use others that never reach
+ * the web server, IPv6 addresses from SLAAC or privacy extensions among them.
+ * Link local addresses are left out, they are never forwarded. Addresses already
+ * held are marked as seen, so the stale ones are replaced first.
+ * The neighbour table is read before client_list_mutex is taken, which is then
+ * held only to apply it, so must be called without it.
+ * @return Number of addresses added
+ */
+int
+client_list_scan_neighbours(void)
+{
+	FILE *output;
+	char *command;
+	char *line = NULL;
+	size_t size = 0;
+	struct {
+		char ip[CLIENT_IP_LEN];
+		char mac[CLIENT_MAC_LEN];
+	} *neighbours = NULL, *grown;
+	int count = 0;
+	int allocated = 0;
+	int added = 0;
+	int i;
+	t_client *client;
+	t_client_addr *addr;
+	s_config *config;
+
+	if (!LIST_LOAD(firstclient)) {
+		return 0;
+	}
+
+	config = config_get_config();
+	safe_asprintf(&command, "ip neigh show dev %s 2>/dev/null", config->gw_interface);
+	output = popen(command, "r");
+	free(command);
+
+	if (!output) {
+		debug(LOG_ERR, "popen(): %s", strerror(errno));
+		return -1;
+	}
+
+	// eg "fd00::1c2b:3aff:fe4d:5e6f lladdr 1c:2b:3a:4d:5e:6f REACHABLE"
+	while (getline(&line, &size, output) != -1) {
+		if (count == allocated) {
+			allocated = allocated ? allocated * 2 : 64;
+			if (!(grown = realloc(neighbours, allocated * sizeof(*neighbours)))) {
+				debug(LOG_ERR, "Failed to allocate neighbours, %d read", count);
+				break;
+			}
+			neighbours = grown;
+		}
+
+		if (sscanf(line, "%45s lladdr %17s", neighbours[count].ip, neighbours[count].mac) != 2) {
+			continue;
+		}
+
+		if (strstr(line, "FAILED") || strstr(line, "INCOMPLETE") || strncasecmp(neighbours[count].ip, "fe80:", 5) == 0) {
+			continue;
+		}
+
+		count++;
+	}
+
+	free(line);
+	pclose(output);
+
+	LOCK_CLIENT_LIST();
+	iptables_fw_batch_begin();
+
+	for (i = 0; i < count; i++) {
+		if (!(client = client_list_find_by_mac(neighbours[i].mac))) {
+			continue;
+		}
+
+		// A known address is marked as seen, which keeps it from being replaced
+		if ((addr = client_list_find_address(neighbours[i].ip)) && addr->client == client) {
+			addr->seen = time(NULL);
+			continue;
+		}
+
+		if (client_list_add_address(client, neighbours[i].ip)) {
+			added++;
+		}
+	}
+
+	iptables_fw_batch_commit();
+	UNLOCK_CLIENT_LIST();
+
+	free(neighbours);
+
+	return added;
+}
+
 /**
  * Finds a client by token. Returns NULL if
  * the client could not be found.
@@ -325,7 +1174,7 @@ client_list_find_by_token(const char token[])
 	char *rhid;
 	char *rhidraw = NULL;
 
-	ptr = firstclient;
+	ptr = LIST_LOAD(firstclient);
 
 	while (ptr) {
 		//Check if token (tok) or hash_id (hid) mode
@@ -355,61 +1204,38 @@ client_list_find_by_token(const char token[])
 			}
 		}
 
-		ptr = ptr->next;
+		ptr = LIST_LOAD(ptr->next);
 	}
 
 	return NULL;
 }
 
 /** @internal
- * @brief Frees the memory used by a t_client structure
- * This function frees the memory used by the t_client structure in the
- * proper order.
- * @param client Points to the client to be freed
+ * Removes any existing cidfile of a client being deleted.
  */
 static void
-_client_list_free_node(t_client *client)
+_client_list_remove_cid(t_client *client)
 {
-
 	char *msg;
 	char *cidinfo;
 
-	debug(LOG_DEBUG, "Freeing client node [ %lu ] [ %s ]", client, client->mac);
-
-	if (client->cid) {
-
-		// Remove any existing cidfile:
-		if (strlen(client->cid) > 0) {
-			msg = safe_calloc(SMALL_BUF);
-			cidinfo = safe_calloc(MID_BUF);
-			safe_snprintf(cidinfo, MID_BUF, "cid=\"%s\"", client->cid);
-			write_client_info(msg, SMALL_BUF, "rmcid", client->cid, cidinfo);
-			free(msg);
-			free(cidinfo);
-		}
+	// Remove any existing cidfile:
+	if (client->cid[0]) {
+		msg = safe_calloc(SMALL_BUF);
+		cidinfo = safe_calloc(MID_BUF);
+		safe_snprintf(cidinfo, MID_BUF, "cid=\"%s\"", client->cid);
+		write_client_info(msg, SMALL_BUF, "rmcid", client->cid, cidinfo);
+		free(msg);
+		free(cidinfo);
 	}
-
-	free(client->ip);
-	free(client->mac);
-	free(client->token);
-	free(client->hid);
-	free(client->cid);
-	free(client->custom);
-	free(client->client_type);
-
-	if (client->cpi_query) {
-		free(client->cpi_query);
-	}
-
-	debug(LOG_DEBUG, "Client node [ %lu ] freed", client);
-	free(client);
 }
 
 /**
  * @brief Deletes a client from the client list
  *
- * Removes the specified client from the client list and then calls
- * the function _client_list_free_node to free the memory taken by the client.
+ * Removes the specified client from the client list. Its memory is freed by
+ * client_list_reclaim() once no reader can still hold it.
+ * Must be called with client_list_mutex held.
  * @param client Points to the client to be deleted
  */
 void
@@ -421,12 +1247,11 @@ client_list_delete(t_client *client)
 
 	if (ptr == NULL) {
 		debug(LOG_ERR, "Node list empty!");
+		return;
 	} else if (ptr == client) {
 		debug(LOG_NOTICE, "Deleting %s %s token %s from client list",
-			  client->ip, client->mac, client->token ? client->token : "none");
-		firstclient = ptr->next;
-		_client_list_free_node(client);
-		client_count--;
+			  client->ip, client->mac, client->token);
+		LIST_STORE(firstclient, ptr->next);
 	} else {
 		// Loop forward until we reach our point in the list.
 		while (ptr->next != NULL && ptr->next != client) {
@@ -435,13 +1260,20 @@ client_list_delete(t_client *client)
 		// If we reach the end before finding out element, complain.
 		if (ptr->next == NULL) {
 			debug(LOG_ERR, "Node to delete could not be found.");
-		} else {
-			// Free element.
-			debug(LOG_NOTICE, "Deleting %s %s token %s from client list",
-				  client->ip, client->mac, client->token ? client->token : "none");
-			ptr->next = client->next;
-			_client_list_free_node(client);
-			client_count--;
+			return;
 		}
+
+		debug(LOG_NOTICE, "Deleting %s %s token %s from client list",
+			  client->ip, client->mac, client->token);
+		LIST_STORE(ptr->next, client->next);
 	}
+
+	// Readers may still be standing on the client, so its next pointers are left as they are
+	_client_list_unhash_client(client);
+	_client_list_remove_cid(client);
+	client->reclaim_next = limbo;
+	limbo = client;
+	client_count--;
+
+	client_list_reclaim();
 }
@@ -28,6 +28,8 @@
 #ifndef _CLIENT_LIST_H_
 #define _CLIENT_LIST_H_
 
+#include "lockstat.h"
+
 /** Counters struct for a client's bandwidth usage (in bytes)
  */
 typedef struct _t_counters {
@@ -44,18 +46,54 @@ typedef struct _t_counters {
 	time_t last_updated;				/**< @brief Last update of the counters */
 } t_counters;
 
+#define CLIENT_IP_LEN 46		/**< @brief Text IP address buffer, INET6_ADDRSTRLEN */
+#define CLIENT_MAC_LEN 18		/**< @brief Text MAC address buffer */
+#define CLIENT_TOKEN_LEN 17		/**< @brief Token buffer */
+#define CLIENT_HID_LEN 65		/**< @brief Hid buffer, a sha256 digest in hex */
+#define CLIENT_CID_LEN 87		/**< @brief Cid buffer, the first 86 characters of the encoded FAS query */
+
+#define CLIENT_MAX_ADDRS 6		/**< @brief IPv4 and IPv6 addresses held per client */
+
+struct _t_client_arena;
+struct _t_client;
+
+/** An address of a client, with the counters of its own firewall rules.
+ *  The client's counters are the sum over its addresses, retired ones included.
+ */
+typedef struct _t_client_addr {
+	struct _t_client_addr *hash_next;		/**< @brief Next address in the same hash bucket */
+	struct _t_client *client;			/**< @brief The client holding the address */
+	unsigned char bin[16];				/**< @brief IP address, IPv4 as IPv4 mapped IPv6 */
+	char text[CLIENT_IP_LEN];			/**< @brief IP address */
+	unsigned long long int outgoing;		/**< @brief Outgoing bytes counted by its rule */
+	unsigned long long int outpackets;		/**< @brief Outgoing packets counted by its rule */
+	unsigned long long int incoming;		/**< @brief Incoming bytes counted by its rule */
+	unsigned long long int inpackets;		/**< @brief Incoming packets counted by its rule */
+	time_t seen;					/**< @brief When the address was added or last seen in the neighbour table */
+	int retired;					/**< @brief Replaced, unhashed and waiting to be reused */
+	unsigned int retired_grace;			/**< @brief Grace period after which a retired slot may be reused */
+} t_client_addr;
+
 /** Client node for the connected client linked list.
+ *  Nodes come from slabs, see client_list.c. The identity is held inline, and the
+ *  variable strings are copied into the client's arena with client_list_strdup().
+ *  A client is one MAC, which may hold several IPv4 and IPv6 addresses.
  */
 typedef struct _t_client {
 	struct _t_client *next;				/**< @brief Pointer to the next client */
-	char *ip;					/**< @brief Client IP address */
-	char *mac;					/**< @brief Client MAC address */
-	char *token;					/**< @brief Client token */
-	char *hid;					/**< @brief Client hid */
-	char *cid;					/**< @brief Client cid */
+	struct _t_client *mac_next;			/**< @brief Next client in the same MAC hash bucket */
+	unsigned long long int mac_bin;			/**< @brief Client MAC address, as a 48 bit integer */
+	t_client_addr addrs[CLIENT_MAX_ADDRS];		/**< @brief Client addresses, the first is ip */
+	int addr_count;					/**< @brief Number of addresses */
+	char ip[CLIENT_IP_LEN];				/**< @brief Client IP address, the one it was added with */
+	char mac[CLIENT_MAC_LEN];			/**< @brief Client MAC address */
+	char token[CLIENT_TOKEN_LEN];			/**< @brief Client token */
+	char hid[CLIENT_HID_LEN];			/**< @brief Client hid */
+	char cid[CLIENT_CID_LEN];			/**< @brief Client cid, empty until the first redirect */
 	char *custom;					/**< @brief Client custom string sent from FAS and sent to BinAuth */
 	char *client_type;				/**< @brief Client type, cpd (cpd_can), rfc8910-cpi (cpi_url) or rfc8908-cpi (cpi_api)  */
 	char *cpi_query;				/**< @brief RFC8910-cpi query string  */
+	char *probe_redirect;				/**< @brief Splash page redirect of the last OS probe, after its cache key, heap allocated, see http_microhttpd.c */
 	unsigned int fw_connection_state;		/**< @brief Client Connection state in the firewall */
 	time_t session_start;				/**< @brief Actual Time the client was authenticated */
 	time_t window_start;				/**< @brief Actual Time the client rate check window begins */
@@ -77,12 +115,18 @@ typedef struct _t_client {
 	unsigned long long int inc_packet_limit;	/**< @brief Incoming packet limit */
 	unsigned long long int out_packet_limit;	/**< @brief Outgoing packet limit */
 	unsigned id;
+	struct _t_client *reclaim_next;			/**< @brief Next deleted client waiting to be freed, or next free node */
+	struct _t_client_arena *arena;			/**< @brief Blocks holding the variable strings */
 } t_client;
 
 /** @brief Get the first element of the list of connected clients
  */
 t_client *client_get_first_client(void);
 
+/** @brief Get the next element of the list of connected clients
+ */
+t_client *client_get_next_client(t_client *client);
+
 /** @brief Initializes the client list */
 void client_list_init(void);
 
@@ -92,6 +136,12 @@ int get_client_list_length();
 /** @brief Adds a new client to the client list */
 t_client *client_list_add_client(const char mac[], const char ip[]);
 
+/** @brief Adds a new client to the client list, taking client_list_mutex only to insert it */
+t_client *client_list_admit_client(const char mac[], const char ip[]);
+
+/** @brief Adds a client restored from a snapshot, with its token and hid */
+t_client *client_list_restore_client(const char mac[], const char ip[], const char token[], const char hid[]);
+
 /** @brief Finds a client by its MAC, IP or token */
 t_client *client_list_find_by_any(const char mac[], const char ip[], const char token[]);
 
@@ -104,27 +154,62 @@ t_client * client_list_find_by_id(const unsigned id);
 /** @brief Finds a client only by its IP */
 t_client *client_list_find_by_ip(const char ip[]); /* needed by fw_iptables.c, auth.c * and ndsctl_thread.c */
 
+/** @brief Finds the address entry of an IP, of any client */
+t_client_addr *client_list_find_address(const char ip[]);
+
+/** @brief Returns the number of addresses of a client, safe for readers */
+int client_list_address_count(t_client *client);
+
+/** @brief Adds another address to a client */
+t_client_addr *client_list_add_address(t_client *client, const char ip[]);
+
+/** @brief Adds the addresses the neighbour table holds for the MACs of clients */
+int client_list_scan_neighbours(void);
+
 /** @brief Finds a client only by its MAC */
 t_client *client_list_find_by_mac(const char mac[]); /* needed by ndsctl_thread.c */
 
 /** @brief Finds a client by its token */
 t_client *client_list_find_by_token(const char token[]);
 
+/** @brief Copies a string into a client's arena, freed with the client */
+char *client_list_strdup(t_client *client, const char s[]);
+
 /** @brief Deletes a client from the client list */
 void client_list_delete(t_client *client);
 
+/** @brief Frees deleted clients no longer visible to any reader */
+void client_list_reclaim(void);
+
+/** @brief Enters a lock free read section of the client list */
+void client_list_read_begin(void);
+
+/** @brief Leaves a read section of the client list */
+void client_list_read_end(void);
+
 #define LOCK_CLIENT_LIST() do { \
 	debug(LOG_DEBUG, "Locking client list"); \
-	pthread_mutex_lock(&client_list_mutex); \
+	lockstat_lock(LOCKSTAT_CLIENT_LIST, &client_list_mutex, __FILE__, __LINE__); \
 	debug(LOG_DEBUG, "Client list locked"); \
 } while (0)
 
 #define UNLOCK_CLIENT_LIST() do { \
 	debug(LOG_DEBUG, "Unlocking client list"); \
-	pthread_mutex_unlock(&client_list_mutex); \
+	lockstat_unlock(LOCKSTAT_CLIENT_LIST, &client_list_mutex); \
 	debug(LOG_DEBUG, "Client list unlocked"); \
 } while (0)
 
+/* Readers of the client list do not take client_list_mutex, see client_list.c.
+ * Clients found between these two remain valid until the end of the section.
+ */
+#define READ_LOCK_CLIENT_LIST() do { \
+	client_list_read_begin(); \
+} while (0)
+
+#define READ_UNLOCK_CLIENT_LIST() do { \
+	client_list_read_end(); \
+} while (0)
+
 extern pthread_mutex_t client_list_mutex;
 
 #endif /* _CLIENT_LIST_H_ */
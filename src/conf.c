@@ -50,9 +50,40 @@
 #include "commandline.h"
 
 /** @internal
- * Holds the current configuration of the gateway */
+ * Holds the configuration of the gateway read at startup */
 static s_config config = {{0}};
 
+/** @internal
+ * The current configuration, replaced as a whole by config_publish() on a reload */
+static s_config *config_active = &config;
+
+/* Readers of the config bracket their use of it with config_read_begin() and
+ * config_read_end(), and take no lock. Writers, holding config_mutex, never
+ * change what a reader may hold: they build a copy, publish it with a release
+ * store and retire the old one with config_retire().
+ *
+ * Retired memory is freed with the two epochs client_list.c uses for deleted
+ * clients: it waits in limbo, moves to pending when the epoch is flipped, and
+ * is freed once the readers of the previous epoch have all left. Writers never
+ * wait for readers, config_reclaim() is retried at each client check.
+ */
+typedef struct _t_config_retired {
+	struct _t_config_retired *next;
+	void *p;
+	void (*release)(void *);
+} t_config_retired;
+
+static int read_epoch = 0;
+static int readers[2] = {0, 0};
+
+// Read sections can nest within a thread, only the outermost one registers
+static __thread int read_depth = 0;
+static __thread int thread_epoch = 0;
+
+static t_config_retired *limbo = NULL;
+static t_config_retired *pending = NULL;
+static int draining = 0;
+
 /**
  * Mutex for the configuration file, used by the auth_servers related
  * functions. */
@@ -65,7 +96,233 @@ pthread_mutex_t config_mutex = PTHREAD_MUTEX_INITIALIZER;
 s_config *
 config_get_config(void)
 {
-	return &config;
+	return __atomic_load_n(&config_active, __ATOMIC_ACQUIRE);
+}
+
+// Gives next its own copy of a list of the current config, each node being a string and a next pointer
+#define CONFIG_DUP_LIST(type, field, item) \
+	do { \
+		type *src; \
+		type **dst = &next->field; \
+		for (src = current->field; src; src = src->next) { \
+			*dst = safe_calloc(sizeof(type)); \
+			(*dst)->item = safe_strdup(src->item); \
+			dst = &(*dst)->next; \
+		} \
+		*dst = NULL; \
+	} while (0)
+
+// Frees a list of a config, each node being a string and a next pointer
+#define CONFIG_FREE_LIST(type, list, item) \
+	do { \
+		type *node; \
+		type *node_next; \
+		for (node = (list); node; node = node_next) { \
+			node_next = node->next; \
+			free(node->item); \
+			free(node); \
+		} \
+		(list) = NULL; \
+	} while (0)
+
+static void _config_free(void *p);
+
+/** Returns a copy of the current config, for a reload to change and then publish.
+ *  The lists are copied, so they can be rebuilt or changed in place without
+ *  touching the current config. The strings are shared, so a string field that
+ *  changes must be given a new allocation rather than be modified in place.
+ *  The runtime state other threads keep in the config, gw_mac, online_status and
+ *  ext_gateway, is only set holding config_mutex, so none is lost between the copy
+ *  and config_publish().
+ *  Must be called with config_mutex held.
+ */
+s_config *
+config_dup(void)
+{
+	s_config *current = config_get_config();
+	s_config *next;
+
+	next = safe_malloc(sizeof(s_config));
+	memcpy(next, current, sizeof(s_config));
+
+	CONFIG_DUP_LIST(t_MAC, trustedmaclist, mac);
+	CONFIG_DUP_LIST(t_FASPARAM, fas_custom_parameters_list, fasparam);
+	CONFIG_DUP_LIST(t_FASVAR, fas_custom_variables_list, fasvar);
+	CONFIG_DUP_LIST(t_FASIMG, fas_custom_images_list, fasimg);
+	CONFIG_DUP_LIST(t_FASFILE, fas_custom_files_list, fasfile);
+
+	next->generation = current->generation + 1;
+
+	return next;
+}
+
+/** Makes a config built by config_dup() the current one.
+ *  The previous config and its lists are retired, and freed once no reader can
+ *  still hold them. Its strings are not, the configs that follow share them.
+ *  Must be called with config_mutex held.
+ */
+void
+config_publish(s_config *next)
+{
+	s_config *old = config_get_config();
+
+	__atomic_store_n(&config_active, next, __ATOMIC_RELEASE);
+	config_retire(old, _config_free);
+}
+
+/** Frees the custom FAS lists of a config built by config_dup() and not yet published,
+ *  for them to be parsed again.
+ */
+void
+config_clear_fas_custom_lists(s_config *cfg)
+{
+	CONFIG_FREE_LIST(t_FASPARAM, cfg->fas_custom_parameters_list, fasparam);
+	CONFIG_FREE_LIST(t_FASVAR, cfg->fas_custom_variables_list, fasvar);
+	CONFIG_FREE_LIST(t_FASIMG, cfg->fas_custom_images_list, fasimg);
+	CONFIG_FREE_LIST(t_FASFILE, cfg->fas_custom_files_list, fasfile);
+}
+
+/** @brief Enters a read section of the config
+ *
+ * The config, its lists and its strings remain valid until config_read_end(),
+ * though possibly replaced. Does not block, and may be called with config_mutex held.
+ */
+void
+config_read_begin(void)
+{
+	int epoch;
+
+	if (read_depth++ > 0) {
+		return;
+	}
+
+	for (;;) {
+		epoch = __atomic_load_n(&read_epoch, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&readers[epoch], 1, __ATOMIC_SEQ_CST);
+
+		// A writer flipping the epoch in between may already have counted this epoch's readers
+		if (__atomic_load_n(&read_epoch, __ATOMIC_SEQ_CST) == epoch) {
+			break;
+		}
+
+		__atomic_sub_fetch(&readers[epoch], 1, __ATOMIC_SEQ_CST);
+	}
+
+	thread_epoch = epoch;
+}
+
+/** @brief Leaves a read section of the config */
+void
+config_read_end(void)
+{
+	if (--read_depth > 0) {
+		return;
+	}
+
+	__atomic_sub_fetch(&readers[thread_epoch], 1, __ATOMIC_SEQ_CST);
+}
+
+/** @brief Frees retired config memory that no reader can still hold
+ *
+ * Must be called with config_mutex held. Never waits for readers.
+ */
+void
+config_reclaim(void)
+{
+	t_config_retired *retired;
+
+	for (;;) {
+		if (draining) {
+			if (__atomic_load_n(&readers[!read_epoch], __ATOMIC_SEQ_CST) != 0) {
+				// Readers that may hold pending memory are still active, try again later
+				return;
+			}
+
+			while ((retired = pending)) {
+				pending = retired->next;
+				retired->release(retired->p);
+				free(retired);
+			}
+
+			draining = 0;
+		}
+
+		if (!limbo) {
+			return;
+		}
+
+		pending = limbo;
+		limbo = NULL;
+		draining = 1;
+		__atomic_store_n(&read_epoch, !read_epoch, __ATOMIC_SEQ_CST);
+	}
+}
+
+/** @brief Hands memory no longer reachable from the current config to release(),
+ *  once no reader can still hold it.
+ *
+ * Must be called with config_mutex held, or before the other threads are started.
+ */
+void
+config_retire(void *p, void (*release)(void *))
+{
+	t_config_retired *retired;
+
+	if (!p) {
+		return;
+	}
+
+	retired = safe_calloc(sizeof(t_config_retired));
+	retired->p = p;
+	retired->release = release;
+	retired->next = limbo;
+	limbo = retired;
+
+	config_reclaim();
+}
+
+// Frees a list of trusted MACs, as config_retire() releases it
+static void
+_config_free_macs(void *p)
+{
+	t_MAC *list = p;
+
+	CONFIG_FREE_LIST(t_MAC, list, mac);
+}
+
+// Frees a config replaced by config_publish(), as config_retire() releases it
+static void
+_config_free(void *p)
+{
+	s_config *cfg = p;
+
+	CONFIG_FREE_LIST(t_MAC, cfg->trustedmaclist, mac);
+	config_clear_fas_custom_lists(cfg);
+
+	// The config read at startup is not allocated
+	if (cfg != &config) {
+		free(cfg);
+	}
+}
+
+// A copy of a list of trusted MACs, leaving out the entry skip
+static t_MAC *
+_config_copy_macs(const t_MAC *list, const t_MAC *skip)
+{
+	t_MAC *copy = NULL;
+	t_MAC **tail = &copy;
+
+	for (; list; list = list->next) {
+		if (list == skip) {
+			continue;
+		}
+
+		*tail = safe_calloc(sizeof(t_MAC));
+		(*tail)->mac = safe_strdup(list->mac);
+		tail = &(*tail)->next;
+	}
+
+	return copy;
 }
 
 char *set_list_str(char *list, const char *default_list, char *debug_level)
@@ -141,8 +398,6 @@ config_init(int argc, char **argv)
 	char *setupcmd;
 	char debug_level[STATUS_BUF];
 	char *msg;
-	FILE *fd;
-	char *lockfile;
 
 	// Check if nodogsplash is installed. If it is, issue a warning and exit
 	libcmd = safe_calloc(STATUS_BUF);
@@ -261,6 +516,12 @@ config_init(int argc, char **argv)
 	sscanf(set_option_str("login_option_enabled", DEFAULT_LOGIN_OPTION_ENABLED, debug_level), "%u", &config.login_option_enabled);
 	sscanf(set_option_str("use_outdated_mhd", DEFAULT_USE_OUTDATED_MHD, debug_level), "%u", &config.use_outdated_mhd);
 	sscanf(set_option_str("max_page_size", DEFAULT_MAX_PAGE_SIZE, debug_level), "%llu", &config.max_page_size);
+	sscanf(set_option_str("webroot_cache_maxage", DEFAULT_WEBROOT_CACHE_MAXAGE, debug_level), "%u", &config.webroot_cache_maxage);
+	sscanf(set_option_str("redirect_keepalive", DEFAULT_REDIRECT_KEEPALIVE, debug_level), "%d", &config.redirect_keepalive);
+	sscanf(set_option_str("http_source_rate", DEFAULT_HTTP_SOURCE_RATE, debug_level), "%u", &config.http_source_rate);
+	sscanf(set_option_str("http_source_burst", DEFAULT_HTTP_SOURCE_BURST, debug_level), "%u", &config.http_source_burst);
+	sscanf(set_option_str("http_script_concurrency", DEFAULT_HTTP_SCRIPT_CONCURRENCY, debug_level), "%d", &config.http_script_concurrency);
+	sscanf(set_option_str("render_cache_ttl", DEFAULT_RENDER_CACHE_TTL, debug_level), "%u", &config.render_cache_ttl);
 	sscanf(set_option_str("max_log_entries", DEFAULT_MAX_LOG_ENTRIES, debug_level), "%llu", &config.max_log_entries);
 	sscanf(set_option_str("allow_preemptive_authentication", DEFAULT_ALLOW_PREEMPTIVE_AUTHENTICATION, debug_level), "%u", &config.allow_preemptive_authentication);
 	sscanf(set_option_str("fas_secure_enabled", DEFAULT_FAS_SECURE_ENABLED, debug_level), "%u", &config.fas_secure_enabled);
@@ -298,14 +559,14 @@ config_init(int argc, char **argv)
 	config.custom_files = NULL;
 	config.tmpfsmountpoint = NULL;
 	config.preauth = NULL;
-	config.lockfd = 0;
 	config.online_status = 0;
 
 	// Lists
 	parse_trusted_mac_list(set_list_str("trustedmac", DEFAULT_TRUSTEDMACLIST, debug_level));
-	parse_fas_custom_parameters_list(set_list_str("fas_custom_parameters_list", DEFAULT_FAS_CUSTOM_PARAMETERS_LIST, debug_level));
-	parse_fas_custom_images_list(set_list_str("fas_custom_images_list", DEFAULT_FAS_CUSTOM_IMAGES_LIST, debug_level));
-	parse_fas_custom_files_list(set_list_str("fas_custom_files_list", DEFAULT_FAS_CUSTOM_FILES_LIST, debug_level));
+	parse_fas_custom_parameters_list(&config, set_list_str("fas_custom_parameters_list", DEFAULT_FAS_CUSTOM_PARAMETERS_LIST, debug_level));
+	parse_fas_custom_variables_list(&config, set_list_str("fas_custom_variables_list", DEFAULT_FAS_CUSTOM_VARIABLES_LIST, debug_level));
+	parse_fas_custom_images_list(&config, set_list_str("fas_custom_images_list", DEFAULT_FAS_CUSTOM_IMAGES_LIST, debug_level));
+	parse_fas_custom_files_list(&config, set_list_str("fas_custom_files_list", DEFAULT_FAS_CUSTOM_FILES_LIST, debug_level));
 
 	// Before we do anything else, reset the firewall (cleans it, in case we are restarting or after an opennds crash)
 	iptables_fw_destroy();
@@ -396,23 +657,13 @@ config_init(int argc, char **argv)
 	}
 
 	free(msg);
-	lockfile = safe_calloc(STATUS_BUF);
-	safe_snprintf(lockfile, STATUS_BUF, "%s/ndsctl.lock", config.tmpfsmountpoint);
-
-	//Remove ndsctl lock file if it exists
-	if ((fd = fopen(lockfile, "r")) != NULL) {
-		fclose(fd);
-		remove(lockfile);
-	}
-
-	free (lockfile);
 }
 
-// Parse a string to see if it is valid decimal dotted quad IP V4 format
+// Parse a string to see if it is a valid IPv4 dotted quad or IPv6 address
 int check_ip_format(const char *possibleip)
 {
 	unsigned char buf[sizeof(struct in6_addr)];
-	return inet_pton(AF_INET, possibleip, buf) > 0;
+	return inet_pton(AF_INET, possibleip, buf) > 0 || inet_pton(AF_INET6, possibleip, buf) > 0;
 }
 
 // Parse a string to see if it is valid MAC address format
@@ -421,7 +672,7 @@ int check_mac_format(const char possiblemac[])
 	return ether_aton(possiblemac) != NULL;
 }
 
-int add_to_fas_custom_parameters_list(const char possibleparam[])
+static int add_to_fas_custom_parameters_list(s_config *cfg, const char possibleparam[])
 {
 	char param[512];
 	t_FASPARAM *p = NULL;
@@ -431,14 +682,14 @@ int add_to_fas_custom_parameters_list(const char possibleparam[])
 	// Add Parameter to head of list
 	p = safe_calloc(sizeof(t_FASPARAM));
 	p->fasparam = safe_strdup(param);
-	p->next = config.fas_custom_parameters_list;
+	p->next = cfg->fas_custom_parameters_list;
 
-	config.fas_custom_parameters_list = p;
+	cfg->fas_custom_parameters_list = p;
 	debug(LOG_INFO, "Added Custom Parameter [%s]", possibleparam);
 	return 0;
 }
 
-int add_to_fas_custom_variables_list(const char possiblevar[])
+static int add_to_fas_custom_variables_list(s_config *cfg, const char possiblevar[])
 {
 	char var[512];
 	t_FASVAR *p = NULL;
@@ -448,14 +699,14 @@ int add_to_fas_custom_variables_list(const char possiblevar[])
 	// Add Variable to head of list
 	p = safe_calloc(sizeof(t_FASVAR));
 	p->fasvar = safe_strdup(var);
-	p->next = config.fas_custom_variables_list;
+	p->next = cfg->fas_custom_variables_list;
 
-	config.fas_custom_variables_list = p;
+	cfg->fas_custom_variables_list = p;
 	debug(LOG_INFO, "Added Custom Variable [%s]", possiblevar);
 	return 0;
 }
 
-int add_to_fas_custom_images_list(const char possibleimage[])
+static int add_to_fas_custom_images_list(s_config *cfg, const char possibleimage[])
 {
 	char image[512];
 	t_FASIMG *p = NULL;
@@ -465,14 +716,14 @@ int add_to_fas_custom_images_list(const char possibleimage[])
 	// Add Image to head of list
 	p = safe_calloc(sizeof(t_FASIMG));
 	p->fasimg = safe_strdup(image);
-	p->next = config.fas_custom_images_list;
+	p->next = cfg->fas_custom_images_list;
 
-	config.fas_custom_images_list = p;
+	cfg->fas_custom_images_list = p;
 	debug(LOG_INFO, "Added Custom Image [%s]", possibleimage);
 	return 0;
 }
 
-int add_to_fas_custom_files_list(const char possiblefile[])
+static int add_to_fas_custom_files_list(s_config *cfg, const char possiblefile[])
 {
 	char file[512];
 	t_FASFILE *p = NULL;
@@ -482,18 +733,25 @@ int add_to_fas_custom_files_list(const char possiblefile[])
 	// Add File to head of list
 	p = safe_calloc(sizeof(t_FASFILE));
 	p->fasfile = safe_strdup(file);
-	p->next = config.fas_custom_files_list;
+	p->next = cfg->fas_custom_files_list;
 
-	config.fas_custom_files_list = p;
+	cfg->fas_custom_files_list = p;
 	debug(LOG_INFO, "Added Custom File [%s]", possiblefile);
 	return 0;
 }
 
 
+/* Add given MAC address to the config's trusted mac list.
+ * The list is replaced by a copy, as readers may be walking it.
+ * Must be called with config_mutex held, or before the other threads are started.
+ * Return 0 on success, nonzero on failure
+ */
 int add_to_trusted_mac_list(const char possiblemac[])
 {
 	char mac[18];
 	t_MAC *p = NULL;
+	t_MAC *list = NULL;
+	s_config *cfg = config_get_config();
 
 	// check for valid format
 	if (!check_mac_format(possiblemac)) {
@@ -505,31 +763,36 @@ int add_to_trusted_mac_list(const char possiblemac[])
 	sscanf(possiblemac, "%17[A-Fa-f0-9:]", mac);
 
 	// See if MAC is already on the list; don't add duplicates
-	for (p = config.trustedmaclist; p != NULL; p = p->next) {
+	for (p = cfg->trustedmaclist; p != NULL; p = p->next) {
 		if (!strcasecmp(p->mac, mac)) {
 			debug(LOG_INFO, "MAC address [%s] already on trusted list", mac);
 			return 1;
 		}
 	}
 
-	// Add MAC to head of list
+	// Add MAC to head of a copy of the list, readers may be walking the current one
 	p = safe_calloc(sizeof(t_MAC));
 	p->mac = safe_strdup(mac);
-	p->next = config.trustedmaclist;
-	config.trustedmaclist = p;
+	list = cfg->trustedmaclist;
+	p->next = _config_copy_macs(list, NULL);
+	__atomic_store_n(&cfg->trustedmaclist, p, __ATOMIC_RELEASE);
+	config_retire(list, _config_free_macs);
 	debug(LOG_INFO, "Added MAC address [%s] to trusted list", mac);
 	return 0;
 }
 
 
 /* Remove given MAC address from the config's trusted mac list.
+ * The list is replaced by a copy, as readers may be walking it.
+ * Must be called with config_mutex held.
  * Return 0 on success, nonzero on failure
  */
 int remove_from_trusted_mac_list(const char possiblemac[])
 {
 	char mac[18];
-	t_MAC **p = NULL;
+	t_MAC *list = NULL;
 	t_MAC *del = NULL;
+	s_config *cfg = config_get_config();
 
 	// check for valid format
 	if (!check_mac_format(possiblemac)) {
@@ -540,19 +803,19 @@ int remove_from_trusted_mac_list(const char possiblemac[])
 	sscanf(possiblemac, "%17[A-Fa-f0-9:]", mac);
 
 	// If empty list, nothing to do
-	if (config.trustedmaclist == NULL) {
+	if (cfg->trustedmaclist == NULL) {
 		debug(LOG_INFO, "MAC address [%s] not on empty trusted list", mac);
 		return -1;
 	}
 
-	// Find MAC on the list, remove it
-	for (p = &(config.trustedmaclist); *p != NULL; p = &((*p)->next)) {
-		if (!strcasecmp((*p)->mac, mac)) {
+	// Find MAC on the list, publish a copy without it
+	for (del = cfg->trustedmaclist; del != NULL; del = del->next) {
+		if (!strcasecmp(del->mac, mac)) {
 			// found it
-			del = *p;
-			*p = del->next;
+			list = cfg->trustedmaclist;
+			__atomic_store_n(&cfg->trustedmaclist, _config_copy_macs(list, del), __ATOMIC_RELEASE);
+			config_retire(list, _config_free_macs);
 			debug(LOG_INFO, "Removed MAC address [%s] from trusted list", mac);
-			free(del);
 			return 0;
 		}
 	}
@@ -591,31 +854,38 @@ int is_trusted_mac(const char *mac)
 	s_config *config;
 	t_MAC *trust_mac;
 
+	int trusted = 0;
+
+	config_read_begin();
 	config = config_get_config();
 
 	// Is a client even recognized here?
-	for (trust_mac = config->trustedmaclist; trust_mac != NULL; trust_mac = trust_mac->next) {
+	for (trust_mac = __atomic_load_n(&config->trustedmaclist, __ATOMIC_ACQUIRE); trust_mac != NULL; trust_mac = trust_mac->next) {
 		if (!strcmp(trust_mac->mac, mac)) {
-			return 1;
+			trusted = 1;
+			break;
 		}
 	}
 
-	return 0;
+	config_read_end();
+
+	return trusted;
 }
 
 /* Given a pointer to a comma or whitespace delimited sequence of
- * Custom FAS Parameters, add each parameter to config.fas_custom_parameters_list
+ * Custom FAS Parameters, add each parameter to cfg->fas_custom_parameters_list
  */
-void parse_fas_custom_parameters_list(const char ptr[])
+void parse_fas_custom_parameters_list(s_config *cfg, const char ptr[])
 {
 	char *ptrcopy = NULL;
+	char *ptrcopyptr;
 	char *possibleparam = NULL;
 	char msg[512] = {0};
 	char *cmd = NULL;
 	char possibleparam_urlencoded[512] = {0};
 
 	// strsep modifies original, so let's make a copy
-	ptrcopy = safe_strdup(ptr);
+	ptrcopyptr = ptrcopy = safe_strdup(ptr);
 
 	while ((possibleparam = strsep(&ptrcopy, ", \t"))) {
 		if (strlen(possibleparam) > 0) {
@@ -637,20 +907,23 @@ void parse_fas_custom_parameters_list(const char ptr[])
 			free(cmd);
 			if (strcmp(msg, possibleparam_urlencoded) == 0) {
 				debug(LOG_INFO, "Adding parameter [%s] [%s]", possibleparam, msg);
-				add_to_fas_custom_parameters_list(possibleparam);
+				add_to_fas_custom_parameters_list(cfg, possibleparam);
 			} else {
 				debug(LOG_WARNING, "Invalid Custom Parameter [%s] [%s] - skipping", possibleparam, msg);
 			}
 		}
 	}
+
+	free(ptrcopyptr);
 }
 
 /* Given a pointer to a comma or whitespace delimited sequence of
- * Custom FAS Variables, add each parameter to config.fas_custom_variables_list
+ * Custom FAS Variables, add each parameter to cfg->fas_custom_variables_list
  */
-void parse_fas_custom_variables_list(const char ptr[])
+void parse_fas_custom_variables_list(s_config *cfg, const char ptr[])
 {
 	char *ptrcopy = NULL;
+	char *ptrcopyptr;
 	char *possiblevar = NULL;
 	char msg[512] = {0};
 	char *cmd = NULL;
@@ -659,7 +932,7 @@ void parse_fas_custom_variables_list(const char ptr[])
 	debug(LOG_INFO, "Parsing list [%s] for Custom FAS Variables", ptr);
 
 	// strsep modifies original, so let's make a copy
-	ptrcopy = safe_strdup(ptr);
+	ptrcopyptr = ptrcopy = safe_strdup(ptr);
 
 	while ((possiblevar = strsep(&ptrcopy, ", \t"))) {
 		if (strlen(possiblevar) > 0) {
@@ -681,20 +954,23 @@ void parse_fas_custom_variables_list(const char ptr[])
 			free(cmd);
 			if (strcmp(msg, possiblevar_urlencoded) == 0) {
 				debug(LOG_INFO, "Adding variable [%s] [%s]", possiblevar, msg);
-				add_to_fas_custom_variables_list(possiblevar);
+				add_to_fas_custom_variables_list(cfg, possiblevar);
 			} else {
 				debug(LOG_WARNING, "Invalid Custom Variable [%s] [%s] - skipping", possiblevar, msg);
 			}
 		}
 	}
+
+	free(ptrcopyptr);
 }
 
 /* Given a pointer to a comma or whitespace delimited sequence of
- * Custom FAS Images, add each image to config.fas_custom_images_list
+ * Custom FAS Images, add each image to cfg->fas_custom_images_list
  */
-void parse_fas_custom_images_list(const char ptr[])
+void parse_fas_custom_images_list(s_config *cfg, const char ptr[])
 {
 	char *ptrcopy = NULL;
+	char *ptrcopyptr;
 	char *possibleimage = NULL;
 	char msg[512] = {0};
 	char *cmd = NULL;
@@ -703,7 +979,7 @@ void parse_fas_custom_images_list(const char ptr[])
 	debug(LOG_INFO, "Parsing list [%s] for Custom FAS Images", ptr);
 
 	// strsep modifies original, so let's make a copy
-	ptrcopy = safe_strdup(ptr);
+	ptrcopyptr = ptrcopy = safe_strdup(ptr);
 
 	while ((possibleimage = strsep(&ptrcopy, ", \t"))) {
 		if (strlen(possibleimage) > 0) {
@@ -725,20 +1001,23 @@ void parse_fas_custom_images_list(const char ptr[])
 			free(cmd);
 			if (strcmp(msg, possibleimage_urlencoded) == 0) {
 				debug(LOG_INFO, "Adding image [%s] [%s]", possibleimage, msg);
-				add_to_fas_custom_images_list(possibleimage);
+				add_to_fas_custom_images_list(cfg, possibleimage);
 			} else {
 				debug(LOG_WARNING, "Invalid Custom Image [%s] [%s] - skipping", possibleimage, msg);
 			}
 		}
 	}
+
+	free(ptrcopyptr);
 }
 
 /* Given a pointer to a comma or whitespace delimited sequence of
- * Custom FAS Files, add each image to config.fas_custom_files_list
+ * Custom FAS Files, add each image to cfg->fas_custom_files_list
  */
-void parse_fas_custom_files_list(const char ptr[])
+void parse_fas_custom_files_list(s_config *cfg, const char ptr[])
 {
 	char *ptrcopy = NULL;
+	char *ptrcopyptr;
 	char *possiblefile = NULL;
 	char msg[512] = {0};
 	char *cmd = NULL;
@@ -747,7 +1026,7 @@ void parse_fas_custom_files_list(const char ptr[])
 	debug(LOG_INFO, "Parsing list [%s] for Custom FAS Files", ptr);
 
 	// strsep modifies original, so let's make a copy
-	ptrcopy = safe_strdup(ptr);
+	ptrcopyptr = ptrcopy = safe_strdup(ptr);
 
 	while ((possiblefile = strsep(&ptrcopy, ", \t"))) {
 		if (strlen(possiblefile) > 0) {
@@ -769,12 +1048,91 @@ void parse_fas_custom_files_list(const char ptr[])
 			free(cmd);
 			if (strcmp(msg, possiblefile_urlencoded) == 0) {
 				debug(LOG_INFO, "Adding file [%s] [%s]", possiblefile, msg);
-				add_to_fas_custom_files_list(possiblefile);
+				add_to_fas_custom_files_list(cfg, possiblefile);
 			} else {
 				debug(LOG_WARNING, "Invalid Custom File [%s] [%s] - skipping", possiblefile, msg);
 			}
 		}
 	}
+
+	free(ptrcopyptr);
+}
+
+/* Builds the custom FAS parameter, variable, image and file strings from their lists
+ */
+void build_fas_custom_strings(s_config *cfg)
+{
+	// Setup custom FAS parameters if configured
+	char fasparam[MAX_BUF] = {0};
+	t_FASPARAM *fas_fasparam;
+	if (cfg->fas_custom_parameters_list) {
+		for (fas_fasparam = cfg->fas_custom_parameters_list; fas_fasparam != NULL; fas_fasparam = fas_fasparam->next) {
+
+			// Make sure we don't have a buffer overflow
+			if ((sizeof(fasparam) - strlen(fasparam)) > (strlen(fas_fasparam->fasparam) + 4)) {
+				strcat(fasparam, fas_fasparam->fasparam);
+				strcat(fasparam, QUERYSEPARATOR);
+			} else {
+				break;
+			}
+		}
+		cfg->custom_params = safe_strdup(fasparam);
+		debug(LOG_DEBUG, "Custom FAS parameter string [%s]", cfg->custom_params);
+	}
+
+	// Setup custom FAS variables if configured
+	char fasvar[MAX_BUF] = {0};
+	t_FASVAR *fas_fasvar;
+	if (cfg->fas_custom_variables_list) {
+		for (fas_fasvar = cfg->fas_custom_variables_list; fas_fasvar != NULL; fas_fasvar = fas_fasvar->next) {
+
+			// Make sure we don't have a buffer overflow
+			if ((sizeof(fasvar) - strlen(fasvar)) > (strlen(fas_fasvar->fasvar) + 4)) {
+				strcat(fasvar, fas_fasvar->fasvar);
+				strcat(fasvar, QUERYSEPARATOR);
+			} else {
+				break;
+			}
+		}
+		cfg->custom_vars = safe_strdup(fasvar);
+		debug(LOG_DEBUG, "Custom FAS variables string [%s]", cfg->custom_vars);
+	}
+
+	// Setup custom FAS images if configured
+	char fasimage[MAX_BUF] = {0};
+	t_FASIMG *fas_fasimage;
+	if (cfg->fas_custom_images_list) {
+		for (fas_fasimage = cfg->fas_custom_images_list; fas_fasimage != NULL; fas_fasimage = fas_fasimage->next) {
+
+			// Make sure we don't have a buffer overflow
+			if ((sizeof(fasimage) - strlen(fasimage)) > (strlen(fas_fasimage->fasimg) + 4)) {
+				strcat(fasimage, fas_fasimage->fasimg);
+				strcat(fasimage, QUERYSEPARATOR);
+			} else {
+				break;
+			}
+		}
+		cfg->custom_images = safe_strdup(fasimage);
+		debug(LOG_DEBUG, "Custom FAS images string [%s]", cfg->custom_images);
+	}
+
+	// Setup custom FAS files if configured
+	char fasfile[MAX_BUF] = {0};
+	t_FASFILE *fas_fasfile;
+	if (cfg->fas_custom_files_list) {
+		for (fas_fasfile = cfg->fas_custom_files_list; fas_fasfile != NULL; fas_fasfile = fas_fasfile->next) {
+
+			// Make sure we don't have a buffer overflow
+			if ((sizeof(fasfile) - strlen(fasfile)) > (strlen(fas_fasfile->fasfile) + 4)) {
+				strcat(fasfile, fas_fasfile->fasfile);
+				strcat(fasfile, QUERYSEPARATOR);
+			} else {
+				break;
+			}
+		}
+		cfg->custom_files = safe_strdup(fasfile);
+		debug(LOG_DEBUG, "Custom FAS files string [%s]", cfg->custom_files);
+	}
 }
 
 /** Set the debug log level.  See syslog.h
@@ -796,7 +1154,7 @@ int set_debuglevel(const char opt[])
 	if (level >= (int) DEBUGLEVEL_MIN && level <= (int) DEBUGLEVEL_MAX) {
 		msg = safe_calloc(STATUS_BUF);
 
-		sscanf(opt, "%u", &config.debuglevel);
+		sscanf(opt, "%u", &config_get_config()->debuglevel);
 
 		libcmd = safe_calloc(STATUS_BUF);
 		safe_snprintf(libcmd, STATUS_BUF, "/usr/lib/opennds/libopennds.sh \"debuglevel\" \"%s\"", opt);
@@ -30,6 +30,8 @@
 #ifndef _CONF_H_
 #define _CONF_H_
 
+#include "lockstat.h"
+
 #define VERSION "11.0.0beta"
 
 /*
@@ -78,6 +80,12 @@
 #define DEFAULT_AUTH_IDLE_TIMEOUT "120"
 #define DEFAULT_REMOTES_REFRESH_INTERVAL "0"
 #define DEFAULT_WEBROOT "/etc/opennds/htdocs"
+#define DEFAULT_WEBROOT_CACHE_MAXAGE "3600" // Cache-Control max-age in seconds for static webroot files, 0 means always revalidate
+#define DEFAULT_HTTP_SOURCE_RATE "10" // Requests per second each client address may make before being shed, 0 means no limit
+#define DEFAULT_HTTP_SOURCE_BURST "40" // Requests a client address may make at once, on top of its rate
+#define DEFAULT_HTTP_SCRIPT_CONCURRENCY "16" // Requests that may be running helper scripts at once, 0 means no limit
+#define DEFAULT_RENDER_CACHE_TTL "5" // Seconds a page rendered by the PreAuth or err511 script is served again to the same client, 0 means only share concurrent renders
+#define DEFAULT_REDIRECT_KEEPALIVE "1" // Keep the connection open after redirecting a client to a page served by openNDS itself
 #define DEFAULT_TMPFSMOUNTPOINT "/tmp"
 #define DEFAULT_AUTHDIR "opennds_auth"
 #define DEFAULT_DENYDIR "opennds_deny"
@@ -232,6 +240,12 @@ typedef struct {
 	char *tmpfsmountpoint;					//@brief Mountpoint of the tmpfs drive eg /tmp etc.
 	char *log_mountpoint;					//@brief Mountpoint of the log drive eg a USB drive mounted at /logs
 	char *webroot;						//@brief Directory containing splash pages, etc.
+	unsigned int webroot_cache_maxage;			//@brief Cache-Control max-age sent with static webroot files
+	int redirect_keepalive;					//@brief Keep the connection open on redirects to pages served by openNDS
+	unsigned int http_source_rate;				//@brief Requests per second allowed from each client address
+	unsigned int http_source_burst;				//@brief Burst of requests allowed from each client address
+	int http_script_concurrency;				//@brief Requests allowed to run helper scripts at once
+	unsigned int render_cache_ttl;				//@brief Seconds a rendered page is kept for the same request
 	char *authdir;						//@brief Notional relative dir for authentication URL
 	char *denydir;						//@brief Notional relative dir for denial URL
 	char *preauthdir;					//@brief Notional relative dir for preauth URL
@@ -275,19 +289,37 @@ typedef struct {
 	char *binauth;						//@brief external postauthentication program
 	char *custombinauth;					//@brief external custom postauthentication program
 	char *preauth;						//@brief external preauthentication program
-	int lockfd;						//@brief ndsctl lockfile file descriptor
+	unsigned int generation;				//@brief configs published before this one, tells a cache built from a freed config apart
 } s_config;
 
 // @brief Get the current gateway configuration
 s_config *config_get_config(void);
 
+// @brief Copy the current configuration, for a reload
+s_config *config_dup(void);
+
+// @brief Make a configuration built by config_dup() the current one
+void config_publish(s_config *next);
+
+// @brief Free the custom FAS lists of an unpublished config, to parse them again
+void config_clear_fas_custom_lists(s_config *cfg);
+
+// @brief Enter and leave a read section, the config read in between stays valid
+void config_read_begin(void);
+void config_read_end(void);
+
+// @brief Free config memory retired by writers, once no reader holds it
+void config_retire(void *p, void (*release)(void *));
+void config_reclaim(void);
+
 // @brief Initialise the conf system
 void config_init(int argc, char **argv);
 void parse_trusted_mac_list(const char[]);
-void parse_fas_custom_parameters_list(const char[]);
-void parse_fas_custom_variables_list(const char[]);
-void parse_fas_custom_images_list(const char[]);
-void parse_fas_custom_files_list(const char[]);
+void parse_fas_custom_parameters_list(s_config *cfg, const char[]);
+void parse_fas_custom_variables_list(s_config *cfg, const char[]);
+void parse_fas_custom_images_list(s_config *cfg, const char[]);
+void parse_fas_custom_files_list(s_config *cfg, const char[]);
+void build_fas_custom_strings(s_config *cfg);
 
 int is_trusted_mac(const char *mac);
 
@@ -302,13 +334,13 @@ int set_debuglevel(const char[]);
 
 #define LOCK_CONFIG() do { \
 	debug(LOG_DEBUG, "Locking config"); \
-	pthread_mutex_lock(&config_mutex); \
+	lockstat_lock(LOCKSTAT_CONFIG, &config_mutex, __FILE__, __LINE__); \
 	debug(LOG_DEBUG, "Config locked"); \
 } while (0)
 
 #define UNLOCK_CONFIG() do { \
 	debug(LOG_DEBUG, "Unlocking config"); \
-	pthread_mutex_unlock(&config_mutex); \
+	lockstat_unlock(LOCKSTAT_CONFIG, &config_mutex); \
 	debug(LOG_DEBUG, "Config unlocked"); \
 } while (0)
 
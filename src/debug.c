@@ -66,15 +66,18 @@ void
 _debug(const char filename[], int line, int level, const char *format, ...)
 {
 	va_list vlist;
-	s_config *config;
+	int debuglevel;
 	time_t ts;
 	sigset_t block_chld;
 
 	time(&ts);
 
-	config = config_get_config();
+	// Called from every thread, in a read section of the config or not
+	config_read_begin();
+	debuglevel = config_get_config()->debuglevel;
+	config_read_end();
 
-	if (do_log(level, config->debuglevel)) {
+	if (do_log(level, debuglevel)) {
 		sigemptyset(&block_chld);
 		sigaddset(&block_chld, SIGCHLD);
 		sigprocmask(SIG_BLOCK, &block_chld, NULL);
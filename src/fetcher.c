@@ -0,0 +1,922 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @internal
+  @file fetcher.c
+  @brief Fetches the themespec remote images and files over http, revalidating them with conditional requests
+  @author Copyright (C) 2015-2025 Modifications and additions by BlueWave Projects and Services <opennds@blue-wave.net>
+
+  download_remotes() used to start the download library call, which fetched every
+  custom image and file again with wget on each refresh. The http ones are now
+  fetched here, in a background thread with FETCHER_PARALLEL connections:
+
+  The ETag and Last-Modified of each response are kept, and a refresh sends them
+  back as If-None-Match and If-Modified-Since, so an unchanged file costs a 304.
+
+  A body is written to a temporary file next to the destination and hashed as it
+  arrives. If it has the same content as the file in place it is dropped,
+  otherwise it is renamed over the destination, so the web server never sees a
+  partly written file.
+
+  https and file urls are still left to the download library call.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include "common.h"
+#include "safe.h"
+#include "conf.h"
+#include "debug.h"
+#include "metrics.h"
+#include "fetcher.h"
+
+#define FETCHER_VALIDATOR 128
+
+typedef struct _fetch_state_t {
+	char *path;
+	char *url;
+	char etag[FETCHER_VALIDATOR];
+	char last_modified[FETCHER_VALIDATOR];
+	uint64_t hash;				/**< @brief Of the file in place, 0 if not known */
+	off_t size;
+	struct _fetch_state_t *next;
+} t_fetch_state;
+
+typedef struct {
+	char host[256];
+	char port[8];
+	char authority[272];			/**< @brief host[:port] as in the url, for the Host header */
+	const char *path;			/**< @brief Points into the url */
+} t_fetch_url;
+
+typedef struct {
+	int status;
+	char etag[FETCHER_VALIDATOR];
+	char last_modified[FETCHER_VALIDATOR];
+	char location[SMALL_BUF];
+	uint64_t hash;
+	off_t size;
+} t_fetch_response;
+
+typedef struct {
+	t_fetch_job *jobs;
+	int count;
+	int refresh;
+	int next;
+} t_fetch_run;
+
+// Validators of every destination fetched, never freed as the set of remotes is small
+static t_fetch_state *fetch_states = NULL;
+static pthread_mutex_t fetcher_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int fetcher_busy = 0;
+
+// FNV-1a, to tell a download from the file it would replace
+static uint64_t
+_fetch_hash(uint64_t hash, const char *buf, size_t len)
+{
+	while (len--) {
+		hash = (hash ^ (unsigned char)*buf++) * 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+#define FETCH_HASH_INIT 14695981039346656037ULL
+
+static uint64_t
+_fetch_hash_file(const char *path, off_t *size)
+{
+	char buf[16384];
+	uint64_t hash = FETCH_HASH_INIT;
+	ssize_t n;
+	int fd;
+
+	*size = 0;
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0) {
+		return 0;
+	}
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		hash = _fetch_hash(hash, buf, n);
+		*size += n;
+	}
+
+	close(fd);
+	return n < 0 ? 0 : hash;
+}
+
+// Copies the validators of path out, dropping them if the url of path has changed
+static void
+_fetch_state_get(const char *path, const char *url, t_fetch_state *copy)
+{
+	t_fetch_state *state;
+
+	memset(copy, 0, sizeof(*copy));
+	pthread_mutex_lock(&fetcher_mutex);
+
+	for (state = fetch_states; state; state = state->next) {
+		if (strcmp(state->path, path) == 0) {
+			if (strcmp(state->url, url) == 0) {
+				*copy = *state;
+			}
+
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&fetcher_mutex);
+}
+
+static void
+_fetch_state_put(const char *path, const char *url, const t_fetch_state *update)
+{
+	t_fetch_state *state;
+
+	pthread_mutex_lock(&fetcher_mutex);
+
+	for (state = fetch_states; state; state = state->next) {
+		if (strcmp(state->path, path) == 0) {
+			break;
+		}
+	}
+
+	if (!state) {
+		state = safe_calloc(sizeof(t_fetch_state));
+		state->path = safe_strdup(path);
+		state->next = fetch_states;
+		fetch_states = state;
+	}
+
+	if (!state->url || strcmp(state->url, url) != 0) {
+		free(state->url);
+		state->url = safe_strdup(url);
+	}
+
+	memcpy(state->etag, update->etag, sizeof(state->etag));
+	memcpy(state->last_modified, update->last_modified, sizeof(state->last_modified));
+	state->hash = update->hash;
+	state->size = update->size;
+
+	pthread_mutex_unlock(&fetcher_mutex);
+}
+
+static int
+_fetch_parse_url(const char *url, t_fetch_url *u)
+{
+	const char *authority;
+	const char *end;
+	const char *port = NULL;
+	size_t len;
+
+	if (strncasecmp(url, "http://", 7) != 0) {
+		return -1;
+	}
+
+	authority = url + 7;
+	end = authority + strcspn(authority, "/?#");
+	len = end - authority;
+
+	if (len == 0 || len >= sizeof(u->authority) || memchr(authority, '@', len)) {
+		return -1;
+	}
+
+	memcpy(u->authority, authority, len);
+	u->authority[len] = '\0';
+
+	// An IPv6 literal is in brackets
+	if (u->authority[0] == '[') {
+		end = strchr(u->authority, ']');
+
+		if (!end) {
+			return -1;
+		}
+
+		len = end - u->authority - 1;
+		port = end[1] == ':' ? end + 2 : NULL;
+
+		if (len >= sizeof(u->host)) {
+			return -1;
+		}
+
+		memcpy(u->host, u->authority + 1, len);
+	} else {
+		len = strcspn(u->authority, ":");
+		port = u->authority[len] == ':' ? u->authority + len + 1 : NULL;
+
+		if (len >= sizeof(u->host)) {
+			return -1;
+		}
+
+		memcpy(u->host, u->authority, len);
+	}
+
+	u->host[len] = '\0';
+	snprintf(u->port, sizeof(u->port), "%s", port && *port ? port : "80");
+
+	u->path = authority + strlen(u->authority);
+
+	if (*u->path != '/') {
+		u->path = "/";
+	}
+
+	return 0;
+}
+
+static int
+_fetch_wait(int sock, short events)
+{
+	struct pollfd pfd;
+	int rc;
+
+	pfd.fd = sock;
+	pfd.events = events;
+
+	do {
+		rc = poll(&pfd, 1, FETCHER_TIMEOUT_MS);
+	} while (rc < 0 && errno == EINTR);
+
+	return rc > 0 ? 0 : -1;
+}
+
+static int
+_fetch_connect(const t_fetch_url *u)
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	struct addrinfo *ai;
+	socklen_t errlen;
+	int sock = -1;
+	int err;
+	int rc;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	rc = getaddrinfo(u->host, u->port, &hints, &res);
+
+	if (rc != 0) {
+		debug(LOG_INFO, "Fetcher: cannot resolve [%s]: %s", u->host, gai_strerror(rc));
+		return -1;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		sock = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+
+		if (sock < 0) {
+			continue;
+		}
+
+		if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0) {
+			break;
+		}
+
+		if (errno == EINPROGRESS && _fetch_wait(sock, POLLOUT) == 0) {
+			err = 0;
+			errlen = sizeof(err);
+
+			if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &errlen) == 0 && err == 0) {
+				break;
+			}
+		}
+
+		close(sock);
+		sock = -1;
+	}
+
+	freeaddrinfo(res);
+
+	if (sock < 0) {
+		debug(LOG_INFO, "Fetcher: cannot connect to [%s]", u->authority);
+	}
+
+	return sock;
+}
+
+static int
+_fetch_send(int sock, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		if (_fetch_wait(sock, POLLOUT) != 0) {
+			return -1;
+		}
+
+		n = send(sock, buf, len, MSG_NOSIGNAL);
+
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				continue;
+			}
+
+			return -1;
+		}
+
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static ssize_t
+_fetch_recv(int sock, char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (1) {
+		if (_fetch_wait(sock, POLLIN) != 0) {
+			return -1;
+		}
+
+		n = recv(sock, buf, len, 0);
+
+		if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+			continue;
+		}
+
+		return n;
+	}
+}
+
+// Copies the value of header name, if present in the header block, trimmed
+static void
+_fetch_header(const char *headers, const char *name, char *value, size_t size)
+{
+	const char *line;
+	const char *end;
+	size_t namelen = strlen(name);
+	size_t len;
+
+	for (line = strstr(headers, "\r\n"); line; line = strstr(line, "\r\n")) {
+		line += 2;
+
+		if (strncasecmp(line, name, namelen) != 0 || line[namelen] != ':') {
+			continue;
+		}
+
+		line += namelen + 1;
+		line += strspn(line, " \t");
+		end = strstr(line, "\r\n");
+		len = end ? (size_t)(end - line) : strlen(line);
+
+		while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t')) {
+			len--;
+		}
+
+		if (len >= size) {
+			return;
+		}
+
+		memcpy(value, line, len);
+		value[len] = '\0';
+		return;
+	}
+}
+
+/* One request. A 200 body is written to out, other responses are only parsed.
+ * HTTP/1.0 is used so the body is never chunked and ends with the connection.
+ */
+static int
+_fetch_http(const char *url, const t_fetch_state *validators, int out, t_fetch_response *resp)
+{
+	t_fetch_url u;
+	char *buf;
+	char *body;
+	char length[32] = {0};
+	size_t len = 0;
+	size_t bodylen;
+	ssize_t n;
+	int sock;
+	int rc = -1;
+
+	memset(resp, 0, sizeof(*resp));
+
+	if (_fetch_parse_url(url, &u) != 0) {
+		debug(LOG_ERR, "Fetcher: invalid url [%s]", url);
+		return -1;
+	}
+
+	sock = _fetch_connect(&u);
+
+	if (sock < 0) {
+		return -1;
+	}
+
+	buf = safe_calloc(FETCHER_HEADER_MAX + 1);
+
+	len = snprintf(buf, FETCHER_HEADER_MAX,
+		"GET %s HTTP/1.0\r\nHost: %s\r\nUser-Agent: openNDS\r\nAccept: */*\r\nConnection: close\r\n",
+		u.path,
+		u.authority
+	);
+
+	if (validators && validators->etag[0] && len < FETCHER_HEADER_MAX) {
+		len += snprintf(buf + len, FETCHER_HEADER_MAX - len, "If-None-Match: %s\r\n", validators->etag);
+	}
+
+	if (validators && validators->last_modified[0] && len < FETCHER_HEADER_MAX) {
+		len += snprintf(buf + len, FETCHER_HEADER_MAX - len, "If-Modified-Since: %s\r\n", validators->last_modified);
+	}
+
+	if (len + 2 >= FETCHER_HEADER_MAX || _fetch_send(sock, buf, len) != 0 || _fetch_send(sock, "\r\n", 2) != 0) {
+		goto out;
+	}
+
+	// Status line and headers
+	len = 0;
+	buf[0] = '\0';
+
+	while (!(body = strstr(buf, "\r\n\r\n"))) {
+		if (len >= FETCHER_HEADER_MAX) {
+			goto out;
+		}
+
+		n = _fetch_recv(sock, buf + len, FETCHER_HEADER_MAX - len);
+
+		if (n <= 0) {
+			goto out;
+		}
+
+		len += n;
+		buf[len] = '\0';
+	}
+
+	if (sscanf(buf, "HTTP/%*d.%*d %d", &resp->status) != 1) {
+		goto out;
+	}
+
+	body += 2;
+	*body = '\0';
+	body += 2;
+	bodylen = buf + len - body;
+
+	_fetch_header(buf, "ETag", resp->etag, sizeof(resp->etag));
+	_fetch_header(buf, "Last-Modified", resp->last_modified, sizeof(resp->last_modified));
+	_fetch_header(buf, "Location", resp->location, sizeof(resp->location));
+	_fetch_header(buf, "Content-Length", length, sizeof(length));
+
+	if (resp->status != 200) {
+		rc = 0;
+		goto out;
+	}
+
+	resp->hash = FETCH_HASH_INIT;
+	n = bodylen;
+	memmove(buf, body, bodylen);
+
+	// Whatever came in with the headers, which may be nothing, then the rest up to the end of the connection
+	do {
+		if (resp->size + n > FETCHER_MAX_SIZE) {
+			debug(LOG_ERR, "Fetcher: [%s] is larger than %d bytes", url, FETCHER_MAX_SIZE);
+			goto out;
+		}
+
+		if (write(out, buf, n) != n) {
+			debug(LOG_ERR, "Fetcher: write failed: %s", strerror(errno));
+			goto out;
+		}
+
+		resp->hash = _fetch_hash(resp->hash, buf, n);
+		resp->size += n;
+	} while ((n = _fetch_recv(sock, buf, FETCHER_HEADER_MAX)) > 0);
+
+	// A timeout or reset, or fewer bytes than announced, is a truncated file
+	if (n < 0 || (length[0] && strtoll(length, NULL, 10) != resp->size)) {
+		debug(LOG_INFO, "Fetcher: [%s] was cut short", url);
+		goto out;
+	}
+
+	rc = 0;
+
+out:
+	free(buf);
+	close(sock);
+	return rc;
+}
+
+// Resolves the Location of a redirect against the url it came from, http only
+static char *
+_fetch_redirect(const char *url, const char *location)
+{
+	t_fetch_url u;
+	char *next;
+
+	if (strncasecmp(location, "http://", 7) == 0) {
+		return safe_strdup(location);
+	}
+
+	if (location[0] == '/' && location[1] != '/' && _fetch_parse_url(url, &u) == 0) {
+		safe_asprintf(&next, "http://%s%s", u.authority, location);
+		return next;
+	}
+
+	return NULL;
+}
+
+/** Fetches url to path, conditionally if path is present and was fetched from url before.
+ *  @return one of the FETCH_ results
+ */
+int
+fetcher_fetch(const char *url, const char *path, int refresh)
+{
+	t_fetch_state state;
+	t_fetch_response resp;
+	struct stat st;
+	char *tmp;
+	char *current;
+	char *next;
+	int exists;
+	int redirects;
+	int fd;
+	int rc = FETCH_FAILED;
+
+	exists = (stat(path, &st) == 0);
+
+	if (exists && refresh == 0) {
+		return FETCH_SKIPPED;
+	}
+
+	_fetch_state_get(path, url, &state);
+
+	// Validators only apply to the file they came with
+	if (!exists || state.size != st.st_size) {
+		state.etag[0] = '\0';
+		state.last_modified[0] = '\0';
+		state.hash = 0;
+	}
+
+	if (exists && state.hash == 0) {
+		state.hash = _fetch_hash_file(path, &state.size);
+	}
+
+	safe_asprintf(&tmp, "%s.XXXXXX", path);
+	fd = mkostemp(tmp, O_CLOEXEC);
+
+	if (fd < 0) {
+		debug(LOG_ERR, "Fetcher: cannot create [%s]: %s", tmp, strerror(errno));
+		free(tmp);
+		return FETCH_FAILED;
+	}
+
+	current = safe_strdup(url);
+
+	for (redirects = 0; ; redirects++) {
+		if (ftruncate(fd, 0) != 0 || lseek(fd, 0, SEEK_SET) != 0 ||
+			_fetch_http(current, exists ? &state : NULL, fd, &resp) != 0) {
+			resp.status = 0;
+			break;
+		}
+
+		if (resp.status != 301 && resp.status != 302 && resp.status != 303 && resp.status != 307 && resp.status != 308) {
+			break;
+		}
+
+		next = resp.location[0] ? _fetch_redirect(current, resp.location) : NULL;
+
+		if (!next || redirects >= FETCHER_MAX_REDIRECTS) {
+			debug(LOG_ERR, "Fetcher: cannot follow redirect of [%s] to [%s]", current, resp.location);
+			resp.status = 0;
+			free(next);
+			break;
+		}
+
+		free(current);
+		current = next;
+	}
+
+	if (resp.status == 304 && exists) {
+		rc = FETCH_UNCHANGED;
+	} else if (resp.status == 200 && exists && resp.hash == state.hash && resp.size == state.size) {
+		rc = FETCH_DEDUPED;
+	} else if (resp.status == 200) {
+		if (fchmod(fd, 0644) == 0 && close(fd) == 0 && rename(tmp, path) == 0) {
+			fd = -1;
+			state.hash = resp.hash;
+			state.size = resp.size;
+			rc = FETCH_UPDATED;
+		} else {
+			fd = -1;
+			debug(LOG_ERR, "Fetcher: cannot rename [%s] to [%s]: %s", tmp, path, strerror(errno));
+		}
+	} else if (resp.status) {
+		debug(LOG_ERR, "Fetcher: http transfer failed with status %d - skipping download of %s", resp.status, path);
+	} else {
+		debug(LOG_ERR, "Fetcher: http transfer failed - skipping download of %s", path);
+	}
+
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	if (rc != FETCH_UPDATED) {
+		unlink(tmp);
+	}
+
+	// A 304 may leave out validators that did not change
+	if (rc != FETCH_FAILED) {
+		if (resp.etag[0] || rc != FETCH_UNCHANGED) {
+			memcpy(state.etag, resp.etag, sizeof(state.etag));
+		}
+
+		if (resp.last_modified[0] || rc != FETCH_UNCHANGED) {
+			memcpy(state.last_modified, resp.last_modified, sizeof(state.last_modified));
+		}
+
+		_fetch_state_put(path, url, &state);
+	}
+
+	debug(LOG_DEBUG, "Fetcher: [%s] to [%s], result %d", url, path, rc);
+
+	free(current);
+	free(tmp);
+	return rc;
+}
+
+static void *
+_fetch_worker(void *arg)
+{
+	t_fetch_run *run = arg;
+	t_fetch_job *job;
+	int i;
+
+	while ((i = __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED)) < run->count) {
+		job = &run->jobs[i];
+		job->result = fetcher_fetch(job->url, job->path, run->refresh);
+
+		switch (job->result) {
+		case FETCH_UPDATED:
+			metrics_inc(METRIC_FETCH, "updated");
+			break;
+		case FETCH_UNCHANGED:
+			metrics_inc(METRIC_FETCH, "unchanged");
+			break;
+		case FETCH_DEDUPED:
+			metrics_inc(METRIC_FETCH, "deduped");
+			break;
+		case FETCH_FAILED:
+			metrics_inc(METRIC_FETCH, "failed");
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/** Fetches every job, with up to FETCHER_PARALLEL in flight, and waits for them all.
+ *  @return the number of jobs that failed
+ */
+int
+fetcher_run(t_fetch_job *jobs, int count, int refresh)
+{
+	pthread_t workers[FETCHER_PARALLEL];
+	t_fetch_run run;
+	int started = 0;
+	int failed = 0;
+	int i;
+
+	run.jobs = jobs;
+	run.count = count;
+	run.refresh = refresh;
+	run.next = 0;
+
+	for (i = 0; i < FETCHER_PARALLEL && i < count; i++) {
+		if (pthread_create(&workers[started], NULL, _fetch_worker, &run) == 0) {
+			started++;
+		}
+	}
+
+	// Without any worker, do the jobs here
+	if (started == 0) {
+		_fetch_worker(&run);
+	}
+
+	for (i = 0; i < started; i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+	for (i = 0; i < count; i++) {
+		if (jobs[i].result == FETCH_FAILED) {
+			failed++;
+		}
+	}
+
+	return failed;
+}
+
+static void *
+_fetch_thread(void *arg)
+{
+	t_fetch_run *run = arg;
+	int failed;
+	int i;
+
+	failed = fetcher_run(run->jobs, run->count, run->refresh);
+	debug(LOG_INFO, "Fetcher: %d remote(s) checked, %d failed", run->count, failed);
+
+	for (i = 0; i < run->count; i++) {
+		free(run->jobs[i].url);
+		free(run->jobs[i].path);
+	}
+
+	free(run->jobs);
+	free(run);
+	__atomic_store_n(&fetcher_busy, 0, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static int
+_fetch_is_http(const char *entry)
+{
+	const char *url = strchr(entry, '=');
+
+	return url && strncasecmp(url + 1, "http://", 7) == 0;
+}
+
+/* Adds a job for an entry such as "logo_png=http://example.com/logo.png",
+ * saved as dir/logo.png, as the get_image_file and get_data_file library functions name it.
+ */
+static void
+_fetch_add_job(t_fetch_run *run, const char *entry, const char *dir, int refresh)
+{
+	const char *url = strchr(entry, '=');
+	const char *ext;
+	t_fetch_job *job;
+	struct stat st;
+	char *path;
+
+	ext = memrchr(entry, '_', url - entry);
+
+	if (!ext || ext == entry || ext + 1 == url) {
+		debug(LOG_WARNING, "Fetcher: cannot name a file for [%s] - skipping", entry);
+		return;
+	}
+
+	safe_asprintf(&path, "%s/%.*s.%.*s", dir, (int)(ext - entry), entry, (int)(url - ext - 1), ext + 1);
+
+	if (refresh == 0 && stat(path, &st) == 0) {
+		free(path);
+		return;
+	}
+
+	job = &run->jobs[run->count++];
+	job->url = safe_strdup(url + 1);
+	job->path = path;
+	job->result = FETCH_SKIPPED;
+}
+
+/** Starts a background fetch of the http custom images and files, unless one is running.
+ *  Images go to the ndsremote directory of the tmpfs, linked from the webroot, files to ndsdata.
+ *  @return 0, or -1 if the thread could not be started
+ */
+int
+fetcher_start(int refresh)
+{
+	s_config *config = config_get_config();
+	t_FASIMG *image;
+	t_FASFILE *file;
+	t_fetch_run *run;
+	pthread_t tid;
+	struct stat st;
+	char *images;
+	char *files;
+	char *link;
+	int i = 0;
+
+	safe_asprintf(&images, "%s/ndsremote", config->tmpfsmountpoint);
+	safe_asprintf(&files, "%s/ndsdata", config->tmpfsmountpoint);
+	mkdir(images, 0755);
+	mkdir(files, 0755);
+
+	safe_asprintf(&link, "%s/ndsremote", config->webroot);
+
+	if (lstat(link, &st) != 0 && symlink(images, link) != 0) {
+		debug(LOG_ERR, "Fetcher: cannot link [%s] to [%s]: %s", link, images, strerror(errno));
+	}
+
+	free(link);
+
+	run = safe_calloc(sizeof(t_fetch_run));
+	run->refresh = refresh;
+
+	for (image = config->fas_custom_images_list; image; image = image->next) {
+		i++;
+	}
+
+	for (file = config->fas_custom_files_list; file; file = file->next) {
+		i++;
+	}
+
+	run->jobs = safe_calloc((i + 1) * sizeof(t_fetch_job));
+
+	for (image = config->fas_custom_images_list; image; image = image->next) {
+		if (_fetch_is_http(image->fasimg)) {
+			_fetch_add_job(run, image->fasimg, images, refresh);
+		}
+	}
+
+	for (file = config->fas_custom_files_list; file; file = file->next) {
+		if (_fetch_is_http(file->fasfile)) {
+			_fetch_add_job(run, file->fasfile, files, refresh);
+		}
+	}
+
+	free(images);
+	free(files);
+
+	if (run->count > 0 && __atomic_exchange_n(&fetcher_busy, 1, __ATOMIC_ACQUIRE) == 0) {
+		if (pthread_create(&tid, NULL, _fetch_thread, run) == 0) {
+			pthread_detach(tid);
+			return 0;
+		}
+
+		debug(LOG_ERR, "Fetcher: cannot start thread");
+		__atomic_store_n(&fetcher_busy, 0, __ATOMIC_RELEASE);
+	} else if (run->count > 0) {
+		debug(LOG_DEBUG, "Fetcher: previous fetch still running");
+	}
+
+	for (i = 0; i < run->count; i++) {
+		free(run->jobs[i].url);
+		free(run->jobs[i].path);
+	}
+
+	free(run->jobs);
+	free(run);
+	return 0;
+}
+
+/** The entries of list not fetched here, each followed by a separator as the download library call expects.
+ *  @return a string to free, or NULL if there are none
+ */
+char *
+fetcher_script_list(const char *list)
+{
+	char *copy;
+	char *next;
+	char *entry;
+	char *rest = NULL;
+	char *joined;
+
+	if (!list) {
+		return NULL;
+	}
+
+	copy = safe_strdup(list);
+
+	for (next = copy; next; ) {
+		entry = next;
+		next = strstr(next, QUERYSEPARATOR);
+
+		if (next) {
+			*next = '\0';
+			next += strlen(QUERYSEPARATOR);
+		}
+
+		if (*entry == '\0' || _fetch_is_http(entry)) {
+			continue;
+		}
+
+		safe_asprintf(&joined, "%s%s%s", rest ? rest : "", entry, QUERYSEPARATOR);
+		free(rest);
+		rest = joined;
+	}
+
+	free(copy);
+	return rest;
+}
@@ -0,0 +1,67 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file fetcher.h
+    @brief Fetches the themespec remote images and files over http, revalidating them with conditional requests
+    @author Copyright (C) 2015-2025 Modifications and additions by BlueWave Projects and Services <opennds@blue-wave.net>
+*/
+
+#ifndef _FETCHER_H_
+#define _FETCHER_H_
+
+/** Downloads run at once */
+#define FETCHER_PARALLEL 4
+/** Milliseconds a connection may wait for the server at any step, as wget -T 4 */
+#define FETCHER_TIMEOUT_MS 4000
+/** Redirects followed, to http urls only */
+#define FETCHER_MAX_REDIRECTS 5
+/** Largest file accepted, the tmpfs is small */
+#define FETCHER_MAX_SIZE (8 * 1024 * 1024)
+/** Room for the status line and headers of a response */
+#define FETCHER_HEADER_MAX 8192
+
+/** Outcome of a fetch */
+enum {
+	FETCH_FAILED = -1,		/**< @brief The file in place, if any, is kept */
+	FETCH_SKIPPED = 0,		/**< @brief Present, and only missing files were asked for */
+	FETCH_UPDATED,			/**< @brief New content renamed into place */
+	FETCH_UNCHANGED,		/**< @brief The server answered 304 Not Modified */
+	FETCH_DEDUPED			/**< @brief Downloaded again, but the content was the same */
+};
+
+typedef struct {
+	char *url;
+	char *path;			/**< @brief Destination, replaced by rename() */
+	int result;			/**< @brief Set by fetcher_run() */
+} t_fetch_job;
+
+/** @brief Fetch one url to path. With refresh 0 a present file is left alone, otherwise it is revalidated */
+int fetcher_fetch(const char *url, const char *path, int refresh);
+
+/** @brief Fetch every job, FETCHER_PARALLEL at a time. Returns the number that failed */
+int fetcher_run(t_fetch_job *jobs, int count, int refresh);
+
+/** @brief Fetch the http custom images and files of the config in the background */
+int fetcher_start(int refresh);
+
+/** @brief The entries of a custom images or files string that are not http, left to the download library call, or NULL */
+char *fetcher_script_list(const char *list);
+
+#endif /* _FETCHER_H_ */
@@ -34,6 +34,7 @@
 #include <syslog.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
 #include <pthread.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -48,6 +49,7 @@
 #include "fw_iptables.h"
 #include "debug.h"
 #include "util.h"
+#include "metrics.h"
 
 static int _iptables_init_marks(void);
 
@@ -61,6 +63,16 @@ unsigned int FW_MARK_MASK;		// @brief nftables mask: bitwise or of the others
 extern pthread_mutex_t client_list_mutex;
 extern pthread_mutex_t config_mutex;
 
+/** @internal Serializes the writers of the address and client counters */
+static pthread_mutex_t counters_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** @internal One address and its counters, as read from a client chain */
+typedef struct {
+	char ip[CLIENT_IP_LEN];
+	unsigned long long int bytes;
+	unsigned long long int packets;
+} t_fw_reading;
+
 // Make nonzero to supress the error output of the firewall during destruction.
 static int fw_quiet = 0;
 
@@ -70,6 +82,39 @@ static const char* markop = "--set-mark";
 // Used to configure use of mark mask, or not
 static const char* markmask = "";
 
+/* A firewall batch, see iptables_fw_batch_begin().
+ * Kept per thread so only the changes made by the batching thread are collected.
+ */
+typedef struct {
+	int active;
+	FILE *nft;		// nft commands of the transaction
+	char *nft_buf;
+	size_t nft_len;
+	FILE *scripts;		// libopennds.sh commands to run once the transaction is applied
+	char *scripts_buf;
+	size_t scripts_len;
+	char **auth_ips;	// clients given rules in this batch
+	int auth_count;
+	int auth_size;
+	char **deauth_ips;	// clients whose rules are to be deleted
+	int deauth_count;
+	int deauth_size;
+	int counted;		// the counters have been read since the batch was opened
+} t_fw_batch;
+
+static __thread t_fw_batch fw_batch;
+
+// The per client chains, as searched by delete_client_rule in libopennds.sh
+static const struct {
+	const char *table;
+	const char *chain;
+} client_chains[] = {
+	{ "nds_mangle", CHAIN_OUTGOING },
+	{ "nds_filter", CHAIN_UPLOAD_RATE },
+	{ "nds_mangle", CHAIN_INCOMING },
+	{ "nds_mangle", CHAIN_DOWNLOAD_RATE }
+};
+
 // Return a string representing a connection state
 const char *
 fw_connection_state_as_string(int mark)
@@ -140,11 +185,18 @@ nftables_do_command(const char *format, ...)
 	char *fmt_cmd = NULL;
 	int rc;
 	int i;
+	double started = metrics_now();
 
 	va_start(vlist, format);
 	safe_vasprintf(&fmt_cmd, format, vlist);
 	va_end(vlist);
 
+	if (fw_batch.active) {
+		fprintf(fw_batch.nft, "%s\n", fmt_cmd);
+		free(fmt_cmd);
+		return 0;
+	}
+
 	for (i = 0; i < 5; i++) {
 
 		rc = execute("nft %s", fmt_cmd);
@@ -160,10 +212,300 @@ nftables_do_command(const char *format, ...)
 	}
 
 	free(fmt_cmd);
+	metrics_observe(METRIC_NFT, NULL, metrics_now() - started);
+
+	return rc;
+}
+
+static int
+_fw_batch_compare(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int
+_fw_batch_has_ip(char **ips, int count, const char *ip)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (strcmp(ips[i], ip) == 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void
+_fw_batch_add_ip(char ***ips, int *count, int *size, const char *ip)
+{
+	char **grown;
+
+	if (_fw_batch_has_ip(*ips, *count, ip)) {
+		return;
+	}
+
+	if (*count == *size) {
+		*size = *size ? *size * 2 : 16;
+		grown = safe_calloc(*size * sizeof(char *));
+
+		if (*ips) {
+			memcpy(grown, *ips, *count * sizeof(char *));
+			free(*ips);
+		}
+
+		*ips = grown;
+	}
+
+	(*ips)[(*count)++] = safe_strdup(ip);
+}
+
+static void
+_fw_batch_free_ips(char **ips, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		free(ips[i]);
+	}
+
+	free(ips);
+}
+
+static void
+_fw_batch_open(void)
+{
+	memset(&fw_batch, 0, sizeof(fw_batch));
+	fw_batch.nft = open_memstream(&fw_batch.nft_buf, &fw_batch.nft_len);
+	fw_batch.scripts = open_memstream(&fw_batch.scripts_buf, &fw_batch.scripts_len);
+
+	if (!fw_batch.nft || !fw_batch.scripts) {
+		debug(LOG_CRIT, "open_memstream(): %s. Bailing out.", strerror(errno));
+		exit(1);
+	}
+
+	fw_batch.active = 1;
+}
+
+/* Apply a list of nft commands as one transaction with "nft -f".
+ * nft applies a file atomically, so if anything in it fails nothing is changed
+ * and the commands are repeated one at a time, as they would have been unbatched.
+ */
+static int
+_fw_batch_apply(const char *commands, size_t len)
+{
+	char *path;
+	char *line;
+	char *next;
+	int fd;
+	int rc;
+	ssize_t written;
+	double started;
+	s_config *config;
+
+	if (len == 0) {
+		return 0;
+	}
+
+	config = config_get_config();
+	safe_asprintf(&path, "%s/ndsbatch.XXXXXX", config->tmpfsmountpoint);
+	fd = mkstemp(path);
+
+	if (fd < 0) {
+		debug(LOG_ERR, "mkstemp(): %s", strerror(errno));
+		rc = -1;
+	} else {
+		written = write(fd, commands, len);
+		close(fd);
+
+		started = metrics_now();
+		rc = (written == (ssize_t)len) ? execute("nft -f %s", path) : -1;
+		metrics_observe(METRIC_NFT, NULL, metrics_now() - started);
+		unlink(path);
+	}
+
+	free(path);
+
+	if (rc == 0) {
+		return 0;
+	}
+
+	debug(LOG_WARNING, "nftables transaction failed [ %d ], applying its commands one at a time", rc);
+
+	line = safe_strdup(commands);
+	rc = 0;
+
+	for (next = line; next && *next; ) {
+		char *command = strsep(&next, "\n");
+
+		if (*command) {
+			rc |= nftables_do_command("%s", command);
+		}
+	}
+
+	free(line);
+	return rc;
+}
+
+/* Build the deletions for the rules of all clients deauthenticated in the batch.
+ * Each chain is listed once and a rule is selected when any of its words is one of
+ * the addresses, as the "grep -w" in delete_client_rule does.
+ */
+static int
+_fw_batch_delete_rules(FILE *deletions, char **ips, int count)
+{
+	FILE *output;
+	char *script;
+	char *line = NULL;
+	char *copy;
+	char *word;
+	char *next;
+	char *handle;
+	size_t size = 0;
+	int i;
+	int rc = 0;
+
+	qsort(ips, count, sizeof(char *), _fw_batch_compare);
+
+	for (i = 0; i < sizeof(client_chains) / sizeof(client_chains[0]); i++) {
+		safe_asprintf(&script, "nft -a list chain inet %s %s 2>/dev/null", client_chains[i].table, client_chains[i].chain);
+		output = popen(script, "r");
+		free(script);
 
+		if (!output) {
+			debug(LOG_ERR, "popen(): %s", strerror(errno));
+			rc = -1;
+			continue;
+		}
+
+		while (getline(&line, &size, output) != -1) {
+			handle = strstr(line, "# handle ");
+
+			if (!handle) {
+				continue;
+			}
+
+			*handle = '\0';
+			handle += strlen("# handle ");
+			handle[strcspn(handle, " \t\r\n")] = '\0';
+			copy = line;
+
+			for (next = copy; next; ) {
+				word = strsep(&next, " \t");
+
+				if (*word && bsearch(&word, ips, count, sizeof(char *), _fw_batch_compare)) {
+					fprintf(deletions, "delete rule inet %s %s handle %s\n", client_chains[i].table, client_chains[i].chain, handle);
+					break;
+				}
+			}
+		}
+
+		pclose(output);
+	}
+
+	free(line);
 	return rc;
 }
 
+// Apply everything collected so far, then go on collecting if reopen is set
+static int
+_fw_batch_flush(int reopen)
+{
+	FILE *deletions;
+	char *deletions_buf = NULL;
+	size_t deletions_len = 0;
+	char *next;
+	int rc = 0;
+	t_fw_batch done;
+
+	fclose(fw_batch.nft);
+	fclose(fw_batch.scripts);
+	done = fw_batch;
+
+	// Anything done from here on is applied directly
+	memset(&fw_batch, 0, sizeof(fw_batch));
+
+	rc |= _fw_batch_apply(done.nft_buf, done.nft_len);
+
+	if (done.deauth_count > 0) {
+		deletions = open_memstream(&deletions_buf, &deletions_len);
+
+		if (deletions) {
+			rc |= _fw_batch_delete_rules(deletions, done.deauth_ips, done.deauth_count);
+			fclose(deletions);
+			rc |= _fw_batch_apply(deletions_buf, deletions_len);
+			free(deletions_buf);
+		} else {
+			debug(LOG_ERR, "open_memstream(): %s", strerror(errno));
+			rc = -1;
+		}
+	}
+
+	for (next = done.scripts_buf; next && *next; ) {
+		char *command = strsep(&next, "\n");
+
+		if (*command) {
+			rc |= execute("%s", command);
+		}
+	}
+
+	debug(LOG_INFO, "Firewall batch applied: %d authenticated, %d deauthenticated, rc [ %d ]",
+		done.auth_count, done.deauth_count, rc);
+
+	free(done.nft_buf);
+	free(done.scripts_buf);
+	_fw_batch_free_ips(done.auth_ips, done.auth_count);
+	_fw_batch_free_ips(done.deauth_ips, done.deauth_count);
+
+	if (reopen) {
+		_fw_batch_open();
+	}
+
+	return rc;
+}
+
+/** @brief Start collecting firewall changes made by this thread
+ *
+ * Until iptables_fw_batch_commit(), the nft commands of iptables_fw_authenticate() and
+ * iptables_fw_deauthenticate() are collected and applied as one nft transaction, rate limit
+ * rule updates are run after it, and the counters are read once, before any rule is deleted.
+ * @return 1 if a batch was started, 0 if one was already being collected
+ */
+int
+iptables_fw_batch_begin(void)
+{
+	if (fw_batch.active) {
+		return 0;
+	}
+
+	_fw_batch_open();
+	return 1;
+}
+
+/** @brief Apply the firewall changes collected since iptables_fw_batch_begin() */
+int
+iptables_fw_batch_commit(void)
+{
+	if (!fw_batch.active) {
+		return 0;
+	}
+
+	return _fw_batch_flush(0);
+}
+
+// Run a client rule script now, or after the transaction of the current batch
+static int
+_fw_client_script(const char *command)
+{
+	if (fw_batch.active) {
+		fprintf(fw_batch.scripts, "%s\n", command);
+		return 0;
+	}
+
+	return execute("%s", command);
+}
+
 int
 iptables_trust_mac(const char mac[])
 {
@@ -233,6 +575,9 @@ iptables_fw_init(void)
 	gw_iprange = safe_strdup(config->gw_iprange);    // must free
 
 	gw_port = config->gw_port;
+
+	// Walked after the lock is released, ndsctl trust may replace the list meanwhile
+	config_read_begin();
 	pt = config->trustedmaclist;
 	FW_MARK_TRUSTED = config->fw_mark_trusted;
 	FW_MARK_AUTHENTICATED = config->fw_mark_authenticated;
@@ -269,12 +614,35 @@ iptables_fw_init(void)
 		rc |= iptables_trust_mac(pt->mac);
 	}
 
+	config_read_end();
+
 	/*
 	 *
 	 * End of mangle table chains and rules
 	 **************************************
 	 */
 
+	/* Remote FAS addresses, kept up to date by the resolver thread as its FQDN resolves to new ones.
+	 * The set is seeded here so the FAS is reachable at once.
+	 */
+	if (fas_port != 0 && strcmp(fas_remotefqdn, "disabled") != 0) {
+		fqdncmd = safe_calloc(SMALL_BUF);
+		safe_snprintf(fqdncmd, SMALL_BUF, "/usr/lib/opennds/libopennds.sh resolve_fqdn \"%s\"", fas_remotefqdn);
+		fqdnip = safe_calloc(SMALL_BUF);
+		rc |= nftables_do_command("add set inet nds_nat %s \"{ type ipv4_addr ; }\"", NFTSET_FAS);
+		rc |= nftables_do_command("add set inet nds_filter %s \"{ type ipv4_addr ; }\"", NFTSET_FAS);
+
+		if (execute_ret_url_encoded(fqdnip, SMALL_BUF, fqdncmd) != 0 || strcmp(fqdnip, "") == 0) {
+			debug(LOG_WARNING, "Unable to resolve fas_remotefqdn [ %s ], leaving it to the resolver", fas_remotefqdn);
+		} else {
+			rc |= nftables_do_command("add element inet nds_nat %s { %s }", NFTSET_FAS, fqdnip);
+			rc |= nftables_do_command("add element inet nds_filter %s { %s }", NFTSET_FAS, fqdnip);
+		}
+
+		free(fqdncmd);
+		free(fqdnip);
+	}
+
 	/*
 	 *
 	 **************************************
@@ -300,14 +668,7 @@ iptables_fw_init(void)
 		// Allow access to remote FAS - CHAIN_OUTGOING and CHAIN_TO_INTERNET packets for remote FAS, ACCEPT
 		if (config->fas_port != 0) {
 			if (strcmp(config->fas_remotefqdn, "disabled") != 0) {
-
-				fqdncmd = safe_calloc(SMALL_BUF);
-				safe_snprintf(fqdncmd, SMALL_BUF, "/usr/lib/opennds/libopennds.sh resolve_fqdn \"%s\"", fas_remotefqdn);
-				fqdnip = safe_calloc(SMALL_BUF);
-				rc = execute_ret_url_encoded(fqdnip, SMALL_BUF, fqdncmd);
-				rc |= nftables_do_command("add rule inet nds_nat %s ip daddr %s tcp dport %d counter accept", CHAIN_OUTGOING, fqdnip, fas_port);
-				free(fqdncmd);
-				// do not free(fqdnip) just yet, we will need it again shortly
+				rc |= nftables_do_command("add rule inet nds_nat %s ip daddr @%s tcp dport %d counter accept", CHAIN_OUTGOING, NFTSET_FAS, fas_port);
 			} else {
 
 				if (strcmp(config->fas_remoteip, "disabled") != 0) {
@@ -377,9 +738,7 @@ iptables_fw_init(void)
 
 	if (config->fas_port != 0) {
 		if (strcmp(config->fas_remotefqdn, "disabled") != 0) {
-			rc |= nftables_do_command("add rule inet nds_filter %s ip daddr %s tcp dport %d counter accept", CHAIN_TO_INTERNET, fqdnip, fas_port);
-			// Now we can free(fqdnip) as we are now finished with it
-			free(fqdnip);
+			rc |= nftables_do_command("add rule inet nds_filter %s ip daddr @%s tcp dport %d counter accept", CHAIN_TO_INTERNET, NFTSET_FAS, fas_port);
 		} else {
 
 			if (strcmp(config->fas_remoteip, "disabled") != 0) {
@@ -442,6 +801,31 @@ iptables_fw_init(void)
 	return rc;
 }
 
+/** Let clients reach a remote FAS FQDN enabled by a reload, when the rules set up at startup use its address.
+ * The nftset is created empty, for the resolver thread to fill, and the rules accepting it go in at
+ * the positions iptables_fw_init() gives them: after the trusted and authenticated returns of the
+ * nat chain, and after the invalid packet drop of the filter chain.
+ */
+int
+iptables_fw_fas_fqdn_enable(void)
+{
+	s_config *config;
+	int rc = 0;
+
+	config = config_get_config();
+
+	rc |= nftables_do_command("add set inet nds_nat %s \"{ type ipv4_addr ; }\"", NFTSET_FAS);
+	rc |= nftables_do_command("add set inet nds_filter %s \"{ type ipv4_addr ; }\"", NFTSET_FAS);
+
+	if (!config->ip6) {
+		rc |= nftables_do_command("add rule inet nds_nat %s index 1 ip daddr @%s tcp dport %d counter accept", CHAIN_OUTGOING, NFTSET_FAS, config->fas_port);
+	}
+
+	rc |= nftables_do_command("add rule inet nds_filter %s index 0 ip daddr @%s tcp dport %d counter accept", CHAIN_TO_INTERNET, NFTSET_FAS, config->fas_port);
+
+	return rc;
+}
+
 /** Remove the firewall rules
  * This is used when we do a clean shutdown of opennds,
  * and when it starts, to make sure there are no rules left over from a crash
@@ -539,7 +923,7 @@ iptables_download_ratelimit_enable(t_client *client, int enable)
 			client->counters.incoming
 		);
 
-		rc = execute(libcommand);
+		rc = _fw_client_script(libcommand);
 		free(libcommand);
 
 	}
@@ -563,7 +947,7 @@ iptables_download_ratelimit_enable(t_client *client, int enable)
 			client->counters.incoming
 		);
 
-		rc = execute(libcommand);
+		rc = _fw_client_script(libcommand);
 		free(libcommand);
 
 		client->inc_packet_limit = packet_limit;
@@ -633,7 +1017,7 @@ iptables_upload_ratelimit_enable(t_client *client, int enable)
 			client->counters.outgoing
 		);
 
-		rc = execute(libcommand);
+		rc = _fw_client_script(libcommand);
 		free(libcommand);
 	}
 
@@ -655,7 +1039,7 @@ iptables_upload_ratelimit_enable(t_client *client, int enable)
 			client->counters.outgoing
 		);
 
-		rc = execute(libcommand);
+		rc = _fw_client_script(libcommand);
 		free(libcommand);
 
 		client->out_packet_limit = packet_limit;
@@ -665,24 +1049,67 @@ iptables_upload_ratelimit_enable(t_client *client, int enable)
 	return rc;
 }
 
-// Insert or delete firewall mangle rules marking a client's packets.
-int
-iptables_fw_authenticate(t_client *client)
+/* Add the rules marking and counting the packets of one address of a client.
+ * The counting rules start from the address's counters, zero unless restored.
+ */
+static int
+_iptables_fw_address_rules(t_client_addr *addr)
 {
 	int rc = 0;
+	const char *family;
+	t_client *client = addr->client;
 
-	debug(LOG_NOTICE, "Authenticating %s %s", client->ip, client->mac);
+	family = strchr(addr->text, ':') ? "ip6" : "ip";
+
+	if (fw_batch.active) {
+		// Rules of this address are to be deleted earlier in the batch
+		if (_fw_batch_has_ip(fw_batch.deauth_ips, fw_batch.deauth_count, addr->text)) {
+			rc |= _fw_batch_flush(1);
+		}
+
+		_fw_batch_add_ip(&fw_batch.auth_ips, &fw_batch.auth_count, &fw_batch.auth_size, addr->text);
+	}
 
 	// This rule is for marking upload (outgoing) packets, and for upload byte accounting. Drop all bucket overflow packets
-	rc |= nftables_do_command("insert rule inet nds_mangle %s ip saddr %s ether saddr %s counter meta mark set mark or 0x%x", CHAIN_OUTGOING, client->ip, client->mac, FW_MARK_AUTHENTICATED);
-	rc |= nftables_do_command("add rule inet nds_filter %s ip saddr %s counter return", CHAIN_UPLOAD_RATE, client->ip);
-	rc |= nftables_do_command("add rule inet nds_filter %s ip saddr %s counter drop", CHAIN_UPLOAD_RATE, client->ip);
+	rc |= nftables_do_command("insert rule inet nds_mangle %s %s saddr %s ether saddr %s counter packets %llu bytes %llu meta mark set mark or 0x%x",
+		CHAIN_OUTGOING, family, addr->text, client->mac, addr->outpackets, addr->outgoing, FW_MARK_AUTHENTICATED);
+	rc |= nftables_do_command("add rule inet nds_filter %s %s saddr %s counter return", CHAIN_UPLOAD_RATE, family, addr->text);
+	rc |= nftables_do_command("add rule inet nds_filter %s %s saddr %s counter drop", CHAIN_UPLOAD_RATE, family, addr->text);
 
 	// This rule is just for download (incoming) byte accounting. Drop all bucket overflow packets
-	rc |= nftables_do_command("insert rule inet nds_mangle %s ip daddr %s counter meta mark set mark or 0x%x", CHAIN_INCOMING, client->ip, FW_MARK_AUTHENTICATED);
-	rc |= nftables_do_command("add rule inet nds_mangle %s ip daddr %s counter return", CHAIN_DOWNLOAD_RATE, client->ip);
-	rc |= nftables_do_command("add rule inet nds_mangle %s ip daddr %s counter drop", CHAIN_DOWNLOAD_RATE, client->ip);
+	rc |= nftables_do_command("insert rule inet nds_mangle %s %s daddr %s counter packets %llu bytes %llu meta mark set mark or 0x%x",
+		CHAIN_INCOMING, family, addr->text, addr->inpackets, addr->incoming, FW_MARK_AUTHENTICATED);
+	rc |= nftables_do_command("add rule inet nds_mangle %s %s daddr %s counter return", CHAIN_DOWNLOAD_RATE, family, addr->text);
+	rc |= nftables_do_command("add rule inet nds_mangle %s %s daddr %s counter drop", CHAIN_DOWNLOAD_RATE, family, addr->text);
 
+	return rc;
+}
+
+// Add the rules of every address of a client
+static int
+_iptables_fw_client_rules(t_client *client)
+{
+	int rc = 0;
+	int i;
+
+	for (i = 0; i < client->addr_count; i++) {
+		if (!client->addrs[i].retired) {
+			rc |= _iptables_fw_address_rules(&client->addrs[i]);
+		}
+	}
+
+	return rc;
+}
+
+// Insert or delete firewall mangle rules marking a client's packets.
+int
+iptables_fw_authenticate(t_client *client)
+{
+	int i;
+
+	debug(LOG_NOTICE, "Authenticating %s %s", client->ip, client->mac);
+
+	pthread_mutex_lock(&counters_mutex);
 	client->counters.incoming = 0;
 	client->counters.incoming_previous = 0;
 	client->counters.outgoing = 0;
@@ -692,6 +1119,64 @@ iptables_fw_authenticate(t_client *client)
 	client->counters.outpackets = 0;
 	client->counters.outpackets_previous = 0;
 
+	for (i = 0; i < client->addr_count; i++) {
+		client->addrs[i].outgoing = 0;
+		client->addrs[i].outpackets = 0;
+		client->addrs[i].incoming = 0;
+		client->addrs[i].inpackets = 0;
+	}
+	pthread_mutex_unlock(&counters_mutex);
+
+	return _iptables_fw_client_rules(client);
+}
+
+// Add the rules of an address a client went on to use after it was authenticated
+int
+iptables_fw_authenticate_address(t_client_addr *addr)
+{
+	debug(LOG_NOTICE, "Authenticating address %s of %s %s", addr->text, addr->client->ip, addr->client->mac);
+
+	return _iptables_fw_address_rules(addr);
+}
+
+// Add the rules of a client authenticated before a restart, carrying on its counters
+int
+iptables_fw_restore(t_client *client)
+{
+	debug(LOG_INFO, "Restoring %s %s", client->ip, client->mac);
+
+	// The snapshot holds the totals, carried on by the first address
+	pthread_mutex_lock(&counters_mutex);
+	client->addrs[0].outgoing = client->counters.outgoing;
+	client->addrs[0].outpackets = client->counters.outpackets;
+	client->addrs[0].incoming = client->counters.incoming;
+	client->addrs[0].inpackets = client->counters.inpackets;
+	pthread_mutex_unlock(&counters_mutex);
+
+	return _iptables_fw_client_rules(client);
+}
+
+// Delete the rules marking and counting the packets of one address
+static int
+_iptables_fw_address_delete(const char *ip)
+{
+	int rc = 0;
+
+	if (fw_batch.active) {
+		// Rules added earlier in the batch must exist before they can be found and deleted
+		if (_fw_batch_has_ip(fw_batch.auth_ips, fw_batch.auth_count, ip)) {
+			rc |= _fw_batch_flush(1);
+		}
+
+		_fw_batch_add_ip(&fw_batch.deauth_ips, &fw_batch.deauth_count, &fw_batch.deauth_size, ip);
+		return rc;
+	}
+
+	rc = execute("/usr/lib/opennds/libopennds.sh delete_client_rule nds_mangle \"%s\" all \"%s\"", CHAIN_OUTGOING, ip);
+	rc = execute("/usr/lib/opennds/libopennds.sh delete_client_rule nds_filter \"%s\" all \"%s\"", CHAIN_UPLOAD_RATE, ip);
+	rc = execute("/usr/lib/opennds/libopennds.sh delete_client_rule nds_mangle \"%s\" all \"%s\"", CHAIN_INCOMING, ip);
+	rc = execute("/usr/lib/opennds/libopennds.sh delete_client_rule nds_mangle \"%s\" all \"%s\"", CHAIN_DOWNLOAD_RATE, ip);
+
 	return rc;
 }
 
@@ -699,18 +1184,34 @@ int
 iptables_fw_deauthenticate(t_client *client)
 {
 	int rc = 0;
+	int i;
 
 	// Remove the authentication rules.
 	debug(LOG_NOTICE, "Deauthenticating %s %s", client->ip, client->mac);
 
-	rc = execute("/usr/lib/opennds/libopennds.sh delete_client_rule nds_mangle \"%s\" all \"%s\"", CHAIN_OUTGOING, client->ip);
-	rc = execute("/usr/lib/opennds/libopennds.sh delete_client_rule nds_filter \"%s\" all \"%s\"", CHAIN_UPLOAD_RATE, client->ip);
-	rc = execute("/usr/lib/opennds/libopennds.sh delete_client_rule nds_mangle \"%s\" all \"%s\"", CHAIN_INCOMING, client->ip);
-	rc = execute("/usr/lib/opennds/libopennds.sh delete_client_rule nds_mangle \"%s\" all \"%s\"", CHAIN_DOWNLOAD_RATE, client->ip);
+	// Outside a batch the counters are as fresh as the last refresh, in one they are read before the rules go
+	if (fw_batch.active && iptables_fw_counters_update() != 0) {
+		debug(LOG_WARNING, "Could not read the final counters of %s", client->ip);
+	}
+
+	for (i = 0; i < client->addr_count; i++) {
+		// The rules of a retired address went when it was replaced
+		if (!client->addrs[i].retired) {
+			rc |= _iptables_fw_address_delete(client->addrs[i].text);
+		}
+	}
 
 	return rc;
 }
 
+// Delete the rules of an address a client no longer uses, leaving the others
+int
+iptables_fw_deauthenticate_address(t_client_addr *addr)
+{
+	debug(LOG_NOTICE, "Deauthenticating address %s of %s %s", addr->text, addr->client->ip, addr->client->mac);
+
+	return _iptables_fw_address_delete(addr->text);
+}
 // Return the total upload usage in bytes
 unsigned long long int
 iptables_fw_total_upload()
@@ -787,27 +1288,36 @@ iptables_fw_total_download()
 	return 0;
 }
 
-// Update the counters of all the clients in the client list
-int
-iptables_fw_counters_update(void)
+/* Read the counters of the client rules in a chain into a list of readings, one per address.
+ * A rule is eg "ip6 saddr fd00::5 ether saddr 1c:2b:3a:4d:5e:6f counter packets 12 bytes 3456 meta mark set meta mark | 0x00000200",
+ * picked out by its words rather than their positions, so IPv4 and IPv6 rules are read alike.
+ */
+static int
+_iptables_fw_read_counters(const char *chain, int outgoing, t_fw_reading **readings, int *count)
 {
 	FILE *output;
 	char *script;
-	char ip[INET6_ADDRSTRLEN];
-	char target[MAX_BUF];
-	int rc;
-	int af;
-	s_config *config;
+	char *line = NULL;
+	char *next;
+	char *word;
+	char *prev;
+	char *last;
+	char *ip;
+	size_t size = 0;
+	int have_packets;
+	int have_bytes;
 	unsigned long long int counter;
 	unsigned long long int packets;
-	t_client *p1;
-	struct sockaddr_storage tempaddr;
+	unsigned char tempaddr[sizeof(struct in6_addr)];
+	t_fw_reading *grown;
+	int allocated = 0;
+	s_config *config;
 
 	config = config_get_config();
-	af = config->ip6 ? AF_INET6 : AF_INET;
+	*readings = NULL;
+	*count = 0;
 
-	// Look for outgoing (upload) traffic of authenticated clients.
-	safe_asprintf(&script, "nft list chain inet nds_mangle %s 2>/dev/null", CHAIN_OUTGOING);
+	safe_asprintf(&script, "nft list chain inet nds_mangle %s 2>/dev/null", chain);
 	output = popen(script, "r");
 	free(script);
 
@@ -816,105 +1326,187 @@ iptables_fw_counters_update(void)
 		return -1;
 	}
 
-	// skip the first two lines
-	while (('\n' != fgetc(output)) && !feof(output)) {}
-	while (('\n' != fgetc(output)) && !feof(output)) {}
-
-	while (!feof(output)) {
-		rc = fscanf(output, " %*s %*s %15[0-9.] %*s %*s %*s %*s %*s %llu %*s %llu  %*s %*s %*s %*s %*s %*s %s", ip, &packets, &counter, target);
+	while (getline(&line, &size, output) != -1) {
+		ip = NULL;
+		prev = "";
+		last = "";
+		have_packets = 0;
+		have_bytes = 0;
+		counter = 0;
+		packets = 0;
 
-		// eat rest of line
-		while (('\n' != fgetc(output)) && !feof(output)) {}
+		for (next = line; next; ) {
+			word = strsep(&next, " \t\r\n");
 
-		if (4 == rc && !strcmp(target, config->authentication_mark)) {
-			// Sanity
-			if (!inet_pton(af, ip, &tempaddr)) {
-				debug(LOG_WARNING, "I was supposed to read an IP address but instead got [%s] - ignoring it", ip);
+			if (!*word) {
 				continue;
 			}
 
-			if (strcmp(ip, "0.0.0.0") == 0) {
-				continue;
+			if (!ip && (!strcmp(word, outgoing ? "saddr" : "daddr")) && (!strcmp(prev, "ip") || !strcmp(prev, "ip6"))) {
+				ip = next ? strsep(&next, " \t\r\n") : NULL;
+				word = ip ? ip : word;
+			} else if (!strcmp(prev, "packets")) {
+				have_packets = sscanf(word, "%llu", &packets) == 1;
+			} else if (!strcmp(prev, "bytes")) {
+				have_bytes = sscanf(word, "%llu", &counter) == 1;
 			}
 
+			prev = word;
+			last = word;
+		}
 
-			debug(LOG_DEBUG, "Read outgoing traffic for %s: Bytes=%llu, Packets=%llu", ip, counter, packets);
+		if (!ip || !have_packets || !have_bytes || strcmp(last, config->authentication_mark)) {
+			continue;
+		}
 
-			if ((p1 = client_list_find_by_ip(ip))) {
-				if (p1->counters.outgoing < counter) {
-					p1->counters.outgoing_previous = p1->counters.outgoing;
-					p1->counters.outgoing = counter;
-					p1->counters.outpackets_previous = p1->counters.outpackets;
-					p1->counters.outpackets = packets;
-					p1->counters.last_updated = time(NULL);
+		// Sanity
+		if (inet_pton(AF_INET, ip, tempaddr) != 1 && inet_pton(AF_INET6, ip, tempaddr) != 1) {
+			debug(LOG_WARNING, "I was supposed to read an IP address but instead got [%s] - ignoring it", ip);
+			continue;
+		}
 
-					debug(LOG_DEBUG, "%s - Updated counter.outgoing to %llu bytes, packets=%llu.  Updated last_updated to %d",
-						ip,
-						counter,
-						packets,
-						p1->counters.last_updated
-					);
-				}
-			} else {
-				debug(LOG_WARNING, "Could not find %s in client list", ip);
+		if (strcmp(ip, "0.0.0.0") == 0) {
+			continue;
+		}
+
+		debug(LOG_DEBUG, "Read %s traffic for %s: Bytes=%llu, Packets=%llu", outgoing ? "outgoing" : "incoming", ip, counter, packets);
+
+		if (*count == allocated) {
+			allocated = allocated ? allocated * 2 : 16;
+			if (!(grown = realloc(*readings, allocated * sizeof(t_fw_reading)))) {
+				debug(LOG_CRIT, "Failed to allocate counter readings - exiting");
+				exit(1);
 			}
+			*readings = grown;
 		}
+
+		strncpy((*readings)[*count].ip, ip, CLIENT_IP_LEN - 1);
+		(*readings)[*count].ip[CLIENT_IP_LEN - 1] = '\0';
+		(*readings)[*count].bytes = counter;
+		(*readings)[*count].packets = packets;
+		(*count)++;
 	}
+
+	free(line);
 	pclose(output);
 
-	// Look for incoming (download) traffic
-	safe_asprintf(&script, "nft list chain inet nds_mangle %s 2>/dev/null", CHAIN_INCOMING);
-	output = popen(script, "r");
-	free(script);
+	return 0;
+}
 
-	if (!output) {
-		debug(LOG_ERR, "popen(): %s", strerror(errno));
+// Apply the readings of one chain to the addresses they count, with counters_mutex held
+static void
+_iptables_fw_apply_counters(const t_fw_reading *readings, int count, int outgoing)
+{
+	int i;
+	t_client_addr *addr;
+
+	for (i = 0; i < count; i++) {
+		if (!(addr = client_list_find_address(readings[i].ip))) {
+			debug(LOG_WARNING, "Could not find %s in client list", readings[i].ip);
+			continue;
+		}
+
+		if (outgoing) {
+			addr->outgoing = readings[i].bytes;
+			addr->outpackets = readings[i].packets;
+		} else {
+			addr->incoming = readings[i].bytes;
+			addr->inpackets = readings[i].packets;
+		}
+	}
+}
+
+// Update the counters of all the clients in the client list, each the sum of its addresses
+int
+iptables_fw_counters_update(void)
+{
+	int i;
+	int count;
+	int out_count;
+	int in_count;
+	unsigned long long int outgoing;
+	unsigned long long int outpackets;
+	unsigned long long int incoming;
+	unsigned long long int inpackets;
+	t_fw_reading *out_readings;
+	t_fw_reading *in_readings;
+	t_client *client;
+
+	/* Nothing in a batch reaches the firewall until it is applied,
+	 * so the counters read once at its start stay current throughout.
+	 */
+	if (fw_batch.active) {
+		if (fw_batch.counted) {
+			return 0;
+		}
+		fw_batch.counted = 1;
+	}
+
+	// Look for outgoing (upload) and incoming (download) traffic of authenticated clients
+	if (_iptables_fw_read_counters(CHAIN_OUTGOING, 1, &out_readings, &out_count) != 0) {
 		return -1;
 	}
 
-	// skip the first two lines
-	while (('\n' != fgetc(output)) && !feof(output)) {}
-	while (('\n' != fgetc(output)) && !feof(output)) {}
+	if (_iptables_fw_read_counters(CHAIN_INCOMING, 0, &in_readings, &in_count) != 0) {
+		free(out_readings);
+		return -1;
+	}
 
-	while (!feof(output)) {
-		rc = fscanf(output, " %*s %*s %15[0-9.] %*s %*s %llu %*s %llu  %*s %*s %*s %*s %*s %*s %s", ip, &packets, &counter, target);
+	/* Called with or without client_list_mutex, by the auth thread and the ndsctl workers at once,
+	 * so the read section keeps the clients valid and counters_mutex keeps their writers apart.
+	 */
+	READ_LOCK_CLIENT_LIST();
+	pthread_mutex_lock(&counters_mutex);
 
-		// eat rest of line
-		while (('\n' != fgetc(output)) && !feof(output)) {}
+	_iptables_fw_apply_counters(out_readings, out_count, 1);
+	_iptables_fw_apply_counters(in_readings, in_count, 0);
 
-		// Sanity check
-		if (4 == rc && !strcmp(target, config->authentication_mark)) {
+	for (client = client_get_first_client(); client; client = client_get_next_client(client)) {
+		outgoing = outpackets = incoming = inpackets = 0;
+		count = client_list_address_count(client);
 
-			if (!inet_pton(af, ip, &tempaddr)) {
-				debug(LOG_WARNING, "I was supposed to read an IP address but instead got [%s] - ignoring it", ip);
-				continue;
-			}
+		for (i = 0; i < count; i++) {
+			outgoing += client->addrs[i].outgoing;
+			outpackets += client->addrs[i].outpackets;
+			incoming += client->addrs[i].incoming;
+			inpackets += client->addrs[i].inpackets;
+		}
 
-			if (strcmp(ip, "0.0.0.0") == 0) {
-				continue;
-			}
+		if (client->counters.outgoing < outgoing) {
+			client->counters.outgoing_previous = client->counters.outgoing;
+			client->counters.outgoing = outgoing;
+			client->counters.outpackets_previous = client->counters.outpackets;
+			client->counters.outpackets = outpackets;
+			client->counters.last_updated = time(NULL);
+
+			debug(LOG_DEBUG, "%s - Updated counter.outgoing to %llu bytes, packets=%llu.  Updated last_updated to %d",
+				client->ip,
+				outgoing,
+				outpackets,
+				client->counters.last_updated
+			);
+		}
 
-			debug(LOG_DEBUG, "Read incoming traffic for %s: Bytes=%llu, Packets=%llu", ip, counter, packets);
-
-			if ((p1 = client_list_find_by_ip(ip))) {
-				if (p1->counters.incoming < counter) {
-					p1->counters.incoming_previous = p1->counters.incoming;
-					p1->counters.incoming = counter;
-					p1->counters.inpackets_previous = p1->counters.inpackets;
-					p1->counters.inpackets = packets;
-					debug(LOG_DEBUG, "%s - Updated counter.incoming to %llu bytes, packets=%llu.  Updated last_updated to %d",
-						ip,
-						counter,
-						packets,
-						p1->counters.last_updated
-					);
-				}
-			} else {
-				debug(LOG_WARNING, "Could not find %s in client list", ip);
-			}
+		if (client->counters.incoming < incoming) {
+			client->counters.incoming_previous = client->counters.incoming;
+			client->counters.incoming = incoming;
+			client->counters.inpackets_previous = client->counters.inpackets;
+			client->counters.inpackets = inpackets;
+
+			debug(LOG_DEBUG, "%s - Updated counter.incoming to %llu bytes, packets=%llu.  Updated last_updated to %d",
+				client->ip,
+				incoming,
+				inpackets,
+				client->counters.last_updated
+			);
 		}
 	}
-	pclose(output);
+
+	pthread_mutex_unlock(&counters_mutex);
+	READ_UNLOCK_CLIENT_LIST();
+
+	free(out_readings);
+	free(in_readings);
 
 	return 0;
 }
@@ -49,6 +49,9 @@
 #define CHAIN_DOWNLOAD_RATE  "ndsDLR"
 #define CHAIN_AUTHENTICATED     "ndsAUT"
 #define CHAIN_TRUSTED    "ndsTRU"
+
+/*@brief nftset of the remote FAS addresses, in the nds_nat and nds_filter tables */
+#define NFTSET_FAS "ndsfas"
 /*@}*/
 
 
@@ -63,6 +66,9 @@ extern unsigned int  FW_MARK_MASK;		/**< @brief nftables mask: bitwise or of the
 /** @brief Initialize the firewall */
 int iptables_fw_init(void);
 
+/** @brief Add the remote FAS nftset and its rules, for a FAS FQDN enabled by a reload */
+int iptables_fw_fas_fqdn_enable(void);
+
 /** @brief Destroy the firewall */
 int iptables_fw_destroy(void);
 
@@ -73,6 +79,15 @@ int create_client_ruleset(char rulesetname[], char ruleset[]);
 int iptables_fw_authenticate(t_client *client);
 int iptables_fw_deauthenticate(t_client *client);
 
+/** @brief Give another address of an authenticated client the same access */
+int iptables_fw_authenticate_address(t_client_addr *addr);
+
+/** @brief Remove the access of one address of a client */
+int iptables_fw_deauthenticate_address(t_client_addr *addr);
+
+/** @brief Restore the access of a client authenticated before a restart, with its counters */
+int iptables_fw_restore(t_client *client);
+
 /** @brief Enable/Disable Upload Rate Limiting of a specific client */
 int iptables_upload_ratelimit_enable(t_client *client, int enable);
 
@@ -94,6 +109,12 @@ const char *fw_connection_state_as_string(int mark);
 /** @brief Fork an nftables command */
 int nftables_do_command(const char format[], ...);
 
+/** @brief Collect this thread's client rule changes into one nftables transaction */
+int iptables_fw_batch_begin(void);
+
+/** @brief Apply the collected client rule changes */
+int iptables_fw_batch_commit(void);
+
 int iptables_trust_mac(const char mac[]);
 int iptables_untrust_mac(const char mac[]);
 
@@ -18,6 +18,7 @@
  * @author Copyright (C) 2015-2025 Modifications and additions by BlueWave Projects and Services <opennds@blue-wave.net>
  */
 
+#define _GNU_SOURCE
 
 #include <microhttpd.h>
 #include <syslog.h>
@@ -29,6 +30,7 @@
 #include <linux/limits.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
 
 #include "client_list.h"
 #include "conf.h"
@@ -41,6 +43,15 @@
 #include "mimetypes.h"
 #include "safe.h"
 #include "util.h"
+#include "webroot_cache.h"
+#include "metrics.h"
+#include "ndsctl_thread.h"
+#include "request_arena.h"
+#include "admission.h"
+#include "render_cache.h"
+#include "watchdog.h"
+
+extern pthread_mutex_t config_mutex;
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 
@@ -63,13 +74,88 @@ static int encode_and_redirect_to_splashpage(struct MHD_Connection *connection,
 static int redirect_to_splashpage(struct MHD_Connection *connection, t_client *client, const char *host, const char *url);
 static int send_error(struct MHD_Connection *connection, int error);
 static int send_redirect_temp(struct MHD_Connection *connection, t_client *client, const char *url);
+static char *build_redirect_body(const char *url, size_t *length);
+static int redirect_keeps_alive(struct MHD_Connection *connection, const char *url);
 static int is_foreign_hosts(struct MHD_Connection *connection, const char *host);
-static int get_query(struct MHD_Connection *connection, char **collect_query, const char *separator);
+static int check_authdir_match(const char *url, const char *authdir);
 static char *construct_querystring(struct MHD_Connection *connection, t_client *client, char *originurl, char *querystr);
-static const char *lookup_mimetype(const char *filename);
+static const struct query_template *get_query_template(void);
+static char *splashpage_url(const char *querystr);
+static const struct probe *probe_lookup(struct MHD_Connection *connection, const char *url);
+static int probe_fast_path(struct MHD_Connection *connection, const char *url, const char *ip, const struct probe *probe, int *ret);
+static int handle_client_request(struct MHD_Connection *connection, const char *url, const char *ip, double started);
+static int send_shed(struct MHD_Connection *connection, unsigned int status);
+static void request_completed_cb(void *cls, struct MHD_Connection *connection, void **ptr, enum MHD_RequestTerminationCode toe);
+static enum MHD_Result handle_request(struct MHD_Connection *connection, const char *url, const char *method);
 
 struct MHD_Daemon * webserver = NULL;
 
+// "http://<gw_address>/", the start of every url served by us, set by start_mhd()
+static char *gw_url = NULL;
+static size_t gw_url_len = 0;
+
+// The redirect page, split around the two copies of the url it carries
+static const char redirect_head[] = "<html><head></head><body><a href='";
+static const char redirect_mid[] = "'>Click here to continue to<br>";
+static const char redirect_tail[] = "</a></body></html>";
+
+/** @internal
+ * The parts of the FAS query string that depend only on the config, already formatted and encoded.
+ * construct_querystring() copies them in between the fields of the client.
+ */
+struct query_template {
+	unsigned int generation;	// of the config the template was built from, its address may be reused once freed
+	char *gw_mac;			// gateway mac when built, the watchdog may change it
+	const char *fields[5];		// tail fields when built, main() may set them after the web server starts
+	char *gw_url;			// url encoded gatewayurl
+	char *gateway;			// "gatewayname=...gatewaymac=..., "
+	size_t gateway_len;
+	char *authdir;			// "authdir=..., "
+	size_t authdir_len;
+	char *tail;			// "themespec=..., " and the custom parameters, variables, images and files
+	size_t tail_len;
+};
+
+// Replaced templates are retired with config_retire(), redirects may still be filling a query from them
+static const struct query_template *query_template = NULL;
+static pthread_mutex_t query_template_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** @internal
+ * A captive portal detection probe sent by an OS, and what it expects back when online.
+ * Their responses are created once by start_mhd() and queued for every probe.
+ */
+struct probe {
+	const char *path;
+	unsigned int status;
+	const char *body;
+	const char *mimetype;
+	struct MHD_Response *response;
+};
+
+static const char apple_success[] = "<HTML><HEAD><TITLE>Success</TITLE></HEAD><BODY>Success</BODY></HTML>";
+
+// Answers to requests refused by admission control, made by start_mhd()
+static struct MHD_Response *shed_511 = NULL;
+static struct MHD_Response *shed_503 = NULL;
+
+static const char page_shed_511[] = "<html><head><title>Error 511</title></head><body><h1>Error 511 - Network Authentication Required</h1></body></html>";
+static const char page_shed_503[] = "<html><head><title>Error 503</title></head><body><h1>Error 503 - Service Unavailable. This may be a temporary condition."
+	"</h1></body></html>";
+
+static struct probe probes[] = {
+	{"/hotspot-detect.html", MHD_HTTP_OK, apple_success, "text/html", NULL},
+	{"/library/test/success.html", MHD_HTTP_OK, apple_success, "text/html", NULL},
+	{"/generate_204", MHD_HTTP_NO_CONTENT, "", NULL, NULL},
+	{"/gen_204", MHD_HTTP_NO_CONTENT, "", NULL, NULL},
+	{"/connecttest.txt", MHD_HTTP_OK, "Microsoft Connect Test", "text/plain", NULL},
+	{"/ncsi.txt", MHD_HTTP_OK, "Microsoft NCSI", "text/plain", NULL},
+	{"/success.txt", MHD_HTTP_OK, "success\n", "text/plain", NULL},
+	{"/check_network_status.txt", MHD_HTTP_OK, "NetworkManager is online\n", "text/plain", NULL},
+};
+
+// Guards the probe_redirect entry of every client, see probe_fast_path()
+static pthread_mutex_t probe_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 void stop_mhd(void)
 {
 	debug(LOG_INFO, "Calling MHD_stop_daemon [%lu]", webserver);
@@ -80,8 +166,52 @@ void start_mhd(void)
 {
 	// Initializes the web server
 	s_config *config;
+	unsigned int i;
 	config = config_get_config();
 
+	free(gw_url);
+	safe_asprintf(&gw_url, "http://%s/", config->gw_address);
+	gw_url_len = strlen(gw_url);
+
+	// Responses to OS probes from authenticated clients, never destroyed so a restarted web server keeps them
+	for (i = 0; i < ARRAY_SIZE(probes); i++) {
+		if (probes[i].response) {
+			continue;
+		}
+
+		probes[i].response = MHD_create_response_from_buffer(strlen(probes[i].body), (void *)probes[i].body, MHD_RESPMEM_PERSISTENT);
+
+		if (!probes[i].response) {
+			continue;
+		}
+
+		if (probes[i].mimetype) {
+			MHD_add_response_header(probes[i].response, "Content-Type", probes[i].mimetype);
+		}
+
+		MHD_add_response_header(probes[i].response, "Cache-Control", "no-cache");
+	}
+
+	if (!shed_511) {
+		shed_511 = MHD_create_response_from_buffer(strlen(page_shed_511), (void *)page_shed_511, MHD_RESPMEM_PERSISTENT);
+
+		if (shed_511) {
+			MHD_add_response_header(shed_511, "Content-Type", "text/html");
+			MHD_add_response_header(shed_511, "Retry-After", "1");
+			MHD_add_response_header(shed_511, MHD_HTTP_HEADER_CONNECTION, "close");
+		}
+	}
+
+	if (!shed_503) {
+		shed_503 = MHD_create_response_from_buffer(strlen(page_shed_503), (void *)page_shed_503, MHD_RESPMEM_PERSISTENT);
+
+		if (shed_503) {
+			MHD_add_response_header(shed_503, "Content-Type", "text/html");
+			MHD_add_response_header(shed_503, "Retry-After", "1");
+			MHD_add_response_header(shed_503, MHD_HTTP_HEADER_CONNECTION, "close");
+		}
+	}
+
 	if ((webserver = MHD_start_daemon(
 		MHD_USE_INTERNAL_POLLING_THREAD | MHD_USE_THREAD_PER_CONNECTION | MHD_USE_TCP_FASTOPEN,
 		config->gw_port,
@@ -92,6 +222,7 @@ void start_mhd(void)
 		MHD_OPTION_CONNECTION_LIMIT, (unsigned int) 100,
 		MHD_OPTION_CONNECTION_TIMEOUT, (unsigned int) 10,
 		MHD_OPTION_PER_IP_CONNECTION_LIMIT, (unsigned int) 10,
+		MHD_OPTION_NOTIFY_COMPLETED, request_completed_cb, NULL,
 		MHD_OPTION_END)) == NULL) {
 
 		debug(LOG_ERR, "Could not create web server: %s", strerror(errno));
@@ -139,9 +270,10 @@ static int do_binauth(
 	unsigned long long int upload_quota;
 	unsigned long long int download_quota;
 	int rc =1;
+	int hold;
 
 	// Get the client user agent
-	user_agent = safe_calloc(USER_AGENT);
+	user_agent = "";
 
 	MHD_get_connection_values(connection, MHD_HEADER_KIND, get_user_agent_callback, &user_agent);
 
@@ -159,23 +291,23 @@ static int do_binauth(
 		custom="bmE=";
 	}
 
-	custom_enc = safe_calloc(CUSTOM_ENC);
+	custom_enc = request_calloc(CUSTOM_ENC);
 	uh_urlencode(custom_enc, CUSTOM_ENC, custom, strlen(custom));
 
 	debug(LOG_DEBUG, "BinAuth: custom data [ %s ]", custom_enc);
 
-	redirect_url_enc_buf = safe_calloc(REDIRECT_URL_ENC_BUF);
+	redirect_url_enc_buf = request_calloc(REDIRECT_URL_ENC_BUF);
 	uh_urlencode(redirect_url_enc_buf, REDIRECT_URL_ENC_BUF, redirect_url, strlen(redirect_url));
 
 	debug(LOG_DEBUG, "BinAuth: Redirect URL is [ %s ]", redirect_url_enc_buf);
 
-	enc_user_agent = safe_calloc(ENC_USER_AGENT);
+	enc_user_agent = request_calloc(ENC_USER_AGENT);
 	uh_urlencode(enc_user_agent, ENC_USER_AGENT, user_agent, strlen(user_agent));
 
 	debug(LOG_DEBUG, "BinAuth: User Agent is [ %s ]", enc_user_agent);
 
 	// Note: username, password and user_agent may contain spaces so argument should be quoted
-	argv = safe_calloc(REDIRECT_URL_ENC_BUF + CUSTOM_ENC);
+	argv = request_calloc(REDIRECT_URL_ENC_BUF + CUSTOM_ENC);
 	safe_snprintf(argv, REDIRECT_URL_ENC_BUF + CUSTOM_ENC, "%s auth_client '%s' '%s' '%s' '%s' '%s' '%s'",
 		binauth,
 		client->mac,
@@ -188,33 +320,25 @@ static int do_binauth(
 
 	debug(LOG_DEBUG, "BinAuth argv: %s", argv);
 
-	// ndsctl will deadlock if run within the BinAuth script so lock it
-	msg = safe_calloc(SMALL_BUF);
+	// ndsctl commands changing state wait until BinAuth is done, or are refused if BinAuth calls them
+	msg = request_calloc(SMALL_BUF);
 
-	if(ndsctl_lock() == 0) {
-		// execute the script
-		rc = execute_ret_url_encoded(msg, SMALL_BUF, argv);
-		debug(LOG_DEBUG, "BinAuth returned arguments: %s", msg);
-
-		// unlock ndsctl
-		ndsctl_unlock();
-	}
+	hold = ndsctl_hold();
 
-	free(custom_enc);
-	free(redirect_url_enc_buf);
-	free(enc_user_agent);
-	free(argv);
+	// execute the script
+	rc = execute_ret_url_encoded(msg, SMALL_BUF, argv);
+	debug(LOG_DEBUG, "BinAuth returned arguments: %s", msg);
 
+	ndsctl_release(hold);
 
 	if (rc != 0) {
 		debug(LOG_DEBUG, "BinAuth script failed to execute");
-		free(msg);
+		metrics_inc(METRIC_BINAUTH, "denied");
 		return rc;
 	}
 
 	rc = sscanf(msg, "%d %llu %llu %llu %llu", &seconds, &upload_rate, &download_rate, &upload_quota, &download_quota);
 	debug(LOG_DEBUG, "BinAuth returned session length: %d", seconds);
-	free(msg);
 
 	// store assigned parameters
 	switch (rc) {
@@ -231,9 +355,11 @@ static int do_binauth(
 		case 0:
 			break;
 		default:
+			metrics_inc(METRIC_BINAUTH, "malformed");
 			return -1;
 	}
 
+	metrics_inc(METRIC_BINAUTH, "allowed");
 	return 0;
 }
 
@@ -247,9 +373,9 @@ static enum MHD_Result collect_query_string(void *cls, enum MHD_ValueKind kind,
 	// what happens when '?=foo' supplied?
 	struct collect_query *collect_query = cls;
 	if (key && !value) {
-		collect_query->elements[collect_query->i] = safe_strdup(key);
+		collect_query->elements[collect_query->i] = request_strdup(key);
 	} else if (key && value) {
-		safe_asprintf(&(collect_query->elements[collect_query->i]), "%s=%s", key, value);
+		request_asprintf(&(collect_query->elements[collect_query->i]), "%s=%s", key, value);
 	}
 	collect_query->i++;
 	return MHD_YES;
@@ -330,6 +456,206 @@ get_client_mac(char mac[18], const char req_ip[])
 	return -1;
 }
 
+// @brief Get the mac of an IPv4 client from the kernel arp table, only if it is on the gateway interface
+static int
+get_client_mac_arp(char mac[18], const char ip[])
+{
+	char line[255] = {0};
+	char entry_ip[64];
+	char hwaddr[18];
+	char device[64];
+	unsigned int flags;
+	FILE *stream;
+	s_config *config = config_get_config();
+
+	stream = fopen("/proc/net/arp", "r");
+	if (!stream) {
+		return -1;
+	}
+
+	// Skip the heading
+	if (fgets(line, sizeof(line) - 1, stream) == NULL) {
+		fclose(stream);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line) - 1, stream) != NULL) {
+		if (4 != sscanf(line, "%63s %*s %x %17s %*s %63s", entry_ip, &flags, hwaddr, device)) {
+			continue;
+		}
+
+		if (strcmp(entry_ip, ip) != 0) {
+			continue;
+		}
+
+		// 0x2 is ATF_COM, the entry is complete
+		if ((flags & 0x2) && strcmp(device, config->gw_interface) == 0) {
+			memcpy(mac, hwaddr, sizeof(hwaddr));
+			fclose(stream);
+			return 0;
+		}
+
+		break;
+	}
+
+	fclose(stream);
+	return -1;
+}
+
+/**
+ * @brief probe_lookup - classify a request as an OS captive portal probe
+ *
+ * Only plain GET or HEAD requests for one of the probe paths on a foreign host count,
+ * RFC8908 requests and anything carrying a query take the full path.
+ * @return the probe, or NULL
+ */
+static const struct probe *probe_lookup(struct MHD_Connection *connection, const char *url)
+{
+	const char *host;
+	const char *accept;
+	unsigned int i;
+
+	host = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Host");
+
+	if (host == NULL || !is_foreign_hosts(connection, host)) {
+		return NULL;
+	}
+
+	accept = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Accept");
+
+	if (accept && strcmp(accept, "application/captive+json") == 0) {
+		return NULL;
+	}
+
+	if (MHD_get_connection_values(connection, MHD_GET_ARGUMENT_KIND, NULL, NULL) > 0) {
+		return NULL;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(probes); i++) {
+		if (strcmp(url, probes[i].path) == 0) {
+			return &probes[i];
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief probe_fast_path - answer an OS probe from a client already on the client list
+ *
+ * The mac comes from the arp table rather than ip neigh, and its device stands in for the
+ * subnet script. Authenticated and trusted clients get the success response of the probe.
+ * Other clients get the splash page redirect cached the first time they sent the probe, which
+ * saves construct_querystring() and its cid file writes on the repeats that follow every few
+ * seconds. The cache is keyed by the probe and the client state the redirect depends on: the
+ * config, and the client type and RFC8910 query of the client. The Host is left out, so the
+ * origin url of the redirect is that of the first request for the probe. Each client holds
+ * one entry, and building it takes a place in the admission budgets, as the full path does.
+ * @return 1 if the probe was answered and *ret is set, 0 to take the full path
+ */
+static int probe_fast_path(struct MHD_Connection *connection, const char *url, const char *ip, const struct probe *probe, int *ret)
+{
+	t_client *client;
+	const char *host;
+	char mac[18];
+	char *key;
+	char *entry;
+	char *old;
+	char *originurl_raw;
+	char *originurl;
+	char *querystr;
+	char *redirect = NULL;
+	size_t key_len;
+
+	if (get_client_mac_arp(mac, ip) != 0) {
+		return 0;
+	}
+
+	host = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Host");
+
+	// Lookups do not wait for a client list refresh or BinAuth holding the lock; client stays valid until the end
+	READ_LOCK_CLIENT_LIST();
+
+	client = client_list_find(mac, ip);
+
+	if (!client) {
+		READ_UNLOCK_CLIENT_LIST();
+		return 0;
+	}
+
+	if (client->fw_connection_state == FW_MARK_AUTHENTICATED || client->fw_connection_state == FW_MARK_TRUSTED) {
+		READ_UNLOCK_CLIENT_LIST();
+
+		if (!probe->response) {
+			return 0;
+		}
+
+		debug(LOG_DEBUG, "probe_fast_path: %s from authenticated client [%s], sending success", url, ip);
+		*ret = MHD_queue_response(connection, probe->status, probe->response);
+		return 1;
+	}
+
+	request_asprintf(&key, "%p %p %p %p\n",
+		(void *)config_get_config(), (void *)probe, (void *)client->client_type, (void *)client->cpi_query);
+	key_len = strlen(key);
+
+	pthread_mutex_lock(&probe_cache_mutex);
+
+	if (client->probe_redirect && strncmp(client->probe_redirect, key, key_len) == 0) {
+		redirect = request_strdup(client->probe_redirect + key_len);
+	}
+
+	pthread_mutex_unlock(&probe_cache_mutex);
+
+	if (redirect) {
+		debug(LOG_DEBUG, "probe_fast_path: %s from client [%s], sending cached redirect", url, ip);
+		*ret = send_redirect_temp(connection, client, redirect);
+		READ_UNLOCK_CLIENT_LIST();
+		return 1;
+	}
+
+	// Building the redirect runs scripts, so it is admitted as the full path would be
+	if (admission_source(ip) != 0) {
+		READ_UNLOCK_CLIENT_LIST();
+		debug(LOG_INFO, "Client [%s] is over its request rate, sending 511", ip);
+		*ret = send_shed(connection, MHD_HTTP_NETWORK_AUTHENTICATION_REQUIRED);
+		return 1;
+	}
+
+	if (admission_script_enter() != 0) {
+		READ_UNLOCK_CLIENT_LIST();
+		debug(LOG_INFO, "Script budget spent, sending 503 to [%s]", ip);
+		*ret = send_shed(connection, MHD_HTTP_SERVICE_UNAVAILABLE);
+		return 1;
+	}
+
+	// As redirect_to_splashpage() does for a request without a query
+	request_asprintf(&originurl_raw, "http://%s%s", host, url);
+	originurl = request_calloc(CUSTOM_ENC);
+	uh_urlencode(originurl, CUSTOM_ENC, originurl_raw, strlen(originurl_raw));
+
+	querystr = request_calloc(QUERYMAXLEN);
+	querystr = construct_querystring(connection, client, originurl, querystr);
+	redirect = splashpage_url(querystr);
+
+	admission_script_leave();
+
+	// The entry replaces the one the client held, readers copy it under the mutex
+	safe_asprintf(&entry, "%s%s", key, redirect);
+
+	pthread_mutex_lock(&probe_cache_mutex);
+	old = client->probe_redirect;
+	client->probe_redirect = entry;
+	pthread_mutex_unlock(&probe_cache_mutex);
+
+	free(old);
+
+	debug(LOG_DEBUG, "probe_fast_path: %s from client [%s], redirect cached", url, ip);
+	*ret = send_redirect_temp(connection, client, redirect);
+	READ_UNLOCK_CLIENT_LIST();
+	return 1;
+}
+
 /**
  * @brief get_client_ip
  * @param connection
@@ -380,8 +706,11 @@ get_client_ip(char ip_addr[INET6_ADDRSTRLEN], struct MHD_Connection *connection)
  * @param version http 1.0 or 1.1
  * @param upload_data - unused
  * @param upload_data_size - unused
- * @param ptr - unused
+ * @param ptr - the arena of the request, freed by request_completed_cb()
  * @return
+ *
+ * Temporary buffers of the request are allocated from its arena with request_calloc(),
+ * so are all released together once the response has been sent.
  */
 enum MHD_Result libmicrohttpd_cb(
 	void *cls,
@@ -393,26 +722,68 @@ enum MHD_Result libmicrohttpd_cb(
 	size_t *upload_data_size,
 	void **ptr) {
 
-	t_client *client;
+	enum MHD_Result ret;
+
+	if (*ptr == NULL) {
+		*ptr = request_arena_new();
+	}
+
+	// The config and what it points to stay valid while the request is handled
+	config_read_begin();
+	request_arena_enter(*ptr);
+	ret = handle_request(connection, url, method);
+	request_arena_leave();
+	config_read_end();
+
+	return ret;
+}
+
+/**
+ * @brief request_completed_cb called by libmicrohttpd when a request is finished with
+ *
+ * Frees the arena of the request, and so every buffer it used, responses included.
+ * Each request answered in full is counted as a heartbeat of the web server.
+ */
+static void request_completed_cb(void *cls, struct MHD_Connection *connection, void **ptr, enum MHD_RequestTerminationCode toe)
+{
+	// Progress for the watchdog, a stalled server completes nothing
+	if (toe == MHD_REQUEST_TERMINATED_COMPLETED_OK) {
+		watchdog_beat();
+	}
+
+	request_arena_free(*ptr);
+	*ptr = NULL;
+}
+
+/**
+ * @brief handle_request - check the client making a request and hand it on by its state
+ */
+static enum MHD_Result handle_request(struct MHD_Connection *connection, const char *url, const char *method)
+{
 	char ip[INET6_ADDRSTRLEN+1];
-	char mac[18];
 	const char *dds = "../";
 	const char *mhdstatus = "/mhdstatus";
 	int rc = 0;
-	char *msg;
-	char *testcmd;
+	const struct probe *probe;
 	s_config *config;
+	double started = metrics_now();
 
 	config = config_get_config();
 
 	debug(LOG_DEBUG, "client access: %s %s", method, url);
 
-	// only allow get
-	if (0 != strcmp(method, "GET")) {
+	// only allow get, and head which MHD answers with the headers of the same response
+	if (0 != strcmp(method, "GET") && 0 != strcmp(method, "HEAD")) {
 		debug(LOG_DEBUG, "Unsupported http method %s, Network Authentication required (Error 511)", method);
 		return send_error(connection, 511);
 	}
 
+	// but never authenticate or deauthenticate on a head request
+	if (0 == strcmp(method, "HEAD") && (check_authdir_match(url, config->authdir) || check_authdir_match(url, config->denydir))) {
+		debug(LOG_DEBUG, "HEAD request for %s, Network Authentication required (Error 511)", url);
+		return send_error(connection, 511);
+	}
+
 	// block path traversal
 	if (strstr(url, dds) != NULL) {
 		debug(LOG_WARNING, "Probable Path Traversal Attack Detected - %s", url);
@@ -438,13 +809,51 @@ enum MHD_Result libmicrohttpd_cb(
 		return send_error(connection, 503);
 	}
 
+	// OS captive portal probes from clients we already know skip the subnet script and ip neigh
+	probe = probe_lookup(connection, url);
+
+	if (probe && probe_fast_path(connection, url, ip, probe, &rc)) {
+		metrics_observe(METRIC_HTTP_REQUEST, "probe", metrics_now() - started);
+		return rc;
+	}
+
+	// Admission control, before any script runs
+	if (admission_source(ip) != 0) {
+		debug(LOG_INFO, "Client [%s] is over its request rate, sending 511", ip);
+		return send_shed(connection, MHD_HTTP_NETWORK_AUTHENTICATION_REQUIRED);
+	}
+
+	if (admission_script_enter() != 0) {
+		debug(LOG_INFO, "Script budget spent, sending 503 to [%s]", ip);
+		return send_shed(connection, MHD_HTTP_SERVICE_UNAVAILABLE);
+	}
+
+	rc = handle_client_request(connection, url, ip, started);
+	admission_script_leave();
+	return rc;
+}
+
+/**
+ * @brief handle_client_request - find or add the client at ip and hand the request on by its state
+ *
+ * Runs the subnet script, ip neigh and the handlers, so is only called within the script budget.
+ */
+static int handle_client_request(struct MHD_Connection *connection, const char *url, const char *ip, double started)
+{
+	t_client *client;
+	char mac[18];
+	int rc = 0;
+	char *msg;
+	char *testcmd;
+	s_config *config;
+
+	config = config_get_config();
 
 	// check if client ip is on our subnet
-	testcmd = safe_calloc(SMALL_BUF);
+	testcmd = request_calloc(SMALL_BUF);
 	safe_snprintf(testcmd, SMALL_BUF, "/usr/lib/opennds/libopennds.sh get_interface_by_ip \"%s\"", ip);
-	msg = safe_calloc(SMALL_BUF);
+	msg = request_calloc(SMALL_BUF);
 	rc = execute_ret_url_encoded(msg, SMALL_BUF, testcmd);
-	free(testcmd);
 
 	if (rc == 0) {
 		debug(LOG_DEBUG, "Interface used to route ip [%s] is [%s]", ip, msg);
@@ -460,17 +869,19 @@ enum MHD_Result libmicrohttpd_cb(
 		debug(LOG_DEBUG, "ip subnet test failed: Continuing...");
 	}
 
-	free (msg);
-
 	rc = get_client_mac(mac, ip);
 	if (rc != 0) {
 		return send_error(connection, 503);
 	}
 
+	// Lookups do not wait for a client list refresh or BinAuth holding the lock; client stays valid until the end
+	READ_LOCK_CLIENT_LIST();
+
 	client = client_list_find(mac, ip);
 	if (!client) {
 		client = add_client(mac, ip);
 		if (!client) {
+			READ_UNLOCK_CLIENT_LIST();
 			return send_error(connection, 403);
 		}
 	}
@@ -478,10 +889,34 @@ enum MHD_Result libmicrohttpd_cb(
 	if (client && (client->fw_connection_state == FW_MARK_AUTHENTICATED ||
 			client->fw_connection_state == FW_MARK_TRUSTED)) {
 		// client is already authenticated, maybe they clicked/tapped "back" on the CPD browser or maybe they want the info page.
-		return authenticated(connection, url, client);
+		rc = authenticated(connection, url, client);
+		READ_UNLOCK_CLIENT_LIST();
+		metrics_observe(METRIC_HTTP_REQUEST, "authenticated", metrics_now() - started);
+		return rc;
 	}
 
-	return preauthenticated(connection, url, client);
+	rc = preauthenticated(connection, url, client);
+	READ_UNLOCK_CLIENT_LIST();
+	metrics_observe(METRIC_HTTP_REQUEST, "preauthenticated", metrics_now() - started);
+	return rc;
+}
+
+/**
+ * @brief send_shed - answer a request refused by admission control
+ *
+ * The responses are made once by start_mhd(), so nothing is run or allocated for the request.
+ */
+static int send_shed(struct MHD_Connection *connection, unsigned int status)
+{
+	struct MHD_Response *response;
+
+	response = (status == MHD_HTTP_SERVICE_UNAVAILABLE) ? shed_503 : shed_511;
+
+	if (!response) {
+		return MHD_NO;
+	}
+
+	return MHD_queue_response(connection, status, response);
 }
 
 /**
@@ -536,17 +971,14 @@ static int try_to_authenticate(struct MHD_Connection *connection, t_client *clie
 		//Check if token (tok) or hash_id (hid) mode
 		if (strlen(tok) > 8) {
 			// hid mode
-			rhidraw = safe_calloc(SMALL_BUF);
+			rhidraw = request_calloc(SMALL_BUF);
 			safe_snprintf(rhidraw, SMALL_BUF, "%s%s", client->hid, config->fas_key);
-			rhid = safe_calloc(STATUS_BUF);
+			rhid = request_calloc(STATUS_BUF);
 			hash_str(rhid, STATUS_BUF, rhidraw);
-			free (rhidraw);
 			if (tok && !strcmp(rhid, tok)) {
 				// rhid is valid
-				free(rhid);
 				return 1;
 			}
-			free(rhid);
 		} else {
 			// tok mode
 			if (tok && !strcmp(client->token, tok)) {
@@ -645,17 +1077,15 @@ static int authenticate_client(struct MHD_Connection *connection,
 				FAS should account for this if used with BinAuth.
 			*/
 
-			redirect_url_enc = safe_calloc(REDIRECT_URL_ENC_BUF);
+			redirect_url_enc = request_calloc(REDIRECT_URL_ENC_BUF);
 			uh_urlencode(redirect_url_enc, REDIRECT_URL_ENC_BUF, redirect_url, strlen(redirect_url));
 
 			debug(LOG_DEBUG, "redirect_url after binauth deny: %s", redirect_url);
 			debug(LOG_DEBUG, "redirect_url_enc after binauth deny: %s", redirect_url_enc);
 
-			querystr = safe_calloc(QUERYMAXLEN);
+			querystr = request_calloc(QUERYMAXLEN);
 			querystr=construct_querystring(connection, client, redirect_url_enc, querystr);
 			ret = encode_and_redirect_to_splashpage(connection, client, redirect_url_enc, querystr);
-			free(querystr);
-			free(redirect_url_enc);
 			return ret;
 		}
 		rc = auth_client_auth(client->id, "client_auth", custom);
@@ -730,7 +1160,7 @@ static int authenticated(struct MHD_Connection *connection,
 	char *query;
 	char *msg;
 	char *clientif;
-	const char *accept;
+	const char *accept = NULL;
 	char *originurl_raw = NULL;
 	char *captive_json = NULL;
 	char *buff;
@@ -753,8 +1183,6 @@ static int authenticated(struct MHD_Connection *connection,
 	}
 
 	// Is it an RFC8908 type request? - check Accept: header
-
-	accept = safe_calloc(SMALL_BUF);
 	ret = MHD_get_connection_values(connection, MHD_HEADER_KIND, get_accept_callback, &accept);
 
 	if (ret < 1) {
@@ -766,8 +1194,8 @@ static int authenticated(struct MHD_Connection *connection,
 		debug(LOG_NOTICE, "authenticated: Accept header [%s]", accept);
 		debug(LOG_NOTICE, "authenticated: RFC 8908 captive+json request received");
 
-		originurl_raw = safe_calloc(SMALL_BUF);
-		captive_json = safe_calloc(SMALL_BUF);
+		originurl_raw = request_calloc(SMALL_BUF);
+		captive_json = request_calloc(SMALL_BUF);
 
 		if (strcmp(config->gw_fqdn, "disable") == 0 || strcmp(config->gw_fqdn, "disabled") == 0) {
 			safe_snprintf(originurl_raw, SMALL_BUF, "http://%s", config->gw_ip);
@@ -784,8 +1212,6 @@ static int authenticated(struct MHD_Connection *connection,
 		debug(LOG_DEBUG, "captive_json [%s]", captive_json);
 		ret = send_json(connection, captive_json);
 
-		free(originurl_raw);
-		free(captive_json);
 		return ret;
 	}
 
@@ -802,43 +1228,22 @@ static int authenticated(struct MHD_Connection *connection,
 		auth_client_deauth(client->id, "client_deauth");
 		debug(LOG_DEBUG, "Post deauth redirection [%s]", config->gw_address);
 
-		redirect_to_us = safe_calloc(QUERYMAXLEN);
-
-		if (!redirect_to_us) {
-			ret = send_error(connection, 503);
-			free(redirect_to_us);
-			return ret;
-		}
+		redirect_to_us = request_calloc(QUERYMAXLEN);
 
 		safe_snprintf(redirect_to_us, QUERYMAXLEN, "http://%s/", config->gw_address);
 
 		ret = send_redirect_temp(connection, client, redirect_to_us);
-		free (redirect_to_us);
 		return ret;
 	}
 
 	if (check_authdir_match(url, config->authdir)) {
-		clientif = safe_calloc(STATUS_BUF);
+		clientif = request_calloc(STATUS_BUF);
 		get_client_interface(clientif, STATUS_BUF, client->mac);
 
 		if (config->fas_port && !config->preauth) {
-			query = safe_calloc(QUERYMAXLEN);
-
-			if (!query) {
-				ret = send_error(connection, 503);
-				free(query);
-				return ret;
-			}
+			query = request_calloc(QUERYMAXLEN);
 
-			fasurl = safe_calloc(QUERYMAXLEN);
-
-			if (!fasurl) {
-				ret = send_error(connection, 503);
-				free(clientif);
-				free(query);
-				free(fasurl);
-				return ret;
-			}
+			fasurl = request_calloc(QUERYMAXLEN);
 
 			get_query(connection, &query, HTMLQUERYSEPARATOR);
 
@@ -850,12 +1255,9 @@ static int authenticated(struct MHD_Connection *connection,
 			debug(LOG_DEBUG, "fasurl [%s]", fasurl);
 			debug(LOG_DEBUG, "query [%s]", query);
 			ret = send_redirect_temp(connection, client, fasurl);
-			free(clientif);
-			free(query);
-			free(fasurl);
 			return ret;
 		} else if (config->fas_port && config->preauth) {
-			fasurl = safe_calloc(QUERYMAXLEN);
+			fasurl = request_calloc(QUERYMAXLEN);
 			safe_snprintf(fasurl, QUERYMAXLEN, "?clientip=%s%sgatewayname=%s%sgatewayaddress=%s%sclientif=%s%sstatus=authenticated",
 				client->ip,
 				QUERYSEPARATOR,
@@ -868,25 +1270,15 @@ static int authenticated(struct MHD_Connection *connection,
 			);
 			debug(LOG_DEBUG, "fasurl %s", fasurl);
 			ret = show_preauthpage(connection, fasurl);
-			free(fasurl);
-			free(clientif);
 			return ret;	
 		}
-		free(clientif);
 	}
 
 	if (check_authdir_match(url, config->preauthdir)) {
 
 		if (config->fas_port) {
-			query = safe_calloc(QUERYMAXLEN);
-			fasurl = safe_calloc(QUERYMAXLEN);
-
-			if (!query) {
-				ret = send_error(connection, 503);
-				free(query);
-				free(fasurl);
-				return ret;
-			}
+			query = request_calloc(QUERYMAXLEN);
+			fasurl = request_calloc(QUERYMAXLEN);
 
 			get_query(connection, &query, QUERYSEPARATOR);
 
@@ -897,56 +1289,35 @@ static int authenticated(struct MHD_Connection *connection,
 
 			debug(LOG_DEBUG, "preauthdir: fasurl %s", fasurl);
 			ret = show_preauthpage(connection, fasurl);
-			free(query);
-			free(fasurl);
 			return ret;
 		}
 	}
 
 	// User just entered gatewayaddress:gatewayport so give them the info page
 	if (strcmp(url, "/") == 0 || strcmp(url, "/login") == 0) {
-		query = safe_calloc(QUERYMAXLEN);
-
-		if (!query) {
-			ret = send_error(connection, 503);
-			free(query);
-			return ret;
-		}
+		query = request_calloc(QUERYMAXLEN);
 
 		get_query(connection, &query, QUERYSEPARATOR);
 		debug(LOG_DEBUG, "status_query=[%s]", query);
 
-		buff = safe_calloc(MID_BUF);
-
-		if (!buff) {
-			ret = send_error(connection, 503);
-			free(buff);
-			return ret;
-		}
+		buff = request_calloc(MID_BUF);
 
 		b64_encode(buff, MID_BUF, query, strlen(query));
 
 		debug(LOG_DEBUG, "b64_status_query=[%s]", buff);
 
-		msg = safe_calloc(HTMLMAXSIZE);
-
-		if (!msg) {
-			ret = send_error(connection, 503);
-			free(msg);
-			return ret;
-		}
+		msg = request_calloc(HTMLMAXSIZE);
 
 		rc = execute_ret(msg, HTMLMAXSIZE - 1, "%s status '%s' '%s'", config->status_path, client->ip, buff);
 
 		if (rc != 0) {
 			debug(LOG_WARNING, "Script: %s - failed to execute", config->status_path);
 			ret = send_error(connection, 503);
-			free(msg);
 			return ret;
 		}
 
 		// serve the script output (in msg)
-		response = MHD_create_response_from_buffer(strlen(msg), (char *)msg, MHD_RESPMEM_MUST_FREE);
+		response = MHD_create_response_from_buffer(strlen(msg), (char *)msg, MHD_RESPMEM_PERSISTENT);
 
 		if (!response) {
 			return send_error(connection, 503);
@@ -969,6 +1340,7 @@ static int show_preauthpage(struct MHD_Connection *connection, const char *query
 {
 	s_config *config = config_get_config();
 
+	char ip[INET6_ADDRSTRLEN];
 	char *msg;
 	const char *user_agent;
 	char *enc_user_agent;
@@ -982,74 +1354,65 @@ static int show_preauthpage(struct MHD_Connection *connection, const char *query
 
 	if ( strlen(query) < 1 ) {
 		// query string is blank, too long or corrupt
+		metrics_inc(METRIC_PREAUTH, "rejected");
 		return send_error(connection, 511);
 	} else {	
-		preauthpath = safe_calloc(SMALL_BUF);
+		preauthpath = request_calloc(SMALL_BUF);
 		safe_snprintf(preauthpath, SMALL_BUF, "/%s/", config->preauthdir);
 
 		if (strcmp(preauthpath, config->fas_path) == 0) {
-			free (preauthpath);
-
 			MHD_get_connection_values(connection, MHD_HEADER_KIND, get_user_agent_callback, &user_agent);
 			debug(LOG_DEBUG, "PreAuth: MHD User Agent ptr is [ %llu ]", &user_agent);
 
 			if (user_agent == NULL) {
+				metrics_inc(METRIC_PREAUTH, "rejected");
 				return send_error(connection, 403);
 			}
 
-			enc_user_agent = safe_calloc(ENC_USER_AGENT);
+			enc_user_agent = request_calloc(ENC_USER_AGENT);
 			uh_urlencode(enc_user_agent, ENC_USER_AGENT, user_agent, strlen(user_agent));
 			debug(LOG_DEBUG, "PreAuth: Encoded User Agent is [ %s ]", enc_user_agent);
 
-			enc_query = safe_calloc(ENC_QUERYSTR);
+			enc_query = request_calloc(ENC_QUERYSTR);
 			uh_urlencode(enc_query, ENC_QUERYSTR, query, strlen(query));
 			debug(LOG_DEBUG, "PreAuth: Encoded query: %s", enc_query);
 
-			msg = safe_calloc(HTMLMAXSIZE);
+			msg = request_calloc(HTMLMAXSIZE);
 
-			if (!msg) {
-				ret = send_error(connection, 503);
-				free(msg);
-				free(enc_user_agent);
-				free(enc_query);
-				return ret;
+			cmd = request_calloc(QUERYMAXLEN);
+			safe_snprintf(cmd, QUERYMAXLEN, "%s '%s' '%s' '%d' '%s'", config->preauth, enc_query, enc_user_agent, config->login_option_enabled, config->themespec_path);
+
+			// The query is sent by the client, so the page is only shared with requests from the same address
+			if (get_client_ip(ip, connection) != 0) {
+				metrics_inc(METRIC_PREAUTH, "rejected");
+				return send_error(connection, 403);
 			}
 
-			cmd = safe_calloc(QUERYMAXLEN);
-			safe_snprintf(cmd, QUERYMAXLEN, "%s '%s' '%s' '%d' '%s'", config->preauth, enc_query, enc_user_agent, config->login_option_enabled, config->themespec_path);
-			rc = execute_ret_url_encoded(msg, HTMLMAXSIZE - 1, cmd);
-			free(cmd);
+			rc = render_cache_exec(msg, HTMLMAXSIZE - 1, ip, cmd);
 
 			if (rc != 0) {
 				debug(LOG_WARNING, "Preauth script - failed to execute: %s, Query[%s]", config->preauth, query);
-				free(msg);
-				free(enc_user_agent);
-				free(enc_query);
+				metrics_inc(METRIC_PREAUTH, "failed");
 
 				return send_error(connection, 511);
 			}
 
 			// serve the script output (in msg)
-			response = MHD_create_response_from_buffer(strlen(msg), (char *)msg, MHD_RESPMEM_MUST_FREE);
+			response = MHD_create_response_from_buffer(strlen(msg), (char *)msg, MHD_RESPMEM_PERSISTENT);
 
 			if (!response) {
-				free(msg);
-				free(enc_user_agent);
-				free(enc_query);
-
 				return send_error(connection, 503);
 			}
 
 			MHD_add_response_header(response, "Content-Type", "text/html; charset=utf-8");
 			ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
 			MHD_destroy_response(response);
+			metrics_inc(METRIC_PREAUTH, "served");
 
-			// MHD will free(msg) when it has finished with it ( ie MHD_RESPMEM_MUST_FREE). Do not free here or MHD will page fault.
-			free(enc_user_agent);
-			free(enc_query);
+			// msg is freed with the request arena once the response has been sent
 			return ret;
 		} else {
-			free (preauthpath);
+			metrics_inc(METRIC_PREAUTH, "rejected");
 			return send_error(connection, 404);
 		}
 	}
@@ -1064,22 +1427,15 @@ static int send_json(struct MHD_Connection *connection, const char *json)
 	int ret;
 	struct MHD_Response *response;
 
-	msg = safe_calloc(SMALL_BUF * 2);
-
-	if (!msg) {
-		ret = send_error(connection, 503);
-		free(msg);
-		return ret;
-	}
+	msg = request_calloc(SMALL_BUF * 2);
 
 	safe_snprintf(msg, SMALL_BUF * 2, "%s", json);
 
 	debug(LOG_DEBUG, "json string [%s],  buffer [%s]", json, msg);
 
-	response = MHD_create_response_from_buffer(strlen(msg), (char *)msg, MHD_RESPMEM_MUST_FREE);
+	response = MHD_create_response_from_buffer(strlen(msg), (char *)msg, MHD_RESPMEM_PERSISTENT);
 
 	if (!response) {
-		free(msg);
 		ret = send_error(connection, 503);
 		return ret;
 	}
@@ -1088,7 +1444,6 @@ static int send_json(struct MHD_Connection *connection, const char *json)
 	MHD_add_response_header(response, "Content-Type", "application/captive+json");
 	ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
 	MHD_destroy_response(response);
-	free(msg);
 	return ret;
 
 }
@@ -1131,7 +1486,7 @@ static int preauthenticated(struct MHD_Connection *connection, const char *url,
 	// check if this is an RFC8910 login request
 	if (strcmp(url, "/login") == 0) {
 		debug(LOG_INFO, "preauthenticated: RFC8910 login request received from client at [%s] [%s]", client->ip, client->mac);
-		client->client_type = safe_strdup("cpi_url");
+		client->client_type = client_list_strdup(client, "cpi_url");
 		return redirect_to_splashpage(connection, client, host, "/login");
 	}
 
@@ -1147,9 +1502,9 @@ static int preauthenticated(struct MHD_Connection *connection, const char *url,
 		debug(LOG_DEBUG, "preauthenticated: Accept header [%s]", accept);
 		debug(LOG_NOTICE, "preauthenticated: RFC 8908 captive+json request received from client at [%s] [%s]", client->ip, client->mac);
 
-		client->client_type = safe_strdup("cpi_api");
+		client->client_type = client_list_strdup(client, "cpi_api");
 
-		originurl_raw = safe_calloc(REDIRECT_URL);
+		originurl_raw = request_calloc(REDIRECT_URL);
 
 		if (strcmp(config->gw_fqdn, "disable") == 0 || strcmp(config->gw_fqdn, "disabled") == 0) {
 			safe_snprintf(originurl_raw, REDIRECT_URL, "http://%s", config->gw_ip);
@@ -1157,44 +1512,23 @@ static int preauthenticated(struct MHD_Connection *connection, const char *url,
 			safe_snprintf(originurl_raw, REDIRECT_URL, "http://%s", config->gw_fqdn);
 		}
 
-		originurl = safe_calloc(REDIRECT_URL_ENC_BUF);
+		originurl = request_calloc(REDIRECT_URL_ENC_BUF);
 		uh_urlencode(originurl, REDIRECT_URL_ENC_BUF, originurl_raw, strlen(originurl_raw));
 		debug(LOG_DEBUG, "originurl: %s", originurl);
 
-		querystr = safe_calloc(QUERYMAXLEN);
-
-		if (!querystr) {
-			ret = send_error(connection, 503);
-			free(originurl);
-			free(originurl_raw);
-			free(querystr);
-			return ret;
-		}
+		querystr = request_calloc(QUERYMAXLEN);
 
 		querystr=construct_querystring(connection, client, originurl, querystr);
 		debug(LOG_DEBUG, "Constructed query string [%s]", querystr);
 		debug(LOG_DEBUG, "FAS url [%s]", config->fas_url);
 
-		captive_json = safe_calloc(QUERYMAXLEN);
-
-		if (!captive_json) {
-			ret = send_error(connection, 503);
-			free(originurl);
-			free(originurl_raw);
-			free(querystr);
-			free(captive_json);
-			return ret;
-		}
+		captive_json = request_calloc(QUERYMAXLEN);
 
 		safe_snprintf(captive_json, QUERYMAXLEN, "{ \"captive\": true, \"user-portal-url\": \"%s%s\" }", config->fas_url, querystr);
 
 		debug(LOG_DEBUG, "captive_json [%s]", captive_json);
 		ret = send_json(connection, captive_json);
 
-		free(originurl);
-		free(originurl_raw);
-		free(querystr);
-		free(captive_json);
 		return ret;
 	}
 
@@ -1209,18 +1543,11 @@ static int preauthenticated(struct MHD_Connection *connection, const char *url,
 	if (check_authdir_match(url, config->preauthdir)) {
 
 		debug(LOG_DEBUG, "preauthdir url detected: %s", url);
-		query = safe_calloc(QUERYMAXLEN);
-
-		if (!query) {
-			ret = send_error(connection, 503);
-			free(query);
-			return ret;
-		}
+		query = request_calloc(QUERYMAXLEN);
 
 		get_query(connection, &query, QUERYSEPARATOR);
 		debug(LOG_DEBUG, "preauthenticated: show_preauthpage [%s]", query);
 		ret = show_preauthpage(connection, query);
-		free(query);
 		return ret;
 	}
 
@@ -1250,23 +1577,14 @@ static int preauthenticated(struct MHD_Connection *connection, const char *url,
 
 		if (!try_to_authenticate(connection, client, host, url)) {
 			// user used an invalid token, redirect to splashpage but hold query "redir" intact
-			originurl = safe_calloc(REDIRECT_URL_ENC_BUF);
+			originurl = request_calloc(REDIRECT_URL_ENC_BUF);
 			uh_urlencode(originurl, REDIRECT_URL_ENC_BUF, redirect_url, strlen(redirect_url));
 
-			querystr = safe_calloc(QUERYMAXLEN);
-
-			if (!querystr) {
-				ret = send_error(connection, 503);
-				free(originurl);
-				free(querystr);
-				return ret;
-			}
+			querystr = request_calloc(QUERYMAXLEN);
 
 			querystr = construct_querystring(connection, client, originurl, querystr);
 
 			ret = encode_and_redirect_to_splashpage(connection, client, originurl, querystr);
-			free(originurl);
-			free(querystr);
 			return ret;
 		}
 
@@ -1286,13 +1604,21 @@ static int preauthenticated(struct MHD_Connection *connection, const char *url,
  * @return
  */
 static int encode_and_redirect_to_splashpage(struct MHD_Connection *connection, t_client *client, const char *originurl, const char *querystr)
+{
+	return send_redirect_temp(connection, client, splashpage_url(querystr));
+}
+
+/**
+ * @brief splashpage_url - the url of the splash page or FAS for a query string built by construct_querystring()
+ * @return the url, allocated from the request arena
+ */
+static char *splashpage_url(const char *querystr)
 {
 	char *splashpageurl = NULL;
 	s_config *config;
-	int ret;
 
 	config = config_get_config();
-	splashpageurl = safe_calloc(QUERYMAXLEN);
+	splashpageurl = request_calloc(QUERYMAXLEN);
 
 	if (config->fas_port) {
 		// Generate secure query string or authaction url
@@ -1311,9 +1637,7 @@ static int encode_and_redirect_to_splashpage(struct MHD_Connection *connection,
 
 	debug(LOG_DEBUG, "splashpageurl: %s", splashpageurl);
 
-	ret = send_redirect_temp(connection, client, splashpageurl);
-	free(splashpageurl);
-	return ret;
+	return splashpageurl;
 }
 
 /**
@@ -1333,54 +1657,29 @@ static int redirect_to_splashpage(struct MHD_Connection *connection, t_client *c
 	const char *separator = "&";
 	char *querystr;
 
-	query = safe_calloc(QUERYMAXLEN);
+	query = request_calloc(QUERYMAXLEN);
 
-	if (!query) {
-		ret = send_error(connection, 503);
-		free(query);
-		return ret;
-	}
+	querystr = request_calloc(QUERYMAXLEN);
 
-	querystr = safe_calloc(QUERYMAXLEN);
+	originurl_raw = request_calloc(MID_BUF);
 
-	if (!querystr) {
-		ret = send_error(connection, 503);
-		free(querystr);
-		return ret;
-	}
-
-	originurl_raw = safe_calloc(MID_BUF);
-
-	if (!originurl_raw) {
-		ret = send_error(connection, 503);
-		free(originurl_raw);
-		return ret;
-	}
-
-	originurl = safe_calloc(CUSTOM_ENC);
-
-	if (!originurl) {
-		ret = send_error(connection, 503);
-		free(originurl);
-		return ret;
-	}
+	originurl = request_calloc(CUSTOM_ENC);
 
 	get_query(connection, &query, separator);
 
 	if (!query) {
 		debug(LOG_DEBUG, "Unable to get query string - error 503");
-		free(query);
 		// probably no mem
 		return send_error(connection, 503);
 	}
 
 	debug(LOG_DEBUG, "Query string is [ %s ]", query);
 
-	safe_asprintf(&originurl_raw, "http://%s%s%s", host, url, query);
+	request_asprintf(&originurl_raw, "http://%s%s%s", host, url, query);
 	uh_urlencode(originurl, CUSTOM_ENC, originurl_raw, strlen(originurl_raw));
 
 	if (strcmp(url, "/login") == 0) {
-		client->cpi_query = safe_strdup(originurl);
+		client->cpi_query = client_list_strdup(client, originurl);
 		debug(LOG_DEBUG, "RFC8910 request: %s", client->cpi_query);
 	}
 
@@ -1389,51 +1688,205 @@ static int redirect_to_splashpage(struct MHD_Connection *connection, t_client *c
 
 	querystr=construct_querystring(connection, client, originurl, querystr);
 	ret = encode_and_redirect_to_splashpage(connection, client, originurl, querystr);
-	free(originurl_raw);
-	free(originurl);
-	free(query);
-	free(querystr);
 	return ret;
 }
 
+// As printf prints a NULL string, so the query string stays as it was when built with snprintf
+static const char *query_string_value(const char *value)
+{
+	return value ? value : "(null)";
+}
+
+// Frees a replaced query template, as config_retire() releases it
+static void query_template_free(void *p)
+{
+	struct query_template *tmpl = p;
+
+	free(tmpl->gw_mac);
+	free(tmpl->gw_url);
+	free(tmpl->gateway);
+	free(tmpl->authdir);
+	free(tmpl->tail);
+	free(tmpl);
+}
+
+// The config fields in the tail of the query template, in order
+static void query_template_fields(const s_config *config, const char *fields[5])
+{
+	fields[0] = config->themespec_path;
+	fields[1] = config->custom_params;
+	fields[2] = config->custom_vars;
+	fields[3] = config->custom_images;
+	fields[4] = config->custom_files;
+}
+
+// Whether a template was built from the config as it is now
+static int query_template_is_current(const struct query_template *tmpl, const s_config *config)
+{
+	const char *fields[5];
+
+	if (!tmpl || tmpl->generation != config->generation || strcmp(tmpl->gw_mac, query_string_value(config->gw_mac)) != 0) {
+		return 0;
+	}
+
+	query_template_fields(config, fields);
+	return memcmp(tmpl->fields, fields, sizeof(fields)) == 0;
+}
+
+/**
+ * @brief get_query_template - the query template of the current config, built on first use
+ *
+ * A reload publishes a new config, and the watchdog may find a new gateway mac, so either
+ * makes the next redirect build a new template. main() sets the themespec and FAS fields
+ * in place after the web server starts, replacing the strings, so a template built before
+ * then is told apart by the addresses of the fields it was built from.
+ */
+static const struct query_template *get_query_template(void)
+{
+	const struct query_template *current;
+	struct query_template *next;
+	s_config *config;
+	char *gw_url_raw;
+
+	config = config_get_config();
+	current = __atomic_load_n(&query_template, __ATOMIC_ACQUIRE);
+
+	if (query_template_is_current(current, config)) {
+		return current;
+	}
+
+	pthread_mutex_lock(&query_template_mutex);
+
+	current = query_template;
+
+	if (query_template_is_current(current, config)) {
+		pthread_mutex_unlock(&query_template_mutex);
+		return current;
+	}
+
+	next = safe_calloc(sizeof(struct query_template));
+	next->generation = config->generation;
+	next->gw_mac = safe_strdup(query_string_value(config->gw_mac));
+	query_template_fields(config, next->fields);
+
+	if (strcmp(config->gw_fqdn, "disable") == 0 || strcmp(config->gw_fqdn, "disabled") == 0) {
+		safe_asprintf(&gw_url_raw, "http://%s", config->gw_ip);
+	} else {
+		safe_asprintf(&gw_url_raw, "http://%s", config->gw_fqdn);
+	}
+
+	next->gw_url = safe_calloc(REDIRECT_URL_ENC_BUF);
+	uh_urlencode(next->gw_url, REDIRECT_URL_ENC_BUF, gw_url_raw, strlen(gw_url_raw));
+	free(gw_url_raw);
+
+	next->gateway_len = safe_asprintf(&next->gateway, "gatewayname=%s%sgatewayurl=%s%sversion=%s%sgatewayaddress=%s%sgatewaymac=%s%s",
+		config->url_encoded_gw_name, QUERYSEPARATOR,
+		next->gw_url, QUERYSEPARATOR,
+		VERSION, QUERYSEPARATOR,
+		config->gw_address, QUERYSEPARATOR,
+		next->gw_mac, QUERYSEPARATOR
+	);
+
+	next->authdir_len = safe_asprintf(&next->authdir, "authdir=%s%s", config->authdir, QUERYSEPARATOR);
+
+	next->tail_len = safe_asprintf(&next->tail, "themespec=%s%s%s%s%s%s",
+		query_string_value(next->fields[0]), QUERYSEPARATOR,
+		query_string_value(next->fields[1]),
+		query_string_value(next->fields[2]),
+		query_string_value(next->fields[3]),
+		query_string_value(next->fields[4])
+	);
+
+	debug(LOG_DEBUG, "Query template built: [%s] [%s] [%s]", next->gateway, next->authdir, next->tail);
+
+	__atomic_store_n(&query_template, next, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&query_template_mutex);
+
+	if (current) {
+		LOCK_CONFIG();
+		config_retire((void *)current, query_template_free);
+		UNLOCK_CONFIG();
+	}
+
+	return next;
+}
+
+/**
+ * @brief fill_query_string - the plain FAS query string of a client, from the query template
+ *
+ * Gives the same string as the snprintf it replaces, truncated at QUERYMAXLEN
+ * @param authdir include the authdir field, as fas_secure_enabled levels 2 and 3 do
+ */
+static void fill_query_string(char *query_str, const struct query_template *tmpl, t_client *client,
+	const char *clienttype, const char *originurl, const char *clientif, int authdir)
+{
+	const char *parts[24];
+	size_t lens[24];
+	size_t len = 0;
+	size_t n;
+	int count = 0;
+	int i;
+
+#define QUERY_PART(str, length) do { parts[count] = (str); lens[count] = (length); count++; } while (0)
+#define QUERY_FIELD(name, value) do { QUERY_PART(name "=", sizeof(name)); \
+		QUERY_PART(query_string_value(value), strlen(query_string_value(value))); \
+		QUERY_PART(QUERYSEPARATOR, sizeof(QUERYSEPARATOR) - 1); } while (0)
+
+	QUERY_FIELD("hid", client->hid);
+	QUERY_FIELD("clientip", client->ip);
+	QUERY_FIELD("clientmac", client->mac);
+	QUERY_FIELD("client_type", clienttype);
+	QUERY_FIELD("cpi_query", client->cpi_query);
+	QUERY_PART(tmpl->gateway, tmpl->gateway_len);
+
+	if (authdir) {
+		QUERY_PART(tmpl->authdir, tmpl->authdir_len);
+	}
+
+	QUERY_FIELD("originurl", originurl);
+	QUERY_FIELD("clientif", clientif);
+	QUERY_PART(tmpl->tail, tmpl->tail_len);
+
+#undef QUERY_FIELD
+#undef QUERY_PART
+
+	for (i = 0; i < count && len < QUERYMAXLEN - 1; i++) {
+		n = lens[i];
+
+		if (n > QUERYMAXLEN - 1 - len) {
+			n = QUERYMAXLEN - 1 - len;
+		}
+
+		memcpy(query_str + len, parts[i], n);
+		len += n;
+	}
+
+	query_str[len] = '\0';
+}
+
 /**
  * @brief construct_querystring
  * @return the querystring
  */
 static char *construct_querystring(struct MHD_Connection *connection, t_client *client, char *originurl, char *querystr ) {
 
-	char cid[87] = {0};
+	char cid[CLIENT_CID_LEN] = {0};
 	char *clienttype;
 	char *clientif;
 	char *query_str;
-	char *query_str_b64;
 	char *msg;
 	char *cidinfo;
-	char *gw_url_raw;
-	char *gw_url;
 	char *phpcmd;
+	const struct query_template *tmpl;
 
 	s_config *config = config_get_config();
 
-	gw_url_raw = safe_calloc(REDIRECT_URL);
-
-	if (strcmp(config->gw_fqdn, "disable") == 0 || strcmp(config->gw_fqdn, "disabled") == 0) {
-		safe_snprintf(gw_url_raw, REDIRECT_URL, "http://%s", config->gw_ip);
-	} else {
-		safe_snprintf(gw_url_raw, REDIRECT_URL, "http://%s", config->gw_fqdn);
-	}
-
-	gw_url = safe_calloc(REDIRECT_URL_ENC_BUF);
-	uh_urlencode(gw_url, REDIRECT_URL_ENC_BUF, gw_url_raw, strlen(gw_url_raw));
-	debug(LOG_DEBUG, "gw_url: %s", gw_url);
-	free (gw_url_raw);
-
-	clienttype = safe_calloc(STATUS_BUF);
+	tmpl = get_query_template();
 
 	if (!client->client_type || strlen(client->client_type) == 0) {
-		clienttype = safe_strdup("cpd_can");
+		clienttype = request_strdup("cpd_can");
 	} else {
-		clienttype = safe_strdup(client->client_type);
+		clienttype = request_strdup(client->client_type);
 	}
 
 	if (config->fas_secure_enabled == 0) {
@@ -1450,12 +1903,12 @@ static char *construct_querystring(struct MHD_Connection *connection, t_client *
 				debug(LOG_DEBUG, "hid=%s", client->hid);
 
 				if (config->preauth) {
-					clientif = safe_calloc(STATUS_BUF);
+					clientif = request_calloc(STATUS_BUF);
 
 					get_client_interface(clientif, STATUS_BUF, client->mac);
 					debug(LOG_DEBUG, "clientif: [%s] url_encoded_gw_name: [%s]", clientif, config->url_encoded_gw_name);
 
-					query_str = safe_calloc(QUERYMAXLEN);
+					query_str = request_calloc(QUERYMAXLEN);
 
 					snprintf(query_str, QUERYMAXLEN,
 						"hid=%s",
@@ -1463,51 +1916,30 @@ static char *construct_querystring(struct MHD_Connection *connection, t_client *
 					);
 
 				} else {
-					clientif = safe_calloc(STATUS_BUF);
+					clientif = request_calloc(STATUS_BUF);
 
 					get_client_interface(clientif, STATUS_BUF, client->mac);
 					debug(LOG_DEBUG, "clientif: [%s] url_encoded_gw_name: [%s]", clientif, config->url_encoded_gw_name);
 
-					query_str = safe_calloc(QUERYMAXLEN);
+					query_str = request_calloc(QUERYMAXLEN);
 
-					snprintf(query_str, QUERYMAXLEN,
-						"hid=%s%sclientip=%s%sclientmac=%s%sclient_type=%s%scpi_query=%s%sgatewayname=%s%sgatewayurl=%s%sversion=%s%sgatewayaddress=%s%sgatewaymac=%s%soriginurl=%s%sclientif=%s%sthemespec=%s%s%s%s%s%s",
-						client->hid, QUERYSEPARATOR,
-						client->ip, QUERYSEPARATOR,
-						client->mac, QUERYSEPARATOR,
-						clienttype, QUERYSEPARATOR,
-						client->cpi_query, QUERYSEPARATOR,
-						config->url_encoded_gw_name, QUERYSEPARATOR,
-						gw_url, QUERYSEPARATOR,
-						VERSION, QUERYSEPARATOR,
-						config->gw_address, QUERYSEPARATOR,
-						config->gw_mac, QUERYSEPARATOR,
-						originurl, QUERYSEPARATOR,
-						clientif, QUERYSEPARATOR,
-						config->themespec_path, QUERYSEPARATOR,
-						config->custom_params,
-						config->custom_vars,
-						config->custom_images,
-						config->custom_files
-					);
+					fill_query_string(query_str, tmpl, client, clienttype, originurl, clientif, 0);
 				}
 
+				// Encode straight into querystr, after the "?fas=" the FAS expects
+				memcpy(querystr, "?fas=", 5);
+				b64_encode(querystr + 5, QUERYMAXLEN - 6, query_str, strlen(query_str));
+				querystr[QUERYMAXLEN - 1] = '\0';
 
-				query_str_b64 = safe_calloc(ENC_QUERYSTR);
-
-				b64_encode(query_str_b64, ENC_QUERYSTR, query_str, strlen(query_str));
-
-				snprintf(querystr, ENC_QUERYSTR,
-					"?fas=%s",
-					query_str_b64
-				);
-
-				strncpy(cid, query_str_b64+5, 86);
-				client->cid = safe_strdup(cid);
+				strncpy(cid, querystr + 10, CLIENT_CID_LEN - 1);
+				// Mostly unchanged between redirects, so only rewritten when it differs
+				if (strcmp(client->cid, cid) != 0) {
+					memcpy(client->cid, cid, CLIENT_CID_LEN);
+				}
 
 				// Write the new cidfile:
-				msg = safe_calloc(STATUS_BUF);
-				cidinfo = safe_calloc(SMALL_BUF);
+				msg = request_calloc(STATUS_BUF);
+				cidinfo = request_calloc(SMALL_BUF);
 				debug(LOG_DEBUG, "writing cid file [%s]", cid);
 
 				safe_snprintf(cidinfo, MID_BUF, "cid=\"%s\"", cid);
@@ -1531,7 +1963,7 @@ static char *construct_querystring(struct MHD_Connection *connection, t_client *
 				safe_snprintf(cidinfo, SMALL_BUF, "gatewayname=\"%s\"\0", config->http_encoded_gw_name);
 				write_client_info(msg, STATUS_BUF, "write", cid, cidinfo);
 
-				safe_snprintf(cidinfo, SMALL_BUF, "gatewayurl=\"%s\"\0", gw_url);
+				safe_snprintf(cidinfo, SMALL_BUF, "gatewayurl=\"%s\"\0", tmpl->gw_url);
 				write_client_info(msg, STATUS_BUF, "write", cid, cidinfo);
 
 				safe_snprintf(cidinfo, SMALL_BUF, "version=\"%s\"\0", VERSION);
@@ -1540,7 +1972,7 @@ static char *construct_querystring(struct MHD_Connection *connection, t_client *
 				safe_snprintf(cidinfo, SMALL_BUF, "gatewayaddress=\"%s\"\0", config->gw_address);
 				write_client_info(msg, STATUS_BUF, "write", cid, cidinfo);
 
-				safe_snprintf(cidinfo, SMALL_BUF, "gatewaymac=\"%s\"\0", config->gw_mac);
+				safe_snprintf(cidinfo, SMALL_BUF, "gatewaymac=\"%s\"\0", tmpl->gw_mac);
 				write_client_info(msg, STATUS_BUF, "write", cid, cidinfo);
 
 				safe_snprintf(cidinfo, SMALL_BUF, "originurl=\"%s\"\0", originurl);
@@ -1574,12 +2006,6 @@ static char *construct_querystring(struct MHD_Connection *connection, t_client *
 					write_client_info(msg, STATUS_BUF, "parse", cid, cidinfo);
 				}
 
-				free(msg);
-				free(cidinfo);
-				free(query_str);
-				free(query_str_b64);
-				free(clientif);
-
 			} else {
 				snprintf(querystr, QUERYMAXLEN,
 					"?clientip=%s&gatewayname=%s&redir=%s",
@@ -1593,32 +2019,12 @@ static char *construct_querystring(struct MHD_Connection *connection, t_client *
 
 		debug(LOG_DEBUG, "hid=%s", client->hid);
 
-		clientif = safe_calloc(STATUS_BUF);
+		clientif = request_calloc(STATUS_BUF);
 		get_client_interface(clientif, STATUS_BUF, client->mac);
 		debug(LOG_DEBUG, "clientif: [%s]", clientif);
-		snprintf(querystr, QUERYMAXLEN,
-			"hid=%s%sclientip=%s%sclientmac=%s%sclient_type=%s%scpi_query=%s%sgatewayname=%s%sgatewayurl=%s%sversion=%s%sgatewayaddress=%s%sgatewaymac=%s%sauthdir=%s%soriginurl=%s%sclientif=%s%sthemespec=%s%s%s%s%s%s",
-			client->hid, QUERYSEPARATOR,
-			client->ip, QUERYSEPARATOR,
-			client->mac, QUERYSEPARATOR,
-			clienttype, QUERYSEPARATOR,
-			client->cpi_query, QUERYSEPARATOR,
-			config->url_encoded_gw_name, QUERYSEPARATOR,
-			gw_url, QUERYSEPARATOR,
-			VERSION, QUERYSEPARATOR,
-			config->gw_address, QUERYSEPARATOR,
-			config->gw_mac, QUERYSEPARATOR,
-			config->authdir, QUERYSEPARATOR,
-			originurl, QUERYSEPARATOR,
-			clientif, QUERYSEPARATOR,
-			config->themespec_path, QUERYSEPARATOR,
-			config->custom_params,
-			config->custom_vars,
-			config->custom_images,
-			config->custom_files
-		);
+		fill_query_string(querystr, tmpl, client, clienttype, originurl, clientif, 1);
 
-		phpcmd = safe_calloc(QUERYMAXLEN);
+		phpcmd = request_calloc(QUERYMAXLEN);
 		safe_snprintf(phpcmd, QUERYMAXLEN,
 			"echo '<?php \n"
 			"$key=\"%s\";\n"
@@ -1640,31 +2046,19 @@ static char *construct_querystring(struct MHD_Connection *connection, t_client *
 
 		debug(LOG_DEBUG, "phpcmd: %s", phpcmd);
 
-		msg = safe_calloc(QUERYMAXLEN);
-
-		if (!msg) {
-			send_error(connection, 503);
-			free(msg);
-		} else {
-
-			if (! execute_ret_url_encoded(msg, QUERYMAXLEN - 1, phpcmd) == 0) {
-				debug(LOG_ERR, "Error encrypting query string. %s", msg);
-			}
-
-			snprintf(querystr, QUERYMAXLEN, "%s", msg);
+		msg = request_calloc(QUERYMAXLEN);
 
-			free(msg);
-			free(phpcmd);
+		if (! execute_ret_url_encoded(msg, QUERYMAXLEN - 1, phpcmd) == 0) {
+			debug(LOG_ERR, "Error encrypting query string. %s", msg);
 		}
-		free(clientif);
+
+		snprintf(querystr, QUERYMAXLEN, "%s", msg);
 
 	} else {
 		snprintf(querystr, QUERYMAXLEN, "?clientip=%s&gatewayname=%s", client->ip, config->url_encoded_gw_name);
 	}
 
 	debug(LOG_DEBUG, "Constructed Query String [%s]", querystr);
-	free(clienttype);
-	free(gw_url);
 	return querystr;
 }
 
@@ -1678,13 +2072,72 @@ static char *construct_querystring(struct MHD_Connection *connection, t_client *
 static t_client *
 add_client(const char *mac, const char *ip)
 {
-	t_client *client;
+	// Only the insertion takes client_list_mutex, the dhcp check and hashing run unlocked
+	return client_list_admit_client(mac, ip);
+}
 
-	LOCK_CLIENT_LIST();
-	client = client_list_add_client(mac, ip);
-	UNLOCK_CLIENT_LIST();
+/**
+ * @brief build_redirect_body - fill the redirect page template with url
+ * @param url the redirect target
+ * @param length set to the length of the page, without the terminating null
+ * @return the page, allocated from the request arena
+ */
+static char *build_redirect_body(const char *url, size_t *length)
+{
+	size_t url_len;
+	char *body;
+	char *p;
+
+	url_len = strlen(url);
+	*length = (sizeof(redirect_head) - 1) + url_len + (sizeof(redirect_mid) - 1) + url_len + (sizeof(redirect_tail) - 1);
+
+	body = request_calloc(*length + 1);
+	p = body;
+
+	memcpy(p, redirect_head, sizeof(redirect_head) - 1);
+	p += sizeof(redirect_head) - 1;
+	memcpy(p, url, url_len);
+	p += url_len;
+	memcpy(p, redirect_mid, sizeof(redirect_mid) - 1);
+	p += sizeof(redirect_mid) - 1;
+	memcpy(p, url, url_len);
+	p += url_len;
+	memcpy(p, redirect_tail, sizeof(redirect_tail) - 1);
+
+	return body;
+}
 
-	return client;
+/**
+ * @brief redirect_keeps_alive - decide whether a redirect to url leaves the connection open
+ *
+ * A client redirected to a page we serve ourselves (splash page, themespec preauth page,
+ * post logout page) comes straight back for the page and then its css and images, but only
+ * over a connection it already holds to the gateway's own name. So the connection is kept
+ * when the request itself was for gw_address or gw_fqdn. A probe or other request for a
+ * foreign host, and a redirect to a remote FAS or the client's original destination, close
+ * the connection as before.
+ */
+static int redirect_keeps_alive(struct MHD_Connection *connection, const char *url)
+{
+	const char *host;
+	s_config *config;
+
+	config = config_get_config();
+
+	if (!config->redirect_keepalive || !gw_url || strncmp(url, gw_url, gw_url_len) != 0) {
+		return 0;
+	}
+
+	host = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Host");
+
+	if (!host) {
+		return 0;
+	}
+
+	// Port 80 is special, because the hostname doesn't need a port
+	return strcmp(host, config->gw_address) == 0
+		|| (config->gw_fqdn && strcmp(host, config->gw_fqdn) == 0)
+		|| (config->gw_port == 80 && strcmp(host, config->gw_ip) == 0);
 }
 
 int send_redirect_temp(struct MHD_Connection *connection, t_client *client, const char *url)
@@ -1693,15 +2146,14 @@ int send_redirect_temp(struct MHD_Connection *connection, t_client *client, cons
 	struct MHD_Response *response;
 	int ret;
 	char *redirect;
+	size_t length;
 
-	redirect = safe_calloc(SMALL_BUF);
-
-	safe_snprintf(redirect, SMALL_BUF, "<html><head></head><body><a href='%s'>Click here to continue to<br>%s</a></body></html", url, url);
+	redirect = build_redirect_body(url, &length);
 
 	debug(LOG_DEBUG, "send_redirect_temp: MHD_create_response_from_buffer. url [%s]", url);
 	debug(LOG_DEBUG, "send_redirect_temp: Redirect to [%s]", redirect);
 
-	response = MHD_create_response_from_buffer(SMALL_BUF, redirect, MHD_RESPMEM_MUST_FREE);
+	response = MHD_create_response_from_buffer(length, redirect, MHD_RESPMEM_PERSISTENT);
 
 	if (!response) {
 		debug(LOG_DEBUG, "send_redirect_temp: Failed to create response....");
@@ -1718,12 +2170,16 @@ int send_redirect_temp(struct MHD_Connection *connection, t_client *client, cons
 		debug(LOG_DEBUG, "send_redirect_temp: Location header added to redirection page");
 	}
 
-	ret = MHD_add_response_header(response, "Connection", "close");
-
-	if (ret == MHD_NO) {
-		debug(LOG_ERR, "send_redirect_temp: Error adding Connection header to redirection page");
+	if (redirect_keeps_alive(connection, url)) {
+		debug(LOG_DEBUG, "send_redirect_temp: Redirect to local page, keeping the connection open");
 	} else {
-		debug(LOG_DEBUG, "send_redirect_temp: Connection header added to redirection page");
+		ret = MHD_add_response_header(response, "Connection", "close");
+
+		if (ret == MHD_NO) {
+			debug(LOG_ERR, "send_redirect_temp: Error adding Connection header to redirection page");
+		} else {
+			debug(LOG_DEBUG, "send_redirect_temp: Connection header added to redirection page");
+		}
 	}
 
 	debug(LOG_DEBUG, "send_redirect_temp: Queueing response");
@@ -1742,7 +2198,7 @@ int send_redirect_temp(struct MHD_Connection *connection, t_client *client, cons
 }
 
 // save the query or empty string into **query.
-static int get_query(struct MHD_Connection *connection, char **query, const char *separator)
+int get_query(struct MHD_Connection *connection, char **query, const char *separator)
 {
 	int element_counter;
 	char **elements;
@@ -1756,13 +2212,10 @@ static int get_query(struct MHD_Connection *connection, char **query, const char
 
 	element_counter = MHD_get_connection_values(connection, MHD_GET_ARGUMENT_KIND, counter_iterator, NULL);
 	if (element_counter < 0) {
-		*query = safe_strdup("");
-		return MHD_NO;
-	}
-	elements = calloc(element_counter, sizeof(char *));
-	if (elements == NULL) {
+		*query = request_strdup("");
 		return MHD_NO;
 	}
+	elements = request_calloc(element_counter * sizeof(char *));
 	collect_query.i = 0;
 	collect_query.elements = elements;
 
@@ -1782,14 +2235,10 @@ static int get_query(struct MHD_Connection *connection, char **query, const char
 
 	// don't miss the zero terminator
 	if (*query == NULL) {
-		for (i = 0; i < element_counter; i++) {
-			free(elements[i]);
-		}
-		free(elements);
 		return 0;
 	}
 
-	query_str = safe_calloc(QUERYMAXLEN);
+	query_str = request_calloc(QUERYMAXLEN);
 
 	for (i = 0, j = 0; i < element_counter; i++) {
 		if (!elements[i]) {
@@ -1815,14 +2264,10 @@ static int get_query(struct MHD_Connection *connection, char **query, const char
 		} else {
 			debug(LOG_WARNING, " Query string is too long, invalid or corrupt so is ignored.");
 		}
-
-		free(elements[i]);
 	}
 
 	debug(LOG_DEBUG, " query is [%s]", query_str);
 	strncpy(*query, query_str, QUERYMAXLEN);
-	free(query_str);
-	free(elements);
 	return 0;
 }
 
@@ -1846,10 +2291,14 @@ static int send_error(struct MHD_Connection *connection, int error)
 	char *cmd;
 	const char *mimetype = lookup_mimetype("foo.html");
 	char ip[INET6_ADDRSTRLEN+1];
+	char code[8];
 
 	int ret = MHD_NO;
 	s_config *config = config_get_config();
 
+	snprintf(code, sizeof(code), "%d", error);
+	metrics_inc(METRIC_HTTP_ERROR, code);
+
 	switch (error) {
 	case 200:
 		response = MHD_create_response_from_buffer(strlen(page_200), (char *)page_200, MHD_RESPMEM_MUST_COPY);
@@ -1901,30 +2350,20 @@ static int send_error(struct MHD_Connection *connection, int error)
 	case 511:
 		get_client_ip(ip, connection);
 
-		page_511 = safe_calloc(HTMLMAXSIZE);
+		page_511 = request_calloc(HTMLMAXSIZE);
 
-		if (!page_511) {
-			ret = send_error(connection, 503);
-			free(page_511);
-			break;
-		}
-
-		cmd = safe_calloc(SMALL_BUF);
+		cmd = request_calloc(SMALL_BUF);
 		safe_snprintf(cmd, SMALL_BUF, "%s err511 '%s'", config->status_path, ip);
 
-		if (execute_ret_url_encoded(page_511, HTMLMAXSIZE - 1, cmd) == 0) {
+		if (render_cache_exec(page_511, HTMLMAXSIZE - 1, ip, cmd) == 0) {
 			debug(LOG_INFO, "Network Authentication Required - page_511 html generated for [%s]", ip);
 		} else {
 			debug(LOG_WARNING, "Script: %s - failed to execute", config->status_path);
 			ret = send_error(connection, 503);
-			free(cmd);
-			free(page_511);
 			return ret;
 		}
 
-		free(cmd);
-
-		response = MHD_create_response_from_buffer(strlen(page_511), (char *)page_511, MHD_RESPMEM_MUST_FREE);
+		response = MHD_create_response_from_buffer(strlen(page_511), (char *)page_511, MHD_RESPMEM_PERSISTENT);
 
 		if (response) {
 			MHD_add_response_header(response, "Content-Type", mimetype);
@@ -2084,59 +2523,210 @@ const char *lookup_mimetype(const char *filename)
 	return DEFAULT_MIME_TYPE;
 }
 
+// Returns 1 if the client will take a gzip content-coding
+static int accepts_gzip(struct MHD_Connection *connection)
+{
+	const char *accept;
+	const char *p;
+
+	accept = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Accept-Encoding");
+
+	if (!accept) {
+		return 0;
+	}
+
+	for (p = strcasestr(accept, "gzip"); p; p = strcasestr(p + 4, "gzip")) {
+		// Must be a whole token, not eg "x-gzip"
+		if (p != accept && p[-1] != ' ' && p[-1] != ',') {
+			continue;
+		}
+
+		p += 4;
+		while (*p == ' ') {
+			p++;
+		}
+
+		// gzip;q=0 means the client refuses it
+		if (*p == ';') {
+			p++;
+			while (*p == ' ') {
+				p++;
+			}
+
+			if ((p[0] == 'q' || p[0] == 'Q') && p[1] == '=' && strtod(p + 2, NULL) == 0.0) {
+				return 0;
+			}
+		}
+
+		return 1;
+	}
+
+	return 0;
+}
+
+// Returns 1 if an If-None-Match header lists etag (weak comparison, RFC 7232 3.2)
+static int etag_matches(const char *header, const char *etag)
+{
+	const char *p = header;
+	size_t etag_len = strlen(etag);
+	size_t len;
+
+	while (*p) {
+		while (*p == ' ' || *p == ',') {
+			p++;
+		}
+
+		if (*p == '*') {
+			return 1;
+		}
+
+		if (strncmp(p, "W/", 2) == 0) {
+			p += 2;
+		}
+
+		len = strcspn(p, ",");
+
+		while (len > 0 && p[len - 1] == ' ') {
+			len--;
+		}
+
+		if (len == etag_len && strncmp(p, etag, len) == 0) {
+			return 1;
+		}
+
+		p += strcspn(p, ",");
+	}
+
+	return 0;
+}
+
+// Returns 1 if the request validators show the client copy of blob is current
+static int is_not_modified(struct MHD_Connection *connection, t_webroot_blob *blob)
+{
+	const char *inm;
+	const char *ims;
+	struct tm tm;
+	char *end;
+
+	inm = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "If-None-Match");
+
+	// If-None-Match takes precedence over If-Modified-Since
+	if (inm) {
+		return etag_matches(inm, blob->etag);
+	}
+
+	ims = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "If-Modified-Since");
+
+	if (!ims) {
+		return 0;
+	}
+
+	memset(&tm, 0, sizeof(tm));
+	end = strptime(ims, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+	if (!end) {
+		return 0;
+	}
+
+	return (blob->mtime <= timegm(&tm));
+}
+
+static void add_cache_headers(struct MHD_Response *response, t_webroot_blob *blob)
+{
+	s_config *config = config_get_config();
+	char cache_control[64];
+
+	if (config->webroot_cache_maxage > 0) {
+		snprintf(cache_control, sizeof(cache_control), "public, max-age=%u", config->webroot_cache_maxage);
+	} else {
+		snprintf(cache_control, sizeof(cache_control), "no-cache");
+	}
+
+	MHD_add_response_header(response, "Cache-Control", cache_control);
+	MHD_add_response_header(response, "ETag", blob->etag);
+	MHD_add_response_header(response, "Last-Modified", blob->last_modified);
+
+	if (blob->has_gzip) {
+		MHD_add_response_header(response, "Vary", "Accept-Encoding");
+	}
+}
+
+// MHD is done with a cached buffer, drop the reference the response held
+static void release_cached_buffer(void *data)
+{
+	webroot_cache_release(webroot_cache_blob_of(data));
+}
+
 /**
  * @brief serve_file try to serve a request via filesystem. Using webroot as root.
+ * Files come from the webroot cache, with validators so that browsers can
+ * revalidate rather than download again on every splash page view.
  * @param connection
  * @param client
  * @return
  */
 static int serve_file(struct MHD_Connection *connection, t_client *client, const char *url)
 {
-	struct stat stat_buf;
-	s_config *config = config_get_config();
 	struct MHD_Response *response;
-	char filename[PATH_MAX];
+	t_webroot_blob *blob;
 	int ret = MHD_NO;
-	const char *mimetype = NULL;
-	off_t size;
+	int status = MHD_HTTP_OK;
+	int fd;
+	double started = metrics_now();
 
-	snprintf(filename, PATH_MAX, "%s/%s", config->webroot, url);
+	blob = webroot_cache_get(url, accepts_gzip(connection));
 
-	// check if file exists and is not a directory
-	ret = stat(filename, &stat_buf);
-	if (ret) {
-		// stat failed
-		debug(LOG_DEBUG, "File %s could not be found", filename);
+	if (!blob) {
+		debug(LOG_DEBUG, "File %s/%s could not be found", config_get_config()->webroot, url);
 		return send_error(connection, 404);
 	}
 
-	if (!S_ISREG(stat_buf.st_mode)) {
-#ifdef S_ISLNK
-		// ignore links
-		if (!S_ISLNK(stat_buf.st_mode))
-#endif // S_ISLNK
-		return send_error(connection, 404);
-	}
+	if (is_not_modified(connection, blob)) {
+		status = MHD_HTTP_NOT_MODIFIED;
+		response = MHD_create_response_from_buffer(0, NULL, MHD_RESPMEM_PERSISTENT);
+	} else if (blob->data) {
+		// The response holds its own reference, released when MHD has sent it
+		webroot_cache_ref(blob);
+		response = MHD_create_response_from_buffer_with_free_callback(blob->size, blob->data, release_cached_buffer);
 
-	int fd = open(filename, O_RDONLY);
-	if (fd < 0)
-		return send_error(connection, 404);
+		if (!response) {
+			webroot_cache_release(blob);
+		}
+	} else {
+		fd = open(blob->filename, O_RDONLY | O_CLOEXEC);
+
+		if (fd < 0) {
+			webroot_cache_release(blob);
+			return send_error(connection, 404);
+		}
 
-	mimetype = lookup_mimetype(filename);
+		response = MHD_create_response_from_fd(blob->size, fd);
 
-	// serving file and creating response
-	size = lseek(fd, 0, SEEK_END);
-	if (size < 0)
-		return send_error(connection, 404);
+		if (!response) {
+			close(fd);
+		}
+	}
 
-	response = MHD_create_response_from_fd(size, fd);
-	if (!response)
+	if (!response) {
+		webroot_cache_release(blob);
 		return send_error(connection, 503);
+	}
 
-	MHD_add_response_header(response, "Content-Type", mimetype);
-	ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+	// A 304 carries the validators and Vary of the 200 it stands for, but no representation headers
+	if (status == MHD_HTTP_OK) {
+		MHD_add_response_header(response, "Content-Type", lookup_mimetype(url));
+
+		if (blob->gzip) {
+			MHD_add_response_header(response, "Content-Encoding", "gzip");
+		}
+	}
+
+	add_cache_headers(response, blob);
+	webroot_cache_release(blob);
+
+	ret = MHD_queue_response(connection, status, response);
 	MHD_destroy_response(response);
+	metrics_observe(METRIC_HTTP_REQUEST, "serve_file", metrics_now() - started);
 
 	return ret;
 }
-
@@ -21,6 +21,12 @@ int arp_get(char mac_addr[18], const char req_ip[]);
 void start_mhd(void);
 void stop_mhd(void);
 
+/** @brief Collects the query arguments of a request, joined by separator, into *query */
+int get_query(struct MHD_Connection *connection, char **query, const char *separator);
+
+/** @brief Returns the mimetype for the extension of filename */
+const char *lookup_mimetype(const char *filename);
+
 enum MHD_Result libmicrohttpd_cb (void *cls,
 					struct MHD_Connection *connection,
 					const char *url,
@@ -0,0 +1,381 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @internal
+  @file lockstat.c
+  @brief Instrumented locking of the global mutexes, with wait, hold and call site statistics
+  @author Copyright (C) 2015-2025 Modifications and additions by BlueWave Projects and Services <opennds@blue-wave.net>
+
+  LOCK_CLIENT_LIST() and LOCK_CONFIG() pass their __FILE__ and __LINE__ here, so
+  every acquisition is attributed to a call site. For each lock this keeps wait
+  and hold time histograms, the current holder, and per call site totals,
+  including how much waiting each site caused other threads while it held the
+  lock. "ndsctl locks" prints the report, and the wait and hold times are also
+  exported by "ndsctl metrics".
+
+  Histograms use power of two microsecond buckets, so percentiles are reported
+  as the upper bound of the bucket they fall in.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "debug.h"
+#include "metrics.h"
+#include "lockstat.h"
+
+/** Bucket i counts times of up to 2^i microseconds, the last one everything longer */
+#define LOCKSTAT_BUCKETS 32
+
+typedef struct {
+	const char *file;
+	int line;
+	unsigned long long int count;		/**< @brief Times the lock was taken here */
+	unsigned long long int contended;	/**< @brief Times the lock was already held when requested here */
+	double wait_total;
+	double wait_max;
+	double hold_total;
+	double hold_max;
+	unsigned long long int blocked;		/**< @brief Times another thread had to wait while this site held the lock */
+	double blocked_total;			/**< @brief Total time other threads waited for this site */
+} t_lock_site;
+
+typedef struct {
+	const char *name;
+	int holder;				/**< @brief Index of the holding site, -1 if free */
+	double locked_at;
+	unsigned long long int wait_buckets[LOCKSTAT_BUCKETS];
+	unsigned long long int hold_buckets[LOCKSTAT_BUCKETS];
+	double wait_max;
+	double hold_max;
+	t_lock_site sites[LOCKSTAT_MAX_SITES];
+	int site_count;
+} t_lock_stats;
+
+static pthread_mutex_t lockstat_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static t_lock_stats locks[LOCKSTAT_LOCKS] = {
+	[LOCKSTAT_CLIENT_LIST] = {.name = "client_list", .holder = -1},
+	[LOCKSTAT_CONFIG] = {.name = "config", .holder = -1},
+};
+
+static int
+bucket(double seconds)
+{
+	double bound = 1e-6;
+	int i;
+
+	for (i = 0; i < LOCKSTAT_BUCKETS - 1; i++, bound *= 2) {
+		if (seconds <= bound) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+// Called with lockstat_mutex held
+static int
+find_site(t_lock_stats *l, const char *file, int line)
+{
+	const char *base;
+	int i;
+
+	base = strrchr(file, '/');
+	base = base ? base + 1 : file;
+
+	for (i = 0; i < l->site_count; i++) {
+		if (l->sites[i].line == line && strcmp(l->sites[i].file, base) == 0) {
+			return i;
+		}
+	}
+
+	// Keep the last slot for everything that does not fit
+	if (l->site_count >= LOCKSTAT_MAX_SITES - 1) {
+		base = "other";
+		line = 0;
+
+		for (i = 0; i < l->site_count; i++) {
+			if (l->sites[i].line == 0) {
+				return i;
+			}
+		}
+	}
+
+	i = l->site_count++;
+	l->sites[i].file = base;
+	l->sites[i].line = line;
+
+	return i;
+}
+
+void
+lockstat_lock(int lock, pthread_mutex_t *mutex, const char *file, int line)
+{
+	t_lock_stats *l = &locks[lock];
+	t_lock_site *s;
+	double requested;
+	double acquired;
+	double wait;
+	int contended = 0;
+	int blocker = -1;
+
+	requested = metrics_now();
+
+	if (pthread_mutex_trylock(mutex) != 0) {
+		contended = 1;
+
+		pthread_mutex_lock(&lockstat_mutex);
+		blocker = l->holder;
+		pthread_mutex_unlock(&lockstat_mutex);
+
+		pthread_mutex_lock(mutex);
+	}
+
+	acquired = metrics_now();
+	wait = acquired - requested;
+
+	pthread_mutex_lock(&lockstat_mutex);
+
+	l->holder = find_site(l, file, line);
+	l->locked_at = acquired;
+
+	s = &l->sites[l->holder];
+	s->count++;
+	s->contended += contended;
+	s->wait_total += wait;
+
+	if (wait > s->wait_max) {
+		s->wait_max = wait;
+	}
+
+	if (wait > l->wait_max) {
+		l->wait_max = wait;
+	}
+
+	l->wait_buckets[bucket(wait)]++;
+
+	if (blocker >= 0) {
+		l->sites[blocker].blocked++;
+		l->sites[blocker].blocked_total += wait;
+	}
+
+	pthread_mutex_unlock(&lockstat_mutex);
+
+	metrics_observe(METRIC_LOCK_WAIT, l->name, wait);
+}
+
+void
+lockstat_unlock(int lock, pthread_mutex_t *mutex)
+{
+	t_lock_stats *l = &locks[lock];
+	t_lock_site *s;
+	double hold;
+
+	pthread_mutex_lock(&lockstat_mutex);
+
+	hold = metrics_now() - l->locked_at;
+
+	if (l->holder >= 0) {
+		s = &l->sites[l->holder];
+		s->hold_total += hold;
+
+		if (hold > s->hold_max) {
+			s->hold_max = hold;
+		}
+	}
+
+	if (hold > l->hold_max) {
+		l->hold_max = hold;
+	}
+
+	l->hold_buckets[bucket(hold)]++;
+	l->holder = -1;
+
+	pthread_mutex_unlock(&lockstat_mutex);
+
+	pthread_mutex_unlock(mutex);
+
+	metrics_observe(METRIC_LOCK_HOLD, l->name, hold);
+}
+
+// Percentile q of a histogram in milliseconds, as the bound of its bucket but no more than max
+static double
+percentile(const unsigned long long int *buckets, double max, double q)
+{
+	unsigned long long int total = 0;
+	unsigned long long int rank;
+	unsigned long long int seen = 0;
+	double bound = 1e-6;
+	int i;
+
+	for (i = 0; i < LOCKSTAT_BUCKETS; i++) {
+		total += buckets[i];
+	}
+
+	if (total == 0) {
+		return 0;
+	}
+
+	rank = (unsigned long long int)(q * total);
+
+	if (rank < 1) {
+		rank = 1;
+	}
+
+	for (i = 0; i < LOCKSTAT_BUCKETS - 1; i++, bound *= 2) {
+		seen += buckets[i];
+
+		if (seen >= rank) {
+			break;
+		}
+	}
+
+	return 1000 * (bound < max ? bound : max);
+}
+
+static int
+compare_hold(const void *a, const void *b)
+{
+	const t_lock_site *sa = a;
+	const t_lock_site *sb = b;
+
+	if (sa->hold_total < sb->hold_total) {
+		return 1;
+	}
+
+	if (sa->hold_total > sb->hold_total) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+write_histogram(FILE *fp, const char *what, const unsigned long long int *buckets, double max)
+{
+	fprintf(fp, "  %s (ms): p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  max %.3f\n", what,
+		percentile(buckets, max, 0.5),
+		percentile(buckets, max, 0.9),
+		percentile(buckets, max, 0.99),
+		percentile(buckets, max, 0.999),
+		1000 * max
+	);
+}
+
+static void
+write_lock(FILE *fp, t_lock_stats *l, double now)
+{
+	t_lock_site sites[LOCKSTAT_MAX_SITES];
+	unsigned long long int count = 0;
+	unsigned long long int contended = 0;
+	char site[80];
+	int i;
+
+	for (i = 0; i < l->site_count; i++) {
+		count += l->sites[i].count;
+		contended += l->sites[i].contended;
+	}
+
+	fprintf(fp, "Lock %s:\n", l->name);
+
+	if (l->holder >= 0) {
+		fprintf(fp, "  Held by %s:%d for %.3f ms\n",
+			l->sites[l->holder].file, l->sites[l->holder].line, 1000 * (now - l->locked_at));
+	} else {
+		fprintf(fp, "  Not held\n");
+	}
+
+	fprintf(fp, "  Acquired %llu times, %llu contended (%.1f%%)\n",
+		count, contended, count ? 100.0 * contended / count : 0.0);
+
+	write_histogram(fp, "Wait", l->wait_buckets, l->wait_max);
+	write_histogram(fp, "Hold", l->hold_buckets, l->hold_max);
+
+	// Busiest call sites first
+	memcpy(sites, l->sites, l->site_count * sizeof(t_lock_site));
+	qsort(sites, l->site_count, sizeof(t_lock_site), compare_hold);
+
+	fprintf(fp, "\n  %-28s %10s %10s %12s %10s %12s %10s %10s %14s\n",
+		"Call site", "Count", "Contended", "Wait total", "Wait max", "Hold total", "Hold max",
+		"Blocked", "Blocked total");
+
+	for (i = 0; i < l->site_count; i++) {
+		if (sites[i].line) {
+			snprintf(site, sizeof(site), "%s:%d", sites[i].file, sites[i].line);
+		} else {
+			snprintf(site, sizeof(site), "%s", sites[i].file);
+		}
+
+		fprintf(fp, "  %-28s %10llu %10llu %12.3f %10.3f %12.3f %10.3f %10llu %14.3f\n",
+			site,
+			sites[i].count,
+			sites[i].contended,
+			1000 * sites[i].wait_total,
+			1000 * sites[i].wait_max,
+			1000 * sites[i].hold_total,
+			1000 * sites[i].hold_max,
+			sites[i].blocked,
+			1000 * sites[i].blocked_total
+		);
+	}
+
+	fprintf(fp, "\n");
+}
+
+void
+lockstat_write(FILE *fp)
+{
+	char *text = NULL;
+	size_t text_len = 0;
+	FILE *mem;
+	double now;
+	int i;
+
+	// Render into memory so a slow reader does not hold up threads taking the locks
+	mem = open_memstream(&text, &text_len);
+
+	if (!mem) {
+		debug(LOG_ERR, "Unable to render lock statistics");
+		return;
+	}
+
+	fprintf(mem, "Times are in milliseconds. Blocked counts the waits a call site caused other threads while holding the lock.\n\n");
+
+	pthread_mutex_lock(&lockstat_mutex);
+
+	now = metrics_now();
+
+	for (i = 0; i < LOCKSTAT_LOCKS; i++) {
+		write_lock(mem, &locks[i], now);
+	}
+
+	pthread_mutex_unlock(&lockstat_mutex);
+
+	fclose(mem);
+	fwrite(text, 1, text_len, fp);
+	free(text);
+}
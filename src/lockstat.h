@@ -0,0 +1,51 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file lockstat.h
+    @brief Instrumented locking of the global mutexes, with wait, hold and call site statistics
+    @author Copyright (C) 2015-2025 Modifications and additions by BlueWave Projects and Services <opennds@blue-wave.net>
+*/
+
+#ifndef _LOCKSTAT_H_
+#define _LOCKSTAT_H_
+
+#include <stdio.h>
+#include <pthread.h>
+
+/** Instrumented locks. Keep in step with the table in lockstat.c */
+enum {
+	LOCKSTAT_CLIENT_LIST,		/**< @brief client_list_mutex */
+	LOCKSTAT_CONFIG,		/**< @brief config_mutex */
+	LOCKSTAT_LOCKS
+};
+
+/** Maximum number of call sites kept per lock, others are counted as "other" */
+#define LOCKSTAT_MAX_SITES 64
+
+/** @brief Lock mutex, recording the wait and the call site as the holder. Use the LOCK_ macros */
+void lockstat_lock(int lock, pthread_mutex_t *mutex, const char *file, int line);
+
+/** @brief Record the hold time and unlock mutex. Use the UNLOCK_ macros */
+void lockstat_unlock(int lock, pthread_mutex_t *mutex);
+
+/** @brief Write the lock report for "ndsctl locks" */
+void lockstat_write(FILE *fp);
+
+#endif /* _LOCKSTAT_H_ */
@@ -37,6 +37,8 @@
 #include <signal.h>
 #include <errno.h>
 #include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <arpa/inet.h>
 
@@ -63,6 +65,12 @@
 #include "ndsctl_thread.h"
 #include "fw_iptables.h"
 #include "util.h"
+#include "webroot_cache.h"
+#include "snapshot.h"
+#include "reload.h"
+#include "nftset_sync.h"
+#include "resolver.h"
+#include "netmon.h"
 
 #include <microhttpd.h>
 
@@ -82,10 +90,17 @@
  * in case we need them
  */
 static pthread_t tid_client_check = 0;
+static pthread_t tid_reload = 0;
+static pthread_t tid_nftset_sync = 0;
+static pthread_t tid_resolver = 0;
+static pthread_t tid_netmon = 0;
 
 // Time when opennds started
 time_t started_time = 0;
 
+// Carries a termination signal, or 0 when the control thread ends, to the main thread
+static int termination_pipe[2] = {-1, -1};
+
 static void catcher(int sig) {
 }
 
@@ -147,7 +162,8 @@ sigchld_handler(int s)
 }
 
 /** Exits cleanly after cleaning up the firewall.
- *  Use this function anytime you need to exit after firewall initialization
+ *  Use this function anytime you need to exit after firewall initialization.
+ *  Not async signal safe, termination signals reach it through termination_signal()
  */
 void
 termination_handler(int s)
@@ -213,6 +229,9 @@ termination_handler(int s)
 	}
 	free(dnscmd);
 
+	// Save the authenticated clients before they are deauthenticated, so a restart can restore them
+	snapshot_write();
+
 	auth_client_deauth_all();
 
 	debug(LOG_INFO, "Flushing firewall rules...");
@@ -223,6 +242,32 @@ termination_handler(int s)
 }
 
 
+/** @internal
+ * Handles SIGTERM, SIGQUIT and SIGINT by passing the signal to the main thread,
+ * which shuts down outside signal context, see main_loop()
+ */
+static void
+termination_signal(int s)
+{
+	unsigned char sig = s;
+	int saved_errno = errno;
+
+	if (write(termination_pipe[1], &sig, 1) < 0) {
+		// The pipe is full, so a termination is already pending
+	}
+
+	errno = saved_errno;
+}
+
+/** @internal
+ * Handles SIGHUP by requesting a reload of the configuration
+ */
+static void
+reload_handler(int s)
+{
+	reload_request();
+}
+
 /** @internal
  * Registers all the signal handlers
  */
@@ -255,8 +300,16 @@ init_signals(void)
 		exit(1);
 	}
 
-	debug(LOG_DEBUG, "Setting SIGTERM, SIGQUIT, SIGINT  handlers to termination_handler()");
-	sa.sa_handler = termination_handler;
+	if (pipe(termination_pipe) != 0
+		|| fcntl(termination_pipe[0], F_SETFD, FD_CLOEXEC) != 0
+		|| fcntl(termination_pipe[1], F_SETFD, FD_CLOEXEC) != 0
+		|| fcntl(termination_pipe[1], F_SETFL, O_NONBLOCK) != 0) {
+		debug(LOG_ERR, "pipe(): %s", strerror(errno));
+		exit(1);
+	}
+
+	debug(LOG_DEBUG, "Setting SIGTERM, SIGQUIT, SIGINT  handlers to termination_signal()");
+	sa.sa_handler = termination_signal;
 	sigemptyset(&sa.sa_mask);
 	sa.sa_flags = SA_RESTART;
 
@@ -277,6 +330,89 @@ init_signals(void)
 		debug(LOG_ERR, "sigaction(): %s", strerror(errno));
 		exit(1);
 	}
+
+	debug(LOG_DEBUG, "Setting SIGHUP handler to reload_handler()");
+	sa.sa_handler = reload_handler;
+
+	// Trap SIGHUP
+	if (sigaction(SIGHUP, &sa, NULL) == -1) {
+		debug(LOG_ERR, "sigaction(): %s", strerror(errno));
+		exit(1);
+	}
+}
+
+/** Kills any running authmon daemon and, if FAS is configured for Level >= 3,
+ *  starts a new one for the current config.
+ *  Return 0 on success, -1 if authmon could not be started.
+ */
+int
+authmon_start(void)
+{
+	char gwhash[66] = {0};
+	char authmonpid[16] = {0};
+	char *fasssl = NULL;
+	char *gatewayhash = NULL;
+	s_config *config = config_get_config();
+
+	// Check if authmon is running and if it is, kill it
+	safe_asprintf(&fasssl, "kill $(pgrep -f \"usr/lib/opennds/authmon.sh\") > /dev/null 2>&1");
+	if (system(fasssl) < 0) {
+		debug(LOG_ERR, "Error returned from system call - Continuing");
+	}
+	free(fasssl);
+
+	// Start the authmon daemon if configured for Level >= 3
+	if (config->fas_key && config->fas_secure_enabled >= 3) {
+
+		// Get the sha256 digest of gatewayname
+		safe_asprintf(&fasssl,
+			"/usr/lib/opennds/libopennds.sh hash_str \"%s\"",
+			config->url_encoded_gw_name
+		);
+
+		if (execute_ret_url_encoded(gwhash, sizeof(gwhash), fasssl) == 0) {
+			safe_asprintf(&gatewayhash, "%s", gwhash);
+			debug(LOG_DEBUG, "gatewayname digest is: %s\n", gwhash);
+		} else {
+			debug(LOG_ERR, "Error hashing gatewayname");
+			free(fasssl);
+			return -1;
+		}
+		free(fasssl);
+
+		// Start authmon in the background
+		safe_asprintf(&fasssl,
+			"/usr/lib/opennds/authmon.sh \"%s\" \"%s\" \"%s\" &",
+			config->fas_url,
+			gatewayhash,
+			config->fas_ssl
+		);
+
+		debug(LOG_DEBUG, "authmon startup command is: %s\n", fasssl);
+
+		if (system(fasssl) != 0) {
+			debug(LOG_ERR, "Error returned from system call - Continuing");
+		}
+		free(fasssl);
+		free(gatewayhash);
+
+		// Check authmon is running
+		safe_asprintf(&fasssl,
+			"pgrep -f \"usr/lib/opennds/authmon.sh\""
+		);
+
+		if (execute_ret_url_encoded(authmonpid, sizeof(authmonpid) - 1, fasssl) == 0) {
+			debug(LOG_INFO, "authmon pid is: %s\n", authmonpid);
+		} else {
+			debug(LOG_ERR, "Error starting authmon daemon");
+			free(fasssl);
+			return -1;
+		}
+
+		free(fasssl);
+	}
+
+	return 0;
 }
 
 /**@internal
@@ -290,12 +426,9 @@ setup_from_config(void)
 	char *msg;
 	char *mark_auth;
 	char *lib_cmd;
-	char gwhash[66] = {0};
-	char authmonpid[16] = {0};
 	char *socket;
 	char *fasurl = NULL;
 	char *fasssl = NULL;
-	char *gatewayhash = NULL;
 	char *fashid = NULL;
 	char *phpcmd = NULL;
 	char *preauth_dir = NULL;
@@ -373,77 +506,8 @@ setup_from_config(void)
 		debug(LOG_NOTICE, "Preemptive authentication is enabled");
 	}
 
-	// Setup custom FAS parameters if configured
-	char fasparam[MAX_BUF] = {0};
-	t_FASPARAM *fas_fasparam;
-	if (config->fas_custom_parameters_list) {
-		for (fas_fasparam = config->fas_custom_parameters_list; fas_fasparam != NULL; fas_fasparam = fas_fasparam->next) {
-
-			// Make sure we don't have a buffer overflow
-			if ((sizeof(fasparam) - strlen(fasparam)) > (strlen(fas_fasparam->fasparam) + 4)) {
-				strcat(fasparam, fas_fasparam->fasparam);
-				strcat(fasparam, QUERYSEPARATOR);
-			} else {
-				break;
-			}
-		}
-		config->custom_params = safe_strdup(fasparam);
-		debug(LOG_DEBUG, "Custom FAS parameter string [%s]", config->custom_params);
-	}
-
-	// Setup custom FAS variables if configured
-	char fasvar[MAX_BUF] = {0};
-	t_FASVAR *fas_fasvar;
-	if (config->fas_custom_parameters_list) {
-		for (fas_fasvar = config->fas_custom_variables_list; fas_fasvar != NULL; fas_fasvar = fas_fasvar->next) {
-
-			// Make sure we don't have a buffer overflow
-			if ((sizeof(fasvar) - strlen(fasvar)) > (strlen(fas_fasvar->fasvar) + 4)) {
-				strcat(fasvar, fas_fasvar->fasvar);
-				strcat(fasvar, QUERYSEPARATOR);
-			} else {
-				break;
-			}
-		}
-		config->custom_vars = safe_strdup(fasvar);
-		debug(LOG_DEBUG, "Custom FAS variables string [%s]", config->custom_vars);
-	}
-
-	// Setup custom FAS images if configured
-	char fasimage[MAX_BUF] = {0};
-	t_FASIMG *fas_fasimage;
-	if (config->fas_custom_images_list) {
-		for (fas_fasimage = config->fas_custom_images_list; fas_fasimage != NULL; fas_fasimage = fas_fasimage->next) {
-
-			// Make sure we don't have a buffer overflow
-			if ((sizeof(fasimage) - strlen(fasimage)) > (strlen(fas_fasimage->fasimg) + 4)) {
-				strcat(fasimage, fas_fasimage->fasimg);
-				strcat(fasimage, QUERYSEPARATOR);
-			} else {
-				break;
-			}
-		}
-		config->custom_images = safe_strdup(fasimage);
-		debug(LOG_DEBUG, "Custom FAS images string [%s]", config->custom_images);
-	}
-
-	// Setup custom FAS files if configured
-	char fasfile[MAX_BUF] = {0};
-	t_FASFILE *fas_fasfile;
-	if (config->fas_custom_files_list) {
-		for (fas_fasfile = config->fas_custom_files_list; fas_fasfile != NULL; fas_fasfile = fas_fasfile->next) {
-
-			// Make sure we don't have a buffer overflow
-			if ((sizeof(fasfile) - strlen(fasfile)) > (strlen(fas_fasfile->fasfile) + 4)) {
-				strcat(fasfile, fas_fasfile->fasfile);
-				strcat(fasfile, QUERYSEPARATOR);
-			} else {
-				break;
-			}
-		}
-		config->custom_files = safe_strdup(fasfile);
-		debug(LOG_DEBUG, "Custom FAS files string [%s]", config->custom_files);
-	}
+	// Setup custom FAS parameter, variable, image and file strings if configured
+	build_fas_custom_strings(config);
 
 	// Do any required dnsmasq configurations and restart it
 
@@ -548,6 +612,9 @@ setup_from_config(void)
 		started_time = time(NULL);
 	}
 
+	// Set up the cache of static files the web server will serve from webroot
+	webroot_cache_init();
+
 	// Initialize the web server
 	start_mhd();
 	debug(LOG_NOTICE, "Created web server on %s", config->gw_address);
@@ -716,62 +783,10 @@ setup_from_config(void)
 
 		free(fasurl);
 
-		// Check if authmon is running and if it is, kill it
-		safe_asprintf(&fasssl, "kill $(pgrep -f \"usr/lib/opennds/authmon.sh\") > /dev/null 2>&1");
-		if (system(fasssl) < 0) {
-			debug(LOG_ERR, "Error returned from system call - Continuing");
-		}
-		free(fasssl);
-
-		// Start the authmon daemon if configured for Level >= 3
-		if (config->fas_key && config->fas_secure_enabled >= 3) {
-
-			// Get the sha256 digest of gatewayname
-			safe_asprintf(&fasssl,
-				"/usr/lib/opennds/libopennds.sh hash_str \"%s\"",
-				config->url_encoded_gw_name
-			);
-
-			if (execute_ret_url_encoded(gwhash, sizeof(gwhash), fasssl) == 0) {
-				safe_asprintf(&gatewayhash, "%s", gwhash);
-				debug(LOG_DEBUG, "gatewayname digest is: %s\n", gwhash);
-			} else {
-				debug(LOG_ERR, "Error hashing gatewayname");
-				debug(LOG_ERR, "Exiting...");
-				exit(1);
-			}
-			free(fasssl);
-
-			// Start authmon in the background
-			safe_asprintf(&fasssl,
-				"/usr/lib/opennds/authmon.sh \"%s\" \"%s\" \"%s\" &",
-				config->fas_url,
-				gatewayhash,
-				config->fas_ssl
-			);
-
-			debug(LOG_DEBUG, "authmon startup command is: %s\n", fasssl);
-
-			if (system(fasssl) != 0) {
-				debug(LOG_ERR, "Error returned from system call - Continuing");
-			}
-			free(fasssl);
-
-			// Check authmon is running
-			safe_asprintf(&fasssl,
-				"pgrep -f \"usr/lib/opennds/authmon.sh\""
-			);
-
-			if (execute_ret_url_encoded(authmonpid, sizeof(authmonpid) - 1, fasssl) == 0) {
-				debug(LOG_INFO, "authmon pid is: %s\n", authmonpid);
-			} else {
-				debug(LOG_ERR, "Error starting authmon daemon");
-				debug(LOG_ERR, "Exiting...");
-				exit(1);
-			}
-
-			free(fasssl);
-			free(gatewayhash);
+		// (Re)start the authmon daemon if configured for Level >= 3
+		if (authmon_start() != 0) {
+			debug(LOG_ERR, "Exiting...");
+			exit(1);
 		}
 
 		// Report the FAS FQDN
@@ -893,6 +908,34 @@ setup_from_config(void)
 
 }
 
+/**@internal
+ * Wakes the main thread when the control thread ends, which it only does on failure
+ */
+static void
+ndsctl_ended(void *arg)
+{
+	unsigned char sig = 0;
+
+	if (write(termination_pipe[1], &sig, 1) < 0) {
+		// A termination is already pending
+	}
+}
+
+/**@internal
+ * Runs the control thread, telling the main thread when it exits
+ */
+static void *
+thread_ndsctl_main(void *arg)
+{
+	void *rc;
+
+	pthread_cleanup_push(ndsctl_ended, NULL);
+	rc = thread_ndsctl(arg);
+	pthread_cleanup_pop(1);
+
+	return rc;
+}
+
 /**@internal
  * Main execution loop
  */
@@ -900,10 +943,14 @@ static void
 main_loop(int argc, char **argv)
 {
 	int result = 0;
+	int restored;
+	unsigned char sig = 0;
 	char *cmd;
 	pthread_t tid;
 	s_config *config;
 
+	// Left only while waiting, the other threads may replace the config from now on
+	config_read_begin();
 	config = config_get_config();
 
 	// Initialize the config
@@ -915,6 +962,9 @@ main_loop(int argc, char **argv)
 	// Set up everything we need based on the configuration
 	setup_from_config();
 
+	// Restore the clients of the previous run, if it left a snapshot
+	restored = snapshot_restore();
+
 	ignore_sigpipe();
 
 	// Start watchdog, client statistics and timeout clean-up thread
@@ -926,29 +976,66 @@ main_loop(int argc, char **argv)
 	pthread_detach(tid_client_check);
 
 	// Start control thread
-	result = pthread_create(&tid, NULL, thread_ndsctl, (void *)(config->ndsctl_sock));
+	result = pthread_create(&tid, NULL, thread_ndsctl_main, (void *)(config->ndsctl_sock));
 	if (result != 0) {
 		debug(LOG_ERR, "FATAL: Failed to create thread_ndsctl - exiting");
 		termination_handler(1);
 	}
+	pthread_detach(tid);
 
-	debug(LOG_NOTICE, "openNDS is now running.\n");
-	safe_asprintf(&cmd, "/usr/lib/opennds/libopennds.sh \"auth_restore\" &");
-	if (system(cmd) != 0) {
-		debug(LOG_ERR, "failure: %s", cmd);
+	// Start the configuration reload thread, woken by SIGHUP
+	result = pthread_create(&tid_reload, NULL, thread_reload, NULL);
+	if (result != 0) {
+		debug(LOG_ERR, "FATAL: Failed to create thread_reload - exiting");
+		termination_handler(0);
 	}
-	free(cmd);
+	pthread_detach(tid_reload);
 
-	result = pthread_join(tid, NULL);
+	// Start the thread copying legacy ipsets to the nftsets
+	result = pthread_create(&tid_nftset_sync, NULL, thread_nftset_sync, NULL);
+	if (result != 0) {
+		debug(LOG_ERR, "FATAL: Failed to create thread_nftset_sync - exiting");
+		termination_handler(0);
+	}
+	pthread_detach(tid_nftset_sync);
 
-	if (result) {
-		debug(LOG_INFO, "Failed to wait for opennds thread.");
+	// Start the thread resolving the walled garden and remote FAS FQDNs
+	result = pthread_create(&tid_resolver, NULL, thread_resolver, NULL);
+	if (result != 0) {
+		debug(LOG_ERR, "FATAL: Failed to create thread_resolver - exiting");
+		termination_handler(0);
 	}
+	pthread_detach(tid_resolver);
+
+	// Start the thread following the gateway interface and upstream routes
+	result = pthread_create(&tid_netmon, NULL, thread_netmon, NULL);
+	if (result != 0) {
+		debug(LOG_ERR, "FATAL: Failed to create thread_netmon - exiting");
+		termination_handler(0);
+	}
+	pthread_detach(tid_netmon);
+
+	debug(LOG_NOTICE, "openNDS is now running.\n");
+
+	// Without a snapshot, fall back to restoring clients from the logs
+	if (restored < 0) {
+		safe_asprintf(&cmd, "/usr/lib/opennds/libopennds.sh \"auth_restore\" &");
+		if (system(cmd) != 0) {
+			debug(LOG_ERR, "failure: %s", cmd);
+		}
+		free(cmd);
+	}
+
+	// Wait for a termination signal, or for the control thread to end
+	config_read_end();
+	while (read(termination_pipe[0], &sig, 1) < 0 && errno == EINTR);
+	config_read_begin();
 
 	//MHD_stop_daemon(webserver);
 	stop_mhd();
 
-	termination_handler(result);
+	// The snapshot and firewall clean up run here, in the main thread
+	termination_handler(sig);
 }
 
 /** Main entry point for opennds.
@@ -33,5 +33,8 @@
 /** @brief exits cleanly and clear the firewall rules. */
 void termination_handler(int s);
 
+/** @brief (re)starts the authmon daemon if FAS is configured for it. */
+int authmon_start(void);
+
 
 #endif /* _MAIN_H_ */
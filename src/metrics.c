@@ -0,0 +1,349 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @internal
+  @file metrics.c
+  @brief Counters and latency histograms of daemon internals, in Prometheus text format
+  @author Copyright (C) 2015-2025 Modifications and additions by BlueWave Projects and Services <opennds@blue-wave.net>
+
+  Observations are kept in fixed tables so that recording one costs a short
+  critical section and no allocation. The text is rendered on request by
+  "ndsctl metrics", for scraping by a node_exporter textfile collector or
+  similar.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "common.h"
+#include "safe.h"
+#include "conf.h"
+#include "debug.h"
+#include "client_list.h"
+#include "fw_iptables.h"
+#include "metrics.h"
+
+#define METRIC_BUCKETS 14
+
+static const double bucket_bounds[METRIC_BUCKETS] = {
+	0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+
+typedef struct {
+	const char *name;
+	const char *type;
+	const char *label;		/**< @brief Label name, NULL if the family has a single series */
+	const char *help;
+} t_metric_family;
+
+static const t_metric_family families[METRIC_FAMILIES] = {
+	[METRIC_HTTP_REQUEST] = {"opennds_http_request_duration_seconds", "histogram", "handler", "Time to answer a request, by handler. serve_file is also included in the handler that called it"},
+	[METRIC_HTTP_ERROR] = {"opennds_http_errors_total", "counter", "code", "Responses sent by send_error(), by status code"},
+	[METRIC_EXEC] = {"opennds_exec_duration_seconds", "histogram", "command", "External commands run, and their run time"},
+	[METRIC_NFT] = {"opennds_nft_duration_seconds", "histogram", NULL, "nft transactions, including retries"},
+	[METRIC_LOCK_WAIT] = {"opennds_lock_wait_seconds", "histogram", "lock", "Time spent waiting for the client list and config locks"},
+	[METRIC_LOCK_HOLD] = {"opennds_lock_hold_seconds", "histogram", "lock", "Time the client list and config locks were held"},
+	[METRIC_SWEEP] = {"opennds_client_sweep_duration_seconds", "histogram", NULL, "Duration of each client list refresh"},
+	[METRIC_BINAUTH] = {"opennds_binauth_total", "counter", "result", "BinAuth authentication outcomes"},
+	[METRIC_PREAUTH] = {"opennds_preauth_total", "counter", "result", "PreAuth page requests, by outcome"},
+	[METRIC_RENDER] = {"opennds_render_total", "counter", "result", "PreAuth and err511 pages, run, shared with a concurrent request or served from the render cache"},
+	[METRIC_WATCHDOG] = {"opennds_mhd_watchdog_total", "counter", "result", "Web server health checks, answered at once, late or stalled, and restarts"},
+	[METRIC_FETCH] = {"opennds_remote_fetch_total", "counter", "result", "Themespec remote images and files fetched over http, updated, unchanged (304), deduplicated or failed"},
+	[METRIC_HTTP_SHED] = {"opennds_http_shed_total", "counter", "reason", "Requests refused before running scripts, over the source rate or the script budget"},
+};
+
+typedef struct {
+	char label[64];
+	unsigned long long int count;
+	double sum;
+	unsigned long long int buckets[METRIC_BUCKETS];
+} t_metric_series;
+
+static pthread_mutex_t metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static t_metric_series series[METRIC_FAMILIES][METRIC_MAX_SERIES];
+static int series_count[METRIC_FAMILIES];
+
+// Defined in auth.c
+extern unsigned int authenticated_since_start;
+
+double
+metrics_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Called with metrics_mutex held
+static t_metric_series *
+find_series(int family, const char *label)
+{
+	int i;
+
+	if (!label) {
+		label = "";
+	}
+
+	for (i = 0; i < series_count[family]; i++) {
+		if (strcmp(series[family][i].label, label) == 0) {
+			return &series[family][i];
+		}
+	}
+
+	// Keep the last slot for everything that does not fit
+	if (series_count[family] >= METRIC_MAX_SERIES - 1) {
+		label = "other";
+
+		for (i = 0; i < series_count[family]; i++) {
+			if (strcmp(series[family][i].label, label) == 0) {
+				return &series[family][i];
+			}
+		}
+	}
+
+	i = series_count[family]++;
+	snprintf(series[family][i].label, sizeof(series[family][i].label), "%s", label);
+
+	return &series[family][i];
+}
+
+void
+metrics_observe(int family, const char *label, double seconds)
+{
+	t_metric_series *s;
+	int i;
+
+	pthread_mutex_lock(&metrics_mutex);
+
+	s = find_series(family, label);
+	s->count++;
+	s->sum += seconds;
+
+	for (i = 0; i < METRIC_BUCKETS; i++) {
+		if (seconds <= bucket_bounds[i]) {
+			s->buckets[i]++;
+		}
+	}
+
+	pthread_mutex_unlock(&metrics_mutex);
+}
+
+void
+metrics_inc(int family, const char *label)
+{
+	pthread_mutex_lock(&metrics_mutex);
+	find_series(family, label)->count++;
+	pthread_mutex_unlock(&metrics_mutex);
+}
+
+// Copy one word of a command line, without quotes, returning the rest of the line
+static const char *
+command_word(char *buf, size_t len, const char *cmd)
+{
+	size_t n = 0;
+
+	while (*cmd == ' ') {
+		cmd++;
+	}
+
+	for (; *cmd && *cmd != ' '; cmd++) {
+		if (*cmd == '"' || *cmd == '\'') {
+			continue;
+		}
+
+		if (n + 1 < len) {
+			buf[n++] = *cmd;
+		}
+	}
+
+	buf[n] = '\0';
+	return cmd;
+}
+
+void
+metrics_command_label(char *buf, size_t len, const char *cmd)
+{
+	char word[64];
+	char *base;
+	char *p;
+	size_t n;
+
+	cmd = command_word(word, sizeof(word), cmd);
+	base = strrchr(word, '/');
+	base = base ? base + 1 : word;
+	snprintf(buf, len, "%s", base);
+
+	// Library scripts take a subcommand as their first argument, so count those separately
+	n = strlen(buf);
+
+	if (n > 3 && strcmp(buf + n - 3, ".sh") == 0) {
+		command_word(word, sizeof(word), cmd);
+
+		if (word[0]) {
+			snprintf(buf + n, len - n, " %s", word);
+		}
+	}
+
+	for (p = buf; *p; p++) {
+		if (!((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9')
+			|| *p == '_' || *p == '-' || *p == '.' || *p == ' ')) {
+			*p = '_';
+		}
+	}
+}
+
+static void
+write_label(FILE *fp, const char *name, const char *value, const char *le)
+{
+	if (!name && !le) {
+		return;
+	}
+
+	fputc('{', fp);
+
+	if (name) {
+		fprintf(fp, "%s=\"", name);
+
+		for (; *value; value++) {
+			if (*value == '\\' || *value == '"') {
+				fputc('\\', fp);
+			}
+
+			fputc(*value == '\n' ? ' ' : *value, fp);
+		}
+
+		fputc('"', fp);
+	}
+
+	if (le) {
+		fprintf(fp, "%sle=\"%s\"", name ? "," : "", le);
+	}
+
+	fputc('}', fp);
+}
+
+static void
+write_family(FILE *fp, int family)
+{
+	const t_metric_family *f = &families[family];
+	t_metric_series *s;
+	char le[16];
+	int i;
+	int b;
+
+	fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n", f->name, f->help, f->name, f->type);
+
+	for (i = 0; i < series_count[family]; i++) {
+		s = &series[family][i];
+
+		if (strcmp(f->type, "counter") == 0) {
+			fputs(f->name, fp);
+			write_label(fp, f->label, s->label, NULL);
+			fprintf(fp, " %llu\n", s->count);
+			continue;
+		}
+
+		for (b = 0; b < METRIC_BUCKETS; b++) {
+			snprintf(le, sizeof(le), "%g", bucket_bounds[b]);
+			fprintf(fp, "%s_bucket", f->name);
+			write_label(fp, f->label, s->label, le);
+			fprintf(fp, " %llu\n", s->buckets[b]);
+		}
+
+		fprintf(fp, "%s_bucket", f->name);
+		write_label(fp, f->label, s->label, "+Inf");
+		fprintf(fp, " %llu\n", s->count);
+
+		fprintf(fp, "%s_sum", f->name);
+		write_label(fp, f->label, s->label, NULL);
+		fprintf(fp, " %.6f\n", s->sum);
+
+		fprintf(fp, "%s_count", f->name);
+		write_label(fp, f->label, s->label, NULL);
+		fprintf(fp, " %llu\n", s->count);
+	}
+}
+
+void
+metrics_write(FILE *fp)
+{
+	const char *states[] = {"Preauthenticated", "Authenticated", "AuthBlocked", "Trusted"};
+	int counts[4] = {0, 0, 0, 0};
+	const char *state;
+	t_client *client;
+	char *text = NULL;
+	size_t text_len = 0;
+	FILE *mem;
+	int i;
+
+	READ_LOCK_CLIENT_LIST();
+
+	for (client = client_get_first_client(); client; client = client_get_next_client(client)) {
+		state = fw_connection_state_as_string(client->fw_connection_state);
+
+		for (i = 0; i < 4; i++) {
+			if (strcmp(state, states[i]) == 0) {
+				counts[i]++;
+				break;
+			}
+		}
+	}
+
+	READ_UNLOCK_CLIENT_LIST();
+
+	fprintf(fp, "# HELP opennds_clients Clients in the client list, by firewall connection state\n");
+	fprintf(fp, "# TYPE opennds_clients gauge\n");
+
+	for (i = 0; i < 4; i++) {
+		fprintf(fp, "opennds_clients{state=\"%s\"} %d\n", states[i], counts[i]);
+	}
+
+	fprintf(fp, "# HELP opennds_authenticated_since_start_total Clients authenticated since opennds started\n");
+	fprintf(fp, "# TYPE opennds_authenticated_since_start_total counter\n");
+	fprintf(fp, "opennds_authenticated_since_start_total %u\n", authenticated_since_start);
+
+	// Render into memory so a slow reader does not hold up threads recording observations
+	mem = open_memstream(&text, &text_len);
+
+	if (!mem) {
+		debug(LOG_ERR, "Unable to render metrics");
+		return;
+	}
+
+	pthread_mutex_lock(&metrics_mutex);
+
+	for (i = 0; i < METRIC_FAMILIES; i++) {
+		write_family(mem, i);
+	}
+
+	pthread_mutex_unlock(&metrics_mutex);
+
+	fclose(mem);
+	fwrite(text, 1, text_len, fp);
+	free(text);
+}
@@ -0,0 +1,67 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file metrics.h
+    @brief Counters and latency histograms of daemon internals, in Prometheus text format
+    @author Copyright (C) 2015-2025 Modifications and additions by BlueWave Projects and Services <opennds@blue-wave.net>
+*/
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdio.h>
+
+/** Metric families. Keep in step with the table in metrics.c */
+enum {
+	METRIC_HTTP_REQUEST,		/**< @brief histogram, by handler */
+	METRIC_HTTP_ERROR,		/**< @brief counter, by status code */
+	METRIC_EXEC,			/**< @brief histogram, by external command */
+	METRIC_NFT,			/**< @brief histogram, nft transactions including retries */
+	METRIC_LOCK_WAIT,		/**< @brief histogram, time waiting for a global mutex, by lock */
+	METRIC_LOCK_HOLD,		/**< @brief histogram, time a global mutex was held, by lock */
+	METRIC_SWEEP,			/**< @brief histogram, fw_refresh_client_list() duration */
+	METRIC_BINAUTH,			/**< @brief counter, by BinAuth outcome */
+	METRIC_PREAUTH,			/**< @brief counter, by PreAuth outcome */
+	METRIC_HTTP_SHED,		/**< @brief counter, requests refused by admission control, by reason */
+	METRIC_RENDER,			/**< @brief counter, page rendering scripts run or shared */
+	METRIC_WATCHDOG,		/**< @brief counter, web server health checks by result */
+	METRIC_FETCH,			/**< @brief counter, remote images and files fetched, by result */
+	METRIC_FAMILIES
+};
+
+/** Maximum number of label values kept per family, others are counted as "other" */
+#define METRIC_MAX_SERIES 48
+
+/** @brief Monotonic time in seconds, for timing observations */
+double metrics_now(void);
+
+/** @brief Add an observation, in seconds, to a histogram */
+void metrics_observe(int family, const char *label, double seconds);
+
+/** @brief Increment a counter */
+void metrics_inc(int family, const char *label);
+
+/** @brief Label an external command line, eg "libopennds.sh gatewayroute" */
+void metrics_command_label(char *buf, size_t len, const char *cmd);
+
+/** @brief Write all metrics in Prometheus text exposition format */
+void metrics_write(FILE *fp);
+
+#endif /* _METRICS_H_ */
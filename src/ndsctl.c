@@ -197,12 +197,24 @@ usage(void)
 		"\n"
 		"  deauth mac|ip|token\n"
 		"	Deauthenticate user with specified mac, ip or token\n\n"
+		"  authbatch file|-\n"
+		"	Authenticate many clients in one request, reading from file, or stdin if - or not given\n"
+		"	One client per line, the auth arguments separated by commas, blank and # lines ignored:\n"
+		"	mac|ip|token,sessiontimeout,uploadrate,downloadrate,uploadquota,downloadquota,customstring\n"
+		"	The firewall rules of all the clients are applied in one transaction.\n"
+		"	A result is printed for each line, followed by a summary line.\n\n"
+		"  deauthbatch file|-\n"
+		"	Deauthenticate many clients in one request, one mac|ip|token per line\n\n"
 		"  trust mac\n"
 		"	Trust the given MAC address\n\n"
 		"  untrust mac\n"
 		"	Untrust the given MAC address\n\n"
 		"  debuglevel n\n"
 		"	Set debug level to n (0=silent, 1=Normal, 2=Info, 3=debug)\n\n"
+		"  metrics\n"
+		"	Print internal counters and latency histograms in Prometheus text format\n\n"
+		"  locks\n"
+		"	Print client list and config lock wait and hold times, by call site\n\n"
 		"  b64decode \"string_to_decode\"\n"
 		"	Base 64 decode the given string\n\n"
 		"  b64encode \"string_to_encode\"\n"
@@ -215,9 +227,13 @@ static struct argument arguments[] = {
 	{"json", NULL, NULL},
 	{"status", NULL, NULL},
 	{"stop", NULL, NULL},
+	{"metrics", NULL, NULL},
+	{"locks", NULL, NULL},
 	{"debuglevel", "Debug level set to %s.\n", "Failed to set debug level to %s.\n"},
 	{"deauth", "Client %s deauthenticated.\n", "Client %s not found.\n"},
 	{"auth", "Client %s authenticated.\n", "Failed to authenticate client %s.\n"},
+	{"authbatch", NULL, NULL},
+	{"deauthbatch", NULL, NULL},
 	{"trust", "MAC %s trusted.\n", "Failed to trust MAC %s.\n"},
 	{"untrust", "MAC %s untrusted.\n", "Failed to untrust MAC %s.\n"},
 	{"b64decode", NULL, NULL},
@@ -242,7 +258,6 @@ static int
 connect_to_server(const char sock_name[])
 {
 	int sock;
-	char lockfile[] = "/tmp/ndsctl.lock";
 	struct sockaddr_un sa_un;
 
 	// Connect to socket
@@ -253,7 +268,6 @@ connect_to_server(const char sock_name[])
 
 	if (connect(sock, (struct sockaddr *)&sa_un, strlen(sa_un.sun_path) + sizeof(sa_un.sun_family))) {
 		fprintf(stderr, "ndsctl: opennds probably not yet started (Error: %s)\n", strerror(errno));
-		remove(lockfile);
 		return -1;
 	}
 
@@ -324,6 +338,9 @@ ndsctl_do(const char *socket, const struct argument *arg, const char *param)
 		} else if (strcmp(buffer, "No") == 0) {
 			printf(arg->ifno, param);
 			ret = 1;
+		} else if (strcmp(buffer, NDSCTL_BUSY) == 0) {
+			printf(NDSCTL_BUSY_MESSAGE);
+			ret = 4;
 		} else {
 			fprintf(stderr, "ndsctl: Error: opennds sent an abnormal reply.\n");
 			ret = 2;
@@ -341,57 +358,97 @@ ndsctl_do(const char *socket, const struct argument *arg, const char *param)
 	return ret;
 }
 
-int ndsctl_lock(char *mountpoint, int *lockfd)
+/* Perform authbatch or deauthbatch.
+ * The client lines are read from path, or stdin if path is "-",
+ * and sent after the command, ended by an empty line.
+ * The per line results and the summary are printed as received.
+ */
+static int
+ndsctl_batch_do(const char *socket, const struct argument *arg, const char *path)
 {
-	char *lockfile;
-
-	// Open or create the lock file
-	safe_asprintf(&lockfile, "%s/ndsctl.lock", mountpoint);
-	*lockfd = open(lockfile, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-	free(lockfile);
-
-	if (*lockfd < 0) {
-		// Critical error - must report to syslog
-		openlog ("ndsctl", LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
-		syslog (LOG_ERR, "CRITICAL ERROR - Unable to open [%s]", lockfile);
-		closelog ();
-		return 5;
+	FILE *in;
+	FILE *request;
+	FILE *reply;
+	char *request_buf = NULL;
+	char *reply_buf = NULL;
+	size_t request_len = 0;
+	size_t reply_len = 0;
+	char *line = NULL;
+	size_t size = 0;
+	char buffer[MAX_BUF];
+	int sock;
+	int len;
+	int ret;
+
+	in = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+
+	if (!in) {
+		fprintf(stderr, "ndsctl: Unable to open %s: %s\n", path, strerror(errno));
+		return 1;
 	}
 
+	request = open_memstream(&request_buf, &request_len);
+	reply = open_memstream(&reply_buf, &reply_len);
 
-	if (lockf(*lockfd, F_TLOCK, 0) == 0) {
-		return 0;
-	} else {
+	if (!request || !reply) {
+		printf("Failed: Memory allocation error");
+		exit(1);
+	}
 
-		if (errno != EACCES && errno != EAGAIN) {
-			// persistent error
-			// This is a Critical error - must report to syslog
-			openlog ("ndsctl", LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
-			syslog (LOG_ERR, "CRITICAL ERROR - Unable to create lock on [%s]", lockfile);
-			closelog ();
-			close(*lockfd);
-			return 6;
-		}
+	fprintf(request, "%s\n", arg->cmd);
 
-		// This is a normal operating state, no need to report to syslog
-		// It is the responsibility of the caller to check return code and retry if required
-		close(*lockfd);
+	while (getline(&line, &size, in) != -1) {
+		line[strcspn(line, "\r\n")] = '\0';
+
+		// An empty line would end the batch early, a comment keeps the line numbers of the results
+		fprintf(request, "%s\n", line[0] != '\0' ? line : "#");
+	}
 
-		printf("ndsctl thread is busy, please try later.\n");
+	fprintf(request, "\n");
+	fclose(request);
+	free(line);
 
-		return 4;
+	if (in != stdin) {
+		fclose(in);
 	}
-}
 
-void ndsctl_unlock(int *lockfd)
-{
-	if (lockf(*lockfd, F_ULOCK, 0) < 0) {
-		printf(" Error - Unable to Unlock ndsctl/n");
+	sock = connect_to_server(socket);
+
+	if (sock < 0) {
+		free(request_buf);
+		fclose(reply);
+		free(reply_buf);
+		return 3;
 	}
 
-	close(*lockfd);
-}
+	send_request(sock, request_buf);
+	free(request_buf);
+
+	while ((len = read(sock, buffer, sizeof(buffer))) > 0) {
+		fwrite(buffer, 1, len, reply);
+	}
 
+	fclose(reply);
+
+	if (len < 0) {
+		fprintf(stderr, "ndsctl: Error reading socket: %s\n", strerror(errno));
+		ret = 3;
+	} else if (strcmp(reply_buf, NDSCTL_BUSY) == 0) {
+		printf(NDSCTL_BUSY_MESSAGE);
+		ret = 4;
+	} else if (!strstr(reply_buf, "summary ")) {
+		fprintf(stderr, "ndsctl: Error: opennds sent an abnormal reply.\n");
+		ret = 2;
+	} else {
+		printf("%s", reply_buf);
+		ret = strstr(reply_buf, " failed=0 firewall=ok") ? 0 : 1;
+	}
+
+	free(reply_buf);
+	shutdown(sock, 2);
+	close(sock);
+	return ret;
+}
 
 int
 main(int argc, char **argv)
@@ -407,7 +464,6 @@ main(int argc, char **argv)
 	char socket_file[128] = {0};
 	char *cmd;
 	int ret;
-	int lockfd;
 	FILE *fd;
 
 	// check arguments and take action:
@@ -472,13 +528,6 @@ main(int argc, char **argv)
 	}
 	pclose(fd);
 
-	//Create lock
-	ret = ndsctl_lock(mountpoint, &lockfd);
-
-	if (ret > 0) {
-		return ret;
-	} 
-
 	// Get the configured socket filename if there is one
 	safe_asprintf(&cmd, "/usr/lib/opennds/libopennds.sh get_option_from_config ndsctlsocket");
 	fd = popen(cmd, "r");
@@ -502,11 +551,16 @@ main(int argc, char **argv)
 
 	if (arg == NULL) {
 		fprintf(stderr, "Unknown command: %s\n", argv[i]);
-		ndsctl_unlock(&lockfd);
 		free(socket);
 		return 1;
 	}
 
+	if (strcmp(arg->cmd, "authbatch") == 0 || strcmp(arg->cmd, "deauthbatch") == 0) {
+		ret = ndsctl_batch_do(socket, arg, (argc > i+1) ? argv[i+1] : "-");
+		free(socket);
+		return ret;
+	}
+
 	// Collect command line arguments then send the command
 	if (argc > i+1) {
 		snprintf(args, sizeof(args), "%s", argv[i+1]);
@@ -518,7 +572,6 @@ main(int argc, char **argv)
 	}
 
 	ret = ndsctl_do(socket, arg, args);
-	ndsctl_unlock(&lockfd);
 	free(socket);
 	return ret;
 }
@@ -30,4 +30,10 @@
 
 #define DEFAULT_SOCKET_FILENAME "ndsctl.sock"
 
+/** Reply to a command that changes state, called by BinAuth while BinAuth runs */
+#define NDSCTL_BUSY "Busy"
+
+/** Keeps the keywords checked by the scripts calling ndsctl */
+#define NDSCTL_BUSY_MESSAGE "ndsctl is locked while BinAuth runs, busy, please try later.\n"
+
 #endif /* _NDSCTL_H_ */
@@ -34,6 +34,8 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 #include <syslog.h>
 #include <signal.h>
@@ -51,27 +53,432 @@
 #include "client_list.h"
 #include "fw_iptables.h"
 #include "main.h"
+#include "metrics.h"
+#include "lockstat.h"
 
+#include "ndsctl.h"
 #include "ndsctl_thread.h"
 #include "http_microhttpd_utils.h"
 
 #define MAX_EVENT_SIZE 30
 
+/** Worker threads running read only commands (status, json, metrics, locks) */
+#define NDSCTL_READ_WORKERS 3
+
+/** Requests that may wait in each queue before the listener stops taking new ones */
+#define NDSCTL_QUEUE_SIZE 16
+
+/** Seconds a worker waits for an ndsctl client that does not read its reply */
+#define NDSCTL_SEND_TIMEOUT 10
+
 // Defined in clientlist.c
 extern pthread_mutex_t client_list_mutex;
 extern pthread_mutex_t config_mutex;
 
-static int ndsctl_handler(int fd);
+/** Largest request accepted, a batch of client lines */
+#define NDSCTL_REQUEST_MAX (1024 * 1024)
+
+/** A control connection, while its request is read and then while it waits for a worker */
+typedef struct {
+	int fd;
+	int len;
+	int size;
+	char *request;
+} t_ndsctl_conn;
+
+/** A bounded queue of complete requests, served by one or more workers */
+typedef struct {
+	const char *name;
+	pthread_mutex_t mutex;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	t_ndsctl_conn *jobs[NDSCTL_QUEUE_SIZE];
+	int head;
+	int count;
+} t_ndsctl_queue;
+
+// Read only commands run concurrently, commands that change state run one at a time, in order
+static t_ndsctl_queue read_queue = {"read", PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+static t_ndsctl_queue write_queue = {"write", PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+/* BinAuth holds, see ndsctl_hold().
+ * Commands that change state wait for the holds taken before them to end, read only commands do not.
+ * Holds are counted in two phases: a waiting command moves new holds to the other phase and only
+ * waits for the old one to drain, so BinAuth runs that keep overlapping cannot hold it back for ever.
+ */
+static pthread_mutex_t hold_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hold_released = PTHREAD_COND_INITIALIZER;
+static int holds[2] = {0, 0};
+static int hold_phase = 0;
+
+/** Results of a single client in auth, deauth and their batch forms */
+enum {
+	NDSCTL_OK,
+	NDSCTL_NOT_FOUND,
+	NDSCTL_WRONG_STATE,
+	NDSCTL_DENIED,
+	NDSCTL_FAILED
+};
+
+static void ndsctl_handler(int fd, char *request);
 static void ndsctl_trust(FILE *fp, char *arg);
 static void ndsctl_untrust(FILE *fp, char *arg);
 static void ndsctl_auth(FILE *fp, char *arg);
 static void ndsctl_deauth(FILE *fp, char *arg);
+static void ndsctl_batch(FILE *fp, char *request, int deauth);
 static void ndsctl_debuglevel(FILE *fp, char *arg);
 
-static int socket_set_non_blocking(int sockfd);
+static int socket_set_non_blocking(int sockfd, int non_blocking);
+static int ndsctl_held(void);
+
+static const char *
+ndsctl_result_as_string(int result, int deauth)
+{
+	switch (result) {
+	case NDSCTL_OK:
+		return "ok";
+	case NDSCTL_NOT_FOUND:
+		return "not_found";
+	case NDSCTL_WRONG_STATE:
+		return deauth ? "not_authenticated" : "not_preauthenticated";
+	case NDSCTL_DENIED:
+		return "denied";
+	default:
+		return "failed";
+	}
+}
+
+/* @return 0, or -1 if the queue is full while BinAuth runs.
+ * Blocking then could stop a BinAuth script calling ndsctl from being served.
+ */
+static int
+ndsctl_queue_push(t_ndsctl_queue *queue, t_ndsctl_conn *conn)
+{
+	struct timespec timeout;
+
+	pthread_mutex_lock(&queue->mutex);
+
+	// Back pressure: further connections wait in the listen backlog
+	while (queue->count == NDSCTL_QUEUE_SIZE) {
+		if (ndsctl_held()) {
+			pthread_mutex_unlock(&queue->mutex);
+			return -1;
+		}
+
+		debug(LOG_INFO, "ndsctl %s queue full, waiting", queue->name);
+
+		// Wake to check for a hold
+		clock_gettime(CLOCK_REALTIME, &timeout);
+		timeout.tv_sec += 1;
+		pthread_cond_timedwait(&queue->not_full, &queue->mutex, &timeout);
+	}
+
+	queue->jobs[(queue->head + queue->count) % NDSCTL_QUEUE_SIZE] = conn;
+	queue->count++;
+
+	pthread_cond_signal(&queue->not_empty);
+	pthread_mutex_unlock(&queue->mutex);
+
+	return 0;
+}
+
+static t_ndsctl_conn *
+ndsctl_queue_pop(t_ndsctl_queue *queue)
+{
+	t_ndsctl_conn *conn;
+
+	pthread_mutex_lock(&queue->mutex);
+
+	while (queue->count == 0) {
+		pthread_cond_wait(&queue->not_empty, &queue->mutex);
+	}
+
+	conn = queue->jobs[queue->head];
+	queue->head = (queue->head + 1) % NDSCTL_QUEUE_SIZE;
+	queue->count--;
+
+	pthread_cond_signal(&queue->not_full);
+	pthread_mutex_unlock(&queue->mutex);
+
+	return conn;
+}
+
+/** BinAuth is about to run. Holds nest, and may be taken by several threads at once.
+ * Never blocks, as it is taken with the client list locked.
+ * @return the hold, to be passed to ndsctl_release()
+ */
+int
+ndsctl_hold(void)
+{
+	int phase;
+
+	pthread_mutex_lock(&hold_mutex);
+	phase = hold_phase;
+	holds[phase]++;
+	pthread_mutex_unlock(&hold_mutex);
+
+	return phase;
+}
+
+void
+ndsctl_release(int hold)
+{
+	pthread_mutex_lock(&hold_mutex);
+
+	if (--holds[hold] == 0) {
+		pthread_cond_broadcast(&hold_released);
+	}
+
+	pthread_mutex_unlock(&hold_mutex);
+}
+
+static int
+ndsctl_held(void)
+{
+	int held;
+
+	pthread_mutex_lock(&hold_mutex);
+	held = holds[0] + holds[1] > 0;
+	pthread_mutex_unlock(&hold_mutex);
+
+	return held;
+}
+
+/* Wait for the holds taken so far to end, but not for those taken meanwhile.
+ * Only the write worker waits, so the phase it leaves has always drained before it comes back to it.
+ */
+static void
+ndsctl_wait_released(void)
+{
+	int phase;
+
+	pthread_mutex_lock(&hold_mutex);
+
+	phase = hold_phase;
+	hold_phase = !phase;
+
+	if (holds[phase] > 0) {
+		debug(LOG_DEBUG, "ndsctl waiting for BinAuth to finish");
+	}
+
+	while (holds[phase] > 0) {
+		pthread_cond_wait(&hold_released, &hold_mutex);
+	}
+
+	pthread_mutex_unlock(&hold_mutex);
+}
+
+/* Is the peer of a control connection run by opennds, eg a BinAuth script calling ndsctl?
+ * The peer pid comes from the socket credentials, its ancestry from /proc.
+ */
+static int
+ndsctl_peer_is_descendant(int fd)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	pid_t self = getpid();
+	pid_t pid;
+	char path[32];
+	char stat[512];
+	char *ppid;
+	FILE *fp;
+	int depth;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+		debug(LOG_ERR, "Could not get ndsctl peer credentials: %s", strerror(errno));
+		return 0;
+	}
+
+	for (pid = cred.pid, depth = 0; pid > 1 && depth < 32; depth++) {
+		snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+
+		if (!(fp = fopen(path, "r"))) {
+			return 0;
+		}
+
+		ppid = fgets(stat, sizeof(stat), fp);
+		fclose(fp);
+
+		// The parent pid follows the state, after the command name in brackets
+		if (!ppid || !(ppid = strrchr(stat, ')'))) {
+			return 0;
+		}
+
+		if (sscanf(ppid, ") %*c %d", &pid) != 1) {
+			return 0;
+		}
+
+		if (pid == self) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void
+ndsctl_reply_busy(t_ndsctl_conn *conn)
+{
+	ssize_t written;
+
+	written = write(conn->fd, NDSCTL_BUSY, strlen(NDSCTL_BUSY));
+
+	if (written < 0) {
+		debug(LOG_DEBUG, "Could not reply to ndsctl: %s", strerror(errno));
+	}
+}
+
+static void *
+thread_ndsctl_worker(void *arg)
+{
+	t_ndsctl_queue *queue = arg;
+	t_ndsctl_conn *conn;
+
+	while (1) {
+		conn = ndsctl_queue_pop(queue);
+
+		if (queue == &write_queue) {
+			ndsctl_wait_released();
+		}
+
+		config_read_begin();
+		ndsctl_handler(conn->fd, conn->request);
+		config_read_end();
+		free(conn->request);
+		free(conn);
+	}
+
+	return NULL;
+}
+
+/* Commands that only report, and so may run alongside each other and alongside a command that
+ * changes state. They use client list read sections, see client_list.c
+ */
+static int
+ndsctl_is_read_only(const char *request)
+{
+	return strncmp(request, "status", 6) == 0
+		|| strncmp(request, "json", 4) == 0
+		|| strncmp(request, "metrics", 7) == 0
+		|| strncmp(request, "locks", 5) == 0;
+}
+
+static int
+ndsctl_is_batch(const char *request)
+{
+	return strncmp(request, "authbatch", 9) == 0
+		|| strncmp(request, "deauthbatch", 11) == 0;
+}
+
+/* Checks for a complete request, terminating it.
+ * A request is one line, except for a batch which ends with an empty line.
+ */
+static int
+ndsctl_complete(t_ndsctl_conn *conn, int from)
+{
+	char *end;
+	char *scan;
+
+	end = strpbrk(conn->request, "\r\n");
+
+	if (!end) {
+		return 0;
+	}
+
+	if (!ndsctl_is_batch(conn->request)) {
+		*end = '\0';
+		return 1;
+	}
+
+	// Only what was just read (and the line end before it) needs searching
+	scan = conn->request + (from > 2 ? from - 2 : 0);
+
+	if (scan < end) {
+		scan = end;
+	}
+
+	for (; (scan = strchr(scan, '\n')) != NULL; scan++) {
+		if (scan[1] == '\n' || (scan[1] == '\r' && scan[2] == '\n')) {
+			scan[1] = '\0';
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Reads whatever has arrived of a request, the socket being non blocking and edge triggered.
+ * @return 1 once the request is complete, 0 if more is to come, -1 on error or early close
+ */
+static int
+ndsctl_read(t_ndsctl_conn *conn)
+{
+	ssize_t len;
+	char *grown;
+
+	while (1) {
+		if (conn->len == conn->size - 1) {
+			// Only batches grow beyond the first buffer
+			if (conn->size >= NDSCTL_REQUEST_MAX || !ndsctl_is_batch(conn->request)) {
+				debug(LOG_ERR, "Invalid ndsctl request, too long.");
+				return -1;
+			}
+
+			grown = safe_calloc(conn->size * 2);
+			memcpy(grown, conn->request, conn->len);
+			free(conn->request);
+			conn->request = grown;
+			conn->size *= 2;
+		}
+
+		len = read(conn->fd, conn->request + conn->len, conn->size - 1 - conn->len);
+
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+
+			debug(LOG_ERR, "Read failed on ndsctl connection: %s", strerror(errno));
+			return -1;
+		}
+
+		if (len == 0) {
+			debug(LOG_ERR, "Invalid ndsctl request, connection closed after %d bytes", conn->len);
+			return -1;
+		}
+
+		conn->len += len;
+		conn->request[conn->len] = '\0';
+
+		// Have we gotten a command yet?
+		if (ndsctl_complete(conn, conn->len - len)) {
+			return 1;
+		}
+	}
+}
+
+static void
+ndsctl_close(int epoll_fd, t_ndsctl_conn *conn)
+{
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+	shutdown(conn->fd, 2);
+	close(conn->fd);
+	free(conn->request);
+	free(conn);
+}
 
 /* Launches a thread that monitors the control socket for request
  @param arg Must contain a pointer to a string containing the Unix domain socket to open
+
+ Requests are read here, without blocking, then handed to the worker threads:
+ NDSCTL_READ_WORKERS for read only commands and one for commands that change state.
+ While BinAuth runs, commands that change state wait in their queue, unless sent by
+ a process opennds started (BinAuth itself) which is told ndsctl is busy.
+ "stop" is answered here, ending the thread.
  @todo This thread loops infinitely, need a watchdog to verify that it is still running?
  */
 void*
@@ -83,9 +490,13 @@ thread_ndsctl(void *arg)
 	socklen_t len;
 	struct epoll_event ev;
 	struct epoll_event *events;
-	int current_fd_count;
+	struct timeval send_timeout = {NDSCTL_SEND_TIMEOUT, 0};
+	t_ndsctl_conn *conn;
+	t_ndsctl_queue *queue;
+	pthread_t tid;
 	int number_of_count;
 	int i;
+	int rc;
 
 	debug(LOG_DEBUG, "Starting ndsctl thread");
 
@@ -119,11 +530,27 @@ thread_ndsctl(void *arg)
 		pthread_exit(NULL);
 	}
 
+	for (i = 0; i <= NDSCTL_READ_WORKERS; i++) {
+		// The last worker serves the write queue
+		rc = pthread_create(&tid, NULL, thread_ndsctl_worker, i < NDSCTL_READ_WORKERS ? &read_queue : &write_queue);
+
+		if (rc != 0) {
+			debug(LOG_ERR, "Could not start ndsctl worker: [%s] Terminating...", strerror(rc));
+			pthread_exit(NULL);
+		}
+
+		pthread_detach(tid);
+	}
+
+	// Edge triggered, so accept and read until there is no more
+	socket_set_non_blocking(sock, 1);
+
 	memset(&ev, 0, sizeof(struct epoll_event));
 	epoll_fd = epoll_create(MAX_EVENT_SIZE);
 
+	// The listening socket is the event without a connection
 	ev.events = EPOLLIN | EPOLLET;
-	ev.data.fd = sock;
+	ev.data.ptr = NULL;
 
 	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev) < 0) {
 		debug(LOG_ERR, "Could not insert socket fd to epoll set: [%s] Terminating...", strerror(errno));
@@ -137,15 +564,10 @@ thread_ndsctl(void *arg)
 		pthread_exit(NULL);
 	}
 
-	current_fd_count = 1;
-
 	debug(LOG_DEBUG, "Entering ndsctl thread loop");
 
 	while (1) {
-		memset(&sa_un, 0, sizeof(sa_un));
-		len = (socklen_t) sizeof(sa_un);
-
-		number_of_count = epoll_wait(epoll_fd, events, current_fd_count, -1);
+		number_of_count = epoll_wait(epoll_fd, events, MAX_EVENT_SIZE, -1);
 
 		if (number_of_count == -1) {
 			// interupted is not an error
@@ -158,50 +580,96 @@ thread_ndsctl(void *arg)
 		}
 
 		for (i = 0; i < number_of_count; i++) {
+			conn = events[i].data.ptr;
 
-			if ((events[i].events & EPOLLERR) || (events[i].events & EPOLLHUP) ||
-					(!(events[i].events & EPOLLIN))) {
-				debug(LOG_ERR, "Socket is not ready for communication : %s", strerror(errno));
+			if (!conn) {
+				while (1) {
+					memset(&sa_un, 0, sizeof(sa_un));
+					len = (socklen_t) sizeof(sa_un);
 
-				if (events[i].data.fd > 0) {
-					shutdown(events[i].data.fd, 2);
-					close(events[i].data.fd);
-					events[i].data.fd = 0;
-				}
-				continue;
-			}
+					if ((fd = accept(sock, (struct sockaddr *)&sa_un, &len)) == -1) {
+						if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+							break;
+						}
+
+						debug(LOG_ERR, "Accept failed on control socket: %s", strerror(errno));
+						free(events);
+						pthread_exit(NULL);
+					}
+
+					socket_set_non_blocking(fd, 1);
+
+					conn = safe_calloc(sizeof(t_ndsctl_conn));
+					conn->fd = fd;
+					conn->size = MAX_BUF;
+					conn->request = safe_calloc(conn->size);
 
-			if (events[i].data.fd == sock) {
-				if ((fd = accept(events[i].data.fd, (struct sockaddr *)&sa_un, &len)) == -1) {
-					debug(LOG_ERR, "Accept failed on control socket: %s", strerror(errno));
-					free(events);
-					pthread_exit(NULL);
-				} else {
-					socket_set_non_blocking(fd);
 					ev.events = EPOLLIN | EPOLLET;
-					ev.data.fd = fd;
+					ev.data.ptr = conn;
 
 					if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
 						debug(LOG_ERR, "Could not insert socket fd to epoll set: %s", strerror(errno));
-						free(events);
-						pthread_exit(NULL);
+						close(fd);
+						free(conn->request);
+						free(conn);
 					}
-
-					current_fd_count += 1;
 				}
 
+				continue;
+			}
+
+			// Read first, a request may arrive together with the hang up
+			rc = (events[i].events & EPOLLIN) ? ndsctl_read(conn) : -1;
+
+			if (rc == 0 && (events[i].events & (EPOLLERR | EPOLLHUP))) {
+				debug(LOG_ERR, "Socket is not ready for communication");
+				rc = -1;
+			}
+
+			if (rc < 0) {
+				ndsctl_close(epoll_fd, conn);
+				continue;
+			}
+
+			if (rc == 0) {
+				// Incomplete, wait for the rest
+				continue;
+			}
+
+			debug(LOG_DEBUG, "ndsctl request received: [%s]", conn->request);
+
+			if (strncmp(conn->request, "stop", 4) == 0) {
+				// Ending this thread stops opennds
+				ndsctl_close(epoll_fd, conn);
+				free(events);
+				pthread_exit(NULL);
+			}
+
+			if (ndsctl_is_read_only(conn->request)) {
+				queue = &read_queue;
 			} else {
-				if (ndsctl_handler(events[i].data.fd)) {
-					free(events);
-					pthread_exit(NULL);
+				queue = &write_queue;
+
+				/* Called from BinAuth, the command would wait for the BinAuth it was called from.
+				 * Read only commands are still served.
+				 */
+				if (ndsctl_held() && ndsctl_peer_is_descendant(conn->fd)) {
+					debug(LOG_NOTICE, "ndsctl [%s] refused, called while BinAuth runs", conn->request);
+					ndsctl_reply_busy(conn);
+					ndsctl_close(epoll_fd, conn);
+					continue;
 				}
-				epoll_ctl(epoll_fd, EPOLL_CTL_DEL, events[i].data.fd, &ev);
-				current_fd_count -= 1;
+			}
 
-				// socket was closed on 'ndsctl_handler'
-				if (events[i].data.fd > 0) {
-					events[i].data.fd = 0;
-				}
+			// Workers write the reply with stdio, so blocking again, but not forever
+			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+			socket_set_non_blocking(conn->fd, 0);
+			setsockopt(conn->fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+
+			if (ndsctl_queue_push(queue, conn) < 0) {
+				debug(LOG_NOTICE, "ndsctl [%s] refused, %s queue full while BinAuth runs", conn->request, queue->name);
+				ndsctl_reply_busy(conn);
+				ndsctl_close(epoll_fd, conn);
 			}
 		}
 	}
@@ -209,64 +677,43 @@ thread_ndsctl(void *arg)
 	return NULL;
 }
 
-static int
-ndsctl_handler(int fd)
+static void
+ndsctl_handler(int fd, char *request)
 {
-	int done, i, ret = 0;
-	char request[MAX_BUF];
-	//ssize_t read_bytes, len;
-	int read_bytes, len;
 	FILE* fp;
 
 	debug(LOG_DEBUG, "Entering thread_ndsctl_handler....");
 
-	// Init variables
-	read_bytes = 0;
-	done = 0;
-	memset(request, 0, sizeof(request));
 	fp = fdopen(fd, "w");
 
-	debug(LOG_DEBUG, "Read bytes and stuff from socket descriptor [%d], pointer [%lu]", fd, fp);
-
-	// Read....
-	while (!done && read_bytes < (sizeof(request) - 1)) {
-		len = read(fd, request + read_bytes, sizeof(request) - read_bytes);
-
-		// Have we gotten a command yet?
-		for (i = read_bytes; i < (read_bytes + len); i++) {
-			if (request[i] == '\r' || request[i] == '\n') {
-				request[i] = '\0';
-				done = 1;
-			}
-		}
-
-		// Increment position
-		read_bytes += len;
+	if (!fp) {
+		debug(LOG_ERR, "Could not open ndsctl connection for writing: %s", strerror(errno));
+		close(fd);
+		return;
 	}
 
-	debug(LOG_DEBUG, "ndsctl request received: [%s]", request);
-
 	if (strncmp(request, "status", 6) == 0) {
 		ndsctl_status(fp);
 	} else if (strncmp(request, "json", 4) == 0) {
 		ndsctl_json(fp, (request + 5));
-	} else if (strncmp(request, "stop", 4) == 0) {
-		// tell the caller to stop the thread
-		ret = 1;
 	} else if (strncmp(request, "trust", 5) == 0) {
 		ndsctl_trust(fp, (request + 6));
 	} else if (strncmp(request, "untrust", 7) == 0) {
 		ndsctl_untrust(fp, (request + 8));
+	} else if (strncmp(request, "authbatch", 9) == 0) {
+		ndsctl_batch(fp, request, 0);
 	} else if (strncmp(request, "auth", 4) == 0) {
 		ndsctl_auth(fp, (request + 5));
+	} else if (strncmp(request, "deauthbatch", 11) == 0) {
+		ndsctl_batch(fp, request, 1);
 	} else if (strncmp(request, "deauth", 6) == 0) {
 		ndsctl_deauth(fp, (request + 7));
 	} else if (strncmp(request, "debuglevel", 10) == 0) {
 		ndsctl_debuglevel(fp, (request + 11));
-	}
-
-	if (!done) {
-		debug(LOG_ERR, "Invalid ndsctl request.");
+	} else if (strncmp(request, "metrics", 7) == 0) {
+		metrics_write(fp);
+	} else if (strncmp(request, "locks", 5) == 0) {
+		lockstat_write(fp);
 	}
 
 	debug(LOG_DEBUG, "ndsctl request processed: [%s]", request);
@@ -274,11 +721,13 @@ ndsctl_handler(int fd)
 
 	// Close and flush fp, also closes underlying fd
 	fclose(fp);
-	return ret;
 }
 
-static void
-ndsctl_auth(FILE *fp, char *arg)
+/* Authenticate one client, the client list being locked.
+ * @param arg mac|ip|token[,minutes,uploadrate,downloadrate,uploadquota,downloadquota,customdata]
+ */
+static int
+ndsctl_auth_client(const char *arg)
 {
 	s_config *config = config_get_config();
 	t_client *client;
@@ -295,6 +744,7 @@ ndsctl_auth(FILE *fp, char *arg)
 	char *msg2;
 	char *customdata;
 	char *argcopy;
+	char *argstart;
 	const char *arg2;
 	const char *arg3;
 	const char *arg4;
@@ -309,7 +759,7 @@ ndsctl_auth(FILE *fp, char *arg)
 
 	debug(LOG_DEBUG, "Entering ndsctl_auth [%s]", arg);
 
-	argcopy=strdup(arg);
+	argcopy = argstart = safe_strdup(arg);
 
 	// arg2 = ip|mac|tok
 	arg2 = strsep(&argcopy, ",");
@@ -370,7 +820,6 @@ ndsctl_auth(FILE *fp, char *arg)
 	debug(LOG_DEBUG, "customdata [%s]", customdata);
 	}
 
-	LOCK_CLIENT_LIST();
 	debug(LOG_DEBUG, "find in client list - arg2: [%s]", arg2);
 	client = client_list_find_by_any(arg2, arg2, arg2);
 	id = client ? client->id : 0;
@@ -414,7 +863,7 @@ ndsctl_auth(FILE *fp, char *arg)
 						if (client) {
 							id = client ? client->id : 0;
 							debug(LOG_DEBUG, "client id: [%d]", id);
-							client->client_type = safe_strdup("preemptive");
+							client->client_type = client_list_strdup(client, "preemptive");
 
 							// log the preemptive authentication
 							safe_asprintf(&libcmd,
@@ -467,27 +916,60 @@ ndsctl_auth(FILE *fp, char *arg)
 			debug(LOG_DEBUG, "ndsctl_thread: client session start time [ %lu ], end time [ %lu ]", now, client->session_end);
 
 			rc = auth_client_auth_nolock(id, "ndsctl_auth", customdata);
+			rc = rc == 0 ? NDSCTL_OK : rc == 1 ? NDSCTL_DENIED : NDSCTL_FAILED;
+		} else {
+			rc = NDSCTL_WRONG_STATE;
 		}
 
-	free(argcopy);
-
 	} else {
 		// Client is neither preauthenticated nor authenticated
 		// If Preemptive authentication is enabled we should have tried to auth by mac
 		debug(LOG_DEBUG, "Client is not in client list.");
-		rc = -1;
+		rc = NDSCTL_NOT_FOUND;
 	}
 
+	free(argstart);
+	free(customdata);
+	debug(LOG_DEBUG, "Exiting ndsctl_auth...");
+
+	return rc;
+}
+
+static void
+ndsctl_auth(FILE *fp, char *arg)
+{
+	int rc;
+
+	LOCK_CLIENT_LIST();
+	rc = ndsctl_auth_client(arg);
 	UNLOCK_CLIENT_LIST();
 
-	if (rc == 0) {
-		fprintf(fp, "Yes");
-	} else {
-		fprintf(fp, "No");
+	fprintf(fp, rc == NDSCTL_OK ? "Yes" : "No");
+}
+
+/* Deauthenticate one client, the client list being locked.
+ * @param arg mac|ip|token
+ */
+static int
+ndsctl_deauth_client(const char *arg)
+{
+	t_client *client;
+	int rc;
+
+	client = client_list_find_by_any(arg, arg, arg);
+
+	if (!client) {
+		debug(LOG_DEBUG, "Client [%s] not found.", arg);
+		return NDSCTL_NOT_FOUND;
 	}
 
-	free(customdata);
-	debug(LOG_DEBUG, "Exiting ndsctl_auth...");
+	if (client->fw_connection_state != FW_MARK_AUTHENTICATED) {
+		return NDSCTL_WRONG_STATE;
+	}
+
+	rc = auth_client_deauth_nolock(client->id, "ndsctl_deauth");
+
+	return rc == 0 ? NDSCTL_OK : NDSCTL_FAILED;
 }
 
 static void
@@ -499,10 +981,10 @@ ndsctl_deauth(FILE *fp, char *arg)
 
 	debug(LOG_DEBUG, "Entering ndsctl_deauth [%s]", arg);
 
-	LOCK_CLIENT_LIST();
+	READ_LOCK_CLIENT_LIST();
 	client = client_list_find_by_any(arg, arg, arg);
 	id = client ? client->id : 0;
-	UNLOCK_CLIENT_LIST();
+	READ_UNLOCK_CLIENT_LIST();
 
 	if (id) {
 		rc = auth_client_deauth(id, "ndsctl_deauth");
@@ -520,6 +1002,84 @@ ndsctl_deauth(FILE *fp, char *arg)
 	debug(LOG_DEBUG, "Exiting ndsctl_deauth...");
 }
 
+/* authbatch and deauthbatch: one client per line, in the argument format of auth or deauth.
+ * All lines are applied under one client list lock and one firewall transaction,
+ * then a result is reported for each line, followed by a summary.
+ * A line is only reported ok once the transaction holding its rules has been applied.
+ */
+static void
+ndsctl_batch(FILE *fp, char *request, int deauth)
+{
+	char *lines = request;
+	char *line;
+	struct {
+		int lineno;
+		const char *target;
+		int rc;
+	} *results = NULL, *grown;
+	int size = 0;
+	int lineno = 0;
+	int count = 0;
+	int ok = 0;
+	int rc;
+	int fw_rc;
+	int i;
+
+	// Skip the command line
+	strsep(&lines, "\n");
+
+	LOCK_CLIENT_LIST();
+	iptables_fw_batch_begin();
+
+	while ((line = strsep(&lines, "\n")) != NULL) {
+		lineno++;
+		line[strcspn(line, "\r")] = '\0';
+
+		if (*line == '\0' || *line == '#') {
+			continue;
+		}
+
+		if (count == size) {
+			size = size ? size * 2 : 64;
+			if (!(grown = realloc(results, size * sizeof(*results)))) {
+				debug(LOG_ERR, "Failed to allocate batch results, stopping at line %d", lineno);
+				break;
+			}
+			results = grown;
+		}
+
+		rc = deauth ? ndsctl_deauth_client(line) : ndsctl_auth_client(line);
+
+		results[count].lineno = lineno;
+		results[count].target = strsep(&line, ",");
+		results[count].rc = rc;
+		count++;
+	}
+
+	fw_rc = iptables_fw_batch_commit();
+
+	UNLOCK_CLIENT_LIST();
+
+	// Reply once the lock is released, the ndsctl client may be slow to read
+	for (i = 0; i < count; i++) {
+		// Which rules failed is not known, so no line of a failed transaction counts as done
+		if (results[i].rc == NDSCTL_OK && fw_rc != 0) {
+			results[i].rc = NDSCTL_FAILED;
+		}
+
+		if (results[i].rc == NDSCTL_OK) {
+			ok++;
+		}
+
+		fprintf(fp, "%d %s %s\n", results[i].lineno, results[i].target, ndsctl_result_as_string(results[i].rc, deauth));
+	}
+
+	fprintf(fp, "summary lines=%d ok=%d failed=%d firewall=%s\n", count, ok, count - ok, fw_rc == 0 ? "ok" : "failed");
+
+	free(results);
+	debug(LOG_NOTICE, "ndsctl %s: %d lines, %d ok, firewall rc [ %d ]", deauth ? "deauthbatch" : "authbatch", count, ok, fw_rc);
+}
+
 static void
 ndsctl_trust(FILE *fp, char *arg)
 {
@@ -574,16 +1134,21 @@ ndsctl_debuglevel(FILE *fp, char *arg)
 }
 
 static int
-socket_set_non_blocking(int sockfd)
+socket_set_non_blocking(int sockfd, int non_blocking)
 {
-	int rc;
+	int flags;
 
-	rc = fcntl(sockfd, F_GETFL, 0);
+	flags = fcntl(sockfd, F_GETFL, 0);
 
-	if (rc) {
-		rc |= O_NONBLOCK;
-		rc = fcntl(sockfd, F_SETFL, rc);
+	if (flags < 0) {
+		return flags;
 	}
 
-	return rc;
+	if (non_blocking) {
+		flags |= O_NONBLOCK;
+	} else {
+		flags &= ~O_NONBLOCK;
+	}
+
+	return fcntl(sockfd, F_SETFL, flags);
 }
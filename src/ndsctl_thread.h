@@ -30,4 +30,10 @@
 /** @brief Listen for opennds control messages on a unix domain socket */
 void *thread_ndsctl(void *arg);
 
+/** @brief Hold back commands that change state while BinAuth runs */
+int ndsctl_hold(void);
+
+/** @brief End a hold, running the commands held back */
+void ndsctl_release(int hold);
+
 #endif
@@ -0,0 +1,542 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @internal
+  @file netmon.c
+  @brief Follows the gateway interface and the upstream routes with rtnetlink events
+  @author Copyright (C) 2015-2025 Modifications and additions by BlueWave Projects and Services <opennds@blue-wave.net>
+
+  The watchdog used to read the mac of the gateway interface and the state of the
+  upstream gateways with helper scripts on every checkinterval. This thread instead
+  listens for the kernel's link, address, route and neighbour events:
+
+  A new mac on gw_interface replaces gw_mac. The old string is never freed, as
+  other threads may still be using it, but it is only replaced when it changes.
+  It is set holding config_mutex, so a reload copying the config cannot lose it.
+
+  The address of gw_interface is only reported when it goes or comes back, gw_ip is
+  in the firewall rules and the portal urls so cannot follow it without a restart.
+
+  The default routes of the main table are kept in a small table. A change of a
+  default route, of the link of its interface or of the neighbour state of its
+  gateway marks the routing stale, and the watchdog runs the gatewayroute script
+  again on its next pass, so online_status only changes on a kernel event.
+
+  While every upstream gateway is offline, the watchdog probes them in process
+  with a TCP connection attempt, at intervals growing from NETMON_BACKOFF_MIN to
+  NETMON_BACKOFF_MAX seconds.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "safe.h"
+#include "conf.h"
+#include "debug.h"
+#include "metrics.h"
+#include "netmon.h"
+
+extern pthread_mutex_t config_mutex;
+
+typedef struct {
+	struct in_addr addr;
+	int ifindex;
+	int state;				/**< @brief 1 online, 0 offline, -1 no neighbour entry */
+} t_netmon_gateway;
+
+// Only used by thread_netmon()
+static t_netmon_gateway gateways[NETMON_GATEWAYS];
+static int gateway_count = 0;
+static int gw_ifindex = 0;
+static int gw_ip_removed = 0;
+
+static int netmon_running = 0;
+static int routing_changed = 0;
+
+// Only used by the watchdog, through netmon_routing_stale()
+static double backoff = 0;
+static double next_probe = 0;
+static double next_refresh = 0;
+
+static void
+_netmon_changed(const char *why)
+{
+	debug(LOG_DEBUG, "Netmon: %s, upstream routing is stale", why);
+	__atomic_store_n(&routing_changed, 1, __ATOMIC_RELAXED);
+}
+
+static t_netmon_gateway *
+_netmon_gateway(const struct in_addr *addr, int ifindex)
+{
+	int i;
+
+	for (i = 0; i < gateway_count; i++) {
+		if (gateways[i].ifindex == ifindex && (!addr || gateways[i].addr.s_addr == addr->s_addr)) {
+			return &gateways[i];
+		}
+	}
+
+	return NULL;
+}
+
+static int
+_netmon_request_routes(int sock)
+{
+	struct {
+		struct nlmsghdr nh;
+		struct rtmsg rt;
+	} req;
+
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+	req.nh.nlmsg_type = RTM_GETROUTE;
+	req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.rt.rtm_family = AF_INET;
+
+	gateway_count = 0;
+
+	if (send(sock, &req, req.nh.nlmsg_len, 0) < 0) {
+		debug(LOG_ERR, "Netmon: cannot request routes: %s", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+// gw_mac is in the format of the gatewaymac library call, lower case hex without separators
+static void
+_netmon_gw_mac(const unsigned char *mac)
+{
+	s_config *config;
+	char *gw_mac;
+
+	safe_asprintf(&gw_mac, "%02x%02x%02x%02x%02x%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+
+	LOCK_CONFIG();
+	config = config_get_config();
+
+	if (config->gw_mac && strcmp(config->gw_mac, gw_mac) == 0) {
+		UNLOCK_CONFIG();
+		free(gw_mac);
+		return;
+	}
+
+	if (config->gw_mac && strcmp(config->gw_mac, "00:00:00:00:00:00") != 0) {
+		debug(LOG_WARNING, "Warning, gateway mac changed from [%s] to [%s]", config->gw_mac, gw_mac);
+	}
+
+	__atomic_store_n(&config->gw_mac, gw_mac, __ATOMIC_RELEASE);
+	UNLOCK_CONFIG();
+}
+
+static void
+_netmon_link(struct nlmsghdr *nh)
+{
+	s_config *config = config_get_config();
+	struct ifinfomsg *ifi = NLMSG_DATA(nh);
+	struct rtattr *rta;
+	int len = IFLA_PAYLOAD(nh);
+	const char *name = NULL;
+	const unsigned char *mac = NULL;
+
+	for (rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == IFLA_IFNAME) {
+			name = RTA_DATA(rta);
+		} else if (rta->rta_type == IFLA_ADDRESS && RTA_PAYLOAD(rta) == 6) {
+			mac = RTA_DATA(rta);
+		}
+	}
+
+	if (name && strcmp(name, config->gw_interface) == 0) {
+		if (nh->nlmsg_type == RTM_DELLINK) {
+			debug(LOG_WARNING, "Gateway interface [%s] has been removed", name);
+			gw_ifindex = 0;
+			return;
+		}
+
+		gw_ifindex = ifi->ifi_index;
+
+		if (mac) {
+			_netmon_gw_mac(mac);
+		}
+
+		return;
+	}
+
+	if (_netmon_gateway(NULL, ifi->ifi_index)) {
+		_netmon_changed("upstream link changed");
+	}
+}
+
+static void
+_netmon_addr(struct nlmsghdr *nh)
+{
+	s_config *config = config_get_config();
+	struct ifaddrmsg *ifa = NLMSG_DATA(nh);
+	struct rtattr *rta;
+	int len = IFA_PAYLOAD(nh);
+	void *addr = NULL;
+	char ip[INET6_ADDRSTRLEN];
+
+	if (ifa->ifa_index != gw_ifindex) {
+		return;
+	}
+
+	// IFA_LOCAL is the address of the interface on point to point links, IFA_ADDRESS the peer
+	for (rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == IFA_LOCAL || (rta->rta_type == IFA_ADDRESS && !addr)) {
+			addr = RTA_DATA(rta);
+		}
+	}
+
+	if (!addr || !inet_ntop(ifa->ifa_family, addr, ip, sizeof(ip)) || strcmp(ip, config->gw_ip) != 0) {
+		return;
+	}
+
+	if (nh->nlmsg_type == RTM_DELADDR) {
+		debug(LOG_WARNING, "Gateway address [%s] has been removed from [%s]", ip, config->gw_interface);
+		gw_ip_removed = 1;
+	} else if (gw_ip_removed) {
+		debug(LOG_NOTICE, "Gateway address [%s] is back on [%s]", ip, config->gw_interface);
+		gw_ip_removed = 0;
+	}
+}
+
+static void
+_netmon_route(struct nlmsghdr *nh)
+{
+	struct rtmsg *rt = NLMSG_DATA(nh);
+	struct rtattr *rta;
+	int len = RTM_PAYLOAD(nh);
+	struct in_addr addr = {0};
+	int ifindex = 0;
+	t_netmon_gateway *gateway;
+
+	// As "ip route | grep default" in the gatewayroute library call
+	if (rt->rtm_family != AF_INET || rt->rtm_table != RT_TABLE_MAIN || rt->rtm_dst_len != 0) {
+		return;
+	}
+
+	for (rta = RTM_RTA(rt); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == RTA_GATEWAY && RTA_PAYLOAD(rta) == sizeof(addr)) {
+			memcpy(&addr, RTA_DATA(rta), sizeof(addr));
+		} else if (rta->rta_type == RTA_OIF) {
+			ifindex = *(int *)RTA_DATA(rta);
+		}
+	}
+
+	gateway = _netmon_gateway(&addr, ifindex);
+
+	if (nh->nlmsg_type == RTM_DELROUTE) {
+		if (gateway) {
+			*gateway = gateways[--gateway_count];
+		}
+	} else if (!gateway && gateway_count < NETMON_GATEWAYS) {
+		gateway = &gateways[gateway_count++];
+		gateway->addr = addr;
+		gateway->ifindex = ifindex;
+		gateway->state = -1;
+	}
+
+	// Routes of the initial dump were already seen by check_routing() at startup
+	if (!(nh->nlmsg_flags & NLM_F_MULTI)) {
+		_netmon_changed("default route changed");
+	}
+}
+
+static void
+_netmon_neigh(struct nlmsghdr *nh)
+{
+	struct ndmsg *ndm = NLMSG_DATA(nh);
+	struct rtattr *rta;
+	int len = RTM_PAYLOAD(nh);
+	struct in_addr addr;
+	t_netmon_gateway *gateway = NULL;
+	int state = -1;
+
+	if (ndm->ndm_family != AF_INET) {
+		return;
+	}
+
+	for (rta = RTM_RTA(ndm); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == NDA_DST && RTA_PAYLOAD(rta) == sizeof(addr)) {
+			memcpy(&addr, RTA_DATA(rta), sizeof(addr));
+			gateway = _netmon_gateway(&addr, ndm->ndm_ifindex);
+		}
+	}
+
+	if (!gateway) {
+		return;
+	}
+
+	/* PROBE is the routine revalidation of a known neighbour, so still online.
+	 * INCOMPLETE leaves the state as it was: the kernel times it out to FAILED,
+	 * which is reported as an event of its own, if the gateway does not answer.
+	 */
+	if (nh->nlmsg_type == RTM_NEWNEIGH) {
+		if (ndm->ndm_state & (NUD_REACHABLE | NUD_STALE | NUD_DELAY | NUD_PROBE)) {
+			state = 1;
+		} else if (ndm->ndm_state & NUD_INCOMPLETE) {
+			return;
+		} else if (ndm->ndm_state & NUD_FAILED) {
+			state = 0;
+		}
+	}
+
+	if (state != gateway->state) {
+		gateway->state = state;
+		_netmon_changed("upstream gateway neighbour changed");
+	}
+}
+
+/** Launched in its own thread.
+ *  If the rtnetlink socket cannot be opened it returns at once and the watchdog
+ *  reads the gateway mac and the upstream routing on every pass, as before.
+ */
+void *
+thread_netmon(void *arg)
+{
+	const char *gw_interface;
+	struct sockaddr_nl local;
+	struct nlmsghdr *nh;
+	char buf[16384] __attribute__((aligned(NLMSG_ALIGNTO)));
+	ssize_t len;
+	int sock;
+
+	// Needs a restart to change, so the string is shared by every config and never freed
+	config_read_begin();
+	gw_interface = config_get_config()->gw_interface;
+	config_read_end();
+
+	sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+
+	if (sock < 0) {
+		debug(LOG_WARNING, "Netmon: cannot open rtnetlink socket: %s, polling instead", strerror(errno));
+		return NULL;
+	}
+
+	memset(&local, 0, sizeof(local));
+	local.nl_family = AF_NETLINK;
+	local.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR | RTMGRP_IPV4_ROUTE | RTMGRP_NEIGH;
+
+	if (bind(sock, (struct sockaddr *)&local, sizeof(local)) < 0 || _netmon_request_routes(sock) != 0) {
+		debug(LOG_WARNING, "Netmon: cannot subscribe to rtnetlink events: %s, polling instead", strerror(errno));
+		close(sock);
+		return NULL;
+	}
+
+	// gatewayinterface needs a restart to change, the helpers read the rest of the config per event
+	gw_ifindex = if_nametoindex(gw_interface);
+	__atomic_store_n(&netmon_running, 1, __ATOMIC_RELEASE);
+
+	debug(LOG_INFO, "Netmon: following [%s] and the upstream routes", gw_interface);
+
+	while (1) {
+		len = recv(sock, buf, sizeof(buf), 0);
+
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			// The socket buffer overflowed, so start again from a fresh view
+			if (errno == ENOBUFS) {
+				debug(LOG_INFO, "Netmon: events were lost, reading the routes again");
+				_netmon_changed("events lost");
+				_netmon_request_routes(sock);
+				continue;
+			}
+
+			debug(LOG_ERR, "Netmon: recv(): %s, polling instead", strerror(errno));
+			break;
+		}
+
+		// The helpers read the config, not while waiting for events
+		config_read_begin();
+
+		for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+			switch (nh->nlmsg_type) {
+			case RTM_NEWLINK:
+			case RTM_DELLINK:
+				_netmon_link(nh);
+				break;
+			case RTM_NEWADDR:
+			case RTM_DELADDR:
+				_netmon_addr(nh);
+				break;
+			case RTM_NEWROUTE:
+			case RTM_DELROUTE:
+				_netmon_route(nh);
+				break;
+			case RTM_NEWNEIGH:
+			case RTM_DELNEIGH:
+				_netmon_neigh(nh);
+				break;
+			}
+		}
+
+		config_read_end();
+	}
+
+	__atomic_store_n(&netmon_running, 0, __ATOMIC_RELEASE);
+	close(sock);
+	return NULL;
+}
+
+int
+netmon_active(void)
+{
+	return __atomic_load_n(&netmon_running, __ATOMIC_ACQUIRE);
+}
+
+// A TCP connection attempt, answered by a reset or an accept alike if the gateway is up
+static int
+_netmon_probe(const char *ip)
+{
+	struct sockaddr_in addr;
+	struct pollfd pfd;
+	socklen_t errlen;
+	int sock;
+	int err = 0;
+	int rc = -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(NETMON_PROBE_PORT);
+
+	if (inet_pton(AF_INET, ip, &addr.sin_addr) != 1) {
+		return -1;
+	}
+
+	sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+	if (sock < 0) {
+		return -1;
+	}
+
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+		rc = 0;
+	} else if (errno == EINPROGRESS) {
+		pfd.fd = sock;
+		pfd.events = POLLOUT;
+
+		if (poll(&pfd, 1, NETMON_PROBE_MS) > 0) {
+			errlen = sizeof(err);
+			getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &errlen);
+
+			if (err == 0 || err == ECONNREFUSED) {
+				rc = 0;
+			}
+		}
+	} else if (errno == ECONNREFUSED) {
+		rc = 0;
+	}
+
+	close(sock);
+	debug(LOG_DEBUG, "Netmon: probe of upstream gateway [%s] %s", ip, rc == 0 ? "answered" : "failed");
+	return rc;
+}
+
+// Probes the offline gateways listed by the gatewayroute library call, eg "offline:192.168.1.1,wan"
+static int
+_netmon_probe_gateways(const char *ext_gateway)
+{
+	char *list;
+	char *next;
+	char *entry;
+	char *ip;
+	int rc = -1;
+
+	if (!ext_gateway) {
+		return -1;
+	}
+
+	list = safe_strdup(ext_gateway);
+
+	for (next = list; next && rc != 0; ) {
+		entry = strsep(&next, " ");
+
+		if (strncmp(entry, "offline:", 8) != 0) {
+			continue;
+		}
+
+		ip = entry + 8;
+		ip[strcspn(ip, ",")] = '\0';
+		rc = _netmon_probe(ip);
+	}
+
+	free(list);
+	return rc;
+}
+
+/** Called by check_routing() on each watchdog pass.
+ *  @return 1 if the gatewayroute library call should be run again
+ */
+int
+netmon_routing_stale(const char *ext_gateway, int online)
+{
+	double now = metrics_now();
+
+	if (!netmon_active()) {
+		return 1;
+	}
+
+	if (__atomic_exchange_n(&routing_changed, 0, __ATOMIC_RELAXED) || now >= next_refresh) {
+		next_refresh = now + NETMON_REFRESH;
+		return 1;
+	}
+
+	if (online > 0) {
+		backoff = 0;
+		next_probe = 0;
+		return 0;
+	}
+
+	if (now < next_probe) {
+		return 0;
+	}
+
+	if (_netmon_probe_gateways(ext_gateway) == 0) {
+		debug(LOG_INFO, "Netmon: an offline upstream gateway answered, checking routing");
+		backoff = 0;
+		next_probe = 0;
+		return 1;
+	}
+
+	backoff = backoff > 0 ? backoff * 2 : NETMON_BACKOFF_MIN;
+
+	if (backoff > NETMON_BACKOFF_MAX) {
+		backoff = NETMON_BACKOFF_MAX;
+	}
+
+	next_probe = now + backoff;
+	debug(LOG_DEBUG, "Netmon: upstream gateway(s) offline, next probe in %.0f seconds", backoff);
+	return 0;
+}
@@ -0,0 +1,51 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file netmon.h
+    @brief Follows the gateway interface and the upstream routes with rtnetlink events
+    @author Copyright (C) 2015-2025 Modifications and additions by BlueWave Projects and Services <opennds@blue-wave.net>
+*/
+
+#ifndef _NETMON_H_
+#define _NETMON_H_
+
+/** Default routes followed for neighbour events */
+#define NETMON_GATEWAYS 8
+/** Seconds between probes of an offline upstream gateway, doubled after each failure */
+#define NETMON_BACKOFF_MIN 5
+#define NETMON_BACKOFF_MAX 300
+/** Seconds after which the routing is read again even without events, in case any were missed */
+#define NETMON_REFRESH 600
+/** Milliseconds allowed for a probe of an upstream gateway */
+#define NETMON_PROBE_MS 1000
+/** Port probed, an answer of any kind, even a reset, shows the gateway is reachable */
+#define NETMON_PROBE_PORT 53
+
+/** @brief Receives link, address, route and neighbour events */
+void *thread_netmon(void *arg);
+
+/** @brief Returns 1 while events are being received */
+int netmon_active(void);
+
+/** @brief Returns 1 if the upstream routing should be read again, after an event,
+ *  or after a probe found an offline upstream gateway reachable again */
+int netmon_routing_stale(const char *ext_gateway, int online);
+
+#endif /* _NETMON_H_ */
@@ -0,0 +1,614 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @internal
+  @file nftset_sync.c
+  @brief Keeps the walled garden, block list and remote FAS nftsets up to date
+  @author Copyright (C) 2015-2025 Modifications and additions by BlueWave Projects and Services <opennds@blue-wave.net>
+
+  When dnsmasq has no nftset support it fills legacy ipsets instead, and their
+  addresses must be copied to the nftsets the firewall rules use. The addresses
+  thread_resolver() finds for the walled garden and remote FAS FQDNs are added too.
+
+  Each second the resolved addresses and the ipset as last read are compared with
+  what was last applied to the nftset. Only the addresses added and removed are
+  sent, all in one nft transaction. Forking "ipset save" costs far more than the
+  comparison, so the ipset is only read every checkinterval and when the nftsets
+  are rebuilt. The resolver already keeps the walled garden FQDNs resolved, so
+  this only delays addresses dnsmasq adds for other names.
+
+  The walled garden and block list nftsets are interval sets, so networks from
+  hash:net ipsets are copied as they are, overlapping entries being merged first.
+  An element of an interval set matches every address it covers, and nft refuses
+  an element overlapping one already in the set. So nothing overlapping an element
+  added from outside is sent, and a resolved address already covered is not added.
+
+  Only elements added here are ever removed, so those dnsmasq adds itself are left
+  alone. The resolver asks dnsmasq, which puts the answers in the nftset before
+  they are picked up here, so a resolved address not yet ours has the nftset
+  listed first, and one already in it is left to dnsmasq rather than taken and
+  later expired. Every checkinterval, and after a failed transaction, the nftset
+  is listed again so changes made to it from outside, eg when it is rebuilt, are
+  caught up with.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "common.h"
+#include "safe.h"
+#include "conf.h"
+#include "debug.h"
+#include "fw_iptables.h"
+#include "resolver.h"
+#include "nftset_sync.h"
+
+// An address range, host byte order, both ends included
+typedef struct {
+	uint32_t start;
+	uint32_t end;
+} t_nftset_range;
+
+typedef struct {
+	t_nftset_range *ranges;
+	int count;
+	int size;
+} t_nftset_ranges;
+
+typedef struct {
+	const char *name;
+	const char *ipset;		// legacy ipset copied to it, or NULL if all its elements are ours
+	const char *tables[2];		// tables holding the nftset, the first one is listed
+	t_nftset_ranges applied;	// the elements we added to the nftset
+	t_nftset_ranges foreign;	// the elements in it when last listed that are not ours
+	int known;			// applied is known to match the nftset
+	t_nftset_ranges copied;		// the legacy ipset when last read, empty if it does not exist
+	time_t ipset_check;		// when to read the ipset again
+	time_t next_list;		// when to list the nftset again
+} t_nftset_sync;
+
+static t_nftset_sync nftset_syncs[] = {
+	{ "walledgarden", "walledgarden", { "ip nds_filter", NULL }, { NULL, 0, 0 }, { NULL, 0, 0 }, 0, { NULL, 0, 0 }, 0, 0 },
+	{ "blocklist", "blocklist", { "ip nds_filter", NULL }, { NULL, 0, 0 }, { NULL, 0, 0 }, 0, { NULL, 0, 0 }, 0, 0 },
+	{ NFTSET_FAS, NULL, { "inet nds_nat", "inet nds_filter" }, { NULL, 0, 0 }, { NULL, 0, 0 }, 0, { NULL, 0, 0 }, 0, 0 }
+};
+
+#define NFTSET_SYNC_COUNT (sizeof(nftset_syncs) / sizeof(nftset_syncs[0]))
+
+// Set by nftset_sync_reset(), from other threads
+static volatile int nftset_sync_stale = 0;
+
+static void
+_nftset_add(t_nftset_ranges *ranges, uint32_t start, uint32_t end)
+{
+	if (ranges->count == ranges->size) {
+		ranges->size = ranges->size ? ranges->size * 2 : 64;
+		ranges->ranges = realloc(ranges->ranges, ranges->size * sizeof(t_nftset_range));
+
+		if (!ranges->ranges) {
+			debug(LOG_CRIT, "Failed to realloc - exiting");
+			exit(1);
+		}
+	}
+
+	ranges->ranges[ranges->count].start = start;
+	ranges->ranges[ranges->count].end = end;
+	ranges->count++;
+}
+
+// Parses an address, a network a.b.c.d/n or a range a.b.c.d-e.f.g.h
+static int
+_nftset_parse(t_nftset_ranges *ranges, const char *element)
+{
+	char buf[64];
+	char *sep;
+	struct in_addr start;
+	struct in_addr end;
+	int prefix;
+	uint32_t mask;
+
+	if (strlen(element) >= sizeof(buf)) {
+		return -1;
+	}
+
+	strcpy(buf, element);
+
+	if ((sep = strchr(buf, '/'))) {
+		*sep = '\0';
+		prefix = atoi(sep + 1);
+
+		if (prefix < 0 || prefix > 32 || inet_pton(AF_INET, buf, &start) != 1) {
+			return -1;
+		}
+
+		mask = prefix ? 0xffffffffU << (32 - prefix) : 0;
+		_nftset_add(ranges, ntohl(start.s_addr) & mask, (ntohl(start.s_addr) & mask) | ~mask);
+	} else if ((sep = strchr(buf, '-'))) {
+		*sep = '\0';
+
+		if (inet_pton(AF_INET, buf, &start) != 1 || inet_pton(AF_INET, sep + 1, &end) != 1
+			|| ntohl(start.s_addr) > ntohl(end.s_addr)) {
+			return -1;
+		}
+
+		_nftset_add(ranges, ntohl(start.s_addr), ntohl(end.s_addr));
+	} else {
+		if (inet_pton(AF_INET, buf, &start) != 1) {
+			return -1;
+		}
+
+		_nftset_add(ranges, ntohl(start.s_addr), ntohl(start.s_addr));
+	}
+
+	return 0;
+}
+
+static int
+_nftset_compare(const void *a, const void *b)
+{
+	const t_nftset_range *ra = a;
+	const t_nftset_range *rb = b;
+
+	if (ra->start != rb->start) {
+		return ra->start < rb->start ? -1 : 1;
+	}
+
+	if (ra->end != rb->end) {
+		return ra->end > rb->end ? -1 : 1;
+	}
+
+	return 0;
+}
+
+// Sorts the ranges and merges those that overlap, as an interval set rejects them
+static void
+_nftset_normalise(t_nftset_ranges *ranges)
+{
+	int i;
+	int kept = 0;
+
+	if (ranges->count == 0) {
+		return;
+	}
+
+	qsort(ranges->ranges, ranges->count, sizeof(t_nftset_range), _nftset_compare);
+
+	for (i = 1; i < ranges->count; i++) {
+		if (ranges->ranges[i].start <= ranges->ranges[kept].end) {
+			if (ranges->ranges[i].end > ranges->ranges[kept].end) {
+				ranges->ranges[kept].end = ranges->ranges[i].end;
+			}
+		} else {
+			ranges->ranges[++kept] = ranges->ranges[i];
+		}
+	}
+
+	ranges->count = kept + 1;
+}
+
+// Appends an element as nft expects it: an address, a network or a range
+static void
+_nftset_format(FILE *fp, const t_nftset_range *range, int first)
+{
+	struct in_addr addr;
+	char start[INET_ADDRSTRLEN];
+	char end[INET_ADDRSTRLEN];
+	uint32_t size = range->end - range->start;
+	int prefix;
+
+	addr.s_addr = htonl(range->start);
+	inet_ntop(AF_INET, &addr, start, sizeof(start));
+
+	fprintf(fp, "%s", first ? "" : ", ");
+
+	if (size == 0) {
+		fprintf(fp, "%s", start);
+		return;
+	}
+
+	// A network when the range is a power of two in size and aligned to it
+	if (((size + 1) & size) == 0 && (range->start & size) == 0) {
+		for (prefix = 32; size; size >>= 1) {
+			prefix--;
+		}
+
+		fprintf(fp, "%s/%d", start, prefix);
+		return;
+	}
+
+	addr.s_addr = htonl(range->end);
+	inet_ntop(AF_INET, &addr, end, sizeof(end));
+	fprintf(fp, "%s-%s", start, end);
+}
+
+/* Reads the elements of a list command's output: the words following "elements = {"
+ * up to the closing brace, or the third word of each "add <set> <element>" line.
+ * Returns -1 if the command failed, as when the set does not exist.
+ */
+static int
+_nftset_read(const char *command, t_nftset_ranges *ranges)
+{
+	FILE *fp;
+	char *line = NULL;
+	size_t size = 0;
+	char *p;
+	char *word;
+	int in_elements = 0;
+	int found = 0;
+
+	ranges->count = 0;
+	fp = popen(command, "r");
+
+	if (!fp) {
+		debug(LOG_ERR, "popen(): %s", strerror(errno));
+		return -1;
+	}
+
+	while (getline(&line, &size, fp) != -1) {
+		p = line;
+
+		if (strncmp(p, "create ", 7) == 0 || strstr(p, "set ")) {
+			found = 1;
+		}
+
+		if (strncmp(p, "add ", 4) == 0) {
+			strsep(&p, " ");
+			strsep(&p, " ");
+			word = strsep(&p, " \n");
+
+			if (word && _nftset_parse(ranges, word) != 0) {
+				debug(LOG_DEBUG, "nftset sync: ignoring [%s]", word);
+			}
+
+			continue;
+		}
+
+		if (!in_elements) {
+			if (!(p = strstr(p, "elements = {"))) {
+				continue;
+			}
+
+			p += strlen("elements = {");
+			in_elements = 1;
+		}
+
+		while ((word = strsep(&p, ", \t\n"))) {
+			if (*word == '}') {
+				in_elements = 0;
+				break;
+			}
+
+			if (*word && _nftset_parse(ranges, word) != 0) {
+				debug(LOG_DEBUG, "nftset sync: ignoring [%s]", word);
+			}
+		}
+	}
+
+	free(line);
+
+	if (pclose(fp) != 0 || !found) {
+		return -1;
+	}
+
+	_nftset_normalise(ranges);
+	return 0;
+}
+
+/* Writes the ranges in one of a and not in the other, as one nft command,
+ * returning their number. With no fp they are only counted.
+ */
+static int
+_nftset_diff(FILE *fp, const char *verb, const char *table, const char *name, const t_nftset_ranges *a, const t_nftset_ranges *b)
+{
+	int i = 0;
+	int j = 0;
+	int count = 0;
+	int cmp;
+
+	while (i < a->count) {
+		cmp = (j < b->count) ? _nftset_compare(&a->ranges[i], &b->ranges[j]) : -1;
+
+		if (cmp == 0) {
+			i++;
+			j++;
+		} else if (cmp > 0) {
+			j++;
+		} else {
+			if (fp && count == 0) {
+				fprintf(fp, "%s element %s %s { ", verb, table, name);
+			}
+
+			if (fp) {
+				_nftset_format(fp, &a->ranges[i], count == 0);
+			}
+
+			count++;
+			i++;
+		}
+	}
+
+	if (fp && count > 0) {
+		fprintf(fp, " }");
+	}
+
+	return count;
+}
+
+static int
+_nftset_contains(const t_nftset_ranges *ranges, const t_nftset_range *range)
+{
+	return bsearch(range, ranges->ranges, ranges->count, sizeof(t_nftset_range), _nftset_compare) != NULL;
+}
+
+// Whether an address is in one of the ranges, which are sorted and do not overlap
+static int
+_nftset_covers(const t_nftset_ranges *ranges, uint32_t addr)
+{
+	int low = 0;
+	int high = ranges->count - 1;
+	int mid;
+
+	while (low <= high) {
+		mid = low + (high - low) / 2;
+
+		if (addr < ranges->ranges[mid].start) {
+			high = mid - 1;
+		} else if (addr > ranges->ranges[mid].end) {
+			low = mid + 1;
+		} else {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// Removes the ranges overlapping any of others, both sorted without overlaps
+static void
+_nftset_remove_overlapping(t_nftset_ranges *ranges, const t_nftset_ranges *others)
+{
+	int i;
+	int j = 0;
+	int kept = 0;
+
+	for (i = 0; i < ranges->count; i++) {
+		while (j < others->count && others->ranges[j].end < ranges->ranges[i].start) {
+			j++;
+		}
+
+		if (j < others->count && others->ranges[j].start <= ranges->ranges[i].end) {
+			debug(LOG_DEBUG, "nftset sync: leaving out an element overlapping one added from outside");
+			continue;
+		}
+
+		ranges->ranges[kept++] = ranges->ranges[i];
+	}
+
+	ranges->count = kept;
+}
+
+/* Lists the nftset and takes as ours the elements in it that we added or copy from the ipset.
+ * Those added by dnsmasq or by hand are kept as foreign, unless all its elements are ours.
+ */
+static int
+_nftset_list(t_nftset_sync *sync, const t_nftset_ranges *wanted)
+{
+	t_nftset_ranges listed = { NULL, 0, 0 };
+	t_nftset_ranges ours = { NULL, 0, 0 };
+	t_nftset_ranges foreign = { NULL, 0, 0 };
+	char *command;
+	int rc;
+	int i;
+
+	safe_asprintf(&command, "nft list set %s %s 2>/dev/null", sync->tables[0], sync->name);
+	rc = _nftset_read(command, &listed);
+	free(command);
+
+	if (rc != 0) {
+		free(listed.ranges);
+		return -1;
+	}
+
+	for (i = 0; i < listed.count; i++) {
+		if (!sync->ipset || _nftset_contains(&sync->applied, &listed.ranges[i]) || _nftset_contains(wanted, &listed.ranges[i])) {
+			_nftset_add(&ours, listed.ranges[i].start, listed.ranges[i].end);
+		} else {
+			_nftset_add(&foreign, listed.ranges[i].start, listed.ranges[i].end);
+		}
+	}
+
+	free(listed.ranges);
+	free(sync->applied.ranges);
+	sync->applied = ours;
+	free(sync->foreign.ranges);
+	sync->foreign = foreign;
+
+	return 0;
+}
+
+static void
+_nftset_sync(t_nftset_sync *sync, time_t now, int checkinterval)
+{
+	t_nftset_ranges wanted = { NULL, 0, 0 };
+	uint32_t *addrs;
+	char *command;
+	char *changes[2] = { NULL, NULL };
+	size_t len;
+	FILE *fp;
+	int removed = 0;
+	int added = 0;
+	int count;
+	int fresh = 0;
+	int rc = 0;
+	int i;
+	int t;
+
+	// The legacy ipset, read again every checkinterval
+	if (sync->ipset && now >= sync->ipset_check) {
+		safe_asprintf(&command, "ipset save %s 2>/dev/null", sync->ipset);
+
+		if (_nftset_read(command, &sync->copied) != 0) {
+			// dnsmasq fills the nftset itself
+			sync->copied.count = 0;
+		}
+
+		free(command);
+		sync->ipset_check = now + checkinterval;
+	}
+
+	for (i = 0; i < sync->copied.count; i++) {
+		_nftset_add(&wanted, sync->copied.ranges[i].start, sync->copied.ranges[i].end);
+	}
+
+	count = resolver_addresses(sync->name, &addrs);
+
+	// Resolved addresses neither ours nor known to be in the nftset, where dnsmasq may have just put them
+	for (i = 0; i < count; i++) {
+		if (!_nftset_covers(&sync->applied, addrs[i]) && !_nftset_covers(&sync->foreign, addrs[i])) {
+			fresh++;
+		}
+	}
+
+	// Nothing to add and nothing of ours to remove, or waiting after a failure
+	if ((wanted.count == 0 && count == 0 && sync->applied.count == 0) || (!sync->known && now < sync->next_list)) {
+		free(wanted.ranges);
+		free(addrs);
+		return;
+	}
+
+	// List the nftset after a failure, before taking fresh addresses, and every checkinterval in case it was changed from outside
+	if (!sync->known || fresh > 0 || now >= sync->next_list) {
+		sync->known = (_nftset_list(sync, &wanted) == 0);
+		sync->next_list = now + checkinterval;
+
+		if (!sync->known) {
+			free(wanted.ranges);
+			free(addrs);
+			return;
+		}
+	}
+
+	// The resolved addresses, but not those dnsmasq put in the nftset
+	for (i = 0; i < count; i++) {
+		if (!_nftset_covers(&sync->foreign, addrs[i])) {
+			_nftset_add(&wanted, addrs[i], addrs[i]);
+		}
+	}
+
+	free(addrs);
+	_nftset_normalise(&wanted);
+	_nftset_remove_overlapping(&wanted, &sync->foreign);
+
+	// The same changes for each table holding the nftset
+	for (t = 0; t < 2 && sync->tables[t]; t++) {
+		fp = open_memstream(&changes[t], &len);
+		removed = _nftset_diff(fp, "delete", sync->tables[t], sync->name, &sync->applied, &wanted);
+
+		if (removed > 0 && _nftset_diff(NULL, "add", sync->tables[t], sync->name, &wanted, &sync->applied) > 0) {
+			fprintf(fp, "\n");
+		}
+
+		added = _nftset_diff(fp, "add", sync->tables[t], sync->name, &wanted, &sync->applied);
+		fclose(fp);
+	}
+
+	if (removed > 0 || added > 0) {
+		iptables_fw_batch_begin();
+
+		for (t = 0; t < 2 && sync->tables[t]; t++) {
+			nftables_do_command("%s", changes[t]);
+		}
+
+		rc = iptables_fw_batch_commit();
+		debug(LOG_DEBUG, "nftset sync: %s %d added, %d removed, rc [ %d ]", sync->name, added, removed, rc);
+	}
+
+	for (t = 0; t < 2; t++) {
+		free(changes[t]);
+	}
+
+	if (rc == 0) {
+		free(sync->applied.ranges);
+		sync->applied = wanted;
+	} else {
+		// Some of it may have been applied, so take all as ours until the nftset is listed again
+		for (i = 0; i < wanted.count; i++) {
+			_nftset_add(&sync->applied, wanted.ranges[i].start, wanted.ranges[i].end);
+		}
+
+		free(wanted.ranges);
+		_nftset_normalise(&sync->applied);
+		sync->known = 0;
+		sync->next_list = now + checkinterval;
+	}
+}
+
+/** Makes the next pass list the nftsets again, for use once they have been rebuilt */
+void
+nftset_sync_reset(void)
+{
+	nftset_sync_stale = 1;
+}
+
+/** Launched in its own thread.
+ *  Each second, applies the changes of the resolved addresses, and of the legacy ipsets read every checkinterval, to the nftsets.
+ */
+void *
+thread_nftset_sync(void *arg)
+{
+	unsigned int i;
+	time_t now;
+	int checkinterval;
+
+	while (1) {
+		now = time(NULL);
+		config_read_begin();
+		checkinterval = config_get_config()->checkinterval;
+		config_read_end();
+
+		if (nftset_sync_stale) {
+			nftset_sync_stale = 0;
+
+			for (i = 0; i < NFTSET_SYNC_COUNT; i++) {
+				nftset_syncs[i].known = 0;
+				nftset_syncs[i].next_list = 0;
+				nftset_syncs[i].ipset_check = 0;
+			}
+		}
+
+		for (i = 0; i < NFTSET_SYNC_COUNT; i++) {
+			_nftset_sync(&nftset_syncs[i], now, checkinterval);
+		}
+
+		sleep(1);
+	}
+
+	return NULL;
+}
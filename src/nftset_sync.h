@@ -0,0 +1,35 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file nftset_sync.h
+    @brief Keeps the walled garden, block list and remote FAS nftsets up to date
+    @author Copyright (C) 2015-2025 Modifications and additions by BlueWave Projects and Services <opennds@blue-wave.net>
+*/
+
+#ifndef _NFTSET_SYNC_H_
+#define _NFTSET_SYNC_H_
+
+/** @brief Keeps the nftsets in step with the legacy ipsets dnsmasq fills and the resolved FQDNs */
+void *thread_nftset_sync(void *arg);
+
+/** @brief Forgets what was applied to the nftsets, after they have been rebuilt */
+void nftset_sync_reset(void);
+
+#endif /* _NFTSET_SYNC_H_ */
@@ -0,0 +1,728 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @internal
+  @file reload.c
+  @brief Reload of the configuration on SIGHUP, without a restart
+  @author Copyright (C) 2015-2025 Modifications and additions by BlueWave Projects and Services <opennds@blue-wave.net>
+
+  On SIGHUP the whole config is read again with a single uci export and compared,
+  option by option, with the values in effect. Options that changed are applied to
+  a copy of the current s_config, which then replaces it for all readers of
+  config_get_config(). Clients, their firewall rules and their sessions are kept.
+
+  Rates, quotas, timeouts, the FAS key, path, fqdn and custom lists, the debug level
+  and a few others are applied this way. The walled garden and block list nftsets
+  are rebuilt, and trusted MACs are added and removed, only when their lists changed.
+  Any other option that changed, eg gatewayinterface or fasport, needs a restart and
+  is reported as such.
+
+  The webroot cache is also flushed, so edited splash pages are served at once.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <time.h>
+
+#include "common.h"
+#include "safe.h"
+#include "conf.h"
+#include "debug.h"
+#include "main.h"
+#include "auth.h"
+#include "client_list.h"
+#include "fw_iptables.h"
+#include "util.h"
+#include "webroot_cache.h"
+#include "render_cache.h"
+#include "nftset_sync.h"
+#include "resolver.h"
+#include "reload.h"
+
+extern pthread_mutex_t config_mutex;
+
+#define RELOAD_READ_COMMAND "if type uci > /dev/null 2>&1; then uci export opennds; else cat /etc/config/opennds; fi"
+
+/** Groups of options, applied together */
+#define RELOAD_RATES		0x001
+#define RELOAD_QUOTAS		0x002
+#define RELOAD_TIMEOUTS		0x004
+#define RELOAD_FAS		0x008
+#define RELOAD_WALLEDGARDEN	0x010
+#define RELOAD_BLOCKLIST	0x020
+#define RELOAD_TRUSTED		0x040
+#define RELOAD_DEBUG		0x080
+#define RELOAD_OTHER		0x100
+
+typedef enum {
+	RELOAD_INT,		// sscanf %u into an int field
+	RELOAD_ULL,		// sscanf %llu into an unsigned long long int field
+	RELOAD_STR,		// the url encoded value, as set_option_str() returns it
+	RELOAD_NONE		// applied by the code of its group
+} t_reload_type;
+
+typedef struct {
+	const char *name;
+	const char *default_value;
+	t_reload_type type;
+	size_t offset;			// of the field in s_config
+	unsigned int group;
+} t_reload_option;
+
+#define RELOAD_FIELD(f) offsetof(s_config, f)
+
+/** Options that can change without a restart, with the same defaults as config_init() */
+static const t_reload_option reload_options[] = {
+	{"sessiontimeout", DEFAULT_SESSIONTIMEOUT, RELOAD_INT, RELOAD_FIELD(sessiontimeout), RELOAD_TIMEOUTS},
+	{"preauthidletimeout", DEFAULT_PREAUTH_IDLE_TIMEOUT, RELOAD_INT, RELOAD_FIELD(preauth_idle_timeout), RELOAD_TIMEOUTS},
+	{"authidletimeout", DEFAULT_AUTH_IDLE_TIMEOUT, RELOAD_INT, RELOAD_FIELD(auth_idle_timeout), RELOAD_TIMEOUTS},
+	{"checkinterval", DEFAULT_CHECKINTERVAL, RELOAD_INT, RELOAD_FIELD(checkinterval), RELOAD_TIMEOUTS},
+	{"ratecheckwindow", DEFAULT_RATE_CHECK_WINDOW, RELOAD_INT, RELOAD_FIELD(rate_check_window), RELOAD_TIMEOUTS},
+	{"remotes_refresh_interval", DEFAULT_REMOTES_REFRESH_INTERVAL, RELOAD_INT, RELOAD_FIELD(remotes_refresh_interval), RELOAD_TIMEOUTS},
+	{"uploadrate", DEFAULT_UPLOAD_RATE, RELOAD_ULL, RELOAD_FIELD(upload_rate), RELOAD_RATES},
+	{"downloadrate", DEFAULT_DOWNLOAD_RATE, RELOAD_ULL, RELOAD_FIELD(download_rate), RELOAD_RATES},
+	{"download_bucket_ratio", DEFAULT_DOWNLOAD_BUCKET_RATIO, RELOAD_ULL, RELOAD_FIELD(download_bucket_ratio), RELOAD_RATES},
+	{"upload_bucket_ratio", DEFAULT_UPLOAD_BUCKET_RATIO, RELOAD_ULL, RELOAD_FIELD(upload_bucket_ratio), RELOAD_RATES},
+	{"max_download_bucket_size", DEFAULT_MAX_DOWNLOAD_BUCKET_SIZE, RELOAD_ULL, RELOAD_FIELD(max_download_bucket_size), RELOAD_RATES},
+	{"max_upload_bucket_size", DEFAULT_MAX_UPLOAD_BUCKET_SIZE, RELOAD_ULL, RELOAD_FIELD(max_upload_bucket_size), RELOAD_RATES},
+	{"download_unrestricted_bursting", DEFAULT_DOWNLOAD_UNRESTRICTED_BURSTING, RELOAD_INT, RELOAD_FIELD(download_unrestricted_bursting), RELOAD_RATES},
+	{"upload_unrestricted_bursting", DEFAULT_UPLOAD_UNRESTRICTED_BURSTING, RELOAD_INT, RELOAD_FIELD(upload_unrestricted_bursting), RELOAD_RATES},
+	{"fup_upload_throttle_rate", DEFAULT_FUP_UPLOAD_THROTTLE_RATE, RELOAD_ULL, RELOAD_FIELD(fup_upload_throttle_rate), RELOAD_RATES},
+	{"fup_download_throttle_rate", DEFAULT_FUP_DOWNLOAD_THROTTLE_RATE, RELOAD_ULL, RELOAD_FIELD(fup_download_throttle_rate), RELOAD_RATES},
+	{"uploadquota", DEFAULT_UPLOAD_QUOTA, RELOAD_ULL, RELOAD_FIELD(upload_quota), RELOAD_QUOTAS},
+	{"downloadquota", DEFAULT_DOWNLOAD_QUOTA, RELOAD_ULL, RELOAD_FIELD(download_quota), RELOAD_QUOTAS},
+	{"faskey", DEFAULT_FASKEY, RELOAD_NONE, 0, RELOAD_FAS},
+	{"faspath", DEFAULT_FASPATH, RELOAD_NONE, 0, RELOAD_FAS},
+	{"fasremotefqdn", DEFAULT_FAS_REMOTEFQDN, RELOAD_NONE, 0, RELOAD_FAS},
+	{"themespec_path", DEFAULT_THEMESPEC_PATH, RELOAD_NONE, 0, RELOAD_FAS},
+	{"fas_custom_parameters_list", DEFAULT_FAS_CUSTOM_PARAMETERS_LIST, RELOAD_NONE, 0, RELOAD_FAS},
+	{"fas_custom_variables_list", DEFAULT_FAS_CUSTOM_VARIABLES_LIST, RELOAD_NONE, 0, RELOAD_FAS},
+	{"fas_custom_images_list", DEFAULT_FAS_CUSTOM_IMAGES_LIST, RELOAD_NONE, 0, RELOAD_FAS},
+	{"fas_custom_files_list", DEFAULT_FAS_CUSTOM_FILES_LIST, RELOAD_NONE, 0, RELOAD_FAS},
+	{"walledgarden_fqdn_list", "", RELOAD_NONE, 0, RELOAD_WALLEDGARDEN},
+	{"walledgarden_port_list", "", RELOAD_NONE, 0, RELOAD_WALLEDGARDEN},
+	{"blocklist_fqdn_list", "", RELOAD_NONE, 0, RELOAD_BLOCKLIST},
+	{"blocklist_port_list", "", RELOAD_NONE, 0, RELOAD_BLOCKLIST},
+	{"trustedmac", DEFAULT_TRUSTEDMACLIST, RELOAD_NONE, 0, RELOAD_TRUSTED},
+	{"debuglevel", DEFAULT_DEBUGLEVEL, RELOAD_NONE, 0, RELOAD_DEBUG},
+	{"max_log_entries", DEFAULT_MAX_LOG_ENTRIES, RELOAD_ULL, RELOAD_FIELD(max_log_entries), RELOAD_OTHER},
+	{"max_page_size", DEFAULT_MAX_PAGE_SIZE, RELOAD_ULL, RELOAD_FIELD(max_page_size), RELOAD_OTHER},
+	{"webroot_cache_maxage", DEFAULT_WEBROOT_CACHE_MAXAGE, RELOAD_INT, RELOAD_FIELD(webroot_cache_maxage), RELOAD_OTHER},
+	{"redirect_keepalive", DEFAULT_REDIRECT_KEEPALIVE, RELOAD_INT, RELOAD_FIELD(redirect_keepalive), RELOAD_OTHER},
+	{"http_source_rate", DEFAULT_HTTP_SOURCE_RATE, RELOAD_INT, RELOAD_FIELD(http_source_rate), RELOAD_OTHER},
+	{"http_source_burst", DEFAULT_HTTP_SOURCE_BURST, RELOAD_INT, RELOAD_FIELD(http_source_burst), RELOAD_OTHER},
+	{"http_script_concurrency", DEFAULT_HTTP_SCRIPT_CONCURRENCY, RELOAD_INT, RELOAD_FIELD(http_script_concurrency), RELOAD_OTHER},
+	{"render_cache_ttl", DEFAULT_RENDER_CACHE_TTL, RELOAD_INT, RELOAD_FIELD(render_cache_ttl), RELOAD_OTHER},
+	{"allow_preemptive_authentication", DEFAULT_ALLOW_PREEMPTIVE_AUTHENTICATION, RELOAD_INT, RELOAD_FIELD(allow_preemptive_authentication), RELOAD_OTHER},
+	{NULL, NULL, RELOAD_NONE, 0, 0}
+};
+
+/** The value of an option, or of all the entries of a list separated by spaces,
+ *  url encoded as get_option_from_config() and get_list_from_config() return them
+ */
+typedef struct _reload_value_t {
+	char *name;
+	char *value;
+	struct _reload_value_t *next;
+} t_reload_value;
+
+// The values in effect, only used by the reload thread
+static t_reload_value *reload_values = NULL;
+
+static sem_t reload_sem;
+static volatile sig_atomic_t reload_ready = 0;
+
+static const t_reload_option *
+_reload_option(const char *name)
+{
+	const t_reload_option *option;
+
+	for (option = reload_options; option->name; option++) {
+		if (strcmp(option->name, name) == 0) {
+			return option;
+		}
+	}
+
+	return NULL;
+}
+
+static const char *
+_reload_get(t_reload_value *values, const char *name)
+{
+	t_reload_value *v;
+
+	for (v = values; v; v = v->next) {
+		if (strcmp(v->name, name) == 0) {
+			return v->value;
+		}
+	}
+
+	return NULL;
+}
+
+// The value of an option, or its default if it is not set
+static const char *
+_reload_value(t_reload_value *values, const t_reload_option *option)
+{
+	const char *value = _reload_get(values, option->name);
+
+	return value ? value : option->default_value;
+}
+
+static void
+_reload_set(t_reload_value **values, const char *name, const char *value)
+{
+	t_reload_value *v;
+	t_reload_value **tail;
+	char *joined;
+
+	for (tail = values; *tail; tail = &(*tail)->next) {
+		v = *tail;
+
+		if (strcmp(v->name, name) == 0) {
+			// A list, or an option set more than once: keep all values, as the shell does
+			safe_asprintf(&joined, "%s %s", v->value, value);
+			free(v->value);
+			v->value = joined;
+			return;
+		}
+	}
+
+	v = safe_calloc(sizeof(t_reload_value));
+	v->name = safe_strdup(name);
+	v->value = safe_strdup(value);
+	*tail = v;
+}
+
+static void
+_reload_free(t_reload_value *values)
+{
+	t_reload_value *next;
+
+	while (values) {
+		next = values->next;
+		free(values->name);
+		free(values->value);
+		free(values);
+		values = next;
+	}
+}
+
+// Encodes the characters libopennds.sh urlencode() encodes
+static char *
+_reload_encode(const char *raw)
+{
+	char *encoded;
+	char *p;
+
+	encoded = safe_calloc(strlen(raw) * 3 + 1);
+
+	for (p = encoded; *raw; raw++) {
+		switch (*raw) {
+		case '%': p += sprintf(p, "%%25"); break;
+		case ' ':
+		case '\t': p += sprintf(p, "%%20"); break;
+		case '"': p += sprintf(p, "%%22"); break;
+		case '>': p += sprintf(p, "%%3E"); break;
+		case '<': p += sprintf(p, "%%3C"); break;
+		case '\'': p += sprintf(p, "%%27"); break;
+		case '`': p += sprintf(p, "%%60"); break;
+		case '$': p += sprintf(p, "%%24"); break;
+		default: *p++ = *raw;
+		}
+	}
+
+	return encoded;
+}
+
+/* Reads all the options and lists of the config in one go, from uci export or
+ * from the config file. Lines are of the form: option|list <name> '<value>'
+ * Returns NULL if the config could not be read.
+ */
+static t_reload_value *
+_reload_read(void)
+{
+	t_reload_value *values = NULL;
+	FILE *fp;
+	char *line = NULL;
+	size_t size = 0;
+	char *p;
+	char *keyword;
+	char *name;
+	char *value;
+	char *end;
+	char *encoded;
+	int options = 0;
+
+	fp = popen(RELOAD_READ_COMMAND, "r");
+
+	if (!fp) {
+		debug(LOG_ERR, "Reload: popen(): %s", strerror(errno));
+		return NULL;
+	}
+
+	while (getline(&line, &size, fp) != -1) {
+		p = line + strspn(line, " \t");
+		keyword = strsep(&p, " \t");
+
+		if (!p || (strcmp(keyword, "option") != 0 && strcmp(keyword, "list") != 0)) {
+			continue;
+		}
+
+		p += strspn(p, " \t");
+		name = strsep(&p, " \t\n");
+
+		if (!p || strlen(name) == 0) {
+			continue;
+		}
+
+		value = p + strspn(p, " \t");
+
+		if (*value == '\'' || *value == '"') {
+			end = strrchr(value + 1, *value);
+
+			if (!end) {
+				continue;
+			}
+
+			*end = '\0';
+			value++;
+		} else {
+			value[strcspn(value, " \t\n#")] = '\0';
+		}
+
+		// An empty option is the same as an unset one, the default is used
+		if (strlen(value) == 0) {
+			continue;
+		}
+
+		encoded = _reload_encode(value);
+		_reload_set(&values, name, encoded);
+		free(encoded);
+		options++;
+	}
+
+	free(line);
+
+	if (pclose(fp) != 0 && options == 0) {
+		debug(LOG_ERR, "Reload: could not read the configuration");
+		_reload_free(values);
+		return NULL;
+	}
+
+	return values;
+}
+
+// Is word one of the space separated words of list
+static int
+_reload_in_list(const char *list, const char *word)
+{
+	size_t len = strlen(word);
+	const char *p;
+
+	for (p = list; (p = strstr(p, word)) != NULL; p += len) {
+		if ((p == list || p[-1] == ' ') && (p[len] == ' ' || p[len] == '\0')) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Trusts the MACs added to the trustedmac list and untrusts those removed from it.
+ * Each change publishes a copy of the trusted list of the new config, as
+ * ndsctl trust does, so readers walking the list are not disturbed.
+ */
+static void
+_reload_trusted(const char *old, const char *new)
+{
+	char *copy;
+	char *p;
+	char *mac;
+
+	p = copy = safe_strdup(old);
+
+	while ((mac = strsep(&p, " "))) {
+		if (strlen(mac) > 0 && !_reload_in_list(new, mac)) {
+			if (!remove_from_trusted_mac_list(mac) && !iptables_untrust_mac(mac)) {
+				debug(LOG_NOTICE, "Reload: %s is no longer trusted", mac);
+			}
+		}
+	}
+
+	free(copy);
+	p = copy = safe_strdup(new);
+
+	while ((mac = strsep(&p, " "))) {
+		if (strlen(mac) > 0 && !_reload_in_list(old, mac)) {
+			if (!add_to_trusted_mac_list(mac) && !iptables_trust_mac(mac)) {
+				debug(LOG_NOTICE, "Reload: %s is now trusted", mac);
+			}
+		}
+	}
+
+	free(copy);
+}
+
+// Sets the FAS url from the FAS settings, as setup_from_config() does
+static void
+_reload_fas_url(s_config *next)
+{
+	char fasurl[SMALL_BUF] = {0};
+	const char *protocol = next->fas_secure_enabled >= 3 ? "https" : "http";
+
+	if (strcmp(next->fas_remotefqdn, "disable") == 0 || strcmp(next->fas_remotefqdn, "disabled") == 0) {
+		safe_snprintf(fasurl, SMALL_BUF, "%s://%s:%u%s", protocol, next->fas_remoteip, next->fas_port, next->fas_path);
+	} else {
+		safe_snprintf(fasurl, SMALL_BUF, "%s://%s:%u%s", protocol, next->fas_remotefqdn, next->fas_port, next->fas_path);
+	}
+
+	next->fas_url = safe_strdup(fasurl);
+	debug(LOG_INFO, "Reload: fasurl is %s", next->fas_url);
+}
+
+// Whether the remote FAS is reached through its FQDN, as iptables_fw_init() and the resolver decide
+static int
+_reload_fas_fqdn(const s_config *config)
+{
+	return config->fas_port != 0 && strcmp(config->fas_remotefqdn, "disabled") != 0;
+}
+
+// Applies the FAS options that changed to next
+static void
+_reload_fas(s_config *next, t_reload_value *values, const char *name)
+{
+	// FAS is not used when a preauth script is, its settings are overridden at startup
+	int fas_enabled = (next->preauth == NULL);
+	const char *value = _reload_value(values, _reload_option(name));
+
+	if (strcmp(name, "faskey") == 0) {
+		if (strlen(value) == 0) {
+			debug(LOG_NOTICE, "Reload: faskey is not set, the key generated at startup is kept");
+		} else {
+			next->fas_key = safe_strdup(value);
+		}
+	} else if (strcmp(name, "faspath") == 0 && fas_enabled) {
+		next->fas_path = safe_strdup(value);
+	} else if (strcmp(name, "fasremotefqdn") == 0 && fas_enabled) {
+		next->fas_remotefqdn = safe_strdup(value);
+	} else if (strcmp(name, "themespec_path") == 0 && next->login_option_enabled == 3) {
+		next->themespec_path = safe_strdup(value);
+	} else if (strncmp(name, "fas_custom_", 11) == 0) {
+		// Rebuilt as a whole, once, by the caller
+	} else {
+		debug(LOG_INFO, "Reload: %s is not used with the current login option", name);
+	}
+}
+
+// Rebuilds the custom FAS lists and strings, from the same lists config_init() parses
+static void
+_reload_fas_custom(s_config *next, t_reload_value *values)
+{
+	// The copies config_dup() gave next, nothing else holds them
+	config_clear_fas_custom_lists(next);
+	next->custom_params = NULL;
+	next->custom_vars = NULL;
+	next->custom_images = NULL;
+	next->custom_files = NULL;
+
+	parse_fas_custom_parameters_list(next, _reload_value(values, _reload_option("fas_custom_parameters_list")));
+	parse_fas_custom_variables_list(next, _reload_value(values, _reload_option("fas_custom_variables_list")));
+	parse_fas_custom_images_list(next, _reload_value(values, _reload_option("fas_custom_images_list")));
+	parse_fas_custom_files_list(next, _reload_value(values, _reload_option("fas_custom_files_list")));
+	build_fas_custom_strings(next);
+}
+
+// Rebuilds the walled garden or block list nftset and reloads dnsmasq for it
+static void
+_reload_nftset(const char *set, const char *type)
+{
+	char *cmd;
+	char msg[SMALL_BUF];
+
+	safe_asprintf(&cmd, "/usr/lib/opennds/libopennds.sh nftset delete %s", set);
+	execute_ret_url_encoded(msg, sizeof(msg) - 1, cmd);
+	free(cmd);
+
+	safe_asprintf(&cmd, "/usr/lib/opennds/libopennds.sh nftset insert %s %s", set, type);
+
+	if (execute_ret_url_encoded(msg, sizeof(msg) - 1, cmd) == 0) {
+		debug(LOG_NOTICE, "Reload: %s rebuilt", set);
+		nftset_sync_reset();
+	} else {
+		debug(LOG_ERR, "Reload: could not rebuild %s", set);
+	}
+
+	free(cmd);
+}
+
+/* Gives the clients still on the old default rates and quotas the new ones.
+ * Rates and quotas set per client, by FAS, BinAuth or ndsctl, are kept.
+ */
+static void
+_reload_clients(const s_config *old, const s_config *next)
+{
+	t_client *client;
+	int updated = 0;
+
+	LOCK_CLIENT_LIST();
+
+	for (client = client_get_first_client(); client; client = client_get_next_client(client)) {
+		if (client->fw_connection_state != FW_MARK_AUTHENTICATED && client->fw_connection_state != FW_MARK_AUTH_BLOCKED) {
+			continue;
+		}
+
+		if (client->upload_rate == old->upload_rate && client->upload_rate != next->upload_rate) {
+			client->upload_rate = next->upload_rate;
+			updated++;
+		}
+
+		if (client->download_rate == old->download_rate && client->download_rate != next->download_rate) {
+			client->download_rate = next->download_rate;
+			updated++;
+		}
+
+		if (client->upload_quota == old->upload_quota && client->upload_quota != next->upload_quota) {
+			client->upload_quota = next->upload_quota;
+			updated++;
+		}
+
+		if (client->download_quota == old->download_quota && client->download_quota != next->download_quota) {
+			client->download_quota = next->download_quota;
+			updated++;
+		}
+	}
+
+	UNLOCK_CLIENT_LIST();
+
+	debug(LOG_INFO, "Reload: %d client rates and quotas updated, they apply from the next client check", updated);
+}
+
+/** Re-reads the configuration, applies the options that changed and reports those
+ *  that need a restart.
+ *  @return number of options applied, or -1 if the configuration could not be read
+ */
+int
+reload_config(void)
+{
+	const t_reload_option *option;
+	t_reload_value *values;
+	t_reload_value *v;
+	s_config *old;
+	s_config *next;
+	const char *was;
+	const char *now;
+	unsigned int changed = 0;
+	int applied = 0;
+	int restart = 0;
+
+	debug(LOG_NOTICE, "Reloading the configuration");
+
+	values = _reload_read();
+
+	if (!values) {
+		return -1;
+	}
+
+	if (!reload_values) {
+		debug(LOG_ERR, "Reload: the configuration in effect is not known, it is recorded and nothing is changed");
+		reload_values = values;
+		return -1;
+	}
+
+	// Options that cannot change without a restart keep their value in effect, and are reported
+	for (v = values; v; v = v->next) {
+		was = _reload_get(reload_values, v->name);
+
+		if (!_reload_option(v->name) && (!was || strcmp(was, v->value) != 0)) {
+			debug(LOG_WARNING, "Reload: option %s changed, restart openNDS to apply it", v->name);
+			free(v->value);
+			v->value = safe_strdup(was ? was : "");
+			restart++;
+		}
+	}
+
+	for (v = reload_values; v; v = v->next) {
+		if (!_reload_option(v->name) && !_reload_get(values, v->name)) {
+			debug(LOG_WARNING, "Reload: option %s removed, restart openNDS to apply it", v->name);
+			_reload_set(&values, v->name, v->value);
+			restart++;
+		}
+	}
+
+	LOCK_CONFIG();
+
+	old = config_get_config();
+	next = config_dup();
+
+	for (option = reload_options; option->name; option++) {
+		was = _reload_value(reload_values, option);
+		now = _reload_value(values, option);
+
+		if (strcmp(was, now) == 0) {
+			continue;
+		}
+
+		debug(LOG_NOTICE, "Reload: %s changed from [%s] to [%s]", option->name, was, now);
+		changed |= option->group;
+		applied++;
+
+		switch (option->type) {
+		case RELOAD_INT:
+			sscanf(now, "%u", (unsigned int *)((char *)next + option->offset));
+			break;
+		case RELOAD_ULL:
+			sscanf(now, "%llu", (unsigned long long int *)((char *)next + option->offset));
+			break;
+		case RELOAD_STR:
+			*(char **)((char *)next + option->offset) = safe_strdup(now);
+			break;
+		case RELOAD_NONE:
+			if (option->group == RELOAD_FAS) {
+				_reload_fas(next, values, option->name);
+			}
+			break;
+		}
+	}
+
+	// As setup_from_config() does
+	if (next->download_bucket_ratio < 1) {
+		next->download_bucket_ratio = 0;
+	}
+
+	if (next->upload_bucket_ratio < 1) {
+		next->upload_bucket_ratio = 0;
+	}
+
+	if (changed & RELOAD_FAS) {
+		_reload_fas_custom(next, values);
+
+		if (next->preauth == NULL) {
+			_reload_fas_url(next);
+		}
+	}
+
+	config_publish(next);
+
+	if (changed & RELOAD_DEBUG) {
+		set_debuglevel(_reload_value(values, _reload_option("debuglevel")));
+	}
+
+	if (changed & RELOAD_TRUSTED) {
+		_reload_trusted(_reload_value(reload_values, _reload_option("trustedmac")), _reload_value(values, _reload_option("trustedmac")));
+	}
+
+	UNLOCK_CONFIG();
+
+	if (changed & RELOAD_WALLEDGARDEN) {
+		_reload_nftset("walledgarden", "");
+	}
+
+	if (changed & RELOAD_BLOCKLIST) {
+		_reload_nftset("blocklist", "reject");
+	}
+
+	if (changed & (RELOAD_WALLEDGARDEN | RELOAD_BLOCKLIST)) {
+		if (system("/usr/lib/opennds/dnsconfig.sh \"reload_only\" &") == 0) {
+			debug(LOG_INFO, "Dnsmasq reloading");
+		} else {
+			debug(LOG_ERR, "Dnsmasq reload failed!");
+		}
+	}
+
+	// Until now the FAS was reached by its address, so there is no nftset for the resolver to fill
+	if ((changed & RELOAD_FAS) && _reload_fas_fqdn(next) && !_reload_fas_fqdn(old)) {
+		if (iptables_fw_fas_fqdn_enable() == 0) {
+			debug(LOG_NOTICE, "Reload: %s created for fasremotefqdn", NFTSET_FAS);
+			nftset_sync_reset();
+		} else {
+			debug(LOG_ERR, "Reload: could not create %s for fasremotefqdn", NFTSET_FAS);
+		}
+	}
+
+	// The walled garden FQDNs or the remote FAS FQDN may have changed
+	if (changed & (RELOAD_WALLEDGARDEN | RELOAD_FAS)) {
+		resolver_reset();
+	}
+
+	if ((changed & RELOAD_FAS) && next->preauth == NULL && authmon_start() != 0) {
+		debug(LOG_ERR, "Reload: authmon could not be restarted");
+	}
+
+	if (changed & (RELOAD_RATES | RELOAD_QUOTAS)) {
+		_reload_clients(old, next);
+	}
+
+	webroot_cache_flush();
+	render_cache_flush();
+
+	_reload_free(reload_values);
+	reload_values = values;
+
+	debug(LOG_NOTICE, "Configuration reloaded, %d options applied, %d need a restart", applied, restart);
+	return applied;
+}
+
+/** Requests a reload. Only async signal safe calls are made, as this runs in the SIGHUP handler.
+ *  A request made before the reload thread is ready is ignored.
+ */
+void
+reload_request(void)
+{
+	if (reload_ready) {
+		sem_post(&reload_sem);
+	}
+}
+
+/** Launched in its own thread.
+ *  Records the configuration in effect, then waits for reload requests and applies them.
+ */
+void *
+thread_reload(void *arg)
+{
+	sem_init(&reload_sem, 0, 0);
+	reload_values = _reload_read();
+	reload_ready = 1;
+
+	while (1) {
+		if (sem_wait(&reload_sem) != 0) {
+			continue;
+		}
+
+		// Several signals received while reloading need only one more reload
+		while (sem_trywait(&reload_sem) == 0);
+
+		// The config replaced is still read after it is published
+		config_read_begin();
+		reload_config();
+		config_read_end();
+	}
+
+	return NULL;
+}
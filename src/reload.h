@@ -0,0 +1,38 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file reload.h
+    @brief Reload of the configuration on SIGHUP, without a restart
+    @author Copyright (C) 2015-2025 Modifications and additions by BlueWave Projects and Services <opennds@blue-wave.net>
+*/
+
+#ifndef _RELOAD_H_
+#define _RELOAD_H_
+
+/** @brief Requests a reload of the configuration, safe to call from a signal handler */
+void reload_request(void);
+
+/** @brief Records the configuration in effect, then applies each requested reload */
+void *thread_reload(void *arg);
+
+/** @brief Re-reads the configuration and applies the options that changed */
+int reload_config(void);
+
+#endif /* _RELOAD_H_ */
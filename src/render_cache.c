@@ -0,0 +1,224 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @internal
+  @file render_cache.c
+  @brief Shared output of the page rendering scripts run by the web server
+  @author Copyright (C) 2015-2025 Modifications and additions by BlueWave Projects and Services <opennds@blue-wave.net>
+
+  Browsers and OS probes often open several connections from the same client at
+  once, and each ran the PreAuth or err511 script with identical arguments. The
+  command line of these scripts holds everything the page depends on, the query
+  and the user agent. The query comes from the client, so another client could send
+  the same one, and the address the request came from is part of the key too.
+
+  The first request for a command runs it, concurrent requests for the same
+  command wait for its output rather than forking their own. A successful output
+  is then kept for render_cache_ttl seconds so a page reload is served from memory.
+  A failed run is handed to its waiters but not kept.
+
+  A request served this way does not run the script, so the side effects of the
+  script, such as logging the request or writing the client info, happen once for
+  all the requests sharing a run rather than once per request.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <pthread.h>
+
+#include "safe.h"
+#include "debug.h"
+#include "conf.h"
+#include "util.h"
+#include "metrics.h"
+#include "render_cache.h"
+
+typedef struct _t_render_entry {
+	struct _t_render_entry *next;
+	unsigned int hash;
+	char *cmd;
+	int refcount;			/**< @brief The running request and its waiters */
+	int done;			/**< @brief 0 while the command is running */
+	int rc;				/**< @brief Return code of the command */
+	int flushed;			/**< @brief Flushed while running, so not to be kept */
+	char *output;
+	double expires;
+} t_render_entry;
+
+static t_render_entry *entries = NULL;
+static int entry_count = 0;
+
+static pthread_mutex_t render_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t render_cond = PTHREAD_COND_INITIALIZER;
+
+static unsigned int
+_render_hash(const char *cmd)
+{
+	unsigned int hash = 2166136261u;
+
+	while (*cmd) {
+		hash = (hash ^ (unsigned char)*cmd++) * 16777619u;
+	}
+
+	return hash;
+}
+
+static void
+_render_free(t_render_entry *entry)
+{
+	free(entry->cmd);
+	free(entry->output);
+	free(entry);
+}
+
+// Unlinks and frees expired entries nobody is using. Called with render_mutex held
+static void
+_render_sweep(double now)
+{
+	t_render_entry **link = &entries;
+	t_render_entry *entry;
+
+	while ((entry = *link)) {
+		if (entry->done && entry->refcount == 0 && entry->expires <= now) {
+			*link = entry->next;
+			entry_count--;
+			_render_free(entry);
+		} else {
+			link = &entry->next;
+		}
+	}
+}
+
+// Called with render_mutex held
+static t_render_entry *
+_render_find(const char *cmd, unsigned int hash, double now)
+{
+	t_render_entry *entry;
+
+	for (entry = entries; entry; entry = entry->next) {
+		if (entry->hash == hash && strcmp(entry->cmd, cmd) == 0 && (!entry->done || entry->expires > now)) {
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+// Copies the output of a finished entry and drops the reference. Called with render_mutex held
+static int
+_render_take(t_render_entry *entry, char *msg, int msg_len)
+{
+	int rc = entry->rc;
+
+	if (entry->output) {
+		snprintf(msg, msg_len, "%s", entry->output);
+	}
+
+	entry->refcount--;
+	return rc;
+}
+
+int
+render_cache_exec(char *msg, int msg_len, const char *client, const char *cmd)
+{
+	s_config *config = config_get_config();
+	t_render_entry *entry;
+	unsigned int hash;
+	char *key;
+	double now;
+	int rc;
+
+	safe_asprintf(&key, "%s %s", client, cmd);
+	hash = _render_hash(key);
+	now = metrics_now();
+
+	pthread_mutex_lock(&render_mutex);
+
+	_render_sweep(now);
+	entry = _render_find(key, hash, now);
+
+	if (entry) {
+		entry->refcount++;
+		metrics_inc(METRIC_RENDER, entry->done ? "cached" : "shared");
+
+		while (!entry->done) {
+			pthread_cond_wait(&render_cond, &render_mutex);
+		}
+
+		rc = _render_take(entry, msg, msg_len);
+		pthread_mutex_unlock(&render_mutex);
+
+		debug(LOG_DEBUG, "Render: output of [%s] shared with %s, rc %d", cmd, client, rc);
+		free(key);
+		return rc;
+	}
+
+	entry = safe_calloc(sizeof(t_render_entry));
+	entry->hash = hash;
+	entry->cmd = key;
+	entry->refcount = 1;
+	entry->next = entries;
+	entries = entry;
+	entry_count++;
+
+	pthread_mutex_unlock(&render_mutex);
+
+	metrics_inc(METRIC_RENDER, "run");
+	rc = execute_ret_url_encoded(msg, msg_len, cmd);
+
+	pthread_mutex_lock(&render_mutex);
+
+	entry->rc = rc;
+	entry->output = safe_strdup(msg);
+	entry->expires = now;
+
+	// Keep a good page unless the table is full of others, which are then left to expire
+	if (rc == 0 && !entry->flushed && config->render_cache_ttl > 0 && entry_count <= RENDER_CACHE_MAX_ENTRIES) {
+		entry->expires = metrics_now() + config->render_cache_ttl;
+	}
+
+	entry->done = 1;
+	entry->refcount--;
+
+	pthread_cond_broadcast(&render_cond);
+	pthread_mutex_unlock(&render_mutex);
+
+	return rc;
+}
+
+void
+render_cache_flush(void)
+{
+	t_render_entry *entry;
+
+	pthread_mutex_lock(&render_mutex);
+
+	// Entries still in use are freed by a later sweep, running ones will not be kept
+	for (entry = entries; entry; entry = entry->next) {
+		entry->expires = 0;
+		entry->flushed = 1;
+	}
+
+	_render_sweep(metrics_now());
+
+	pthread_mutex_unlock(&render_mutex);
+}
@@ -0,0 +1,40 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file render_cache.h
+    @brief Shared output of the page rendering scripts run by the web server
+    @author Copyright (C) 2015-2025 Modifications and additions by BlueWave Projects and Services <opennds@blue-wave.net>
+*/
+
+#ifndef _RENDER_CACHE_H_
+#define _RENDER_CACHE_H_
+
+/** Most pages kept, a page that does not fit is still shared with concurrent requests */
+#define RENDER_CACHE_MAX_ENTRIES 128
+
+/** @brief Run a page rendering command as execute_ret_url_encoded() does, sharing its output
+ *  with identical commands for the same client address running at the same time or run
+ *  within render_cache_ttl seconds */
+int render_cache_exec(char *msg, int msg_len, const char *client, const char *cmd);
+
+/** @brief Drop every cached page, eg when the config or the themespec files change */
+void render_cache_flush(void);
+
+#endif /* _RENDER_CACHE_H_ */
@@ -0,0 +1,218 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @internal
+  @file request_arena.c
+  @brief Per request memory arena for the web server
+  @author Copyright (C) 2015-2025 Modifications and additions by BlueWave Projects and Services <opennds@blue-wave.net>
+
+  Building a splash page redirect takes a dozen or more temporary buffers of up to
+  QUERYMAXLEN. Rather than each being malloc'd and freed on its own, from many MHD
+  connection threads at once, they are carved from blocks owned by the request and
+  released together when libmicrohttpd reports the request completed. A buffer
+  can so be handed to MHD as MHD_RESPMEM_PERSISTENT, and none can be leaked.
+
+  Most requests, OS probes and files, need little, and there may be a hundred
+  at once, so the first block is small and each further one twice the size of the
+  last, up to REQUEST_ARENA_BLOCK_MAX.
+
+  The arena of the request being handled is kept per thread, as MHD runs a
+  thread per connection, so the helpers of the handler need no extra argument.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+
+#include "debug.h"
+#include "request_arena.h"
+
+#define REQUEST_ARENA_ALIGN 16
+
+typedef struct _t_arena_block {
+	struct _t_arena_block *next;
+	size_t used;
+	size_t size;
+	char data[] __attribute__((aligned(REQUEST_ARENA_ALIGN)));
+} t_arena_block;
+
+struct _t_request_arena {
+	t_arena_block *blocks;		/**< @brief Block being carved first, then the full and oversized ones */
+};
+
+static __thread t_request_arena *current_arena = NULL;
+
+static t_arena_block *
+_request_arena_block(size_t size)
+{
+	t_arena_block *block;
+
+	// calloc() hands back zeroed memory, and a block is never reused, so allocations need no clearing
+	block = calloc(1, sizeof(t_arena_block) + size);
+
+	if (!block) {
+		debug(LOG_CRIT, "Failed to allocate a request arena block of %zu bytes: %s. Bailing out.", size, strerror(errno));
+		exit(1);
+	}
+
+	block->size = size;
+	return block;
+}
+
+t_request_arena *
+request_arena_new(void)
+{
+	t_request_arena *arena;
+
+	arena = calloc(1, sizeof(t_request_arena));
+
+	if (!arena) {
+		debug(LOG_CRIT, "Failed to allocate a request arena: %s. Bailing out.", strerror(errno));
+		exit(1);
+	}
+
+	return arena;
+}
+
+void
+request_arena_free(t_request_arena *arena)
+{
+	t_arena_block *block;
+
+	if (!arena) {
+		return;
+	}
+
+	if (current_arena == arena) {
+		current_arena = NULL;
+	}
+
+	while ((block = arena->blocks)) {
+		arena->blocks = block->next;
+		free(block);
+	}
+
+	free(arena);
+}
+
+void
+request_arena_enter(t_request_arena *arena)
+{
+	current_arena = arena;
+}
+
+void
+request_arena_leave(void)
+{
+	current_arena = NULL;
+}
+
+void *
+request_calloc(size_t size)
+{
+	t_request_arena *arena = current_arena;
+	t_arena_block *block;
+	size_t block_size;
+	void *p;
+
+	if (!arena) {
+		debug(LOG_CRIT, "Request arena allocation outside of a request. Bailing out.");
+		exit(1);
+	}
+
+	size = (size + REQUEST_ARENA_ALIGN - 1) & ~((size_t)REQUEST_ARENA_ALIGN - 1);
+
+	// A big buffer gets a block of its own, behind the one being carved
+	if (size > REQUEST_ARENA_BLOCK_MAX / 4) {
+		block = _request_arena_block(size);
+		block->used = size;
+
+		if (arena->blocks) {
+			block->next = arena->blocks->next;
+			arena->blocks->next = block;
+		} else {
+			arena->blocks = block;
+		}
+
+		return block->data;
+	}
+
+	block = arena->blocks;
+
+	if (!block || block->size - block->used < size) {
+		block_size = block ? block->size * 2 : REQUEST_ARENA_BLOCK;
+
+		if (block_size > REQUEST_ARENA_BLOCK_MAX) {
+			block_size = REQUEST_ARENA_BLOCK_MAX;
+		}
+
+		while (block_size < size) {
+			block_size *= 2;
+		}
+
+		block = _request_arena_block(block_size);
+		block->next = arena->blocks;
+		arena->blocks = block;
+	}
+
+	p = block->data + block->used;
+	block->used += size;
+	return p;
+}
+
+char *
+request_strdup(const char s[])
+{
+	size_t len = strlen(s) + 1;
+	char *p;
+
+	p = request_calloc(len);
+	memcpy(p, s, len);
+	return p;
+}
+
+int
+request_asprintf(char **strp, const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+
+	if (len < 0) {
+		debug(LOG_CRIT, "Failed to format a string for a request. Bailing out.");
+		exit(1);
+	}
+
+	*strp = request_calloc(len + 1);
+
+	va_start(ap, fmt);
+	vsnprintf(*strp, len + 1, fmt, ap);
+	va_end(ap);
+
+	return len;
+}
@@ -0,0 +1,60 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file request_arena.h
+    @brief Per request memory arena for the web server
+    @author Copyright (C) 2015-2025 Modifications and additions by BlueWave Projects and Services <opennds@blue-wave.net>
+*/
+
+#ifndef _REQUEST_ARENA_H_
+#define _REQUEST_ARENA_H_
+
+#include <stddef.h>
+
+/** Size of the first block allocations are carved from, each further block is twice the last */
+#define REQUEST_ARENA_BLOCK 4096
+
+/** Largest block carved from. Allocations of more than a quarter of it get a block of their own */
+#define REQUEST_ARENA_BLOCK_MAX 65536
+
+typedef struct _t_request_arena t_request_arena;
+
+/** @brief Create the arena of a request */
+t_request_arena *request_arena_new(void);
+
+/** @brief Free an arena and everything allocated from it */
+void request_arena_free(t_request_arena *arena);
+
+/** @brief Make an arena the one this thread allocates from */
+void request_arena_enter(t_request_arena *arena);
+
+/** @brief Stop allocating from the arena of this thread */
+void request_arena_leave(void);
+
+/** @brief Allocate zeroed memory from this thread's arena, freed with the arena */
+void *request_calloc(size_t size);
+
+/** @brief Copy a string into this thread's arena */
+char *request_strdup(const char s[]);
+
+/** @brief asprintf() into this thread's arena */
+int request_asprintf(char **strp, const char *fmt, ...);
+
+#endif /* _REQUEST_ARENA_H_ */
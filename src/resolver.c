@@ -0,0 +1,566 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @internal
+  @file resolver.c
+  @brief Resolves the walled garden and remote FAS FQDNs, honouring record TTLs
+  @author Copyright (C) 2015-2025 Modifications and additions by BlueWave Projects and Services <opennds@blue-wave.net>
+
+  dnsmasq adds the addresses of walled garden FQDNs to the nftset only when a
+  client looks them up, and the remote FAS FQDN used to be resolved once at startup.
+  FQDNs on CDNs resolve to addresses that keep changing, so a client could be sent
+  to an address the firewall does not yet allow.
+
+  This thread asks the local nameserver (the first of /etc/resolv.conf, normally
+  dnsmasq) for the A records of each FQDN, again as soon as the TTL of the answer
+  runs out. Each address is kept until its TTL has run out since it was last
+  seen, plus a grace period for clients holding on to it a little longer. While
+  lookups of an FQDN fail its addresses are kept.
+
+  The addresses are picked up each second by thread_nftset_sync(), which adds and
+  removes them from the walled garden and remote FAS nftsets. Those dnsmasq put in
+  the nftset itself, as it does when answering, are left to it and never expired.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "common.h"
+#include "safe.h"
+#include "conf.h"
+#include "debug.h"
+#include "util.h"
+#include "fw_iptables.h"
+#include "resolver.h"
+
+#define RESOLVER_MIN_TTL	5	// seconds, lower TTLs are raised to this
+#define RESOLVER_MAX_TTL	3600	// seconds, higher TTLs are lowered to this
+#define RESOLVER_RETRY		30	// seconds before looking up a failed FQDN again
+#define RESOLVER_GRACE		60	// seconds an address is kept after its TTL ran out
+#define RESOLVER_TIMEOUT	2000	// milliseconds to wait for each answer
+#define RESOLVER_TRIES		2
+#define RESOLVER_MAX_ADDRS	32	// addresses kept per FQDN
+
+#define DNS_TYPE_A		1
+#define DNS_TYPE_CNAME		5
+#define DNS_CLASS_IN		1
+
+typedef struct {
+	uint32_t addr;			// host byte order
+	time_t expires;
+} t_resolver_addr;
+
+typedef struct _t_resolver_name {
+	char *fqdn;
+	const char *set;		// the nftset its addresses go to
+	t_resolver_addr addrs[RESOLVER_MAX_ADDRS];
+	int count;
+	int failed;			// the last lookup failed
+	time_t next;			// when to look it up again
+	struct _t_resolver_name *next_name;
+} t_resolver_name;
+
+// The FQDNs are only added and removed by the resolver thread, under resolver_mutex
+static pthread_mutex_t resolver_mutex = PTHREAD_MUTEX_INITIALIZER;
+static t_resolver_name *resolver_names = NULL;
+static struct in_addr resolver_server;
+
+// Set by resolver_reset(), from other threads
+static volatile int resolver_stale = 1;
+
+// The first IPv4 nameserver of /etc/resolv.conf, or 127.0.0.1
+static void
+_resolver_load_server(void)
+{
+	FILE *fp;
+	char line[SMALL_BUF];
+	char server[SMALL_BUF];
+
+	inet_pton(AF_INET, "127.0.0.1", &resolver_server);
+
+	if (!(fp = fopen("/etc/resolv.conf", "r"))) {
+		return;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "nameserver %127s", server) == 1 && inet_pton(AF_INET, server, &resolver_server) == 1) {
+			break;
+		}
+	}
+
+	fclose(fp);
+}
+
+static int
+_resolver_valid_fqdn(const char *fqdn)
+{
+	const char *p;
+
+	if (strlen(fqdn) == 0 || strlen(fqdn) > 253) {
+		return 0;
+	}
+
+	for (p = fqdn; *p; p++) {
+		if (!(('a' <= *p && *p <= 'z') || ('A' <= *p && *p <= 'Z') || ('0' <= *p && *p <= '9') || *p == '-' || *p == '.')) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static t_resolver_name *
+_resolver_find(t_resolver_name *names, const char *fqdn, const char *set)
+{
+	for (; names; names = names->next_name) {
+		if (strcmp(names->fqdn, fqdn) == 0 && strcmp(names->set, set) == 0) {
+			return names;
+		}
+	}
+
+	return NULL;
+}
+
+// Adds an FQDN to a new list, keeping what was known of it in the old one
+static void
+_resolver_add_name(t_resolver_name **names, t_resolver_name *old, const char *fqdn, const char *set)
+{
+	t_resolver_name *name;
+	t_resolver_name *known;
+
+	if (!_resolver_valid_fqdn(fqdn)) {
+		debug(LOG_WARNING, "Resolver: fqdn [ %s ] is invalid, ignoring it", fqdn);
+		return;
+	}
+
+	if (_resolver_find(*names, fqdn, set)) {
+		return;
+	}
+
+	name = safe_calloc(sizeof(t_resolver_name));
+
+	if ((known = _resolver_find(old, fqdn, set))) {
+		*name = *known;
+	}
+
+	name->fqdn = safe_strdup(fqdn);
+	name->set = set;
+	name->next_name = *names;
+	*names = name;
+}
+
+// Builds the list of FQDNs from the configuration
+static void
+_resolver_load(void)
+{
+	s_config *config = config_get_config();
+	t_resolver_name *names = NULL;
+	t_resolver_name *old;
+	t_resolver_name *next;
+	char *msg;
+	char *p;
+	char *fqdn;
+	int count = 0;
+
+	_resolver_load_server();
+
+	msg = safe_calloc(STATUS_BUF);
+
+	if (execute_ret_url_encoded(msg, STATUS_BUF - 1, "/usr/lib/opennds/libopennds.sh get_list_from_config walledgarden_fqdn_list newlines") == 0) {
+		p = msg;
+
+		while ((fqdn = strsep(&p, " \t\r\n"))) {
+			if (*fqdn) {
+				_resolver_add_name(&names, resolver_names, fqdn, "walledgarden");
+			}
+		}
+	}
+
+	free(msg);
+
+	if (config->fas_port != 0 && strcmp(config->fas_remotefqdn, "disabled") != 0) {
+		_resolver_add_name(&names, resolver_names, config->fas_remotefqdn, NFTSET_FAS);
+	}
+
+	pthread_mutex_lock(&resolver_mutex);
+	old = resolver_names;
+	resolver_names = names;
+	pthread_mutex_unlock(&resolver_mutex);
+
+	for (; old; old = next) {
+		next = old->next_name;
+		free(old->fqdn);
+		free(old);
+	}
+
+	for (; names; names = names->next_name) {
+		count++;
+	}
+
+	debug(LOG_INFO, "Resolver: %d fqdn(s) to resolve using %s", count, inet_ntoa(resolver_server));
+}
+
+// Returns the offset just past a possibly compressed name, or -1
+static int
+_resolver_skip_name(const unsigned char *buf, int len, int off)
+{
+	while (off < len) {
+		if ((buf[off] & 0xc0) == 0xc0) {
+			return off + 2 <= len ? off + 2 : -1;
+		}
+
+		if (buf[off] == 0) {
+			return off + 1;
+		}
+
+		off += buf[off] + 1;
+	}
+
+	return -1;
+}
+
+static int
+_resolver_build_query(unsigned char *buf, int size, const char *fqdn, uint16_t id)
+{
+	const char *label = fqdn;
+	const char *dot;
+	int off = 12;
+	int len;
+
+	memset(buf, 0, 12);
+	buf[0] = id >> 8;
+	buf[1] = id & 0xff;
+	buf[2] = 0x01;	// recursion desired
+	buf[5] = 1;	// one question
+
+	while (*label) {
+		dot = strchr(label, '.');
+		len = dot ? dot - label : (int)strlen(label);
+
+		if (len == 0 || len > 63 || off + len + 6 > size) {
+			return -1;
+		}
+
+		buf[off++] = len;
+		memcpy(buf + off, label, len);
+		off += len;
+		label += len + (dot ? 1 : 0);
+	}
+
+	buf[off++] = 0;
+	buf[off++] = 0;
+	buf[off++] = DNS_TYPE_A;
+	buf[off++] = 0;
+	buf[off++] = DNS_CLASS_IN;
+
+	return off;
+}
+
+/* Looks up the A records of an FQDN, following any CNAME chain in the answer.
+ * Returns the number of addresses found, with the lowest TTL of the records used,
+ * or -1 if the nameserver could not be asked or gave an error.
+ */
+static int
+_resolver_query(const char *fqdn, uint32_t *addrs, int max, int *ttl)
+{
+	unsigned char query[512];
+	unsigned char answer[1500];
+	struct sockaddr_in server;
+	struct pollfd pfd;
+	uint16_t id = random() & 0xffff;
+	int querylen;
+	int len = -1;
+	int sock;
+	int try;
+	int off;
+	int i;
+	int count = 0;
+	int ancount;
+	int type;
+	int class;
+	int rdlen;
+	uint32_t recttl;
+
+	if ((querylen = _resolver_build_query(query, sizeof(query), fqdn, id)) < 0) {
+		return -1;
+	}
+
+	if ((sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) {
+		debug(LOG_ERR, "Resolver: socket(): %s", strerror(errno));
+		return -1;
+	}
+
+	memset(&server, 0, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_port = htons(53);
+	server.sin_addr = resolver_server;
+
+	if (connect(sock, (struct sockaddr *)&server, sizeof(server)) != 0) {
+		close(sock);
+		return -1;
+	}
+
+	for (try = 0; try < RESOLVER_TRIES && len < 0; try++) {
+		if (send(sock, query, querylen, 0) != querylen) {
+			continue;
+		}
+
+		pfd.fd = sock;
+		pfd.events = POLLIN;
+
+		// Ignore anything that is not the answer to this query
+		while (poll(&pfd, 1, RESOLVER_TIMEOUT) > 0) {
+			len = recv(sock, answer, sizeof(answer), 0);
+
+			if (len >= 12 && answer[0] == query[0] && answer[1] == query[1] && (answer[2] & 0x80)) {
+				break;
+			}
+
+			len = -1;
+		}
+	}
+
+	close(sock);
+
+	// A missing name is not an error, it has no addresses
+	if (len < 0 || ((answer[3] & 0x0f) != 0 && (answer[3] & 0x0f) != 3)) {
+		return -1;
+	}
+
+	*ttl = RESOLVER_MAX_TTL;
+	off = 12;
+
+	for (i = (answer[4] << 8) | answer[5]; i > 0; i--) {
+		if ((off = _resolver_skip_name(answer, len, off)) < 0 || off + 4 > len) {
+			return -1;
+		}
+
+		off += 4;
+	}
+
+	for (ancount = (answer[6] << 8) | answer[7]; ancount > 0; ancount--) {
+		if ((off = _resolver_skip_name(answer, len, off)) < 0 || off + 10 > len) {
+			break;
+		}
+
+		type = (answer[off] << 8) | answer[off + 1];
+		class = (answer[off + 2] << 8) | answer[off + 3];
+		recttl = ((uint32_t)answer[off + 4] << 24) | (answer[off + 5] << 16) | (answer[off + 6] << 8) | answer[off + 7];
+		rdlen = (answer[off + 8] << 8) | answer[off + 9];
+		off += 10;
+
+		if (off + rdlen > len) {
+			break;
+		}
+
+		if (class == DNS_CLASS_IN && (type == DNS_TYPE_A || type == DNS_TYPE_CNAME)) {
+			if (recttl < (uint32_t)*ttl) {
+				*ttl = recttl;
+			}
+
+			if (type == DNS_TYPE_A && rdlen == 4 && count < max) {
+				addrs[count++] = ((uint32_t)answer[off] << 24) | (answer[off + 1] << 16) | (answer[off + 2] << 8) | answer[off + 3];
+			}
+		}
+
+		off += rdlen;
+	}
+
+	if (count == 0) {
+		*ttl = RESOLVER_RETRY;
+	}
+
+	return count;
+}
+
+// Looks up an FQDN and updates its addresses
+static void
+_resolver_lookup(t_resolver_name *name, time_t now)
+{
+	uint32_t found[RESOLVER_MAX_ADDRS];
+	struct in_addr addr;
+	int count;
+	int ttl;
+	int added = 0;
+	int removed = 0;
+	int i;
+	int j;
+	int oldest;
+
+	count = _resolver_query(name->fqdn, found, RESOLVER_MAX_ADDRS, &ttl);
+
+	pthread_mutex_lock(&resolver_mutex);
+
+	if (count < 0) {
+		if (!name->failed) {
+			debug(LOG_WARNING, "Resolver: unable to resolve [ %s ], keeping its addresses", name->fqdn);
+		}
+
+		name->failed = 1;
+		name->next = now + RESOLVER_RETRY;
+		pthread_mutex_unlock(&resolver_mutex);
+		return;
+	}
+
+	name->failed = 0;
+
+	if (ttl < RESOLVER_MIN_TTL) {
+		ttl = RESOLVER_MIN_TTL;
+	}
+
+	// Addresses still answered have their expiry moved on, new ones replace the oldest when full
+	for (i = 0; i < count; i++) {
+		oldest = 0;
+
+		for (j = 0; j < name->count; j++) {
+			if (name->addrs[j].addr == found[i]) {
+				break;
+			}
+
+			if (name->addrs[j].expires < name->addrs[oldest].expires) {
+				oldest = j;
+			}
+		}
+
+		if (j == name->count) {
+			j = (name->count < RESOLVER_MAX_ADDRS) ? name->count++ : oldest;
+			name->addrs[j].addr = found[i];
+			added++;
+
+			addr.s_addr = htonl(found[i]);
+			debug(LOG_DEBUG, "Resolver: %s [ %s ] ttl [ %d ]", name->fqdn, inet_ntoa(addr), ttl);
+		}
+
+		name->addrs[j].expires = now + ttl + RESOLVER_GRACE;
+	}
+
+	for (j = 0; j < name->count; j++) {
+		if (name->addrs[j].expires <= now) {
+			name->addrs[j--] = name->addrs[--name->count];
+			removed++;
+		}
+	}
+
+	// dnsmasq answers from its cache until the TTL runs out, then asks upstream again
+	name->next = now + ttl + 1;
+
+	pthread_mutex_unlock(&resolver_mutex);
+
+	if (added > 0 || removed > 0) {
+		debug(LOG_INFO, "Resolver: %s has %d address(es), %d new, %d expired", name->fqdn, name->count, added, removed);
+	}
+}
+
+/** Makes the resolver thread read the list of FQDNs again */
+void
+resolver_reset(void)
+{
+	resolver_stale = 1;
+}
+
+/** Returns the addresses, in host byte order, of the FQDNs resolved for an nftset.
+ *  Addresses of an FQDN whose lookups fail are kept. The caller must free(*addrs).
+ */
+int
+resolver_addresses(const char *set, uint32_t **addrs)
+{
+	t_resolver_name *name;
+	time_t now = time(NULL);
+	int count = 0;
+	int size = 0;
+	int i;
+
+	*addrs = NULL;
+
+	pthread_mutex_lock(&resolver_mutex);
+
+	for (name = resolver_names; name; name = name->next_name) {
+		if (strcmp(name->set, set) == 0) {
+			size += name->count;
+		}
+	}
+
+	if (size > 0) {
+		*addrs = safe_calloc(size * sizeof(uint32_t));
+
+		for (name = resolver_names; name; name = name->next_name) {
+			if (strcmp(name->set, set) != 0) {
+				continue;
+			}
+
+			for (i = 0; i < name->count; i++) {
+				if (name->failed || name->addrs[i].expires > now) {
+					(*addrs)[count++] = name->addrs[i].addr;
+				}
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&resolver_mutex);
+
+	return count;
+}
+
+/** Launched in its own thread.
+ *  Each second, looks up the FQDNs whose last answer has run out.
+ */
+void *
+thread_resolver(void *arg)
+{
+	t_resolver_name *name;
+	time_t now;
+
+	srandom(time(NULL) ^ getpid());
+
+	while (1) {
+		if (resolver_stale) {
+			resolver_stale = 0;
+			config_read_begin();
+			_resolver_load();
+			config_read_end();
+		}
+
+		now = time(NULL);
+
+		// Only this thread changes the list, so it is walked without the lock
+		for (name = resolver_names; name; name = name->next_name) {
+			if (now >= name->next) {
+				_resolver_lookup(name, now);
+			}
+		}
+
+		sleep(1);
+	}
+
+	return NULL;
+}
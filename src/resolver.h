@@ -0,0 +1,40 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file resolver.h
+    @brief Resolves the walled garden and remote FAS FQDNs, honouring record TTLs
+    @author Copyright (C) 2015-2025 Modifications and additions by BlueWave Projects and Services <opennds@blue-wave.net>
+*/
+
+#ifndef _RESOLVER_H_
+#define _RESOLVER_H_
+
+#include <stdint.h>
+
+/** @brief Resolves the FQDNs again as each answer's TTL runs out */
+void *thread_resolver(void *arg);
+
+/** @brief Reloads the list of FQDNs, after a configuration reload */
+void resolver_reset(void);
+
+/** @brief Current addresses, host byte order, of the FQDNs resolved for an nftset */
+int resolver_addresses(const char *set, uint32_t **addrs);
+
+#endif /* _RESOLVER_H_ */
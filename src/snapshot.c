@@ -0,0 +1,461 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @internal
+  @file snapshot.c
+  @brief Snapshot of the authenticated clients, for a fast restart
+  @author Copyright (C) 2015-2025 Modifications and additions by BlueWave Projects and Services <opennds@blue-wave.net>
+
+  The authenticated clients are written to a binary file in the tmpfs mountpoint
+  every checkinterval and on shutdown. When opennds starts again the file is mapped
+  and every client whose session has not ended is put back on the client list, with
+  its token, counters, rates and quotas, and its firewall rules are added in one
+  nftables transaction. BinAuth is not run for restored clients.
+
+  The file is a header followed by one record per client. A record is a fixed part
+  followed by its strings, each terminated by a NUL. The layout is native, the file
+  being written and read on the same host.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "safe.h"
+#include "conf.h"
+#include "debug.h"
+#include "client_list.h"
+#include "fw_iptables.h"
+#include "metrics.h"
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC "NDSSNAP"
+
+/** Strings of a record, in order */
+enum {
+	SNAPSHOT_MAC,
+	SNAPSHOT_IP,
+	SNAPSHOT_TOKEN,
+	SNAPSHOT_HID,
+	SNAPSHOT_CID,
+	SNAPSHOT_CUSTOM,
+	SNAPSHOT_CLIENT_TYPE,
+	SNAPSHOT_STRINGS
+};
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;		// of the fixed part of a record, to catch layout changes
+	uint32_t count;
+	uint32_t reserved;
+	int64_t written;
+} t_snapshot_header;
+
+typedef struct {
+	uint32_t size;			// of the record, with its strings
+	uint32_t blocked;		// was FW_MARK_AUTH_BLOCKED
+	int64_t session_start;
+	int64_t session_end;
+	uint64_t incoming;
+	uint64_t outgoing;
+	uint64_t inpackets;
+	uint64_t outpackets;
+	uint64_t upload_rate;
+	uint64_t download_rate;
+	uint64_t upload_quota;
+	uint64_t download_quota;
+	uint16_t len[SNAPSHOT_STRINGS];	// string lengths, without the NUL
+} t_snapshot_record;
+
+// Nothing is written until the snapshot of the previous run has been restored
+static int snapshot_ready = 0;
+
+// Serialises writers, the client check thread and the termination handler
+static pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static char *
+_snapshot_path(const char *suffix)
+{
+	char *path;
+
+	safe_asprintf(&path, "%s/%s%s", config_get_config()->tmpfsmountpoint, SNAPSHOT_FILE, suffix);
+	return path;
+}
+
+static int
+_snapshot_write_client(FILE *fp, t_client *client)
+{
+	t_snapshot_record record;
+	const char *strings[SNAPSHOT_STRINGS];
+	size_t len;
+	int i;
+
+	strings[SNAPSHOT_MAC] = client->mac;
+	strings[SNAPSHOT_IP] = client->ip;
+	strings[SNAPSHOT_TOKEN] = client->token;
+	strings[SNAPSHOT_HID] = client->hid;
+	strings[SNAPSHOT_CID] = client->cid;
+	strings[SNAPSHOT_CUSTOM] = client->custom;
+	strings[SNAPSHOT_CLIENT_TYPE] = client->client_type;
+
+	memset(&record, 0, sizeof(record));
+	record.size = sizeof(record);
+
+	for (i = 0; i < SNAPSHOT_STRINGS; i++) {
+		len = strings[i] ? strlen(strings[i]) : 0;
+
+		if (len > UINT16_MAX) {
+			debug(LOG_WARNING, "Snapshot: string %d of client %s too long, not saved", i, client->mac);
+			len = 0;
+			strings[i] = NULL;
+		}
+
+		record.len[i] = len;
+		record.size += len + 1;
+	}
+
+	record.blocked = client->fw_connection_state == FW_MARK_AUTH_BLOCKED;
+	record.session_start = client->session_start;
+	record.session_end = client->session_end;
+	record.incoming = client->counters.incoming;
+	record.outgoing = client->counters.outgoing;
+	record.inpackets = client->counters.inpackets;
+	record.outpackets = client->counters.outpackets;
+	record.upload_rate = client->upload_rate;
+	record.download_rate = client->download_rate;
+	record.upload_quota = client->upload_quota;
+	record.download_quota = client->download_quota;
+
+	if (fwrite(&record, sizeof(record), 1, fp) != 1) {
+		return -1;
+	}
+
+	for (i = 0; i < SNAPSHOT_STRINGS; i++) {
+		if (fwrite(strings[i] ? strings[i] : "", record.len[i] + 1, 1, fp) != 1) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/** Writes the authenticated clients to a new file, then renames it over the last snapshot,
+ *  so a restart never sees a partly written snapshot.
+ *  @return number of clients written, or -1 on error
+ */
+int
+snapshot_write(void)
+{
+	t_snapshot_header header;
+	t_client *client;
+	FILE *fp;
+	char *path;
+	char *tmppath;
+	int rc = 0;
+	double started = metrics_now();
+
+	pthread_mutex_lock(&snapshot_mutex);
+
+	if (!snapshot_ready) {
+		pthread_mutex_unlock(&snapshot_mutex);
+		return 0;
+	}
+
+	path = _snapshot_path("");
+	tmppath = _snapshot_path(".tmp");
+
+	fp = fopen(tmppath, "w");
+
+	if (!fp) {
+		debug(LOG_ERR, "Snapshot: could not open [%s]: %s", tmppath, strerror(errno));
+		free(path);
+		free(tmppath);
+		pthread_mutex_unlock(&snapshot_mutex);
+		return -1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+	header.version = SNAPSHOT_VERSION;
+	header.record_size = sizeof(t_snapshot_record);
+	header.written = time(NULL);
+
+	// The header is written again once the count is known
+	if (fwrite(&header, sizeof(header), 1, fp) != 1) {
+		rc = -1;
+	}
+
+	READ_LOCK_CLIENT_LIST();
+
+	for (client = client_get_first_client(); client && rc == 0; client = client_get_next_client(client)) {
+		if (client->fw_connection_state != FW_MARK_AUTHENTICATED && client->fw_connection_state != FW_MARK_AUTH_BLOCKED) {
+			continue;
+		}
+
+		if (_snapshot_write_client(fp, client) == 0) {
+			header.count++;
+		} else {
+			rc = -1;
+		}
+	}
+
+	READ_UNLOCK_CLIENT_LIST();
+
+	if (rc == 0 && (fseek(fp, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, fp) != 1)) {
+		rc = -1;
+	}
+
+	if (fclose(fp) != 0) {
+		rc = -1;
+	}
+
+	if (rc == 0 && rename(tmppath, path) != 0) {
+		rc = -1;
+	}
+
+	if (rc == 0) {
+		debug(LOG_DEBUG, "Snapshot: %u clients written in %.3f ms", header.count, (metrics_now() - started) * 1000);
+		rc = header.count;
+	} else {
+		debug(LOG_ERR, "Snapshot: could not write [%s]: %s", tmppath, strerror(errno));
+		unlink(tmppath);
+	}
+
+	free(path);
+	free(tmppath);
+	pthread_mutex_unlock(&snapshot_mutex);
+
+	return rc;
+}
+
+/* Puts one client back, the client list being locked and a firewall batch open.
+ * strings points at the NUL terminated strings of the record, already checked.
+ */
+static int
+_snapshot_restore_client(const t_snapshot_record *record, const char *strings[], time_t now)
+{
+	s_config *config = config_get_config();
+	t_client *client;
+
+	if (record->session_end != 0 && record->session_end <= now) {
+		debug(LOG_INFO, "Snapshot: session of %s %s has ended, not restored", strings[SNAPSHOT_IP], strings[SNAPSHOT_MAC]);
+		return -1;
+	}
+
+	if (record->len[SNAPSHOT_TOKEN] == 0 || record->len[SNAPSHOT_HID] == 0) {
+		return -1;
+	}
+
+	client = client_list_restore_client(strings[SNAPSHOT_MAC], strings[SNAPSHOT_IP], strings[SNAPSHOT_TOKEN], strings[SNAPSHOT_HID]);
+
+	if (!client) {
+		return -1;
+	}
+
+	if (record->len[SNAPSHOT_CID] > 0) {
+		strncpy(client->cid, strings[SNAPSHOT_CID], CLIENT_CID_LEN - 1);
+	}
+
+	if (record->len[SNAPSHOT_CUSTOM] > 0) {
+		client->custom = client_list_strdup(client, strings[SNAPSHOT_CUSTOM]);
+	} else {
+		client->custom = client_list_strdup(client, "bmE=");
+	}
+
+	if (record->len[SNAPSHOT_CLIENT_TYPE] > 0) {
+		client->client_type = client_list_strdup(client, strings[SNAPSHOT_CLIENT_TYPE]);
+	}
+
+	client->session_start = record->session_start;
+	client->session_end = record->session_end;
+	client->upload_rate = record->upload_rate;
+	client->download_rate = record->download_rate;
+	client->upload_quota = record->upload_quota;
+	client->download_quota = record->download_quota;
+
+	// The counting rules start from the saved counters, so usage and quotas carry on
+	client->counters.incoming = client->counters.incoming_previous = record->incoming;
+	client->counters.outgoing = client->counters.outgoing_previous = record->outgoing;
+	client->counters.inpackets = client->counters.inpackets_previous = record->inpackets;
+	client->counters.outpackets = client->counters.outpackets_previous = record->outpackets;
+
+	iptables_fw_restore(client);
+
+	// As on authentication, the rate check starts again
+	client->window_start = now;
+	client->window_counter = config->rate_check_window;
+	client->initial_loop = 1;
+	client->counters.in_window_start = client->counters.incoming;
+	client->counters.out_window_start = client->counters.outgoing;
+
+	if (config->download_unrestricted_bursting == 0 && config->download_bucket_ratio > 0) {
+		iptables_download_ratelimit_enable(client, 1);
+		client->rate_exceeded = client->rate_exceeded^1;
+	}
+
+	if (config->upload_unrestricted_bursting == 0 && config->upload_bucket_ratio > 0) {
+		iptables_upload_ratelimit_enable(client, 1);
+		client->rate_exceeded = client->rate_exceeded^2;
+	}
+
+	client->fw_connection_state = FW_MARK_AUTHENTICATED;
+
+	if (record->blocked) {
+		debug(LOG_INFO, "Snapshot: %s %s was rate blocked, rate checks resume", client->ip, client->mac);
+	}
+
+	return 0;
+}
+
+/** Maps the snapshot left by the previous run and restores its clients.
+ *  Must be called once the firewall is set up and before the threads using the client list start.
+ *  @return number of clients restored, or -1 if there was no usable snapshot
+ */
+int
+snapshot_restore(void)
+{
+	const t_snapshot_header *header;
+	const t_snapshot_record *record;
+	const char *strings[SNAPSHOT_STRINGS];
+	const char *base;
+	struct stat st;
+	char *path;
+	size_t offset;
+	size_t next;
+	time_t now = time(NULL);
+	double started = metrics_now();
+	int restored = 0;
+	int rc = -1;
+	int fd;
+	int i;
+	uint32_t n;
+
+	path = _snapshot_path("");
+	fd = open(path, O_RDONLY);
+
+	if (fd < 0) {
+		debug(LOG_INFO, "Snapshot: no snapshot [%s]", path);
+		goto end;
+	}
+
+	if (fstat(fd, &st) != 0 || st.st_size < sizeof(t_snapshot_header)) {
+		debug(LOG_WARNING, "Snapshot: [%s] is too short, ignored", path);
+		close(fd);
+		goto end;
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (base == MAP_FAILED) {
+		debug(LOG_ERR, "Snapshot: could not map [%s]: %s", path, strerror(errno));
+		goto end;
+	}
+
+	header = (const t_snapshot_header *)base;
+
+	if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0
+		|| header->version != SNAPSHOT_VERSION
+		|| header->record_size != sizeof(t_snapshot_record)) {
+		debug(LOG_WARNING, "Snapshot: [%s] is not a version %d snapshot, ignored", path, SNAPSHOT_VERSION);
+		munmap((void *)base, st.st_size);
+		goto end;
+	}
+
+	LOCK_CLIENT_LIST();
+	iptables_fw_batch_begin();
+
+	offset = sizeof(t_snapshot_header);
+
+	for (n = 0; n < header->count; n++) {
+		// Records are packed, so copy the fixed part out to read it aligned
+		t_snapshot_record fixed;
+
+		if (offset + sizeof(fixed) > st.st_size) {
+			break;
+		}
+
+		memcpy(&fixed, base + offset, sizeof(fixed));
+		record = &fixed;
+		next = offset + record->size;
+
+		if (record->size < sizeof(fixed) || next > st.st_size) {
+			break;
+		}
+
+		strings[0] = base + offset + sizeof(fixed);
+
+		for (i = 0; i < SNAPSHOT_STRINGS; i++) {
+			if (i > 0) {
+				strings[i] = strings[i - 1] + record->len[i - 1] + 1;
+			}
+
+			if (strings[i] + record->len[i] >= base + next || strings[i][record->len[i]] != '\0') {
+				break;
+			}
+		}
+
+		if (i < SNAPSHOT_STRINGS) {
+			break;
+		}
+
+		if (_snapshot_restore_client(record, strings, now) == 0) {
+			restored++;
+		}
+
+		offset = next;
+	}
+
+	if (n < header->count) {
+		debug(LOG_WARNING, "Snapshot: [%s] is damaged at client %u of %u, the rest is ignored", path, n + 1, header->count);
+	}
+
+	iptables_fw_batch_commit();
+	UNLOCK_CLIENT_LIST();
+
+	debug(LOG_NOTICE, "Snapshot: restored %d of %u clients saved %lld seconds ago, in %.3f ms",
+		restored, header->count, (long long)(now - header->written), (metrics_now() - started) * 1000);
+
+	munmap((void *)base, st.st_size);
+	rc = restored;
+
+end:
+	free(path);
+
+	// From now on the snapshot follows this run
+	pthread_mutex_lock(&snapshot_mutex);
+	snapshot_ready = 1;
+	pthread_mutex_unlock(&snapshot_mutex);
+
+	return rc;
+}
@@ -0,0 +1,41 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file snapshot.h
+    @brief Snapshot of the authenticated clients, for a fast restart
+    @author Copyright (C) 2015-2025 Modifications and additions by BlueWave Projects and Services <opennds@blue-wave.net>
+*/
+
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+/** File in the tmpfs mountpoint holding the snapshot */
+#define SNAPSHOT_FILE "ndsclients.snap"
+
+/** Bumped whenever the layout of the snapshot changes, older snapshots are then ignored */
+#define SNAPSHOT_VERSION 1
+
+/** @brief Restore the clients of the previous run, returns the number restored or -1 if there was no usable snapshot */
+int snapshot_restore(void);
+
+/** @brief Write a snapshot of the authenticated clients */
+int snapshot_write(void);
+
+#endif /* _SNAPSHOT_H_ */
@@ -70,6 +70,11 @@
 #include "debug.h"
 #include "fw_iptables.h"
 #include "http_microhttpd_utils.h"
+#include "metrics.h"
+#include "admission.h"
+#include "watchdog.h"
+#include "netmon.h"
+#include "fetcher.h"
 
 // Defined in main.c
 extern time_t started_time;
@@ -292,8 +297,15 @@ int check_routing(int watchdog)
 	char rtr_online[] = "online";
 	int online_count;
 	int offline_count;
+	int online_status;
 	s_config *config = config_get_config();
 
+	// Between kernel events, and while no offline gateway answers a probe, nothing has changed
+	if (watchdog == 1 && netmon_routing_stale(config->ext_gateway, config->online_status) == 0) {
+		debug(LOG_DEBUG, "Online Status [ %d ], no routing events", config->online_status);
+		return config->online_status;
+	}
+
 	safe_asprintf(&rcmd,
 		"/usr/lib/opennds/libopennds.sh gatewayroute \"%s\"",
 		config->gw_interface
@@ -305,6 +317,10 @@ int check_routing(int watchdog)
 		online_count = count_substrings(rtest, rtr_online);
 		offline_count = count_substrings(rtest, rtr_offline);
 
+		// A reload may have published a new config while the script ran, and copies it under the lock
+		LOCK_CONFIG();
+		config = config_get_config();
+
 
 		if (strcmp(rtest, rtr_fail) == 0) {
 			debug(LOG_ERR, "Routing configuration is not valid for openNDS, exiting ...");
@@ -342,73 +358,36 @@ int check_routing(int watchdog)
 			}
 		}
 
-		if (config->ext_gateway) {
-			free (config->ext_gateway);
+		// Replaced only on a change, the old string is not freed as ndsctl status may be printing it
+		if (!config->ext_gateway || strcmp(config->ext_gateway, rtest) != 0) {
+			config->ext_gateway = safe_strdup(rtest);
 		}
 
-		config->ext_gateway = safe_strdup(rtest);
+		online_status = config->online_status;
+		UNLOCK_CONFIG();
+
 		free (rcmd);
 		free (rtest);
-		debug(LOG_DEBUG, "Online Status [ %d ]", config->online_status);
-		return config->online_status;
+		debug(LOG_DEBUG, "Online Status [ %d ]", online_status);
+		return online_status;
 	} else {
 		debug(LOG_ERR, "Unable to get routing configuration, retrying later ...");
-		config->online_status = 0;
+		LOCK_CONFIG();
+		config_get_config()->online_status = 0;
+		UNLOCK_CONFIG();
 		free (rcmd);
 		free (rtest);
 
-		return config->online_status;
-	}
-}
-
-
-int ndsctl_lock()
-{
-	char *lockfile;
-	s_config *config = config_get_config();
-
-	// Open or create the lock file
-	safe_asprintf(&lockfile, "%s/ndsctl.lock", config->tmpfsmountpoint);
-	config->lockfd = open(lockfile, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-	free(lockfile);
-
-	if (config->lockfd < 0) {
-		debug(LOG_ERR, "CRITICAL ERROR - Unable to open [%s]", lockfile);
-		return 5;
-	}
-
-	if (lockf(config->lockfd, F_TLOCK, 0) == 0) {
 		return 0;
-	} else {
-
-		if (errno != EACCES && errno != EAGAIN) {
-			// persistent error
-			debug(LOG_ERR, "CRITICAL ERROR - Unable to create lock on [%s]", lockfile);
-			close(config->lockfd);
-			return 6;
-		}
-
-		debug(LOG_ERR, "ndsctl is locked by another process");
-		close(config->lockfd);
-		return 4;
-	}
-}
-
-void ndsctl_unlock()
-{
-	s_config *config = config_get_config();
-
-	if (lockf(config->lockfd, F_ULOCK, 0) < 0) {
-		debug(LOG_ERR, "Unable to Unlock ndsctl");
 	}
-
-	close(config->lockfd);
 }
 
 
 int download_remotes(int refresh)
 {
 	char *cmd = NULL;
+	char *images;
+	char *files;
 	int daemonpid = 0;
 	s_config *config = config_get_config();
 
@@ -425,16 +404,28 @@ int download_remotes(int refresh)
 		debug(LOG_DEBUG, "Background Refreshing of remotes for: %s\n", config->themespec_path);
 	}
 
-	safe_asprintf(&cmd,
-		"/usr/lib/opennds/libopennds.sh download \"%s\" \"%s\" \"%s\" \"%d\" \"%s\"",
-		config->themespec_path,
-		config->custom_images,
-		config->custom_files,
-		refresh,
-		config->webroot
-	);
+	if (config->online_status <= 0) {
+		debug(LOG_DEBUG, "Cannot download remotes - upstream gateway(s) are offline");
+		return 0;
+	}
+
+	// http remotes are fetched in process, and revalidated with conditional requests
+	fetcher_start(refresh);
+
+	// Only the others, eg https, are left to the download library call
+	images = fetcher_script_list(config->custom_images);
+	files = fetcher_script_list(config->custom_files);
+
+	if (images || files) {
+		safe_asprintf(&cmd,
+			"/usr/lib/opennds/libopennds.sh download \"%s\" \"%s\" \"%s\" \"%d\" \"%s\"",
+			config->themespec_path,
+			images ? images : "",
+			files ? files : "",
+			refresh,
+			config->webroot
+		);
 
-	if (config->online_status > 0) {
 		debug(LOG_DEBUG, "Starting daemon: %s\n", cmd);
 
 		if (startdaemon(cmd, daemonpid) == 0) {
@@ -445,11 +436,12 @@ int download_remotes(int refresh)
 		} else {
 			debug(LOG_DEBUG, "Cannot download remotes - daemon failed to start");
 		}
-	} else {
-		debug(LOG_DEBUG, "Cannot download remotes - upstream gateway(s) are offline");
+
+		free(cmd);
 	}
 
-	free(cmd);
+	free(images);
+	free(files);
 	return 0;
 }
 
@@ -587,6 +579,8 @@ static int _execute_ret(char* msg, int msg_len, const char *cmd)
 	FILE *fp;
 	int rc;
 	size_t byte_count;
+	char label[64];
+	double started = metrics_now();
 
 	debug(LOG_DEBUG, "Executing command: %s", cmd);
 
@@ -639,6 +633,9 @@ abort:
 		debug(LOG_ERR, "sigaction() failed to restore SIGCHLD handler! Error %s", strerror(errno));
 	}
 
+	metrics_command_label(label, sizeof(label), cmd);
+	metrics_observe(METRIC_EXEC, label, metrics_now() - started);
+
 	return rc;
 }
 
@@ -860,6 +857,7 @@ ndsctl_status(FILE *fp)
 	unsigned int downloadburst = 0;
 	unsigned long int now, uptimesecs, durationsecs = 0;
 	unsigned long long int download_bytes, upload_bytes;
+	t_MAC *trust_list;
 	t_MAC *trust_mac;
 	time_t sysuptime;
 	const char *mhdversion = MHD_get_version();
@@ -902,12 +900,8 @@ ndsctl_status(FILE *fp)
 		fprintf(fp, "Managed interface: %s - IP address range: %s\n", config->gw_interface, config->gw_iprange);
 	}
 
-	// Check if router is online
-	int watchdog = 0;
-	int routercheck;
-	routercheck = check_routing(watchdog);
-
-	if (routercheck > 0) {
+	// Upstream state as last read by the watchdog, on a routing event
+	if (config->online_status > 0) {
 		fprintf(fp, "Upstream gateway(s) [ %s ]\n", config->ext_gateway);
 	} else {
 		fprintf(fp, "All Upstream gateway(s) are offline or not connected [ %s ]\n", config->ext_gateway);
@@ -915,6 +909,8 @@ ndsctl_status(FILE *fp)
 
 	fprintf(fp, "MHD Server [ version %s ] listening on: http://%s\n", mhdversion, config->gw_address);
 	fprintf(fp, "Maximum Html Page size is [ %llu ] Bytes\n", HTMLMAXSIZE);
+	admission_status(fp);
+	watchdog_status(fp);
 
 	if (config->allow_preemptive_authentication > 0) {
 		fprintf(fp, "Preemptive Authentication is Enabled\n");
@@ -986,7 +982,7 @@ ndsctl_status(FILE *fp)
 	// Update the client's counters so info is current
 	iptables_fw_counters_update();
 
-	LOCK_CLIENT_LIST();
+	READ_LOCK_CLIENT_LIST();
 
 	fprintf(fp, "Current clients: %d\n", get_client_list_length());
 
@@ -1028,7 +1024,7 @@ ndsctl_status(FILE *fp)
 			fprintf(fp, "  Session End:   -\n");
 		}
 
-		fprintf(fp, "  Token: %s\n", client->token ? client->token : "none");
+		fprintf(fp, "  Token: %s\n", client->token);
 		fprintf(fp, "  State: %s\n", fw_connection_state_as_string(client->fw_connection_state));
 
 		if (client->download_rate == 0) {
@@ -1092,23 +1088,29 @@ ndsctl_status(FILE *fp)
 		;
 
 		indx++;
-		client = client->next;
+		client = client_get_next_client(client);
 	}
 
-	UNLOCK_CLIENT_LIST();
+	READ_UNLOCK_CLIENT_LIST();
 
 	fprintf(fp, "====\n");
 	fprintf(fp, "Trusted MAC addresses:\n");
 
-	if (config->trustedmaclist != NULL) {
+	// ndsctl trust and untrust replace the list, the one read here stays valid until config_read_end()
+	config_read_begin();
+	trust_list = __atomic_load_n(&config->trustedmaclist, __ATOMIC_ACQUIRE);
+
+	if (trust_list != NULL) {
 
-		for (trust_mac = config->trustedmaclist; trust_mac != NULL; trust_mac = trust_mac->next) {
+		for (trust_mac = trust_list; trust_mac != NULL; trust_mac = trust_mac->next) {
 			fprintf(fp, "%s\n", trust_mac->mac);
 		}
 	} else {
 		fprintf(fp, "none\n");
 	}
 
+	config_read_end();
+
 	fprintf(fp, "====\n");
 	fprintf(fp, "Walledgarden FQDNs:\n");
 
@@ -1222,7 +1224,7 @@ ndsctl_json_client(FILE *fp, const t_client *client, time_t now, char *indent)
 	}
 
 	fprintf(fp, "  %s\"last_active\":\"%lld\",\n", indent, (long long) client->counters.last_updated);
-	fprintf(fp, "  %s\"token\":\"%s\",\n", indent, client->token ? client->token : "none");
+	fprintf(fp, "  %s\"token\":\"%s\",\n", indent, client->token);
 	fprintf(fp, "  %s\"state\":\"%s\",\n", indent, fw_connection_state_as_string(client->fw_connection_state));
 
 	if (!client->custom || strlen(client->custom) == 0) {
@@ -1315,7 +1317,7 @@ ndsctl_json_one(FILE *fp, const char *arg, char *indent)
 	// Update the client's counters so info is current
 	iptables_fw_counters_update();
 
-	LOCK_CLIENT_LIST();
+	READ_LOCK_CLIENT_LIST();
 
 	client = client_list_find_by_any(arg, arg, arg);
 
@@ -1327,7 +1329,7 @@ ndsctl_json_one(FILE *fp, const char *arg, char *indent)
 		fprintf(fp, "{}\n");
 	}
 
-	UNLOCK_CLIENT_LIST();
+	READ_UNLOCK_CLIENT_LIST();
 }
 
 static void
@@ -1335,6 +1337,7 @@ ndsctl_json_all(FILE *fp, char *indent)
 {
 	t_client *client;
 	time_t now;
+	t_MAC *trust_list;
 	t_MAC *trust_mac;
 	s_config *config;
 	int count = 0;
@@ -1346,7 +1349,7 @@ ndsctl_json_all(FILE *fp, char *indent)
 	// Update the client's counters so info is current
 	iptables_fw_counters_update();
 
-	LOCK_CLIENT_LIST();
+	READ_LOCK_CLIENT_LIST();
 
 	fprintf(fp, "{\n  \"client_list_length\":\"%d\",\n", get_client_list_length());
 
@@ -1358,7 +1361,7 @@ ndsctl_json_all(FILE *fp, char *indent)
 		fprintf(fp, "%s\"%s\":{\n", indent, client->mac);
 		ndsctl_json_client(fp, client, now, indent);
 
-		client = client->next;
+		client = client_get_next_client(client);
 		if (client) {
 			fprintf(fp, "%s},\n", indent);
 		} else {
@@ -1366,13 +1369,16 @@ ndsctl_json_all(FILE *fp, char *indent)
 		}
 	}
 
-	UNLOCK_CLIENT_LIST();
+	READ_UNLOCK_CLIENT_LIST();
+
+	// Trusted mac list, read once as ndsctl trust and untrust replace it
+	config_read_begin();
+	trust_list = __atomic_load_n(&config->trustedmaclist, __ATOMIC_ACQUIRE);
 
-	// Trusted mac list
-	if (config->trustedmaclist != NULL) {
+	if (trust_list != NULL) {
 		fprintf(fp, "  },\n");
 		// count the number of trusted mac addresses
-		for (trust_mac = config->trustedmaclist; trust_mac != NULL; trust_mac = trust_mac->next) {
+		for (trust_mac = trust_list; trust_mac != NULL; trust_mac = trust_mac->next) {
 			count++;
 		}
 
@@ -1380,7 +1386,7 @@ ndsctl_json_all(FILE *fp, char *indent)
 		fprintf(fp, "  \"trusted_list_length\":\"%d\",\n", count);
 		fprintf(fp, "  \"trusted\":[\n");
 
-		for (trust_mac = config->trustedmaclist; trust_mac != NULL; trust_mac = trust_mac->next) {
+		for (trust_mac = trust_list; trust_mac != NULL; trust_mac = trust_mac->next) {
 
 			if (count > 1) {
 				fprintf(fp, "    \"%s\",\n", trust_mac->mac);
@@ -1394,6 +1400,8 @@ ndsctl_json_all(FILE *fp, char *indent)
 	} else {
 		fprintf(fp, "  }\n");
 	}
+
+	config_read_end();
 	fprintf(fp, "}\n");
 }
 
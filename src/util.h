@@ -68,12 +68,6 @@ int hash_str(char *buf, int hash_len, const char *src);
 // @brief Downloads remote files specified in the configured themespec
 int download_remotes(int refresh);
 
-// @brief locks ndsctl
-int ndsctl_lock();
-
-// @brief unlocks ndsctl
-void ndsctl_unlock();
-
 // @brief startdaemon
 int startdaemon(char *cmd, int daemonpid);
 
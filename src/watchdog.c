@@ -0,0 +1,342 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @internal
+  @file watchdog.c
+  @brief In-process health checks of the web server and the firewall ruleset
+  @author Copyright (C) 2015-2025 Modifications and additions by BlueWave Projects and Services <opennds@blue-wave.net>
+
+  Every checkinterval the client timeout thread asks whether the web server is alive.
+  It connects to the gateway address on a connection of its own and requests /mhdstatus,
+  within WATCHDOG_DEADLINE_MS. A slow answer alone does not mean a stall: every request
+  the web server completes bumps a heartbeat counter, and if the counter moved while
+  the self requests were waiting the server is busy, not stuck. Only when
+  WATCHDOG_ATTEMPTS self requests go unanswered and no request at all is completed
+  in that time is the web server restarted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "common.h"
+#include "safe.h"
+#include "conf.h"
+#include "debug.h"
+#include "util.h"
+#include "metrics.h"
+#include "watchdog.h"
+
+static unsigned long long int beats = 0;
+static unsigned long long int restarts = 0;
+static unsigned long long int late = 0;
+static time_t last_healthy = 0;
+
+void
+watchdog_beat(void)
+{
+	__atomic_add_fetch(&beats, 1, __ATOMIC_RELAXED);
+}
+
+// Wait for events on sock until the deadline, in seconds of metrics_now()
+static int
+_watchdog_wait(int sock, short events, double deadline)
+{
+	struct pollfd pfd;
+	double remaining;
+	int rc;
+
+	pfd.fd = sock;
+	pfd.events = events;
+
+	while (1) {
+		remaining = deadline - metrics_now();
+
+		if (remaining <= 0) {
+			return -1;
+		}
+
+		rc = poll(&pfd, 1, (int)(remaining * 1000) + 1);
+
+		if (rc > 0) {
+			return 0;
+		}
+
+		if (rc < 0 && errno != EINTR) {
+			return -1;
+		}
+	}
+}
+
+static int
+_watchdog_address(const s_config *config, struct sockaddr_storage *addr, socklen_t *addrlen)
+{
+	struct sockaddr_in *in4 = (struct sockaddr_in *)addr;
+	struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)addr;
+
+	memset(addr, 0, sizeof(*addr));
+
+	if (inet_pton(AF_INET, config->gw_ip, &in4->sin_addr) == 1) {
+		in4->sin_family = AF_INET;
+		in4->sin_port = htons(config->gw_port);
+		*addrlen = sizeof(*in4);
+		return 0;
+	}
+
+	if (inet_pton(AF_INET6, config->gw_ip, &in6->sin6_addr) == 1) {
+		in6->sin6_family = AF_INET6;
+		in6->sin6_port = htons(config->gw_port);
+
+		if (IN6_IS_ADDR_LINKLOCAL(&in6->sin6_addr)) {
+			in6->sin6_scope_id = if_nametoindex(config->gw_interface);
+		}
+
+		*addrlen = sizeof(*in6);
+		return 0;
+	}
+
+	debug(LOG_ERR, "MHD Watchdog: cannot use gateway address [%s]", config->gw_ip);
+	return -1;
+}
+
+/* Request /mhdstatus from the web server, as a client would.
+ * Returns 0 if the expected answer arrived before the deadline.
+ */
+static int
+_watchdog_self_request(const s_config *config, double deadline)
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	socklen_t errlen;
+	char request[SMALL_BUF];
+	char reply[SMALL_BUF];
+	size_t reqlen;
+	size_t sent = 0;
+	size_t len = 0;
+	ssize_t n;
+	int sock;
+	int err = 0;
+	int rc = -1;
+
+	if (_watchdog_address(config, &addr, &addrlen) != 0) {
+		return -1;
+	}
+
+	sock = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+	if (sock < 0) {
+		debug(LOG_ERR, "MHD Watchdog: socket(): %s", strerror(errno));
+		return -1;
+	}
+
+	if (connect(sock, (struct sockaddr *)&addr, addrlen) != 0 && errno != EINPROGRESS) {
+		debug(LOG_DEBUG, "MHD Watchdog: connect(): %s", strerror(errno));
+		goto out;
+	}
+
+	if (_watchdog_wait(sock, POLLOUT, deadline) != 0) {
+		goto out;
+	}
+
+	errlen = sizeof(err);
+
+	if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &errlen) != 0 || err != 0) {
+		debug(LOG_DEBUG, "MHD Watchdog: connect(): %s", strerror(err));
+		goto out;
+	}
+
+	reqlen = snprintf(request, sizeof(request),
+		"GET /mhdstatus HTTP/1.0\r\nHost: %s\r\nConnection: close\r\n\r\n",
+		config->gw_address
+	);
+
+	if (reqlen >= sizeof(request)) {
+		goto out;
+	}
+
+	while (sent < reqlen) {
+		if (_watchdog_wait(sock, POLLOUT, deadline) != 0) {
+			goto out;
+		}
+
+		n = send(sock, request + sent, reqlen - sent, MSG_NOSIGNAL);
+
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				continue;
+			}
+
+			goto out;
+		}
+
+		sent += n;
+	}
+
+	// The answer is the page of send_error(200), after the headers
+	while (len < sizeof(reply) - 1) {
+		if (_watchdog_wait(sock, POLLIN, deadline) != 0) {
+			goto out;
+		}
+
+		n = recv(sock, reply + len, sizeof(reply) - 1 - len, 0);
+
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				continue;
+			}
+
+			goto out;
+		}
+
+		if (n == 0) {
+			break;
+		}
+
+		len += n;
+		reply[len] = '\0';
+
+		if (strstr(reply, "<br>OK<br>")) {
+			rc = 0;
+			break;
+		}
+	}
+
+out:
+	close(sock);
+	return rc;
+}
+
+/** Checks the web server answers, or is at least completing requests.
+ *  @return 0 if it is alive, -1 if it is stalled and should be restarted
+ */
+int
+watchdog_check_mhd(void)
+{
+	s_config *config = config_get_config();
+	unsigned long long int before;
+	double deadline;
+	int attempt;
+
+	before = __atomic_load_n(&beats, __ATOMIC_RELAXED);
+
+	for (attempt = 1; attempt <= WATCHDOG_ATTEMPTS; attempt++) {
+		deadline = metrics_now() + WATCHDOG_DEADLINE_MS / 1000.0;
+
+		if (_watchdog_self_request(config, deadline) == 0) {
+			metrics_inc(METRIC_WATCHDOG, attempt == 1 ? "ok" : "late");
+
+			if (attempt > 1) {
+				__atomic_add_fetch(&late, 1, __ATOMIC_RELAXED);
+			}
+
+			return 0;
+		}
+
+		debug(LOG_INFO, "MHD Watchdog: no answer to self request %d of %d", attempt, WATCHDOG_ATTEMPTS);
+
+		// A refused connection fails at once, give the web server the whole deadline anyway
+		while (metrics_now() < deadline) {
+			usleep(100000);
+		}
+
+		// Busy rather than stalled while other requests are still completed
+		if (__atomic_load_n(&beats, __ATOMIC_RELAXED) != before) {
+			debug(LOG_INFO, "MHD Watchdog: web server is busy but completing requests");
+			metrics_inc(METRIC_WATCHDOG, "late");
+			__atomic_add_fetch(&late, 1, __ATOMIC_RELAXED);
+			return 0;
+		}
+	}
+
+	metrics_inc(METRIC_WATCHDOG, "stalled");
+	return -1;
+}
+
+/** Checks the filter chain of the ruleset exists, allowing a second for another process to finish with it.
+ *  @return 0 if the ruleset is in place
+ */
+int
+watchdog_check_ruleset(void)
+{
+	const char cmd[] = "nft list chain inet nds_filter ndsNET >/dev/null 2>&1";
+
+	if (execute(cmd) == 0) {
+		return 0;
+	}
+
+	sleep(1);
+	return execute(cmd) == 0 ? 0 : -1;
+}
+
+void
+watchdog_write_heartbeat(void)
+{
+	s_config *config = config_get_config();
+	char *path;
+	time_t now = time(NULL);
+	FILE *fp;
+
+	__atomic_store_n(&last_healthy, now, __ATOMIC_RELAXED);
+
+	safe_asprintf(&path, "%s/ndscids/heartbeat", config->tmpfsmountpoint);
+	fp = fopen(path, "w");
+
+	if (!fp) {
+		debug(LOG_DEBUG, "MHD Watchdog: cannot write [%s]: %s", path, strerror(errno));
+		free(path);
+		return;
+	}
+
+	fprintf(fp, "%lld\n", (long long int)now);
+	fclose(fp);
+	free(path);
+}
+
+void
+watchdog_restarted(void)
+{
+	__atomic_add_fetch(&restarts, 1, __ATOMIC_RELAXED);
+	metrics_inc(METRIC_WATCHDOG, "restarted");
+}
+
+void
+watchdog_status(FILE *fp)
+{
+	time_t healthy = __atomic_load_n(&last_healthy, __ATOMIC_RELAXED);
+
+	fprintf(fp, "MHD requests completed: %llu\n", __atomic_load_n(&beats, __ATOMIC_RELAXED));
+
+	if (healthy > 0) {
+		fprintf(fp, "MHD Watchdog: last healthy %lld seconds ago, %llu slow checks, %llu restarts\n",
+			(long long int)(time(NULL) - healthy),
+			__atomic_load_n(&late, __ATOMIC_RELAXED),
+			__atomic_load_n(&restarts, __ATOMIC_RELAXED));
+	} else {
+		fprintf(fp, "MHD Watchdog: no check yet\n");
+	}
+}
@@ -0,0 +1,55 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file watchdog.h
+    @brief In-process health checks of the web server and the firewall ruleset
+    @author Copyright (C) 2015-2025 Modifications and additions by BlueWave Projects and Services <opennds@blue-wave.net>
+*/
+
+#ifndef _WATCHDOG_H_
+#define _WATCHDOG_H_
+
+#include <stdio.h>
+
+/** Milliseconds allowed for one self request, from connect to the end of the response */
+#define WATCHDOG_DEADLINE_MS 2000
+/** Self requests made in one check before the web server is considered stalled */
+#define WATCHDOG_ATTEMPTS 3
+
+/** @brief Count a request completed by the web server, called from its connection threads */
+void watchdog_beat(void);
+
+/** @brief Check the web server with a self request on a dedicated connection.
+ *  Returns 0 if it answered, or completed other requests meanwhile, -1 if it is stalled */
+int watchdog_check_mhd(void);
+
+/** @brief Check the nftables ruleset is still in place. Returns 0 if it is */
+int watchdog_check_ruleset(void);
+
+/** @brief Write the time of the last healthy check to the heartbeat file */
+void watchdog_write_heartbeat(void);
+
+/** @brief Count a restart of the web server by the watchdog */
+void watchdog_restarted(void);
+
+/** @brief Write the watchdog counters, for ndsctl status */
+void watchdog_status(FILE *fp);
+
+#endif /* _WATCHDOG_H_ */
@@ -0,0 +1,516 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @internal
+  @file webroot_cache.c
+  @brief Cache of static files served from the webroot
+  @author Copyright (C) 2015-2025 Modifications and additions by BlueWave Projects and Services <opennds@blue-wave.net>
+
+  Files are loaded on first request and kept, with a content hash used as the
+  ETag, until inotify reports a change in the directory holding them.
+  download_remotes() rewrites themespec images and files in place, so the
+  watch is placed on both the directory the url points into and the directory
+  the file really lives in after symlinks are resolved.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "common.h"
+#include "safe.h"
+#include "conf.h"
+#include "debug.h"
+#include "webroot_cache.h"
+
+#define WEBROOT_CACHE_BUCKETS 64
+#define WEBROOT_CACHE_MAX_ENTRIES 512
+
+#define WEBROOT_WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE \
+	| IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+
+typedef struct _t_webroot_entry {
+	struct _t_webroot_entry *next;
+	char *url;
+	unsigned int hash;
+	int wd;				/**< @brief Watch on the directory the url points into */
+	int wd_real;			/**< @brief Watch on the directory of the resolved file */
+	time_t checked;			/**< @brief Last stat() revalidation, used without inotify */
+	ino_t ino;
+	t_webroot_blob *identity;
+	t_webroot_blob *gzip;
+} t_webroot_entry;
+
+static pthread_mutex_t webroot_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static t_webroot_entry *buckets[WEBROOT_CACHE_BUCKETS];
+static int entry_count = 0;
+static size_t cached_bytes = 0;
+static int inotify_fd = -1;
+
+static unsigned int
+url_hash(const char *url)
+{
+	unsigned int h = 2166136261u;
+
+	for (; *url; url++) {
+		h = (h ^ (unsigned char) *url) * 16777619u;
+	}
+
+	return h;
+}
+
+// Called with webroot_cache_mutex held
+static void
+blob_unref(t_webroot_blob *blob)
+{
+	if (!blob) {
+		return;
+	}
+
+	if (--blob->refcount > 0) {
+		return;
+	}
+
+	if (blob->data) {
+		cached_bytes -= blob->size;
+	}
+
+	free(blob->filename);
+	free(blob);
+}
+
+/* Read a file, hashing it for the ETag and keeping the contents in memory if
+ * it fits the budget. Returns a blob holding one reference, or NULL if the
+ * file cannot be served.
+ */
+static t_webroot_blob *
+blob_load(const char *filename, int gzip, struct stat *st)
+{
+	t_webroot_blob *blob;
+	char buf[SMALL_BUF];
+	unsigned long long hash = 14695981039346656037ULL;
+	off_t total = 0;
+	ssize_t n = 0;
+	int keep;
+	int fd;
+	int i;
+	struct tm tm;
+
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0) {
+		return NULL;
+	}
+
+	if (fstat(fd, st) != 0 || !S_ISREG(st->st_mode)) {
+		close(fd);
+		return NULL;
+	}
+
+	keep = (st->st_size <= WEBROOT_CACHE_MAX_FILE && cached_bytes + st->st_size <= WEBROOT_CACHE_MAX_BYTES);
+
+	blob = safe_calloc(sizeof(t_webroot_blob) + (keep ? st->st_size + 1 : 0));
+
+	if (keep) {
+		// The contents follow the header so webroot_cache_blob_of() can find it again
+		blob->data = (char *)(blob + 1);
+	}
+
+	for (;;) {
+		if (keep) {
+			if (total >= st->st_size) {
+				break;
+			}
+
+			n = read(fd, blob->data + total, st->st_size - total);
+		} else {
+			n = read(fd, buf, sizeof(buf));
+		}
+
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (n <= 0) {
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			hash = (hash ^ (unsigned char) (keep ? blob->data[total + i] : buf[i])) * 1099511628211ULL;
+		}
+
+		total += n;
+	}
+
+	close(fd);
+
+	if (n < 0) {
+		debug(LOG_ERR, "Unable to read %s: %s", filename, strerror(errno));
+		free(blob);
+		return NULL;
+	}
+
+	blob->refcount = 1;
+	blob->gzip = gzip;
+	blob->mtime = st->st_mtime;
+	blob->size = total;
+
+	if (keep) {
+		cached_bytes += total;
+	} else {
+		blob->filename = safe_strdup(filename);
+	}
+
+	snprintf(blob->etag, sizeof(blob->etag), "\"%016llx\"", hash);
+	gmtime_r(&blob->mtime, &tm);
+	strftime(blob->last_modified, sizeof(blob->last_modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+	debug(LOG_DEBUG, "Cached %s, %lld bytes%s, etag %s", filename, (long long) total, keep ? "" : " (streamed)", blob->etag);
+
+	return blob;
+}
+
+static int
+watch_dir_of(const char *path)
+{
+	char dir[PATH_MAX];
+	char *slash;
+
+	if (inotify_fd < 0) {
+		return -1;
+	}
+
+	strncpy(dir, path, sizeof(dir) - 1);
+	dir[sizeof(dir) - 1] = '\0';
+
+	slash = strrchr(dir, '/');
+
+	if (!slash) {
+		return -1;
+	}
+
+	*slash = '\0';
+
+	// inotify returns the existing descriptor if the directory is already watched
+	return inotify_add_watch(inotify_fd, dir[0] ? dir : "/", WEBROOT_WATCH_MASK);
+}
+
+// Remove a watch once no cached entry uses it, the entry that did being already unlinked
+static void
+watch_release(int wd)
+{
+	t_webroot_entry *entry;
+	int i;
+
+	if (wd < 0 || inotify_fd < 0) {
+		return;
+	}
+
+	for (i = 0; i < WEBROOT_CACHE_BUCKETS; i++) {
+		for (entry = buckets[i]; entry; entry = entry->next) {
+			if (entry->wd == wd || entry->wd_real == wd) {
+				return;
+			}
+		}
+	}
+
+	// Fails with EINVAL if the kernel already removed it with its directory, which is fine
+	inotify_rm_watch(inotify_fd, wd);
+}
+
+static void
+entry_free(t_webroot_entry *entry)
+{
+	watch_release(entry->wd);
+
+	if (entry->wd_real != entry->wd) {
+		watch_release(entry->wd_real);
+	}
+
+	blob_unref(entry->identity);
+	blob_unref(entry->gzip);
+	free(entry->url);
+	free(entry);
+}
+
+// Drop entries matching wd, or every entry if wd is -1
+static void
+invalidate(int wd)
+{
+	t_webroot_entry **pp;
+	t_webroot_entry *entry;
+	int i;
+
+	for (i = 0; i < WEBROOT_CACHE_BUCKETS; i++) {
+		pp = &buckets[i];
+
+		while ((entry = *pp) != NULL) {
+			if (wd == -1 || entry->wd == wd || entry->wd_real == wd) {
+				*pp = entry->next;
+				debug(LOG_DEBUG, "Webroot cache: dropping %s", entry->url);
+				entry_free(entry);
+				entry_count--;
+			} else {
+				pp = &entry->next;
+			}
+		}
+	}
+}
+
+// Consume pending inotify events without blocking
+static void
+drain_events(void)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	ssize_t len;
+	char *ptr;
+
+	if (inotify_fd < 0) {
+		return;
+	}
+
+	for (;;) {
+		len = read(inotify_fd, buf, sizeof(buf));
+
+		if (len <= 0) {
+			if (len < 0 && errno == EINTR) {
+				continue;
+			}
+
+			break;
+		}
+
+		for (ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + event->len) {
+			event = (const struct inotify_event *) ptr;
+
+			if (event->mask & IN_Q_OVERFLOW) {
+				invalidate(-1);
+			} else {
+				invalidate(event->wd);
+			}
+		}
+	}
+}
+
+static t_webroot_entry *
+entry_load(const char *url, unsigned int hash)
+{
+	s_config *config = config_get_config();
+	t_webroot_entry *entry;
+	char filename[PATH_MAX];
+	char gzname[PATH_MAX];
+	char resolved[PATH_MAX];
+	struct stat st;
+	struct stat gzst;
+
+	if (snprintf(filename, sizeof(filename), "%s/%s", config->webroot, url) >= sizeof(filename)) {
+		return NULL;
+	}
+
+	entry = safe_calloc(sizeof(t_webroot_entry));
+
+	// Watch first, so a change made while we read is not missed
+	entry->wd = watch_dir_of(filename);
+	entry->wd_real = -1;
+
+	if (realpath(filename, resolved)) {
+		entry->wd_real = watch_dir_of(resolved);
+	}
+
+	entry->identity = blob_load(filename, 0, &st);
+
+	if (!entry->identity) {
+		entry_free(entry);
+		return NULL;
+	}
+
+	entry->ino = st.st_ino;
+
+	if (snprintf(gzname, sizeof(gzname), "%s.gz", filename) < sizeof(gzname)) {
+		entry->gzip = blob_load(gzname, 1, &gzst);
+	}
+
+	if (entry->gzip) {
+		entry->identity->has_gzip = 1;
+		entry->gzip->has_gzip = 1;
+	}
+
+	entry->url = safe_strdup(url);
+	entry->hash = hash;
+	entry->checked = time(NULL);
+
+	return entry;
+}
+
+// Without inotify, fall back to an occasional stat() of the file
+static int
+entry_is_stale(t_webroot_entry *entry)
+{
+	s_config *config = config_get_config();
+	char filename[PATH_MAX];
+	struct stat st;
+	time_t now;
+
+	if (inotify_fd >= 0) {
+		return 0;
+	}
+
+	now = time(NULL);
+
+	if (now - entry->checked < WEBROOT_CACHE_REVALIDATE) {
+		return 0;
+	}
+
+	entry->checked = now;
+	snprintf(filename, sizeof(filename), "%s/%s", config->webroot, entry->url);
+
+	if (stat(filename, &st) != 0) {
+		return 1;
+	}
+
+	if (st.st_ino != entry->ino || st.st_mtime != entry->identity->mtime || st.st_size != entry->identity->size) {
+		return 1;
+	}
+
+	if (entry->gzip) {
+		strncat(filename, ".gz", sizeof(filename) - strlen(filename) - 1);
+
+		if (stat(filename, &st) != 0 || st.st_mtime != entry->gzip->mtime) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int
+webroot_cache_init(void)
+{
+	pthread_mutex_lock(&webroot_cache_mutex);
+
+	if (inotify_fd < 0) {
+		inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+		if (inotify_fd < 0) {
+			debug(LOG_WARNING, "inotify unavailable (%s), webroot cache will revalidate with stat()", strerror(errno));
+		}
+	}
+
+	pthread_mutex_unlock(&webroot_cache_mutex);
+
+	return (inotify_fd < 0) ? -1 : 0;
+}
+
+void
+webroot_cache_flush(void)
+{
+	pthread_mutex_lock(&webroot_cache_mutex);
+	drain_events();
+	invalidate(-1);
+	pthread_mutex_unlock(&webroot_cache_mutex);
+}
+
+t_webroot_blob *
+webroot_cache_get(const char *url, int accept_gzip)
+{
+	t_webroot_entry **pp;
+	t_webroot_entry *entry;
+	t_webroot_blob *blob;
+	unsigned int hash;
+
+	hash = url_hash(url);
+
+	pthread_mutex_lock(&webroot_cache_mutex);
+	drain_events();
+
+	for (pp = &buckets[hash % WEBROOT_CACHE_BUCKETS]; (entry = *pp) != NULL; pp = &entry->next) {
+		if (entry->hash == hash && strcmp(entry->url, url) == 0) {
+			break;
+		}
+	}
+
+	if (entry && entry_is_stale(entry)) {
+		*pp = entry->next;
+		entry_free(entry);
+		entry_count--;
+		entry = NULL;
+	}
+
+	if (!entry) {
+		if (entry_count >= WEBROOT_CACHE_MAX_ENTRIES) {
+			invalidate(-1);
+		}
+
+		entry = entry_load(url, hash);
+
+		if (!entry) {
+			pthread_mutex_unlock(&webroot_cache_mutex);
+			return NULL;
+		}
+
+		entry->next = buckets[hash % WEBROOT_CACHE_BUCKETS];
+		buckets[hash % WEBROOT_CACHE_BUCKETS] = entry;
+		entry_count++;
+	}
+
+	blob = (accept_gzip && entry->gzip) ? entry->gzip : entry->identity;
+	blob->refcount++;
+
+	pthread_mutex_unlock(&webroot_cache_mutex);
+
+	return blob;
+}
+
+t_webroot_blob *
+webroot_cache_ref(t_webroot_blob *blob)
+{
+	pthread_mutex_lock(&webroot_cache_mutex);
+	blob->refcount++;
+	pthread_mutex_unlock(&webroot_cache_mutex);
+
+	return blob;
+}
+
+void
+webroot_cache_release(t_webroot_blob *blob)
+{
+	pthread_mutex_lock(&webroot_cache_mutex);
+	blob_unref(blob);
+	pthread_mutex_unlock(&webroot_cache_mutex);
+}
+
+t_webroot_blob *
+webroot_cache_blob_of(const char *data)
+{
+	return ((t_webroot_blob *) data) - 1;
+}
@@ -0,0 +1,74 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file webroot_cache.h
+    @brief Cache of static files served from the webroot
+    @author Copyright (C) 2015-2025 Modifications and additions by BlueWave Projects and Services <opennds@blue-wave.net>
+*/
+
+#ifndef _WEBROOT_CACHE_H_
+#define _WEBROOT_CACHE_H_
+
+#include <sys/types.h>
+#include <time.h>
+
+/** Largest file that will be held in memory. Bigger files are streamed from disk */
+#define WEBROOT_CACHE_MAX_FILE 262144
+/** Total memory budget for cached file contents */
+#define WEBROOT_CACHE_MAX_BYTES 1048576
+/** Seconds before an entry is re-checked with stat() when inotify is not available */
+#define WEBROOT_CACHE_REVALIDATE 2
+
+/** @brief One representation (identity or gzip) of a webroot file.
+ *
+ * Blobs are reference counted and immutable once published, so a response
+ * can keep using one after the cache entry it came from has been replaced.
+ */
+typedef struct _t_webroot_blob {
+	int refcount;
+	int gzip;			/**< @brief 1 if this is the precompressed .gz representation */
+	int has_gzip;			/**< @brief 1 if a .gz representation exists, so responses must Vary */
+	time_t mtime;
+	off_t size;
+	char etag[24];			/**< @brief Quoted content hash */
+	char last_modified[32];		/**< @brief RFC 7231 IMF-fixdate of mtime */
+	char *filename;			/**< @brief File on disk, used when data is NULL */
+	char *data;			/**< @brief File contents, or NULL if too large to hold in memory */
+} t_webroot_blob;
+
+/** @brief Set up the cache and the inotify watch used to invalidate it */
+int webroot_cache_init(void);
+
+/** @brief Drop every cached entry, eg when the webroot changes */
+void webroot_cache_flush(void);
+
+/** @brief Look up url in the webroot. The returned blob must be released */
+t_webroot_blob *webroot_cache_get(const char *url, int accept_gzip);
+
+/** @brief Take an extra reference on a blob */
+t_webroot_blob *webroot_cache_ref(t_webroot_blob *blob);
+
+/** @brief Release a reference taken by webroot_cache_get() or webroot_cache_ref() */
+void webroot_cache_release(t_webroot_blob *blob);
+
+/** @brief Find the blob owning a data pointer handed to MHD */
+t_webroot_blob *webroot_cache_blob_of(const char *data);
+
+#endif /* _WEBROOT_CACHE_H_ */